@@ -0,0 +1,199 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef APPLYJOURNAL_H
+#define APPLYJOURNAL_H
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+
+#include "LinkManifest.h"
+#include "PathBuffer.h"
+
+/**
+ * How far an operation got according to the link it was planned for, as seen by a run resuming an interrupted one.
+ */
+enum LinkOpProgress
+{
+	/** The link still has the type and target it was planned with. */
+	LINK_OP_PLANNED,
+	/** The link already has its new target. */
+	LINK_OP_DONE,
+	/** The file object was left without any reparse data, between removing the old and writing the new. */
+	LINK_OP_NO_REPARSE_DATA,
+	/** The link was changed by something else. */
+	LINK_OP_CHANGED
+};
+
+/**
+ * A write-ahead journal of the progress made applying a manifest (/JOURNAL), which lets a run that was interrupted be
+ * resumed (/RESUME) without walking or applying anything a second time.
+ *
+ * Each batch of operations is recorded as begun, and flushed to disk, before any of its links is touched. Batches
+ * recorded at the same time by different threads share a single flush. The operations a batch finishes are recorded
+ * without waiting, so at worst a crash loses a few of those records, and the operations are then checked against
+ * their links by the next run instead of being skipped. Every manifest operation belongs to the same journal so
+ * operations are named by their index, which keeps each record to a few bytes.
+ */
+class ApplyJournal
+{
+public:
+	ApplyJournal();
+	~ApplyJournal();
+
+	/**
+	 * Opens the journal of a manifest that is about to be applied. A new journal replaces any existing one, while a
+	 * resumed journal reads what the previous run recorded and carries on after it.
+	 *
+	 * @param Path The path of the journal file.
+	 * @param Tool The name of the utility applying the manifest.
+	 * @param NumOps The number of operations of the manifest.
+	 * @param ManifestHash The content hash of the manifest (see LinkManifest::GetContentHash).
+	 * @param bResume Set to true to carry on with the journal of an interrupted run. A journal that doesn't exist yet
+	 *			is created.
+	 * @return Returns zero if the operation was successful, ERROR_INVALID_DATA if the journal belongs to another
+	 *		manifest, otherwise a non-zero value if an error occurred.
+	 */
+	DWORD Open(LPCTSTR Path, LPCTSTR Tool, size_t NumOps, DWORDLONG ManifestHash, bool bResume);
+
+	/**
+	 * Records a batch of operations as begun, returning once the record is on disk.
+	 *
+	 * @param Begin The index of the first operation of the batch.
+	 * @param End The index after the last operation of the batch.
+	 * @return Returns zero if the record was written, otherwise a non-zero value, in which case none of the operations
+	 *		may be carried out.
+	 */
+	DWORD BeginOps(size_t Begin, size_t End);
+
+	/**
+	 * Records a range of operations as finished. The record is written along with the next batch begun, or when the
+	 * journal is closed.
+	 *
+	 * @param Begin The index of the first finished operation.
+	 * @param End The index after the last finished operation.
+	 */
+	void FinishOps(size_t Begin, size_t End);
+
+	/**
+	 * Writes the records still pending and closes the journal file.
+	 *
+	 * @return Returns zero if every record was written successfully, otherwise a non-zero value.
+	 */
+	DWORD Close();
+
+	/**
+	 * Returns true if an earlier run finished an operation.
+	 */
+	bool IsDone(size_t Index) const
+	{
+		return States[Index] == STATE_DONE;
+	}
+
+	/**
+	 * Returns true if an earlier run began an operation without recording that it finished. Its link may be anywhere
+	 * between its planned and its new state.
+	 */
+	bool IsUnfinished(size_t Index) const
+	{
+		return States[Index] == STATE_BEGUN;
+	}
+
+	/**
+	 * Returns the number of operations finished by earlier runs.
+	 */
+	LONG GetNumDone() const
+	{
+		return NumDone;
+	}
+
+	/**
+	 * Returns the path of the journal file.
+	 */
+	LPCTSTR GetPath() const
+	{
+		return Path.c_str();
+	}
+
+private:
+	ApplyJournal(const ApplyJournal&);
+	ApplyJournal& operator=(const ApplyJournal&);
+
+	/** The state of an operation according to the journal, ordered so that a later state never goes back. */
+	enum OpState
+	{
+		STATE_PENDING,
+		STATE_BEGUN,
+		STATE_DONE
+	};
+
+	/**
+	 * Reads the records of an existing journal and drops whatever was left of a record cut short by a crash.
+	 */
+	DWORD Load(const std::string& Header);
+
+	/**
+	 * Adds a record to the journal, optionally waiting until it is on disk. The first thread to wait writes everything
+	 * added so far in one go while the others wait for it.
+	 */
+	DWORD Append(const char* Record, size_t Length, bool bDurable);
+
+	tstring Path;
+	HANDLE hFile;
+	CRITICAL_SECTION Lock;
+	/** Signaled each time a group of records is written. */
+	CONDITION_VARIABLE Flushed;
+	/** The records added since the last group was written. */
+	std::string Pending;
+	/** The number of records added, and the number of those that are on disk. */
+	ULONGLONG NumAppended;
+	ULONGLONG NumFlushed;
+	/** Set while a thread is writing a group of records. */
+	bool bFlushing;
+	/** The error of the first group that failed to be written. Nothing is recorded after it. */
+	DWORD WriteError;
+	std::vector<BYTE> States;
+	LONG NumDone;
+};
+
+/**
+ * Works out how far an operation got from the link it was planned for. Used when resuming a run for the operations
+ * that were begun but not recorded as finished.
+ *
+ * @param hLink The handle of the link, opened with at least FILE_READ_ATTRIBUTES access.
+ * @param Op The operation planned for the link.
+ * @param Arena The scratch memory to read the current target into.
+ * @param Progress Set to the progress of the operation. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD GetLinkOpProgress(HANDLE hLink, const LinkOp& Op, StringArena& Arena, LinkOpProgress& Progress);
+
+#endif //APPLYJOURNAL_H
@@ -0,0 +1,181 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef ASYNCREPARSE_H
+#define ASYNCREPARSE_H
+#pragma once
+
+#include <Windows.h>
+#include <vector>
+
+#include "ConcurrencyControl.h"
+#include "LinkStats.h"
+#include "PathBuffer.h"
+#include "ReparsePoint.h"
+
+/** The number of reparse requests kept in flight when /ASYNC is specified without a count. */
+#define DEFAULT_ASYNC_REQUESTS 256
+
+/** The maximum number of reparse requests that can be kept in flight at once. */
+#define MAX_ASYNC_REQUESTS 4096
+
+/** The number of threads that wait on the completion port. Completions take little work so a few keep up with many. */
+#define ASYNC_COMPLETION_THREADS 4
+
+/**
+ * A link being read, and possibly rewritten, by an AsyncLinkQueue.
+ */
+struct AsyncLink
+{
+	/** The full path of the link. */
+	tstring Path;
+	/** The file attributes of the link. */
+	DWORD Attributes;
+	/** The reparse data read from the link. */
+	ReparsePointInfo Info;
+	/** The target of the link, or an empty string if it isn't a junction or symbolic link. */
+	LPCTSTR Target;
+	/** The target to write to the link, set by the action. NULL leaves the link as it is. */
+	LPCTSTR NewTarget;
+	/** Scratch memory for the strings the action needs until the link is done with. Reset before each link. */
+	StringArena Arena;
+};
+
+/**
+ * The callbacks that a utility implements to act upon the links read by an AsyncLinkQueue. They are invoked from the
+ * completion threads of the queue, concurrently, and must be thread-safe.
+ */
+class AsyncLinkAction
+{
+public:
+	virtual ~AsyncLinkAction() {}
+
+	/**
+	 * Called once the reparse data of a link has been read.
+	 *
+	 * @param Link The link that was read. Set Link.NewTarget to have the link rewritten. [IN/OUT]
+	 * @return Returns zero if the operation was successful, otherwise a non-zero error code.
+	 */
+	virtual DWORD OnReadLink(AsyncLink& Link) = 0;
+
+	/**
+	 * Called once the new target of a link has been written.
+	 *
+	 * @param Link The link that was rewritten.
+	 */
+	virtual void OnLinkWritten(const AsyncLink& Link)
+	{
+		UNREFERENCED_PARAMETER(Link);
+	}
+};
+
+/**
+ * Reads and rewrites reparse points with overlapped FSCTL requests against a single I/O completion port, so that many
+ * requests are waiting on the file system at once while only a few threads handle their completions. On a file server
+ * every request costs a network round trip and the synchronous calls leave a thread idle for each one; the queue keeps
+ * up to MaxRequests of them outstanding instead.
+ *
+ * Links are submitted from any thread. Each is opened, read with FSCTL_GET_REPARSE_POINT and handed to the action,
+ * then written back with FSCTL_SET_REPARSE_POINT if the action gives it a new target. Retargets are done in place or
+ * by deleting the reparse data first, as RetargetReparsePoint does. Any failure once a link has been submitted is
+ * counted in Stats and reported on the console. An adaptive queue lets a controller decide how many of the MaxRequests
+ * are in flight at once.
+ */
+class AsyncLinkQueue
+{
+public:
+	AsyncLinkQueue(AsyncLinkAction& InAction, LinkStats& InStats);
+	~AsyncLinkQueue();
+
+	/**
+	 * Creates the completion port and the threads that wait on it.
+	 *
+	 * @param MaxRequests The maximum number of links in flight at once.
+	 * @param bInPlace Set to true to overwrite the reparse data of rewritten links in place, false to always delete it
+	 *		first.
+	 * @param bAdaptive Set to true to adapt the number of links in flight to the latency and overload failures of the
+	 *			requests, MaxRequests at most.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+	 */
+	DWORD Start(int MaxRequests, bool bInPlace, bool bAdaptive);
+
+	/**
+	 * Opens a link and starts reading its reparse data. Waits for an earlier link to complete if MaxRequests, or as
+	 * many as the controller allows, are already in flight.
+	 *
+	 * @param Path The full path of the link.
+	 * @param Attributes The file attributes of the link.
+	 * @param DesiredAccess The access to open the link with. Write access is needed to rewrite it.
+	 * @return Returns zero if the link was submitted, otherwise a non-zero error code if it couldn't be opened.
+	 */
+	DWORD Submit(LPCTSTR Path, DWORD Attributes, DWORD DesiredAccess);
+
+	/**
+	 * Waits for every submitted link to complete and stops the completion threads. The queue can be started again
+	 * afterwards.
+	 */
+	void Finish();
+
+private:
+	AsyncLinkQueue(const AsyncLinkQueue&);
+	AsyncLinkQueue& operator=(const AsyncLinkQueue&);
+
+	struct Request;
+
+	static DWORD WINAPI CompletionThreadProc(LPVOID Param);
+	void RunCompletions();
+	void OnCompletion(Request& Req, DWORD Result, DWORD BytesTransferred);
+	DWORD Issue(Request& Req, int State);
+	void Complete(Request& Req, DWORD Result);
+
+	AsyncLinkAction& Action;
+	LinkStats& Stats;
+	bool bInPlace;
+	bool bAdaptive;
+	/** Limits the links in flight when the queue is adaptive. */
+	ConcurrencyController Controller;
+	HANDLE Port;
+	std::vector<HANDLE> Threads;
+	/** Every request of the queue, allocated once by Start. */
+	std::vector<Request*> Requests;
+	/** The requests that aren't in flight. */
+	std::vector<Request*> FreeRequests;
+	CRITICAL_SECTION Lock;
+	CONDITION_VARIABLE RequestFreed;
+};
+
+/**
+ * Parses the request count of an /ASYNC[:n] command line option.
+ *
+ * @param Arg The command line argument to parse.
+ * @return Returns the number of requests to keep in flight, clamped to the range supported by AsyncLinkQueue.
+ */
+int ParseAsyncRequestCount(LPCTSTR Arg);
+
+#endif //ASYNCREPARSE_H
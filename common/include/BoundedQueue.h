@@ -0,0 +1,175 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+#pragma once
+
+#include <Windows.h>
+#include <deque>
+
+/**
+ * A first-in first-out queue of fixed capacity shared between the threads of two pipeline stages. Producers block
+ * while the queue is full so that a fast stage can't run arbitrarily far ahead of a slow one, and consumers block while
+ * it is empty until it is closed.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+	BoundedQueue(size_t InCapacity)
+		: Capacity(InCapacity > 0 ? InCapacity : 1)
+		, bClosed(false)
+	{
+		InitializeCriticalSection(&Lock);
+		InitializeConditionVariable(&NotEmpty);
+		InitializeConditionVariable(&NotFull);
+	}
+
+	~BoundedQueue()
+	{
+		DeleteCriticalSection(&Lock);
+	}
+
+	/**
+	 * Adds an item to the back of the queue, waiting for room if the queue is full.
+	 *
+	 * @param Item The item to add.
+	 * @return Returns true if the item was added, or false if the queue was closed.
+	 */
+	bool Push(const T& Item)
+	{
+		EnterCriticalSection(&Lock);
+		while (Items.size() >= Capacity && !bClosed)
+		{
+			SleepConditionVariableCS(&NotFull, &Lock, INFINITE);
+		}
+
+		bool bAdded = !bClosed;
+		if (bAdded)
+		{
+			Items.push_back(Item);
+		}
+		LeaveCriticalSection(&Lock);
+
+		if (bAdded)
+		{
+			WakeConditionVariable(&NotEmpty);
+		}
+
+		return bAdded;
+	}
+
+	/**
+	 * Removes the item at the front of the queue, waiting for one if the queue is empty.
+	 *
+	 * @param Item The item removed from the queue. [OUT]
+	 * @return Returns true if an item was removed, or false once the queue is closed and every item has been removed.
+	 */
+	bool Pop(T& Item)
+	{
+		EnterCriticalSection(&Lock);
+		while (Items.empty() && !bClosed)
+		{
+			SleepConditionVariableCS(&NotEmpty, &Lock, INFINITE);
+		}
+
+		bool bRemoved = !Items.empty();
+		if (bRemoved)
+		{
+			Item = Items.front();
+			Items.pop_front();
+		}
+		LeaveCriticalSection(&Lock);
+
+		if (bRemoved)
+		{
+			WakeConditionVariable(&NotFull);
+		}
+
+		return bRemoved;
+	}
+
+	/**
+	 * Removes up to MaxItems items from the front of the queue, waiting for at least one if the queue is empty.
+	 *
+	 * @param OutItems The array to store the removed items in. [OUT]
+	 * @param MaxItems The size of the array.
+	 * @return Returns the number of items removed, or zero once the queue is closed and every item has been removed.
+	 */
+	size_t PopMany(T* OutItems, size_t MaxItems)
+	{
+		EnterCriticalSection(&Lock);
+		while (Items.empty() && !bClosed)
+		{
+			SleepConditionVariableCS(&NotEmpty, &Lock, INFINITE);
+		}
+
+		size_t NumRemoved = 0;
+		while (NumRemoved < MaxItems && !Items.empty())
+		{
+			OutItems[NumRemoved++] = Items.front();
+			Items.pop_front();
+		}
+		LeaveCriticalSection(&Lock);
+
+		if (NumRemoved > 0)
+		{
+			WakeAllConditionVariable(&NotFull);
+		}
+
+		return NumRemoved;
+	}
+
+	/**
+	 * Marks the end of the input. The items still queued can be removed, after which Pop returns false.
+	 */
+	void Close()
+	{
+		EnterCriticalSection(&Lock);
+		bClosed = true;
+		LeaveCriticalSection(&Lock);
+
+		WakeAllConditionVariable(&NotEmpty);
+		WakeAllConditionVariable(&NotFull);
+	}
+
+private:
+	BoundedQueue(const BoundedQueue&);
+	BoundedQueue& operator=(const BoundedQueue&);
+
+	std::deque<T> Items;
+	size_t Capacity;
+	bool bClosed;
+	CRITICAL_SECTION Lock;
+	CONDITION_VARIABLE NotEmpty;
+	CONDITION_VARIABLE NotFull;
+};
+
+#endif //BOUNDEDQUEUE_H
@@ -0,0 +1,132 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef CHANGEJOURNAL_H
+#define CHANGEJOURNAL_H
+#pragma once
+
+#include <Windows.h>
+#include <vector>
+#include <winioctl.h>
+
+#include "LinkStats.h"
+#include "PathBuffer.h"
+#include "TreeWalker.h"
+
+/**
+ * The position in the USN change journal of a volume up to which all changes beneath a root have been processed.
+ */
+struct JournalCheckpoint
+{
+	/** The serial number of the volume. */
+	DWORD VolumeSerial;
+	/** The identifier of the change journal instance. A new identifier means earlier records are gone. */
+	DWORDLONG JournalId;
+	/** The first USN that has not been processed yet. */
+	USN NextUsn;
+	/**
+	 * The normalized path of the root the changes were processed for, without the \\?\ prefix or a trailing separator.
+	 * Empty when the checkpoint covers a tree identified by other means, as for a link index.
+	 */
+	tstring Root;
+};
+
+typedef std::vector<JournalCheckpoint> JournalCheckpointList;
+
+/**
+ * Returns the checkpoint of a root, or NULL if the list doesn't have one.
+ *
+ * @param Checkpoints The list to search.
+ * @param VolumeSerial The serial number of the volume of the root.
+ * @param Root The normalized path of the root (see JournalCheckpoint::Root), compared ignoring case.
+ */
+const JournalCheckpoint* FindCheckpoint(const JournalCheckpointList& Checkpoints, DWORD VolumeSerial,
+	const tstring& Root);
+
+/**
+ * Reads the checkpoints previously saved to the given file. A missing file yields an empty list.
+ *
+ * @param Path The path of the checkpoint file.
+ * @param Checkpoints The list to write the checkpoints to, one per root. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD LoadCheckpoints(LPCTSTR Path, JournalCheckpointList& Checkpoints);
+
+/**
+ * Writes the given checkpoints to a file. The checkpoints the file already holds for other roots are kept, so that
+ * runs on different roots can share the same file.
+ *
+ * @param Path The path of the checkpoint file.
+ * @param Checkpoints The checkpoints to write, one per root.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD SaveCheckpoints(LPCTSTR Path, const JournalCheckpointList& Checkpoints);
+
+/**
+ * Retrieves the current position of the change journal of the volume that holds the given path. Requires elevation.
+ *
+ * @param Path A path on the volume.
+ * @param Checkpoint The current position of the journal. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD GetJournalCheckpoint(LPCTSTR Path, JournalCheckpoint& Checkpoint);
+
+/**
+ * Checks whether any reparse point or directory beneath the root was created, deleted, renamed or gained or lost its
+ * reparse data since the checkpoint, i.e. whether the set of links in the tree may differ. A link whose reparse data
+ * was only replaced is not a change, which also means a directory that was made a link in place goes unnoticed.
+ * Changes whose parent directory no longer exists can't be placed and count as a change, as does a checkpoint that
+ * the journal no longer covers. Requires elevation.
+ *
+ * @param Root The path of the directory tree to check.
+ * @param Since The checkpoint to look for changes after.
+ * @param bChanged Set to true if anything changed, false otherwise. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD HasTreeChanged(LPCTSTR Root, const JournalCheckpoint& Since, bool& bChanged);
+
+/**
+ * Invokes the action for each reparse point beneath the root whose reparse data or name changed since the checkpoint
+ * of the root, as recorded by the USN change journal. Directories created or moved beneath the root since then are
+ * walked again, since the links they hold may never have been processed. The whole tree is walked instead when there
+ * is no usable checkpoint, e.g. on the first run or after the journal was recreated or has wrapped past the checkpoint.
+ *
+ * @param Root The path of the directory tree to process.
+ * @param Action The action to perform on each changed reparse point.
+ * @param Options The options that control the walk.
+ * @param Stats The statistics to record failures and skipped file objects to.
+ * @param Since The checkpoints of the previous run.
+ * @param Next The checkpoints to save once the run succeeds. The current journal position of the volume of Root is
+ *		added unless the list already holds one for that root. [IN/OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD WalkChanges(LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats,
+	const JournalCheckpointList& Since, JournalCheckpointList& Next);
+
+#endif //CHANGEJOURNAL_H
@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef CONCURRENCYCONTROL_H
+#define CONCURRENCYCONTROL_H
+#pragma once
+
+#include <Windows.h>
+
+#include "RunMetrics.h"
+
+/** The number of operations measured before the controller decides whether to raise or lower its limit. */
+#define CONTROL_WINDOW_OPS 64
+
+/** The number of samples an operation needs within a window for its latency to count. */
+#define CONTROL_MIN_SAMPLES 8
+
+/** The factor over its usual latency at which an operation is considered to be slowed down by the load. */
+#define CONTROL_LATENCY_FACTOR 2
+
+/**
+ * Adapts the number of operations carried out at the same time to what the volume can take (/ADAPT), in the manner of
+ * additive increase, multiplicative decrease. Each window of CONTROL_WINDOW_OPS operations that completes at about the
+ * usual latency lets one more operation run, while a window that is CONTROL_LATENCY_FACTOR times slower, or any
+ * failure that tells of an overloaded server such as ERROR_SHARING_VIOLATION, halves the limit right away.
+ *
+ * The usual latency of each kind of operation is the lowest mean seen over a window. It is allowed to creep up a little
+ * with each window so that it follows a volume that gets slower for good.
+ */
+class ConcurrencyController
+{
+public:
+	ConcurrencyController();
+	~ConcurrencyController();
+
+	/**
+	 * Resets the controller to half of its maximum limit with nothing measured yet. Must be called before any other
+	 * thread uses the controller.
+	 *
+	 * @param InMaxLimit The highest number of operations to allow at the same time.
+	 */
+	void Start(int InMaxLimit);
+
+	/**
+	 * Waits until fewer operations than the limit are running, then counts one more.
+	 */
+	void Acquire();
+
+	/**
+	 * Counts an operation taken with Acquire as done.
+	 */
+	void Release();
+
+	/**
+	 * Adds the latency of an operation to the current window.
+	 *
+	 * @param Op The operation that was measured.
+	 * @param Micros The time the operation took, in microseconds.
+	 */
+	void RecordLatency(MetricOp Op, LONGLONG Micros);
+
+	/**
+	 * Records an operation that failed. Only the failures caused by an overloaded volume or server lower the limit.
+	 *
+	 * @param Result The error code of the operation.
+	 */
+	void RecordFailure(DWORD Result);
+
+	/**
+	 * Returns the number of operations currently allowed at the same time.
+	 */
+	int GetLimit() const
+	{
+		return Limit;
+	}
+
+private:
+	ConcurrencyController(const ConcurrencyController&);
+	ConcurrencyController& operator=(const ConcurrencyController&);
+
+	/**
+	 * Raises or lowers the limit based on the window just measured and starts the next one. Called with Lock held.
+	 */
+	void EndWindow();
+
+	CRITICAL_SECTION Lock;
+	/** Signaled when an operation is done or the limit is raised. */
+	CONDITION_VARIABLE SlotFreed;
+	int MaxLimit;
+	volatile int Limit;
+	int NumActive;
+	/** The operations of each kind measured in the current window, and the time they took in microseconds. */
+	LONG WindowOps[NUM_METRIC_OPS];
+	LONGLONG WindowMicros[NUM_METRIC_OPS];
+	LONG NumWindowOps;
+	/** The overload failures of the current window. */
+	LONG NumCongested;
+	/** The usual latency of each kind of operation, in microseconds, or zero until it is known. */
+	LONGLONG BaselineMicros[NUM_METRIC_OPS];
+};
+
+/**
+ * Returns true for the failures that tell of a volume or server with more requests than it can handle.
+ */
+bool IsCongestionError(DWORD Result);
+
+/**
+ * Returns the controller the calling thread reports the latency of its operations to, or NULL if there is none.
+ */
+ConcurrencyController* GetThreadController();
+
+/**
+ * Has the calling thread report the latency of its operations to a controller for as long as it is in scope.
+ */
+class ThreadControllerScope
+{
+public:
+	explicit ThreadControllerScope(ConcurrencyController* Controller);
+	~ThreadControllerScope();
+
+private:
+	ThreadControllerScope(const ThreadControllerScope&);
+	ThreadControllerScope& operator=(const ThreadControllerScope&);
+
+	ConcurrencyController* Previous;
+};
+
+#endif //CONCURRENCYCONTROL_H
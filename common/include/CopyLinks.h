@@ -0,0 +1,323 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef COPYLINKS_H
+#define COPYLINKS_H
+#pragma once
+
+#include <Windows.h>
+#include <map>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "DestinationCache.h"
+#include "LinkCore.h"
+#include "PathBuffer.h"
+#include "RebaseMap.h"
+#include "ReparseDataCache.h"
+#include "TargetCache.h"
+#include "TreeWalker.h"
+
+/**
+ * The options of a copy made by cplink.
+ */
+struct CopyLinkOptions : public LinkCopyOptions
+{
+	/** Set to true to check that the target of each copy exists before creating it. */
+	bool bVerify;
+	/** The number of threads reading the source links in a pipelined copy, or zero to copy each link as it is found. */
+	int NumReaders;
+	/** The number of threads creating the copies in a pipelined copy. */
+	int NumWriters;
+	/** Set to true to link the copies of the members of each group of hard links together (/HARDLINKS). */
+	bool bHardLinks;
+
+	CopyLinkOptions()
+		: bVerify(false)
+		, NumReaders(0)
+		, NumWriters(0)
+		, bHardLinks(false)
+	{
+	}
+};
+
+/**
+ * The statistics of a copy made by cplink.
+ */
+struct CopyLinkStats : public LinkStats
+{
+	/** The number of file objects successfully copied. */
+	AtomicCounter NumCopied;
+	/** The number of file objects not copied because their target is missing or of the wrong kind. */
+	AtomicCounter NumBroken;
+};
+
+/**
+ * Remembers the first member of each group of hard links found with /HARDLINKS, so that the copies of the other
+ * members can be linked to its copy. Files are identified by their volume and file index.
+ */
+class HardLinkGroups
+{
+public:
+	HardLinkGroups()
+	{
+		InitializeCriticalSection(&Lock);
+	}
+
+	~HardLinkGroups()
+	{
+		DeleteCriticalSection(&Lock);
+	}
+
+	/**
+	 * Makes a file the first member of its group unless the group already has one.
+	 *
+	 * @param Info The identity of the source file.
+	 * @param DestPath The full path of the copy of the file.
+	 * @param LeaderPath Set to the full path of the copy of the first member of the group. [OUT]
+	 * @return Returns true if the file is the first member of its group.
+	 */
+	bool Join(const BY_HANDLE_FILE_INFORMATION& Info, LPCTSTR DestPath, tstring& LeaderPath)
+	{
+		FileId Id(Info.dwVolumeSerialNumber, ((DWORDLONG)Info.nFileIndexHigh << 32) | Info.nFileIndexLow);
+
+		EnterCriticalSection(&Lock);
+		std::pair<std::map<FileId, tstring>::iterator, bool> Entry =
+			Leaders.insert(std::make_pair(Id, tstring(DestPath)));
+		LeaderPath = Entry.first->second;
+		LeaveCriticalSection(&Lock);
+
+		return Entry.second;
+	}
+
+	/**
+	 * Forgets every group.
+	 */
+	void Clear()
+	{
+		EnterCriticalSection(&Lock);
+		Leaders.clear();
+		LeaveCriticalSection(&Lock);
+	}
+
+private:
+	HardLinkGroups(const HardLinkGroups&);
+	HardLinkGroups& operator=(const HardLinkGroups&);
+
+	typedef std::pair<DWORD, DWORDLONG> FileId;
+
+	CRITICAL_SECTION Lock;
+	/** The full path of the copy of the first member of each group. */
+	std::map<FileId, tstring> Leaders;
+};
+
+/**
+ * Mirrors the directory structure of the source tree at the destination and copies each reparse point found, rebasing
+ * its target based on the options set (when applicable). The targets checked by /VERIFY, the copies prepared for the
+ * distinct source links and the groups of hard links found by /HARDLINKS are kept for as long as the action, and
+ * shared by all threads.
+ */
+class CopyLinkAction : public LinkAction
+{
+public:
+	/**
+	 * @param InOptions The options of the copy.
+	 * @param InStats The statistics to record the copies, broken targets and skipped file objects to.
+	 * @param InDestDirs The known state of the destination directories.
+	 * @param InRules The rules loaded with /RMAP.
+	 * @param InDestRoot The full path of the destination that the source tree is copied to.
+	 */
+	CopyLinkAction(const CopyLinkOptions& InOptions, CopyLinkStats& InStats, DestinationCache& InDestDirs,
+		const RebaseMap& InRules, LPCTSTR InDestRoot);
+
+	virtual DWORD OnDirectory(const WalkEntry& Entry);
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry);
+	virtual DWORD OnFile(const WalkEntry& Entry);
+
+protected:
+	/**
+	 * Prepares the copy of a source link from its reparse data: the target is rebased based on the options set (when
+	 * applicable) and built into the reparse data of the copy. Links with the same reparse data share the same copy,
+	 * which is only prepared the first time it is seen while the cache has room for it.
+	 *
+	 * @param Info The reparse data of the source link.
+	 * @param Arena The scratch memory to allocate the target paths from.
+	 * @param Storage The copy to prepare the link into when the cache is full.
+	 * @param Link Set to the copy of the link, which stays valid for as long as the action unless it is Storage. [OUT]
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+	 */
+	DWORD PrepareLink(const ReparsePointInfo& Info, StringArena& Arena, PreparedLink& Storage,
+		const PreparedLink*& Link);
+
+	/**
+	 * Reads a source reparse point and prepares its copy (see PrepareLink).
+	 *
+	 * @param SrcPath The full path of the source reparse point to read.
+	 * @param Arena The scratch memory to allocate the target paths from.
+	 * @param Storage The copy to prepare the link into when the cache is full.
+	 * @param Link Set to the copy of the link. [OUT]
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+	 */
+	DWORD ReadLink(LPCTSTR SrcPath, StringArena& Arena, PreparedLink& Storage, const PreparedLink*& Link);
+
+	/**
+	 * Checks that the target of a copy exists when /VERIFY is specified. Copies whose target is missing, or isn't the
+	 * kind of file object the link expects, are counted as broken and not created.
+	 *
+	 * @param DestPath The full path of the reparse point to create.
+	 * @param Link The copy to create.
+	 * @param bDirectory Set to true if the reparse point is a directory.
+	 * @param bBroken Set to true if the copy is not to be created. [OUT]
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+	 */
+	DWORD CheckLinkTarget(LPCTSTR DestPath, const PreparedLink& Link, bool bDirectory, bool& bBroken);
+
+	/**
+	 * Records a reparse point that was created at the destination.
+	 */
+	void CountCopiedLink(LPCTSTR DestPath, DWORD ReparseTag, LPCTSTR DestTarget);
+
+	/**
+	 * Creates a reparse point at the destination, replacing any link already there (see CreateDestinationLink).
+	 * Volume mount points are mounted on a new directory instead (see CreateDestinationMountPoint). Missing parent
+	 * directories are created from those of the source.
+	 *
+	 * @param SrcPath The full path of the source reparse point.
+	 * @param DestPath The full path of the reparse point to create.
+	 * @param Link The copy to create.
+	 * @param bDirectory Set to true if the reparse point is a directory.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+	 */
+	DWORD WriteLink(LPCTSTR SrcPath, LPCTSTR DestPath, const PreparedLink& Link, bool bDirectory);
+
+	/**
+	 * Links the copy of a file to the copy of the other members of its group of hard links when /HARDLINKS is
+	 * specified. The copy of the first member found is kept as is, the copies of the others are replaced by hard
+	 * links to it (see CreateDestinationHardLink). Files with a single link are left alone.
+	 *
+	 * @param SrcPath The full path of the source file.
+	 * @param DestPath The full path of the copy of the file.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+	 */
+	DWORD CopyHardLink(LPCTSTR SrcPath, LPCTSTR DestPath);
+
+	/**
+	 * Returns true if the reparse point is one that can be copied, otherwise reports it as skipped.
+	 */
+	bool IsCopyableLink(LPCTSTR SrcPath, DWORD ReparseTag);
+
+	/**
+	 * Copies a single reparse point to the given destination and rebases its target based on the options set (when
+	 * applicable).
+	 *
+	 * @param SrcPath The full path of the source reparse point to copy.
+	 * @param Attributes The file attributes of the source reparse point.
+	 * @param ReparseTag The reparse tag of the source reparse point.
+	 * @param DestPath The full path of the destination to copy SrcPath to.
+	 * @param Arena The scratch memory to allocate the target paths from.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+	 */
+	DWORD CopyLink(LPCTSTR SrcPath, DWORD Attributes, DWORD ReparseTag, LPCTSTR DestPath, StringArena& Arena);
+
+	const CopyLinkOptions& Options;
+	CopyLinkStats& Stats;
+	DestinationCache& DestDirs;
+	const RebaseMap& Rules;
+	/** The full path of the destination that the source tree is copied to. */
+	LPCTSTR DestRoot;
+	/** The targets checked by /VERIFY. */
+	TargetCache Targets;
+	/** The copies prepared for the distinct source links. */
+	ReparseDataCache PreparedLinks;
+	/** The groups of hard links found by /HARDLINKS. */
+	HardLinkGroups HardLinks;
+
+private:
+	CopyLinkAction(const CopyLinkAction&);
+	CopyLinkAction& operator=(const CopyLinkAction&);
+};
+
+/**
+ * Copies the reparse points found by the walk in two further stages, each with its own pool of threads: one reads and
+ * rebases the source links, the other creates the directories and links at the destination. The walk only queues work,
+ * so enumerating the source, reading it and writing the destination all overlap instead of adding up.
+ */
+class CopyLinkPipeline : public CopyLinkAction
+{
+public:
+	/**
+	 * @param InOptions The options of the copy.
+	 * @param InStats The statistics to record the copies, broken targets, failures and skipped file objects to.
+	 * @param InDestDirs The known state of the destination directories.
+	 * @param InRules The rules loaded with /RMAP.
+	 * @param InDestRoot The full path of the destination that the source tree is copied to.
+	 */
+	CopyLinkPipeline(const CopyLinkOptions& InOptions, CopyLinkStats& InStats, DestinationCache& InDestDirs,
+		const RebaseMap& InRules, LPCTSTR InDestRoot);
+	~CopyLinkPipeline();
+
+	/**
+	 * Starts the threads of the read and write stages.
+	 *
+	 * @param NumReaders The number of threads reading the source links.
+	 * @param NumWriters The number of threads creating the copies.
+	 * @return Returns zero if at least one thread of each stage was started, otherwise a non-zero value.
+	 */
+	DWORD Start(int NumReaders, int NumWriters);
+
+	/**
+	 * Waits for every queued directory and link to be copied and stops the threads of both stages.
+	 */
+	void Finish();
+
+	virtual DWORD OnDirectory(const WalkEntry& Entry);
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry);
+
+private:
+	CopyLinkPipeline(const CopyLinkPipeline&);
+	CopyLinkPipeline& operator=(const CopyLinkPipeline&);
+
+	struct CopyItem;
+
+	static DWORD WINAPI ReaderThreadProc(LPVOID Param);
+	static DWORD WINAPI WriterThreadProc(LPVOID Param);
+	static void WaitForThreads(std::vector<HANDLE>& Threads);
+
+	void RunReader();
+	void RunWriter();
+
+	/** The links waiting for their target to be read. */
+	BoundedQueue<CopyItem*> ReadQueue;
+	/** The directories and links waiting to be created at the destination. */
+	BoundedQueue<CopyItem*> WriteQueue;
+	std::vector<HANDLE> Readers;
+	std::vector<HANDLE> Writers;
+};
+
+#endif //COPYLINKS_H
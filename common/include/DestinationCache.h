@@ -0,0 +1,216 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef DESTINATIONCACHE_H
+#define DESTINATIONCACHE_H
+#pragma once
+
+#include <Windows.h>
+#include <unordered_set>
+
+#include "PathBuffer.h"
+#include "ReparsePoint.h"
+
+/**
+ * Remembers which destination directories are known to hold no links, either because the current run created them or
+ * because the destination was asserted to be empty (/EMPTYDEST). Links written beneath such a directory can be created
+ * straight away instead of first probing for an existing link to replace. Directories are identified by a hash of
+ * their path so that the cache stays small on large trees. The occasional collision is harmless since a link found in
+ * the way is still replaced. The cache can be used from multiple threads at once.
+ */
+class DestinationCache
+{
+public:
+	DestinationCache();
+	~DestinationCache();
+
+	/**
+	 * Marks a directory as known to hold no links.
+	 *
+	 * @param DirPath The full path of the directory.
+	 */
+	void MarkEmpty(LPCTSTR DirPath);
+
+	/**
+	 * Creates a destination directory if it doesn't exist yet. A directory created by this call is marked empty. It
+	 * takes the attributes of its template but inherits its security from its parent, as a copied file would.
+	 *
+	 * @param TemplatePath The path of the source directory whose attributes the new directory gets.
+	 * @param DirPath The full path of the directory to create.
+	 * @return Returns zero if the directory exists afterwards, otherwise a non-zero value if an error occurred.
+	 */
+	DWORD EnsureDirectory(LPCTSTR TemplatePath, LPCTSTR DirPath);
+
+	/**
+	 * Creates the missing parent directories of a destination path, each from the matching parent of the source as
+	 * EnsureDirectory does. Parents beyond those of the source are created without a template. The directories created
+	 * by this call are marked empty.
+	 *
+	 * @param TemplatePath The full path of the source file object the destination path is the copy of.
+	 * @param Path The full path of a file object in the destination.
+	 * @return Returns zero if the parent directory exists afterwards, otherwise a non-zero value if an error occurred.
+	 */
+	DWORD EnsureParentDirectories(LPCTSTR TemplatePath, LPCTSTR Path);
+
+	/**
+	 * Returns true if the parent directory of the given path is known to hold no links.
+	 *
+	 * @param Path The full path of a file object in the destination.
+	 */
+	bool IsInEmptyDirectory(LPCTSTR Path) const;
+
+	/**
+	 * Forgets every directory, for when the destination may have changed since they were marked.
+	 */
+	void Clear();
+
+private:
+	DestinationCache(const DestinationCache&);
+	DestinationCache& operator=(const DestinationCache&);
+
+	static DWORDLONG HashPath(LPCTSTR Path, size_t Length);
+
+	/**
+	 * Creates a directory from a template, or without one if the template is empty or can't be used, and marks it
+	 * empty.
+	 */
+	DWORD CreateFromTemplate(const tstring& TemplatePath, const tstring& DirPath);
+
+	mutable CRITICAL_SECTION Lock;
+	std::unordered_set<DWORDLONG> EmptyDirs;
+};
+
+/**
+ * Creates a link in the destination, replacing any link already there. Beneath a directory the cache knows to be empty
+ * the link is created straight away, otherwise any existing link is removed first. An existing link is always
+ * replaced, without asking, while any other file or directory in the way is left alone and makes the call fail.
+ * Missing parent directories are created as needed, from the parents of the source when its path is given (see
+ * EnsureParentDirectories).
+ *
+ * @param Cache The known state of the destination directories.
+ * @param DestPath The full path of the link to create.
+ * @param ReparseTag The reparse tag of the link to create.
+ * @param TargetPath The target of the link to create.
+ * @param bDirectory Set to true if the link is a directory.
+ * @param TemplatePath The full path of the source link, or NULL to create missing parents without a template.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateDestinationLink(DestinationCache& Cache, LPCTSTR DestPath, DWORD ReparseTag, LPCTSTR TargetPath,
+	bool bDirectory, LPCTSTR TemplatePath = NULL);
+
+/**
+ * Creates the link described by a request in the destination, as the other overload does, from its prebuilt reparse
+ * data if it has any.
+ *
+ * @param Cache The known state of the destination directories.
+ * @param Request The link to create. Its Result is left as is.
+ * @param TemplatePath The full path of the source link, or NULL to create missing parents without a template.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateDestinationLink(DestinationCache& Cache, const LinkRequest& Request, LPCTSTR TemplatePath = NULL);
+
+/**
+ * Mounts a volume on a new directory in the destination, replacing any link already there as CreateDestinationLink
+ * does.
+ *
+ * @param Cache The known state of the destination directories.
+ * @param DestPath The full path of the mount point to create.
+ * @param VolumeName The name of the volume to mount in the form \\?\Volume{GUID}\.
+ * @param TemplatePath The full path of the source mount point, or NULL to create missing parents without a template.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateDestinationMountPoint(DestinationCache& Cache, LPCTSTR DestPath, LPCTSTR VolumeName,
+	LPCTSTR TemplatePath = NULL);
+
+/**
+ * Creates a hard link in the destination to an existing file. A destination that already is the same file is left as
+ * is. A destination that is a separate copy of the file, with the same size, last write time and contents, is replaced
+ * by the hard link. Anything else in the way fails with ERROR_FILE_EXISTS. Missing parent directories are created as
+ * needed.
+ *
+ * @param DestPath The full path of the hard link to create.
+ * @param ExistingPath The full path of the file to link to, on the same volume.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateDestinationHardLink(LPCTSTR DestPath, LPCTSTR ExistingPath);
+
+/**
+ * Reads the identity, size and times of a file object without following it if it is a link.
+ *
+ * @param Path The full path of the file object.
+ * @param Info The structure to write the information to. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD GetFileInformation(LPCTSTR Path, BY_HANDLE_FILE_INFORMATION& Info);
+
+/**
+ * Returns true if two file objects are the same file, i.e. hard links of each other.
+ */
+inline bool IsSameFile(const BY_HANDLE_FILE_INFORMATION& A, const BY_HANDLE_FILE_INFORMATION& B)
+{
+	return A.dwVolumeSerialNumber == B.dwVolumeSerialNumber && A.nFileIndexHigh == B.nFileIndexHigh &&
+		A.nFileIndexLow == B.nFileIndexLow;
+}
+
+/**
+ * Creates a batch of links in the destination, as CreateDestinationLink would for each one. The links are created
+ * together with CreateReparsePoints. Those that find a missing parent directory or something in their way are then
+ * retried one at a time.
+ *
+ * @param Cache The known state of the destination directories.
+ * @param Requests The links to create. The result of each is stored in the request.
+ * @param NumRequests The number of links to create.
+ * @param TemplatePaths The full path of the source link of each request, or NULL to create missing parents without
+ *		a template.
+ */
+void CreateDestinationLinks(DestinationCache& Cache, LinkRequest* Requests, size_t NumRequests,
+	const LPCTSTR* TemplatePaths = NULL);
+
+/**
+ * Moves an open link to a new path in the destination on the same volume, replacing any link already there. Beneath a
+ * directory the cache knows to be empty the link is renamed straight away, otherwise any existing link is removed
+ * first. Missing parent directories are created as needed.
+ *
+ * @param Cache The known state of the destination directories.
+ * @param hLink The handle of the link to move, opened with DELETE access.
+ * @param DestPath The full path to move the link to.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD RenameDestinationLink(const DestinationCache& Cache, HANDLE hLink, LPCTSTR DestPath);
+
+/**
+ * Checks whether a directory holds any file objects.
+ *
+ * @param DirPath The full path of the directory to check.
+ * @param bEmpty Set to true if the directory is empty or doesn't exist, false otherwise. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD IsDirectoryEmpty(LPCTSTR DirPath, bool& bEmpty);
+
+#endif //DESTINATIONCACHE_H
@@ -0,0 +1,141 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef DIRECTORYENUMERATOR_H
+#define DIRECTORYENUMERATOR_H
+#pragma once
+
+#include <Windows.h>
+#include <vector>
+
+#include "PathBuffer.h"
+
+/** The default size of the buffer that directory entries are read into, in bytes. */
+#define DEFAULT_ENUMERATE_BUFFER_SIZE (64 * 1024)
+
+/**
+ * The ways a directory listing can be read from the filesystem.
+ */
+enum EnumerateMethod
+{
+	/** FindFirstFile/FindNextFile with the standard information level, including 8.3 short names. */
+	ENUMERATE_FIND_FILE,
+	/** FindFirstFileEx without short names and with the large fetch buffers of Windows 7 and later. */
+	ENUMERATE_FIND_FILE_EX,
+	/**
+	 * GetFileInformationByHandleEx on an open directory handle. Every call fills the caller-supplied buffer, so a
+	 * single round trip to the filesystem returns hundreds of entries.
+	 */
+	ENUMERATE_FILE_INFORMATION
+};
+
+/**
+ * A single entry of a directory listing.
+ */
+struct DirectoryEntry
+{
+	/** The name of the file object. Only valid until the next entry is read. */
+	LPCTSTR Name;
+	/** The file attributes of the file object. */
+	DWORD Attributes;
+	/** The reparse tag of the file object, if it is a reparse point. */
+	DWORD ReparseTag;
+};
+
+/**
+ * Reads the entries of one directory at a time. The '.' and '..' entries are skipped. An enumerator keeps its buffers
+ * between directories so it should be reused for every directory a thread visits.
+ */
+class DirectoryEnumerator
+{
+public:
+	/**
+	 * @param InMethod The way the directory listings are read. Methods that aren't supported by the system or by the
+	 *		filesystem of a directory fall back to the next simplest one.
+	 * @param BufferSize The size of the buffer used by ENUMERATE_FILE_INFORMATION, in bytes.
+	 */
+	DirectoryEnumerator(EnumerateMethod InMethod = ENUMERATE_FILE_INFORMATION,
+		DWORD BufferSize = DEFAULT_ENUMERATE_BUFFER_SIZE);
+	~DirectoryEnumerator();
+
+	/**
+	 * Starts reading the entries of the given directory. Any directory that was previously open is closed first.
+	 *
+	 * @param Directory The path of the directory to read, without a trailing wildcard.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+	 */
+	DWORD Open(LPCTSTR Directory);
+
+	/**
+	 * Reads the next entry of the open directory.
+	 *
+	 * @param Entry The entry that was read. [OUT]
+	 * @return Returns zero if an entry was read, ERROR_NO_MORE_FILES once every entry has been read, otherwise a
+	 *		non-zero value if an error occurred.
+	 */
+	DWORD Next(DirectoryEntry& Entry);
+
+	/**
+	 * Closes the open directory, if any.
+	 */
+	void Close();
+
+private:
+	DirectoryEnumerator(const DirectoryEnumerator&);
+	DirectoryEnumerator& operator=(const DirectoryEnumerator&);
+
+	DWORD OpenFind(LPCTSTR Directory, bool bBasic);
+	DWORD OpenHandle(LPCTSTR Directory);
+	DWORD NextFind(DirectoryEntry& Entry);
+	DWORD NextHandle(DirectoryEntry& Entry);
+
+	EnumerateMethod Method;
+	/** The length of the path of the directory being read, in characters, for the traces of each batch. */
+	DWORD PathLength;
+	/** Set once FindFirstFileEx rejected the basic information level, i.e. before Windows 7. */
+	bool bBasicUnsupported;
+
+	/** The search handle when the directory is read through FindFirstFile(Ex). */
+	HANDLE hFind;
+	/** Set while FindData holds an entry that hasn't been returned yet. */
+	bool bPending;
+	WIN32_FIND_DATA FindData;
+	PathBuffer SearchPath;
+
+	/** The directory handle when the directory is read through GetFileInformationByHandleEx. */
+	HANDLE hDirectory;
+	/** The entries read by the last call, kept 8-byte aligned as the entries require. */
+	std::vector<LONGLONG> Buffer;
+	/** The offset of the next entry to return within Buffer, in bytes, or -1 when the buffer must be refilled. */
+	LONG NextOffset;
+	/** The null-terminated copy of the name of the last entry returned from Buffer. */
+	std::vector<WCHAR> Name;
+};
+
+#endif //DIRECTORYENUMERATOR_H
@@ -0,0 +1,217 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef ENTRYTABLE_H
+#define ENTRYTABLE_H
+#pragma once
+
+#include <Windows.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "PathBuffer.h"
+
+/** The id of no string, and the index of no entry. */
+#define ENTRY_TABLE_NONE 0xFFFFFFFF
+
+/**
+ * A pool of null-terminated strings stored back to back, each stored once and referred to by its offset in
+ * characters. The offsets are looked up through the pool itself, so a string costs its characters plus one slot of
+ * the lookup table no matter how often it is added.
+ */
+class StringPool
+{
+public:
+	StringPool();
+
+	/**
+	 * Returns the id of a string, adding it to the pool if it isn't there yet.
+	 *
+	 * @param Str The string to add. It doesn't have to be null-terminated.
+	 * @param Length The length of the string, in characters.
+	 * @return Returns the offset of the string in the pool.
+	 */
+	DWORD Intern(LPCTSTR Str, size_t Length);
+
+	/**
+	 * Returns the string with the given id.
+	 */
+	LPCTSTR Get(DWORD Id) const
+	{
+		return &Chars[Id];
+	}
+
+	/**
+	 * Returns the characters of every string in the pool, each followed by its terminator.
+	 */
+	const std::vector<TCHAR>& GetChars() const
+	{
+		return Chars;
+	}
+
+private:
+	StringPool(const StringPool&);
+	StringPool& operator=(const StringPool&);
+
+	/** Hashes the string at an offset of the pool. */
+	struct IdHash
+	{
+		const std::vector<TCHAR>* Chars;
+
+		IdHash(const std::vector<TCHAR>* InChars)
+			: Chars(InChars)
+		{
+		}
+
+		size_t operator()(DWORD Id) const;
+	};
+
+	/** Compares the strings at two offsets of the pool. */
+	struct IdEqual
+	{
+		const std::vector<TCHAR>* Chars;
+
+		IdEqual(const std::vector<TCHAR>* InChars)
+			: Chars(InChars)
+		{
+		}
+
+		bool operator()(DWORD A, DWORD B) const
+		{
+			return _tcscmp(&(*Chars)[A], &(*Chars)[B]) == 0;
+		}
+	};
+
+	std::vector<TCHAR> Chars;
+	/** The offset of every string in the pool. The functors look the strings up in Chars, so the pool can't be copied. */
+	std::unordered_set<DWORD, IdHash, IdEqual> Ids;
+};
+
+/**
+ * A tree of file system entries laid out as a structure of arrays. Each entry holds the index of its parent, the id of
+ * its name and of its target in a shared string pool, its attributes and its reparse tag, which is 20 bytes no matter
+ * how deep the entry is. Names are shared by every entry with that name, and directories by every entry beneath
+ * them, so full paths are only put together when one is asked for.
+ */
+class EntryTable
+{
+public:
+	/**
+	 * Adds an entry beneath a parent, or updates the entry of that name if there is one already.
+	 *
+	 * @param Parent The index of the parent entry, or ENTRY_TABLE_NONE for a root.
+	 * @param Name The name of the entry.
+	 * @param NameLength The length of the name, in characters.
+	 * @param Attributes The file attributes of the entry.
+	 * @param ReparseTag The reparse tag of the entry, or zero if it isn't a reparse point.
+	 * @param Target The target of the entry, or NULL if it has none.
+	 * @return Returns the index of the entry.
+	 */
+	DWORD AddEntry(DWORD Parent, LPCTSTR Name, size_t NameLength, DWORD Attributes, DWORD ReparseTag, LPCTSTR Target);
+
+	/**
+	 * Adds the entry at a path along with the directories leading to it. The path is split at each separator and
+	 * GetPath puts it back together exactly as given, whatever its syntax.
+	 *
+	 * @param Path The path of the entry.
+	 * @param Attributes The file attributes of the entry.
+	 * @param ReparseTag The reparse tag of the entry, or zero if it isn't a reparse point.
+	 * @param Target The target of the entry, or NULL if it has none.
+	 * @return Returns the index of the entry.
+	 */
+	DWORD AddPath(LPCTSTR Path, DWORD Attributes, DWORD ReparseTag, LPCTSTR Target);
+
+	/**
+	 * Puts together the path of an entry, from its root down to its name.
+	 *
+	 * @param Index The index of the entry.
+	 * @param Arena The scratch memory to allocate the path from.
+	 * @return Returns the path of the entry.
+	 */
+	LPCTSTR GetPath(DWORD Index, StringArena& Arena) const;
+
+	DWORD GetParent(DWORD Index) const
+	{
+		return Parents[Index];
+	}
+
+	LPCTSTR GetName(DWORD Index) const
+	{
+		return Strings.Get(Names[Index]);
+	}
+
+	DWORD GetAttributes(DWORD Index) const
+	{
+		return Attributes[Index];
+	}
+
+	DWORD GetReparseTag(DWORD Index) const
+	{
+		return ReparseTags[Index];
+	}
+
+	/**
+	 * Returns the target of an entry, or NULL if it has none.
+	 */
+	LPCTSTR GetTarget(DWORD Index) const
+	{
+		return Targets[Index] != ENTRY_TABLE_NONE ? Strings.Get(Targets[Index]) : NULL;
+	}
+
+	size_t GetNumEntries() const
+	{
+		return Parents.size();
+	}
+
+	/**
+	 * Returns the pool holding the names and targets of the entries.
+	 */
+	StringPool& GetStrings()
+	{
+		return Strings;
+	}
+
+	const StringPool& GetStrings() const
+	{
+		return Strings;
+	}
+
+private:
+	std::vector<DWORD> Parents;
+	std::vector<DWORD> Names;
+	std::vector<DWORD> Attributes;
+	std::vector<DWORD> ReparseTags;
+	std::vector<DWORD> Targets;
+	StringPool Strings;
+	/** The index of every entry, keyed on the index of its parent and the id of its name. */
+	std::unordered_map<DWORDLONG, DWORD> Children;
+};
+
+#endif //ENTRYTABLE_H
@@ -0,0 +1,277 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef FIXLINKS_H
+#define FIXLINKS_H
+#pragma once
+
+#include <Windows.h>
+#include <memory.h>
+
+#include "AsyncReparse.h"
+#include "LinkCore.h"
+#include "LinkManifest.h"
+#include "PathBuffer.h"
+#include "RebaseMap.h"
+#include "TargetCache.h"
+#include "TreeWalker.h"
+
+/**
+ * The options of a fix made by fixlink.
+ */
+struct FixLinkOptions : public LinkToolOptions
+{
+	/** Set to true to overwrite the reparse data of each link in place instead of deleting and recreating it. */
+	bool bInPlace;
+	/** Set to true to check that each new target exists before writing it. */
+	bool bVerify;
+	/** Set to true to carry on from where the run that wrote the journal stopped. */
+	bool bResume;
+	/** The number of overlapped reparse requests kept in flight, or zero to read and write each link in turn. */
+	int NumAsyncRequests;
+	/** The path of the manifest to modify the links of instead of walking the given paths. */
+	TCHAR ApplyPath[MAX_PATH];
+	/** The path of the manifest to write the planned changes to instead of modifying anything. */
+	TCHAR PlanPath[MAX_PATH];
+	/** The path of the journal to record the progress of /APPLY to. */
+	TCHAR JournalPath[MAX_PATH];
+	/** The path of the checkpoint file used to only process links changed since the previous run. */
+	TCHAR CheckpointPath[MAX_PATH];
+	/** The path of the file holding the rules to rebase targets with. */
+	TCHAR RebaseMapPath[MAX_PATH];
+	/** The path to rebase targets to. */
+	TCHAR NewTargetBase[MAX_PATH];
+	/** The path to rebase targets from. */
+	TCHAR OldTargetBase[MAX_PATH];
+
+	FixLinkOptions()
+		: bInPlace(true)
+		, bVerify(false)
+		, bResume(false)
+		, NumAsyncRequests(0)
+	{
+		memset(ApplyPath, 0, sizeof(ApplyPath));
+		memset(PlanPath, 0, sizeof(PlanPath));
+		memset(JournalPath, 0, sizeof(JournalPath));
+		memset(CheckpointPath, 0, sizeof(CheckpointPath));
+		memset(RebaseMapPath, 0, sizeof(RebaseMapPath));
+		memset(NewTargetBase, 0, sizeof(NewTargetBase));
+		memset(OldTargetBase, 0, sizeof(OldTargetBase));
+	}
+};
+
+/**
+ * The statistics of a fix made by fixlink.
+ */
+struct FixLinkStats : public LinkStats
+{
+	/** The number of file objects successfully modified. */
+	AtomicCounter NumModified;
+	/** The number of file objects not modified because their new target is missing or of the wrong kind. */
+	AtomicCounter NumBroken;
+};
+
+/**
+ * Works out and writes the new targets of links for the actions of a fix, which share it: the target of each link is
+ * rebased with the rules of the rebase map if one was given, otherwise by replacing the old base with the new one.
+ * The targets checked by /VERIFY are kept for as long as the fixer. The fixer can be used from multiple threads at
+ * once.
+ */
+class LinkFixer
+{
+public:
+	/**
+	 * @param InOptions The options of the fix.
+	 * @param InStats The statistics to record the modified, broken, failed and skipped links to.
+	 * @param InRules The rules loaded with /RMAP.
+	 * @param InPlan The manifest to write the planned changes to, or NULL to modify the links.
+	 */
+	LinkFixer(const FixLinkOptions& InOptions, FixLinkStats& InStats, const RebaseMap& InRules,
+		ManifestWriter* InPlan = NULL);
+
+	/**
+	 * Returns true if the changes are written to a manifest instead of being made.
+	 */
+	bool IsPlanning() const
+	{
+		return Plan != NULL;
+	}
+
+	/**
+	 * Returns true if the reparse point is a junction or a symbolic link, otherwise reports it as skipped.
+	 */
+	bool IsFixableLink(LPCTSTR Path, DWORD ReparseTag);
+
+	/**
+	 * Reports a link of a manifest that changed since the manifest was planned, which is skipped.
+	 */
+	void SkipChangedLink(LPCTSTR Path);
+
+	/**
+	 * Works out the new target of a link based on the options set.
+	 *
+	 * @param Target The existing target of the link.
+	 * @param Arena The scratch memory to allocate the new target from.
+	 * @return Returns the new target, or NULL if the link is to be left untouched.
+	 */
+	LPCTSTR RebaseTarget(LPCTSTR Target, StringArena& Arena) const;
+
+	/**
+	 * Works out the change to a single reparse point by reading its existing target and rebasing it.
+	 *
+	 * @param hLink The handle of the reparse point.
+	 * @param Op The change to fill in. The path and attributes must already be set. NewTarget is set to NULL if the
+	 *			link is to be left untouched. [IN/OUT]
+	 * @param Arena The scratch memory to allocate the target paths from.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+	 */
+	DWORD PlanFix(HANDLE hLink, LinkOp& Op, StringArena& Arena) const;
+
+	/**
+	 * Checks that the new target of a link exists when /VERIFY is specified. Links whose new target is missing, or
+	 * isn't the kind of file object the link expects, are counted as broken.
+	 *
+	 * @param Op The change to check.
+	 * @return Returns true if the link is to be left untouched because its new target is broken or couldn't be checked.
+	 */
+	bool IsBrokenTarget(const LinkOp& Op);
+
+	/**
+	 * Decides what becomes of a link once its new target is worked out. When planning, the change is written to the
+	 * manifest instead.
+	 *
+	 * @param Op The change worked out by PlanFix.
+	 * @return Returns true if the new target is to be written to the link.
+	 */
+	bool ShouldFixLink(const LinkOp& Op);
+
+	/**
+	 * Records a link whose new target was written.
+	 */
+	void CountFixedLink(const LinkOp& Op);
+
+	/**
+	 * Writes the new target of a single reparse point.
+	 *
+	 * @param hLink The handle of the reparse point, opened with write access.
+	 * @param Op The change to carry out.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+	 */
+	DWORD FixLink(HANDLE hLink, const LinkOp& Op);
+
+private:
+	LinkFixer(const LinkFixer&);
+	LinkFixer& operator=(const LinkFixer&);
+
+	const FixLinkOptions& Options;
+	FixLinkStats& Stats;
+	const RebaseMap& Rules;
+	/** The manifest written by /PLAN, or NULL if the links are modified. */
+	ManifestWriter* Plan;
+	/** The targets checked by /VERIFY. */
+	TargetCache Targets;
+};
+
+/**
+ * Rewrites the target of every reparse point discovered in the directory tree. When planning, the changes are written
+ * to the manifest instead and nothing is modified. With a queue the links are handed to it instead of being read and
+ * written in turn.
+ */
+class FixLinkAction : public LinkAction
+{
+public:
+	/**
+	 * @param InFixer The fixer that works out and writes the new targets.
+	 * @param InAsyncLinks The started queue to submit the links to (/ASYNC), or NULL to fix each link as it is found.
+	 */
+	FixLinkAction(LinkFixer& InFixer, AsyncLinkQueue* InAsyncLinks = NULL)
+		: Fixer(InFixer)
+		, AsyncLinks(InAsyncLinks)
+	{
+	}
+
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry);
+
+private:
+	FixLinkAction(const FixLinkAction&);
+	FixLinkAction& operator=(const FixLinkAction&);
+
+	LinkFixer& Fixer;
+	AsyncLinkQueue* AsyncLinks;
+};
+
+/**
+ * Rebases the links read by the completion port of /ASYNC. The queue writes the new targets itself.
+ */
+class FixLinkAsyncAction : public AsyncLinkAction
+{
+public:
+	/**
+	 * @param InFixer The fixer that works out the new targets.
+	 */
+	FixLinkAsyncAction(LinkFixer& InFixer)
+		: Fixer(InFixer)
+	{
+	}
+
+	virtual DWORD OnReadLink(AsyncLink& Link);
+	virtual void OnLinkWritten(const AsyncLink& Link);
+
+private:
+	FixLinkAsyncAction(const FixLinkAsyncAction&);
+	FixLinkAsyncAction& operator=(const FixLinkAsyncAction&);
+
+	LinkFixer& Fixer;
+};
+
+/**
+ * Carries out the changes read from a manifest, skipping the links that changed since the manifest was planned.
+ */
+class FixApplyAction : public LinkOpAction
+{
+public:
+	/**
+	 * @param InFixer The fixer that checks and writes the new targets.
+	 */
+	FixApplyAction(LinkFixer& InFixer)
+		: Fixer(InFixer)
+	{
+	}
+
+	virtual DWORD OnLinkOp(const LinkOp& Op, StringArena& Arena);
+	virtual DWORD OnResumeLinkOp(const LinkOp& Op, StringArena& Arena);
+
+private:
+	FixApplyAction(const FixApplyAction&);
+	FixApplyAction& operator=(const FixApplyAction&);
+
+	LinkFixer& Fixer;
+};
+
+#endif //FIXLINKS_H
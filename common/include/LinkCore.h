@@ -0,0 +1,266 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LINKCORE_H
+#define LINKCORE_H
+#pragma once
+
+#include <Windows.h>
+#include <memory.h>
+
+#include "DestinationCache.h"
+#include "LinkStats.h"
+#include "PathBuffer.h"
+#include "RebaseMap.h"
+#include "TreeWalker.h"
+#include "WalkFilter.h"
+
+/**
+ * The options shared by every link utility. Each utility extends this with the options specific to the operation it
+ * performs.
+ */
+struct LinkToolOptions
+{
+	/** Set to true to adapt the number of concurrent operations to the latency and overload failures of the volume. */
+	bool bAdaptive;
+	/** Set to true to walk the directory tree level by level instead of depth-first. */
+	bool bBreadthFirst;
+	/** Set to true to discover links from the volume metadata instead of enumerating every directory. */
+	bool bFast;
+	/** Set to true to enable verbose logging. */
+	bool bVerbose;
+	/** The maximum file tree depth to traverse before stopping. */
+	int MaxDepth;
+	/** The number of worker threads used to walk the directory tree. */
+	int NumThreads;
+	/** The path of the link index to replay, and record if it is out of date, instead of walking the tree. */
+	TCHAR IndexPath[MAX_PATH];
+	/** The highest number of file system operations to start each second, or zero for no limit. */
+	DWORD MaxIops;
+	/** The time between two /STATS reports, in milliseconds, or zero for none. */
+	DWORD StatsInterval;
+	/** The path of the file to append the /STATS reports to, or an empty string for stderr. */
+	TCHAR StatsPath[MAX_PATH];
+	/** The directories and links to leave out of the walk (/XD, /XJ and /TYPE). */
+	WalkFilter Filter;
+
+	LinkToolOptions()
+		: bAdaptive(false)
+		, bBreadthFirst(false)
+		, bFast(false)
+		, bVerbose(false)
+		, MaxDepth(-1)
+		, NumThreads(1)
+		, MaxIops(0)
+		, StatsInterval(0)
+	{
+		memset(IndexPath, 0, sizeof(IndexPath));
+		memset(StatsPath, 0, sizeof(StatsPath));
+	}
+
+	/**
+	 * Returns the options of a walk made with these options.
+	 */
+	WalkOptions GetWalkOptions() const;
+};
+
+/**
+ * The options shared by the utilities that recreate the links of a source tree at a destination.
+ */
+struct LinkCopyOptions : public LinkToolOptions
+{
+	/** Set to true to assert that the destination holds nothing yet, so that no existing links are looked for. */
+	bool bEmptyDest;
+	/** The path of the file holding the rules to rebase targets with. */
+	TCHAR RebaseMapPath[MAX_PATH];
+	/** The path to rebase targets to. */
+	TCHAR NewTargetBase[MAX_PATH];
+	/** The path to rebase targets from. */
+	TCHAR OldTargetBase[MAX_PATH];
+
+	LinkCopyOptions()
+		: bEmptyDest(false)
+	{
+		memset(RebaseMapPath, 0, sizeof(RebaseMapPath));
+		memset(NewTargetBase, 0, sizeof(NewTargetBase));
+		memset(OldTargetBase, 0, sizeof(OldTargetBase));
+	}
+};
+
+/**
+ * A directory tree to walk with an action, one of a batch given to RunLinkJobs.
+ */
+struct LinkJob
+{
+	/** The path of the directory tree or reparse point to walk, as given by the caller. */
+	LPCTSTR Root;
+	/** The action to perform on each file object discovered. Jobs may share an action. */
+	LinkAction* Action;
+	/** Set to the result of the walk once the job has run. [OUT] */
+	DWORD Result;
+
+	LinkJob()
+		: Root(NULL)
+		, Action(NULL)
+		, Result(0)
+	{
+	}
+};
+
+/**
+ * Deletes every junction and symbolic link discovered in the directory tree.
+ */
+class RemoveLinkAction : public LinkAction
+{
+public:
+	/**
+	 * @param InStats The statistics to record skipped file objects to.
+	 * @param InNumDeleted The counter to record each deleted link to.
+	 */
+	RemoveLinkAction(LinkStats& InStats, AtomicCounter& InNumDeleted)
+		: Stats(InStats)
+		, NumDeleted(InNumDeleted)
+	{
+	}
+
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry);
+
+private:
+	RemoveLinkAction(const RemoveLinkAction&);
+	RemoveLinkAction& operator=(const RemoveLinkAction&);
+
+	LinkStats& Stats;
+	AtomicCounter& NumDeleted;
+};
+
+/**
+ * Parses a command line option shared by every utility: /LEV:n, /MT[:n], /ADAPT, /MAXIOPS:n, /BFS, /FAST, /INDEX:file,
+ * /STATS[:n[,file]], /XD:pattern, /XJ, /TYPE:types and /V. Options are matched anywhere in the argument, so the
+ * options of a utility that contain /V must be looked for first.
+ *
+ * @param Arg The command line argument to parse.
+ * @param Options The options to set. [IN/OUT]
+ * @return Returns true if the argument is one of the shared options.
+ */
+bool ParseLinkToolOption(LPCTSTR Arg, LinkToolOptions& Options);
+
+/**
+ * Parses a command line option shared by the utilities that copy or move links: /EMPTYDEST and /RMAP:file, along with
+ * the options shared by every utility. /R takes its values from the arguments that follow and is left to the utility.
+ *
+ * @param Arg The command line argument to parse.
+ * @param Options The options to set. [IN/OUT]
+ * @return Returns true if the argument is one of the shared options.
+ */
+bool ParseLinkCopyOption(LPCTSTR Arg, LinkCopyOptions& Options);
+
+/**
+ * Starts the /STATS reports when they were requested, reporting the file that couldn't be written otherwise, along with
+ * the measurements of /ADAPT and the pacing of /MAXIOPS. StopMetrics ends them all.
+ *
+ * @param Options The options of the run.
+ * @param Stats The statistics of the run.
+ * @param NumProcessed The counter of the links the utility has processed.
+ * @return Returns zero if the reports were started or none were requested, otherwise a non-zero value on failure.
+ */
+DWORD StartToolMetrics(const LinkToolOptions& Options, const LinkStats& Stats, const AtomicCounter& NumProcessed);
+
+/**
+ * Compiles the rules of a /RMAP file, reporting the file if it can't be read.
+ *
+ * @param Path The path of the rebase map.
+ * @param bVerbose Set to true to report the number of rules loaded.
+ * @param Rules The rules to load. [OUT]
+ * @return Returns zero if the rules were loaded, otherwise a non-zero value on failure.
+ */
+DWORD LoadRebaseRules(LPCTSTR Path, bool bVerbose, RebaseMap& Rules);
+
+/**
+ * Reads the target of an open junction or symbolic link.
+ *
+ * @param hLink The handle of the reparse point, opened with read access.
+ * @param ReparseTag Set to the reparse tag of the reparse point. [OUT]
+ * @param Target Set to the target of the reparse point. [OUT]
+ * @param Arena The scratch memory to allocate the target from.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD ReadLinkTarget(HANDLE hLink, DWORD& ReparseTag, LPCTSTR& Target, StringArena& Arena);
+
+/**
+ * Rebases the target of a copied or moved link. The rules of the rebase map take precedence over /R.
+ *
+ * @param Options The options holding the /R bases.
+ * @param Rules The rules loaded with /RMAP.
+ * @param Target The existing target of the link.
+ * @param Arena The scratch memory to allocate the rebased target from.
+ * @return Returns the rebased target, or Target itself if it isn't rebased.
+ */
+LPCTSTR RebaseLinkTarget(const LinkCopyOptions& Options, const RebaseMap& Rules, LPCTSTR Target, StringArena& Arena);
+
+/**
+ * Expands the source and the destination of a copy or move to full paths. When /EMPTYDEST is specified the
+ * destination is checked to be empty and marked so in the cache.
+ *
+ * @param Src The path of the source as given on the command line.
+ * @param Dest The path of the destination as given on the command line.
+ * @param Options The options of the run.
+ * @param DestDirs The known state of the destination directories.
+ * @param SrcPath Set to the full path of the source. [OUT]
+ * @param DestPath Set to the full path of the destination. [OUT]
+ * @param Stats The statistics to record the failure to.
+ * @return Returns zero if both paths are valid, otherwise a non-zero value after the failure is reported.
+ */
+DWORD GetCopyPaths(LPCTSTR Src, LPCTSTR Dest, const LinkCopyOptions& Options, DestinationCache& DestDirs,
+	tstring& SrcPath, tstring& DestPath, LinkStats& Stats);
+
+/**
+ * Walks the directory tree of a single job. The root is expanded to the extended-length syntax first, which lifts the
+ * MAX_PATH limit for deep trees.
+ *
+ * @param Job The job to run. Its result is set.
+ * @param Options The options that control the walk.
+ * @param Stats The statistics to record failures and skipped file objects to.
+ * @return Returns zero if the root could be walked, otherwise a non-zero error code.
+ */
+DWORD RunLinkJob(LinkJob& Job, const WalkOptions& Options, LinkStats& Stats);
+
+/**
+ * Runs a batch of jobs in the calling process. The jobs of one volume run one after the other, in the order given,
+ * while the volumes run side by side (see ScheduleRoots). A link index describes a single root, so with one the jobs
+ * all run in turn on the calling thread. A failing job doesn't stop the others.
+ *
+ * @param Jobs The jobs to run. The result of each is set.
+ * @param NumJobs The number of jobs.
+ * @param Options The options that control each walk.
+ * @param Stats The statistics shared by the jobs.
+ * @return Returns zero if every job succeeded, otherwise the error of the first job that failed.
+ */
+DWORD RunLinkJobs(LinkJob* Jobs, size_t NumJobs, const WalkOptions& Options, LinkStats& Stats);
+
+#endif //LINKCORE_H
@@ -0,0 +1,126 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LINKINDEX_H
+#define LINKINDEX_H
+#pragma once
+
+#include <Windows.h>
+#include <winioctl.h>
+
+#include "LinkStats.h"
+#include "TreeWalker.h"
+
+/** The first four bytes of every link index file, "LIDX". */
+#define LINK_INDEX_SIGNATURE 0x5844494C
+
+/** The version of the link index format described below. */
+#define LINK_INDEX_VERSION 2
+
+/** The parent of the root directory of an index. */
+#define LINK_INDEX_NO_PARENT 0xFFFFFFFF
+
+/**
+ * The header of a link index file. A link index is a snapshot of every link beneath a root directory along with the
+ * state of the change journal when it was taken, so that repeated queries of an unchanged tree can skip the walk. The
+ * file is laid out as the header followed by the directory table, the link table and the string pool, and is meant to
+ * be mapped into memory as is. Every string is stored once in the pool as a null-terminated WCHAR string and referred
+ * to by its offset in characters.
+ */
+struct LinkIndexHeader
+{
+	/** Always LINK_INDEX_SIGNATURE. */
+	DWORD Signature;
+	/** Always LINK_INDEX_VERSION. */
+	DWORD Version;
+	/** The serial number of the volume the index was taken on. */
+	DWORD VolumeSerial;
+	/** The maximum depth of the walk the index was taken with, or -1 if the whole tree was walked. */
+	int MaxDepth;
+	/** The identifier of the change journal when the index was taken. */
+	DWORDLONG JournalId;
+	/** The position of the change journal when the walk that took the index started. */
+	USN NextUsn;
+	/** The root of the walk, as an offset in the string pool. */
+	DWORD RootPath;
+	/** The number of entries in the directory table. */
+	DWORD NumDirectories;
+	/** The number of entries in the link table. */
+	DWORD NumLinks;
+	/** The size of the string pool, in characters. */
+	DWORD PoolSize;
+};
+
+/**
+ * A directory leading to one or more links. The root is always the first entry and every directory comes after its
+ * parent.
+ */
+struct LinkIndexDirectory
+{
+	/** The index of the parent directory, or LINK_INDEX_NO_PARENT for the root. */
+	DWORD Parent;
+	/** The name of the directory, as an offset in the string pool. Names are shared by every entry with that name. */
+	DWORD Name;
+	/** The level of the directory in the tree. The root is at level zero. */
+	DWORD Depth;
+};
+
+/**
+ * A link beneath the root of the index.
+ */
+struct LinkIndexLink
+{
+	/** The index of the directory that holds the link. */
+	DWORD Parent;
+	/** The name of the link, as an offset in the string pool. */
+	DWORD Name;
+	/** The file attributes of the link. */
+	DWORD Attributes;
+	/** The reparse tag of the link. */
+	DWORD ReparseTag;
+};
+
+/**
+ * Walks the directory tree at the given root using the link index in Options.IndexPath. When the index was taken of
+ * the same root and the change journal shows that no link or directory beneath the root was created, deleted or renamed
+ * since, the directories and links are replayed from the index without touching the tree. The index doesn't hold the
+ * targets, so a link retargeted in place, as fixlink does, leaves it valid (see HasTreeChanged). Otherwise the
+ * tree is walked as WalkTree would and a fresh index is written if the walk reached every directory, whatever the
+ * action made of the links. The index can't be validated without access to the change journal, which requires
+ * elevation, so such walks never use or write one.
+ *
+ * @param Root The path of the directory tree to walk.
+ * @param Action The action to perform on each file object discovered.
+ * @param Options The options that control the walk.
+ * @param Stats The statistics to record failures and skipped file objects to.
+ * @return Returns zero if the root could be walked, otherwise a non-zero error code.
+ */
+DWORD WalkIndex(LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats);
+
+#endif //LINKINDEX_H
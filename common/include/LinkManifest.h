@@ -0,0 +1,242 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LINKMANIFEST_H
+#define LINKMANIFEST_H
+#pragma once
+
+#include <Windows.h>
+#include <stdio.h>
+#include <vector>
+
+#include "EntryTable.h"
+#include "LinkStats.h"
+#include "PathBuffer.h"
+
+class ApplyJournal;
+
+/** The number of operations a worker claims at a time when applying a manifest. */
+#define LINK_OP_BATCH_SIZE 64
+
+/**
+ * A single change to a link, worked out ahead of time so that it can be recorded in a manifest (/PLAN) and carried out
+ * later (/APPLY). The strings are owned by whoever built the operation.
+ */
+struct LinkOp
+{
+	/** The reparse tag of the link, either IO_REPARSE_TAG_MOUNT_POINT or IO_REPARSE_TAG_SYMLINK. */
+	DWORD ReparseTag;
+	/** The file attributes of the link. */
+	DWORD Attributes;
+	/** The full path of the link. */
+	LPCTSTR Path;
+	/** The full path the link is moved to, or an empty string if it stays where it is. */
+	LPCTSTR DestPath;
+	/** The target of the link when the operation was planned. */
+	LPCTSTR OldTarget;
+	/** The target the link is given. */
+	LPCTSTR NewTarget;
+
+	LinkOp()
+		: ReparseTag(0)
+		, Attributes(0)
+		, Path(TEXT(""))
+		, DestPath(TEXT(""))
+		, OldTarget(TEXT(""))
+		, NewTarget(TEXT(""))
+	{
+	}
+};
+
+/**
+ * Records planned link operations to a manifest file. Operations can be written from multiple threads at once.
+ */
+class ManifestWriter
+{
+public:
+	ManifestWriter();
+	~ManifestWriter();
+
+	/**
+	 * Creates the manifest file, replacing any existing one.
+	 *
+	 * @param Path The path of the manifest file to create.
+	 * @param Tool The name of the utility the manifest is meant for. Only that utility will apply it.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+	 */
+	DWORD Open(LPCTSTR Path, LPCTSTR Tool);
+
+	/**
+	 * Appends an operation to the manifest.
+	 */
+	void Write(const LinkOp& Op);
+
+	/**
+	 * Flushes and closes the manifest file.
+	 *
+	 * @return Returns zero if every operation was written successfully, otherwise a non-zero value.
+	 */
+	DWORD Close();
+
+	/**
+	 * Returns the number of operations written to the manifest.
+	 */
+	LONG GetNumOps() const
+	{
+		return NumOps;
+	}
+
+private:
+	ManifestWriter(const ManifestWriter&);
+	ManifestWriter& operator=(const ManifestWriter&);
+
+	FILE* File;
+	CRITICAL_SECTION Lock;
+	LONG NumOps;
+};
+
+/**
+ * The link operations read back from a manifest file. The links and their destinations are kept in an entry table,
+ * which shares the directories and names that the paths have in common, and each operation only holds the indices of
+ * its entries and the id of its new target. Full paths are put back together as each operation is carried out.
+ */
+class LinkManifest
+{
+public:
+	LinkManifest()
+		: ContentHash(0)
+	{
+	}
+
+	/**
+	 * Reads a manifest file written by ManifestWriter.
+	 *
+	 * @param Path The path of the manifest file to read.
+	 * @param Tool The name of the utility that is going to apply the manifest.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+	 */
+	DWORD Load(LPCTSTR Path, LPCTSTR Tool);
+
+	/**
+	 * Rebuilds an operation of the manifest.
+	 *
+	 * @param Index The index of the operation.
+	 * @param Op The operation to fill in. [OUT]
+	 * @param Arena The scratch memory to allocate the paths of the operation from.
+	 */
+	void GetOp(size_t Index, LinkOp& Op, StringArena& Arena) const;
+
+	size_t GetNumOps() const
+	{
+		return Links.size();
+	}
+
+	/**
+	 * Returns a hash of the whole manifest file as it was read, which tells apart manifests with the same shape.
+	 */
+	DWORDLONG GetContentHash() const
+	{
+		return ContentHash;
+	}
+
+private:
+	EntryTable Entries;
+	/** The entry of the link of each operation, which holds its type, attributes and planned target. */
+	std::vector<DWORD> Links;
+	/** The entry of the destination of each operation, or ENTRY_TABLE_NONE if the link stays where it is. */
+	std::vector<DWORD> Dests;
+	/** The new target of each operation, as an id in the string pool of the entries. */
+	std::vector<DWORD> NewTargets;
+	/** The FNV-1a hash of the bytes of the manifest file. */
+	DWORDLONG ContentHash;
+};
+
+/**
+ * The callback that a utility implements to carry out the operations of a manifest. It is invoked concurrently when
+ * more than one thread is used and must be thread-safe.
+ */
+class LinkOpAction
+{
+public:
+	virtual ~LinkOpAction() {}
+
+	/**
+	 * Called for each operation of the manifest.
+	 *
+	 * @param Op The operation to carry out.
+	 * @param Arena Scratch memory owned by the calling thread, reset before each call.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero error code.
+	 */
+	virtual DWORD OnLinkOp(const LinkOp& Op, StringArena& Arena) = 0;
+
+	/**
+	 * Called instead of OnLinkOp for each operation that an interrupted run began but didn't record as finished, whose
+	 * link may already be partly or fully changed. By default the operation is simply carried out again.
+	 *
+	 * @param Op The operation to finish.
+	 * @param Arena Scratch memory owned by the calling thread, reset before each call.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero error code.
+	 */
+	virtual DWORD OnResumeLinkOp(const LinkOp& Op, StringArena& Arena)
+	{
+		return OnLinkOp(Op, Arena);
+	}
+};
+
+/**
+ * Checks that a link still has the type and target it had when an operation was planned for it, so that a stale
+ * manifest never overwrites changes made since.
+ *
+ * @param hLink The handle of the link, opened with at least FILE_READ_ATTRIBUTES access.
+ * @param Op The operation planned for the link.
+ * @param Arena The scratch memory to read the current target into.
+ * @param bUnchanged Set to true if the link is as planned, false otherwise. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CheckPlannedTarget(HANDLE hLink, const LinkOp& Op, StringArena& Arena, bool& bUnchanged);
+
+/**
+ * Carries out every operation of a manifest. The operations are handed out to a pool of threads in batches of
+ * consecutive entries so that links of the same directory tend to be written together. Any failure is counted in
+ * Stats and does not stop the others.
+ *
+ * With a journal each batch is recorded as begun before it is carried out, and the operations that succeeded as
+ * finished afterwards. The operations an earlier run finished are skipped and the ones it left unfinished are handed
+ * to OnResumeLinkOp.
+ *
+ * @param Manifest The manifest to apply.
+ * @param Action The action that carries out each operation.
+ * @param NumThreads The number of threads to use.
+ * @param Stats The statistics to record failures to.
+ * @param Journal The open journal of the manifest, or NULL for none.
+ */
+void ApplyManifest(const LinkManifest& Manifest, LinkOpAction& Action, int NumThreads, LinkStats& Stats,
+	ApplyJournal* Journal);
+
+#endif //LINKMANIFEST_H
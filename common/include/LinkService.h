@@ -0,0 +1,104 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LINKSERVICE_H
+#define LINKSERVICE_H
+#pragma once
+
+#include <Windows.h>
+
+/** The prefix of the named pipe of each utility's service. The name of the utility is appended to it. */
+#define LINK_SERVICE_PIPE_PREFIX TEXT("\\\\.\\pipe\\ntfslinkd\\")
+
+/** The size of the buffer used to relay the output of a job to the client, in bytes. */
+#define LINK_SERVICE_BUFFER_SIZE 4096
+
+/**
+ * The callback that a utility implements to run one invocation of its command line, either directly or on behalf of
+ * a client of its service. Jobs run one at a time, so an implementation only has to reset the state left behind by the
+ * previous job.
+ */
+class LinkServiceJob
+{
+public:
+	virtual ~LinkServiceJob() {}
+
+	/**
+	 * Called for each invocation.
+	 *
+	 * @param argc The number of command line arguments, including the name of the utility.
+	 * @param argv The command line arguments.
+	 * @return Returns the exit code of the invocation.
+	 */
+	virtual int Run(int argc, TCHAR* argv[]) = 0;
+};
+
+/**
+ * Runs a utility from its entry point. With /SERVE the process becomes a long-running service that carries out the
+ * invocations of other processes over a named pipe. With /SERVICE the invocation is handed to the service when one is
+ * running for the same user, and run in this process when there is none or the service turns it down. Otherwise the
+ * invocation always runs in this process.
+ *
+ * @param Tool The name of the utility, which also names its pipe.
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @param Job The job that runs the command line of the utility.
+ * @return Returns the exit code of the invocation.
+ */
+int RunLinkTool(LPCTSTR Tool, int argc, TCHAR* argv[], LinkServiceJob& Job);
+
+/**
+ * Carries out the invocations sent to the pipe of a utility, one at a time, until the process is stopped or the pipe
+ * fails. Only the user running the service can connect to the pipe. Each job runs as its client, in the working
+ * directory of the client, and its console output is relayed back to the client. The service returns to its own
+ * working directory after each job. Clients at a lower integrity level than the service, such as unelevated clients of
+ * an elevated service, are turned down.
+ *
+ * @param Tool The name of the utility, which also names its pipe.
+ * @param Job The job that runs the command line of the utility.
+ * @return Returns a non-zero value if the pipe could not be created or stopped accepting clients.
+ */
+DWORD RunLinkService(LPCTSTR Tool, LinkServiceJob& Job);
+
+/**
+ * Hands an invocation to the service of a utility and relays its output to the console, waiting for the service to
+ * finish any job it is running first. The invocation is only sent to a service run by the same user.
+ *
+ * @param Tool The name of the utility, which also names its pipe.
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @param ExitCode Set to the exit code of the invocation. [OUT]
+ * @return Returns zero if the service ran the invocation, ERROR_FILE_NOT_FOUND if no service is running,
+ *		ERROR_ACCESS_DENIED if the service is run by another user, ERROR_BUFFER_OVERFLOW if the command line is too long
+ *		to send, ERROR_REQUEST_REFUSED if the service turned it down, otherwise a non-zero value if the connection to the
+ *		service failed. The invocation didn't run in any of the cases other than the last.
+ */
+DWORD ForwardToLinkService(LPCTSTR Tool, int argc, TCHAR* argv[], int& ExitCode);
+
+#endif //LINKSERVICE_H
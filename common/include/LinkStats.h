@@ -27,47 +27,59 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ///////////////////////////////////////////////////////////////////////////////
 
-#ifndef DATATYPES_H
-#define DATATYPES_H
+#ifndef LINKSTATS_H
+#define LINKSTATS_H
 #pragma once
 
-#include <memory.h>
+#include <Windows.h>
 
-struct cplinkOptions
+/**
+ * A statistics counter that can be safely incremented from multiple threads at once.
+ */
+struct AtomicCounter
 {
-	/** Set to true to enable verbose logging. */
-	bool bVerbose;
-	/** The maximum file tree depth to traverse before stopping. */
-	int MaxDepth;
-	/** The path to rebase targets to. */
-	TCHAR NewTargetBase[MAX_PATH];
-	/** The path to rebase targets from. */
-	TCHAR OldTargetBase[MAX_PATH];
+	/** The current value of the counter. */
+	volatile LONG Value;
 
-	cplinkOptions()
-		: bVerbose(false)
-		, MaxDepth(-1)
+	AtomicCounter()
+		: Value(0)
 	{
-		memset(NewTargetBase, 0, sizeof(NewTargetBase));
-		memset(OldTargetBase, 0, sizeof(OldTargetBase));
 	}
-};
 
-struct cplinkStats
-{
-	/** The number of file objects that failed to be moved. */
-	size_t NumFailed;
-	/** The number of file objects successfully copied. */
-	size_t NumCopied;
-	/** The number of file objects that were skipped. */
-	size_t NumSkipped;
+	void operator++(int)
+	{
+		InterlockedIncrement(&Value);
+	}
+
+	void operator+=(LONG Amount)
+	{
+		InterlockedExchangeAdd(&Value, Amount);
+	}
 
-	cplinkStats()
-		: NumFailed(0)
-		, NumCopied(0)
-		, NumSkipped(0)
+	/**
+	 * Returns the current value of the counter.
+	 */
+	LONG Get() const
 	{
+		return Value;
 	}
+
+	operator LONG() const
+	{
+		return Value;
+	}
+};
+
+/**
+ * The execution statistics common to all of the link utilities. Each utility extends this with the counters specific
+ * to the operation it performs.
+ */
+struct LinkStats
+{
+	/** The number of file objects that failed to be processed. */
+	AtomicCounter NumFailed;
+	/** The number of file objects that were skipped. */
+	AtomicCounter NumSkipped;
 };
 
-#endif //DATATYPES_H
\ No newline at end of file
+#endif //LINKSTATS_H
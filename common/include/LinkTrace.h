@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LINKTRACE_H
+#define LINKTRACE_H
+#pragma once
+
+#include <Windows.h>
+
+/**
+ * The operations traced as a pair of start and stop events. The file system operations are listed in the same order as
+ * MetricOp so that a measured operation maps to its task directly.
+ */
+enum TraceTask
+{
+	/** Opening a directory listing or reading the next batch of entries. */
+	TraceEnumerate,
+	/** Reading the reparse data of a link. */
+	TraceGetTarget,
+	/** Writing the reparse data of a link. */
+	TraceSetTarget,
+	/** Deleting a link or its reparse data. */
+	TraceDelete,
+	/** Creating the file object of a new link. */
+	TraceCreate,
+	/** Working out the new target of a link from /R or /RMAP. */
+	TraceRebase,
+	NUM_TRACE_TASKS
+};
+
+/** Set while an ETW session has the ntfslinkutils provider enabled. Nothing is traced while it is false. */
+extern bool bTraceEnabled;
+
+/**
+ * Writes the start event of an operation. Only called while bTraceEnabled is set.
+ *
+ * @param Task The operation that starts.
+ * @param PathLength The length, in characters, of the path the operation is given, or zero if it has none.
+ */
+void TraceStart(TraceTask Task, DWORD PathLength);
+
+/**
+ * Writes the stop event of an operation. Only called while bTraceEnabled is set.
+ *
+ * @param Task The operation that is done.
+ * @param PathLength The length, in characters, of the path the operation was given or returned, or zero if it has none.
+ * @param Result The error code of the operation, or zero if it was successful.
+ * @param Micros The time the operation took, in microseconds.
+ */
+void TraceStop(TraceTask Task, DWORD PathLength, DWORD Result, LONGLONG Micros);
+
+/**
+ * Traces an operation that isn't measured for /STATS, and isn't held back by /MAXIOPS, for as long as it is in scope.
+ */
+class TraceTimer
+{
+public:
+	TraceTimer(TraceTask InTask, LPCTSTR Path)
+		: Task(InTask)
+		, PathLength(0)
+		, Result(0)
+		, Start(0)
+	{
+		if (bTraceEnabled)
+		{
+			Begin(Path);
+		}
+	}
+
+	~TraceTimer()
+	{
+		if (Start != 0)
+		{
+			End();
+		}
+	}
+
+	/**
+	 * Sets the error code the stop event carries and returns it.
+	 */
+	DWORD SetResult(DWORD InResult)
+	{
+		Result = InResult;
+		return Result;
+	}
+
+private:
+	TraceTimer(const TraceTimer&);
+	TraceTimer& operator=(const TraceTimer&);
+
+	void Begin(LPCTSTR Path);
+	void End();
+
+	TraceTask Task;
+	DWORD PathLength;
+	DWORD Result;
+	/** The time the operation started at, or zero if it isn't traced. */
+	LONGLONG Start;
+};
+
+#endif //LINKTRACE_H
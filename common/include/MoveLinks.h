@@ -0,0 +1,144 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef MOVELINKS_H
+#define MOVELINKS_H
+#pragma once
+
+#include <Windows.h>
+#include <memory.h>
+
+#include "DestinationCache.h"
+#include "LinkCore.h"
+#include "LinkManifest.h"
+#include "PathBuffer.h"
+#include "RebaseMap.h"
+#include "TreeWalker.h"
+
+/**
+ * The options of a move made by mvlink.
+ */
+struct MoveLinkOptions : public LinkCopyOptions
+{
+	/** The path of the manifest to move the links of instead of walking a directory tree. */
+	TCHAR ApplyPath[MAX_PATH];
+	/** The path of the manifest to write the planned moves to instead of moving anything. */
+	TCHAR PlanPath[MAX_PATH];
+	/** The path of the journal to record the progress of /APPLY to. */
+	TCHAR JournalPath[MAX_PATH];
+	/** Set to true to carry on from where the run that wrote the journal stopped. */
+	bool bResume;
+
+	MoveLinkOptions()
+		: bResume(false)
+	{
+		memset(ApplyPath, 0, sizeof(ApplyPath));
+		memset(PlanPath, 0, sizeof(PlanPath));
+		memset(JournalPath, 0, sizeof(JournalPath));
+	}
+};
+
+/**
+ * The statistics of a move made by mvlink.
+ */
+struct MoveLinkStats : public LinkStats
+{
+	/** The number of file objects successfully moved. */
+	AtomicCounter NumMoved;
+};
+
+/**
+ * Mirrors the directory structure of the source tree at the destination and moves each reparse point found, rebasing
+ * its target based on the options set (when applicable). Links are renamed while the destination is on the same
+ * volume, otherwise they are recreated at the destination and the originals are removed. When planning, the moves are
+ * written to the manifest instead and nothing is changed.
+ */
+class MoveLinkAction : public LinkAction
+{
+public:
+	/**
+	 * @param InOptions The options of the move.
+	 * @param InStats The statistics to record the moves and skipped file objects to.
+	 * @param InDestDirs The known state of the destination directories.
+	 * @param InRules The rules loaded with /RMAP.
+	 * @param InDestRoot The full path of the destination that the source tree is moved to.
+	 * @param bSameVolume Set to true if the source and the destination appear to be on the same volume, so that the
+	 *		links are renamed.
+	 * @param InPlan The manifest to write the planned moves to, or NULL to move the links.
+	 */
+	MoveLinkAction(const MoveLinkOptions& InOptions, MoveLinkStats& InStats, DestinationCache& InDestDirs,
+		const RebaseMap& InRules, LPCTSTR InDestRoot, bool bSameVolume, ManifestWriter* InPlan = NULL);
+
+	virtual DWORD OnDirectory(const WalkEntry& Entry);
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry);
+
+private:
+	MoveLinkAction(const MoveLinkAction&);
+	MoveLinkAction& operator=(const MoveLinkAction&);
+
+	const MoveLinkOptions& Options;
+	MoveLinkStats& Stats;
+	DestinationCache& DestDirs;
+	const RebaseMap& Rules;
+	/** The full path of the destination that the source tree is moved to. */
+	LPCTSTR DestRoot;
+	/** The manifest written by /PLAN, or NULL if the links are moved. */
+	ManifestWriter* Plan;
+	/** Set while links can be moved by renaming them. Cleared as soon as a rename reports another volume. */
+	volatile LONG bRenameLinks;
+};
+
+/**
+ * Carries out the moves read from a manifest, skipping the links that changed since the manifest was planned.
+ */
+class MoveApplyAction : public LinkOpAction
+{
+public:
+	/**
+	 * @param InOptions The options of the move.
+	 * @param InStats The statistics to record the moves and skipped links to.
+	 * @param InDestDirs The known state of the destination directories.
+	 */
+	MoveApplyAction(const MoveLinkOptions& InOptions, MoveLinkStats& InStats, DestinationCache& InDestDirs);
+
+	virtual DWORD OnLinkOp(const LinkOp& Op, StringArena& Arena);
+	virtual DWORD OnResumeLinkOp(const LinkOp& Op, StringArena& Arena);
+
+private:
+	MoveApplyAction(const MoveApplyAction&);
+	MoveApplyAction& operator=(const MoveApplyAction&);
+
+	const MoveLinkOptions& Options;
+	MoveLinkStats& Stats;
+	DestinationCache& DestDirs;
+	/** Set while links can be moved by renaming them. Cleared as soon as a rename reports another volume. */
+	volatile LONG bRenameLinks;
+};
+
+#endif //MOVELINKS_H
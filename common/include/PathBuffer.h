@@ -0,0 +1,173 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef PATHBUFFER_H
+#define PATHBUFFER_H
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+
+typedef std::basic_string<TCHAR> tstring;
+
+/**
+ * A growable, null-terminated path that components can be pushed onto and popped off of without copying the rest of
+ * the path again.
+ */
+class PathBuffer
+{
+public:
+	PathBuffer();
+
+	/**
+	 * Replaces the contents of the buffer with the given path.
+	 */
+	void Assign(LPCTSTR Path, size_t PathLength);
+	void Assign(const tstring& Path)
+	{
+		Assign(Path.c_str(), Path.size());
+	}
+
+	/**
+	 * Appends a separator and the given component to the path. No separator is added when the path already ends with
+	 * one.
+	 *
+	 * @param Component The path component to append.
+	 * @return Returns the length of the path before the component was pushed, to be passed to Pop.
+	 */
+	size_t Push(LPCTSTR Component);
+
+	/**
+	 * Appends a relative path that begins with a separator (e.g. WalkEntry::RelativePath), collapsing the separator if
+	 * the path already ends with one.
+	 */
+	void Append(LPCTSTR RelativePath);
+
+	/**
+	 * Truncates the path back to the length returned by a previous call to Push.
+	 */
+	void Pop(size_t PathLength);
+
+	LPCTSTR c_str() const
+	{
+		return &Buffer[0];
+	}
+
+	size_t size() const
+	{
+		return Length;
+	}
+
+private:
+	void Reserve(size_t NumChars);
+
+	std::vector<TCHAR> Buffer;
+	size_t Length;
+};
+
+/**
+ * Hands out scratch strings from a few large blocks that are reused once the arena is reset, so that actions don't hit
+ * the heap for every link they process. An arena must only be used by one thread at a time.
+ */
+class StringArena
+{
+public:
+	StringArena();
+	~StringArena();
+
+	/**
+	 * Allocates an uninitialized string of the given size from the arena.
+	 *
+	 * @param NumChars The size of the string, in characters, including the null terminator.
+	 * @return Returns the allocated string, valid until the arena is reset or destroyed.
+	 */
+	LPTSTR Allocate(size_t NumChars);
+
+	/**
+	 * Releases every string allocated from the arena while keeping its memory for reuse.
+	 */
+	void Reset();
+
+private:
+	StringArena(const StringArena&);
+	StringArena& operator=(const StringArena&);
+
+	struct Block
+	{
+		TCHAR* Data;
+		size_t Size;
+	};
+
+	std::vector<Block> Blocks;
+	/** The index of the block strings are currently allocated from. */
+	size_t CurrentBlock;
+	/** The number of characters used in the current block. */
+	size_t Used;
+};
+
+/**
+ * Retrieves the full path of the given path in the extended-length (\\?\) syntax so that it isn't limited to MAX_PATH
+ * characters. Paths that already use the extended-length or device syntax are returned as is.
+ *
+ * @param Path The relative or absolute path to convert.
+ * @param LongPath The full extended-length path. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD GetLongPath(LPCTSTR Path, tstring& LongPath);
+
+/**
+ * Joins a root path with a relative path that begins with a separator, without doubling the separator between them.
+ */
+tstring JoinPath(LPCTSTR Root, const tstring& RelativePath);
+LPCTSTR JoinPath(StringArena& Arena, LPCTSTR Root, LPCTSTR RelativePath);
+
+/**
+ * Creates every missing directory leading to the given path. The path itself is not created.
+ *
+ * @param Path The full path of the file object whose parent directories are created.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateParentDirectories(LPCTSTR Path);
+
+/**
+ * Returns the given path without the extended-length prefix of local paths, for display purposes only.
+ */
+LPCTSTR GetDisplayPath(LPCTSTR Path);
+
+/**
+ * Checks whether two paths are on the same volume. Neither path has to exist yet.
+ *
+ * @param Path The first full path.
+ * @param OtherPath The second full path.
+ * @return Returns true if both paths are on the same volume, false if they aren't or it can't be told.
+ */
+bool IsSameVolume(LPCTSTR Path, LPCTSTR OtherPath);
+
+#endif //PATHBUFFER_H
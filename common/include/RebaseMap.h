@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef REBASEMAP_H
+#define REBASEMAP_H
+#pragma once
+
+#include <Windows.h>
+#include <vector>
+
+#include "PathBuffer.h"
+#include "StringMatch.h"
+
+/**
+ * A set of rules that each rebase link targets from an old base path to a new one. The rules are compiled into a
+ * case-insensitive prefix trie so that a target is matched against every rule in a single pass over its characters,
+ * no matter how many rules there are.
+ *
+ * A rule only matches whole path components, e.g. D:\Old matches D:\Old and D:\Old\Sub but not D:\Older. When several
+ * rules match the same target the one with the longest old base wins.
+ */
+class RebaseMap
+{
+public:
+	RebaseMap();
+
+	/**
+	 * Reads the rules from a file and compiles them. Each line of the file holds one rule in the form
+	 * <old>|<new>. Blank lines and lines starting with ';' are ignored.
+	 *
+	 * @param Path The path of the file to read.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+	 */
+	DWORD Load(LPCTSTR Path);
+
+	/**
+	 * Adds a rule to the map. A rule with the same old base as an existing one replaces it. The map must be compiled
+	 * again before it is used.
+	 *
+	 * @param OldBase The path to rebase targets from.
+	 * @param NewBase The path to rebase targets to.
+	 */
+	void AddRule(LPCTSTR OldBase, LPCTSTR NewBase);
+
+	/**
+	 * Builds the trie from the rules that were added.
+	 */
+	void Compile();
+
+	/**
+	 * Returns the number of rules in the map.
+	 */
+	size_t GetNumRules() const
+	{
+		return Rules.size();
+	}
+
+	/**
+	 * Rebases the given target with the longest rule that matches it. Safe to call from multiple threads at once.
+	 *
+	 * @param Target The target path to rebase.
+	 * @param Arena The scratch memory to allocate the rebased target from.
+	 * @return Returns the rebased target, or NULL if no rule matches.
+	 */
+	LPCTSTR Apply(LPCTSTR Target, StringArena& Arena) const;
+
+private:
+	struct Rule
+	{
+		tstring OldBase;
+		tstring NewBase;
+	};
+
+	/** A node of the compiled trie. The edges to its children are stored sorted by character in Edges. */
+	struct Node
+	{
+		UINT FirstEdge;
+		UINT NumEdges;
+		/** The index of the rule whose old base ends at this node, or -1. */
+		int RuleIdx;
+	};
+
+	struct Edge
+	{
+		TCHAR Char;
+		UINT Child;
+	};
+
+	static TCHAR Fold(TCHAR Char)
+	{
+		return UpcaseChar(Char);
+	}
+
+	const Node* FindChild(const Node& Parent, TCHAR Char) const;
+
+	std::vector<Rule> Rules;
+	std::vector<Node> Nodes;
+	std::vector<Edge> Edges;
+};
+
+#endif //REBASEMAP_H
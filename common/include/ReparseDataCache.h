@@ -0,0 +1,132 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef REPARSEDATACACHE_H
+#define REPARSEDATACACHE_H
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "PathBuffer.h"
+#include "ReparsePoint.h"
+
+/** The number of independently locked parts of a reparse data cache, so that threads copying links rarely wait. */
+#define REPARSE_DATA_CACHE_SHARDS 16
+
+/** The number of links a reparse data cache holds at most, so that many distinct targets can't exhaust memory. */
+#define REPARSE_DATA_CACHE_MAX_ENTRIES (64 * 1024)
+
+/**
+ * The copy of a source link worked out once: its rebased target and the reparse data to write for it.
+ */
+struct PreparedLink
+{
+	/** The reparse tag of the copy. */
+	DWORD ReparseTag;
+	/** The target of the copy, after rebasing. */
+	tstring Target;
+	/** Set to true if the link is a volume mount point, which is mounted with CreateVolumeMountPoint instead. */
+	bool bVolume;
+	/** The reparse data of the copy as built by BuildReparseData. Empty for volume mount points. */
+	std::vector<BYTE> Data;
+
+	PreparedLink()
+		: ReparseTag(0)
+		, bVolume(false)
+	{
+	}
+
+	/**
+	 * Returns the reparse data of the copy, or NULL if it has none.
+	 */
+	const REPARSE_DATA_BUFFER* GetData() const
+	{
+		return Data.empty() ? NULL : (const REPARSE_DATA_BUFFER*)&Data[0];
+	}
+};
+
+/**
+ * Remembers the copy prepared for each distinct source reparse data, so that the many links of a tree that point to
+ * the same target have their target converted, rebased and built into reparse data only once. Links are identified by
+ * their raw reparse data, which stands for the target as well as its rebase since the rebase rules don't change during
+ * a run. Once the cache is full the links it doesn't hold yet are prepared anew each time, while those it holds stay.
+ * The cache can be used from multiple threads at once; two threads preparing the same link at the same time both build
+ * it and the first one added is kept.
+ */
+class ReparseDataCache
+{
+public:
+	ReparseDataCache();
+	~ReparseDataCache();
+
+	/**
+	 * Looks up the copy prepared for a source link.
+	 *
+	 * @param Info The reparse data of the source link as returned by QueryReparsePoint.
+	 * @return Returns the prepared copy, or NULL if the link hasn't been seen yet.
+	 */
+	const PreparedLink* Find(const ReparsePointInfo& Info) const;
+
+	/**
+	 * Remembers the copy prepared for a source link.
+	 *
+	 * @param Info The reparse data of the source link as returned by QueryReparsePoint.
+	 * @param Link The copy prepared for the link.
+	 * @return Returns the copy held by the cache, which stays valid until Clear is called, or NULL if the cache is full.
+	 */
+	const PreparedLink* Add(const ReparsePointInfo& Info, const PreparedLink& Link);
+
+	/**
+	 * Forgets every link, for when the rebase rules may have changed since they were prepared.
+	 */
+	void Clear();
+
+private:
+	ReparseDataCache(const ReparseDataCache&);
+	ReparseDataCache& operator=(const ReparseDataCache&);
+
+	/**
+	 * Returns the raw source reparse data that identifies a link.
+	 */
+	static std::string GetKey(const ReparsePointInfo& Info);
+
+	struct Shard
+	{
+		mutable CRITICAL_SECTION Lock;
+		/** The copy prepared for each link, keyed by its raw reparse data. */
+		std::unordered_map<std::string, PreparedLink> Entries;
+	};
+
+	Shard Shards[REPARSE_DATA_CACHE_SHARDS];
+};
+
+#endif //REPARSEDATACACHE_H
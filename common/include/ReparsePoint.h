@@ -0,0 +1,293 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef REPARSEPOINT_H
+#define REPARSEPOINT_H
+#pragma once
+
+#include <Windows.h>
+#include <winioctl.h>
+
+#include <ntfstypes.h>
+
+// As defined in ntifs.h
+#ifndef SYMLINK_FLAG_RELATIVE
+#define SYMLINK_FLAG_RELATIVE 0x00000001
+#endif
+
+/**
+ * The contents of a reparse point as read by a single FSCTL_GET_REPARSE_POINT request. The substitute and print names
+ * are stored as offsets into the raw reparse data and are not null-terminated.
+ */
+struct ReparsePointInfo
+{
+	/** The reparse tag of the reparse point. */
+	DWORD ReparseTag;
+	/** The symbolic link flags (e.g. SYMLINK_FLAG_RELATIVE). Always zero for junctions. */
+	ULONG Flags;
+	/** The offset, in characters, of the substitute name within the path buffer of Data. */
+	USHORT SubstituteNameOffset;
+	/** The length, in characters, of the substitute name. */
+	USHORT SubstituteNameLength;
+	/** The offset, in characters, of the print name within the path buffer of Data. */
+	USHORT PrintNameOffset;
+	/** The length, in characters, of the print name. */
+	USHORT PrintNameLength;
+	/** The raw reparse data returned by the file system. */
+	union
+	{
+		REPARSE_DATA_BUFFER Header;
+		BYTE Raw[MAXIMUM_REPARSE_DATA_BUFFER_SIZE];
+	} Data;
+};
+
+/**
+ * Opens a handle to the reparse point itself rather than the object that it points to.
+ *
+ * @param Path The path of the reparse point to open.
+ * @param DesiredAccess The access to request for the handle.
+ * @return Returns a handle to the reparse point, or INVALID_HANDLE_VALUE on failure. Call GetLastError for details.
+ */
+HANDLE OpenReparsePoint(LPCTSTR Path, DWORD DesiredAccess);
+
+/**
+ * Reads the reparse data of an open reparse point.
+ *
+ * @param hLink The handle of the reparse point returned by OpenReparsePoint.
+ * @param Info The structure to write the reparse data to. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD QueryReparsePoint(HANDLE hLink, ReparsePointInfo& Info);
+
+/**
+ * Fills in the name offsets of reparse data that was read into Info.Data by other means than QueryReparsePoint, such as
+ * an overlapped FSCTL_GET_REPARSE_POINT request.
+ *
+ * @param Info The reparse data to parse. Only Info.Data needs to be set. [IN/OUT]
+ * @param DataSize The number of bytes of reparse data returned by the file system.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if the data is malformed.
+ */
+DWORD ParseReparseData(ReparsePointInfo& Info, DWORD DataSize);
+
+/**
+ * Returns the length of the substitute name held by reparse data, in characters, for the traces of the operations on
+ * an open link.
+ *
+ * @param Data The reparse data of a junction or symbolic link.
+ * @return Returns the length of the substitute name, or zero for any other kind of reparse point.
+ */
+DWORD GetReparseDataTargetLength(const REPARSE_DATA_BUFFER& Data);
+
+/**
+ * Retrieves the target path of a junction or symbolic link from previously read reparse data. The NT namespace
+ * prefix of absolute targets is removed.
+ *
+ * @param Info The reparse data returned by QueryReparsePoint.
+ * @param TargetPath The buffer to write the target path to. [OUT]
+ * @param TargetSize The size of the TargetPath buffer, in characters.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD GetReparsePointTarget(const ReparsePointInfo& Info, LPTSTR TargetPath, size_t TargetSize);
+
+/**
+ * Returns the size of the buffer needed by GetReparsePointTarget for the given reparse data.
+ *
+ * @param Info The reparse data returned by QueryReparsePoint.
+ * @return Returns the size of the target path, in characters, including the null terminator.
+ */
+size_t GetReparsePointTargetSize(const ReparsePointInfo& Info);
+
+/**
+ * Builds the reparse data for a junction or symbolic link pointing to the given target.
+ *
+ * @param ReparseTag The type of link to build, either IO_REPARSE_TAG_MOUNT_POINT or IO_REPARSE_TAG_SYMLINK.
+ * @param TargetPath The target path of the link.
+ * @param Buffer The buffer to write the reparse data to. [OUT]
+ * @param BufferSize The size of Buffer, in bytes.
+ * @param DataSize The number of bytes of Buffer that were written. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD BuildReparseData(DWORD ReparseTag, LPCTSTR TargetPath, REPARSE_DATA_BUFFER* Buffer, DWORD BufferSize,
+	DWORD* DataSize);
+
+/**
+ * Writes new reparse data to an open file object, replacing any existing reparse data with the same tag.
+ *
+ * @param hLink The handle of the file object, opened with write access.
+ * @param ReparseTag The type of link to write, either IO_REPARSE_TAG_MOUNT_POINT or IO_REPARSE_TAG_SYMLINK.
+ * @param TargetPath The target path of the link.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD SetReparsePoint(HANDLE hLink, DWORD ReparseTag, LPCTSTR TargetPath);
+
+/**
+ * Removes the reparse data of an open reparse point, leaving behind an ordinary (empty) file or directory.
+ *
+ * @param hLink The handle of the reparse point, opened with write access.
+ * @param ReparseTag The reparse tag of the reparse point.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD DeleteReparsePoint(HANDLE hLink, DWORD ReparseTag);
+
+/**
+ * Changes the target of an open junction or symbolic link. In-place retargets overwrite the existing reparse data with
+ * a single FSCTL_SET_REPARSE_POINT so the link never disappears, falling back to deleting and rewriting the reparse
+ * data on file systems that don't support it.
+ *
+ * @param hLink The handle of the reparse point, opened with write access.
+ * @param ReparseTag The reparse tag of the reparse point.
+ * @param TargetPath The new target path of the link.
+ * @param bInPlace Set to true to overwrite the existing reparse data, false to always delete it first.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD RetargetReparsePoint(HANDLE hLink, DWORD ReparseTag, LPCTSTR TargetPath, bool bInPlace);
+
+/**
+ * Deletes an open reparse point from its parent directory. The object that it points to is left untouched.
+ *
+ * @param hLink The handle of the reparse point, opened with DELETE access.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD RemoveReparsePoint(HANDLE hLink);
+
+/**
+ * Renames an open reparse point to a new path on the same volume. The reparse data, security descriptor and timestamps
+ * stay as they are. Nothing at the new path is replaced.
+ *
+ * @param hLink The handle of the reparse point, opened with DELETE access.
+ * @param NewPath The full extended-length path to rename the reparse point to.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred. The new path
+ *		being on another volume yields ERROR_NOT_SAME_DEVICE.
+ */
+DWORD RenameReparsePoint(HANDLE hLink, LPCTSTR NewPath);
+
+/**
+ * Deletes the junction or symbolic link at the given path, if one exists. Other file objects are left untouched.
+ *
+ * @param Path The path of the link to delete.
+ * @return Returns zero if the link was deleted or nothing exists at Path, otherwise a non-zero error code.
+ */
+DWORD RemoveExistingLink(LPCTSTR Path);
+
+/**
+ * Creates a new junction or symbolic link at the given path using a single handle for the create and the write.
+ *
+ * @param Link The path of the link to create.
+ * @param ReparseTag The type of link to create, either IO_REPARSE_TAG_MOUNT_POINT or IO_REPARSE_TAG_SYMLINK.
+ * @param TargetPath The target path of the new link.
+ * @param bDirectory Set to true to create a directory link. Junctions are always directories.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateReparsePoint(LPCTSTR Link, DWORD ReparseTag, LPCTSTR TargetPath, bool bDirectory);
+
+/**
+ * Creates a new junction or symbolic link at the given path from reparse data built beforehand with BuildReparseData,
+ * so that many links with the same target only have it built once.
+ *
+ * @param Link The path of the link to create.
+ * @param Data The reparse data of the link, which also gives its type.
+ * @param DataSize The size of the reparse data, in bytes.
+ * @param bDirectory Set to true to create a directory link. Junctions are always directories.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateReparsePointFromData(LPCTSTR Link, const REPARSE_DATA_BUFFER& Data, DWORD DataSize, bool bDirectory);
+
+/**
+ * Returns true if a link is a volume mount point, i.e. a junction whose target returned by GetReparsePointTarget is
+ * exactly the root of a volume, \\?\Volume{GUID}\. Symbolic links to a volume and links to a directory on a volume
+ * are ordinary links.
+ *
+ * @param ReparseTag The reparse tag of the link.
+ * @param TargetPath The target of the link.
+ */
+bool IsVolumeTarget(DWORD ReparseTag, LPCTSTR TargetPath);
+
+/**
+ * Mounts a volume on a new directory at the given path. The mount point is set through the mount manager, which
+ * keeps track of the mount points of each volume unlike the junctions written with CreateReparsePoint.
+ *
+ * @param Link The path of the directory to create.
+ * @param VolumeName The name of the volume to mount in the form \\?\Volume{GUID}\.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateVolumeMountPoint(LPCTSTR Link, LPCTSTR VolumeName);
+
+/**
+ * A link to create with CreateReparsePoints.
+ */
+struct LinkRequest
+{
+	/** The full extended-length path of the link to create. */
+	LPCTSTR Path;
+	/** The reparse tag of the link, either IO_REPARSE_TAG_MOUNT_POINT or IO_REPARSE_TAG_SYMLINK. */
+	DWORD ReparseTag;
+	/** The target of the link. */
+	LPCTSTR Target;
+	/** Set to true to create a directory symbolic link. Junctions are always directories. */
+	bool bDirectory;
+	/** The reparse data already built from Target, or NULL to build it as the link is created. */
+	const REPARSE_DATA_BUFFER* Data;
+	/** The size of Data, in bytes. */
+	DWORD DataSize;
+	/** Set to zero if the link was created, otherwise to the error that occurred. [OUT] */
+	DWORD Result;
+
+	LinkRequest()
+		: Path(NULL)
+		, ReparseTag(0)
+		, Target(NULL)
+		, bDirectory(false)
+		, Data(NULL)
+		, DataSize(0)
+		, Result(0)
+	{
+	}
+};
+
+/**
+ * Creates the link described by a request, as CreateReparsePoint would, from its prebuilt reparse data if it has any.
+ *
+ * @param Request The link to create. Its Result is left as is.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD CreateReparsePoint(const LinkRequest& Request);
+
+/**
+ * Creates a batch of junctions and symbolic links, as CreateReparsePoint would for each one. The links are created
+ * relative to an open handle of their parent directory with NtCreateFile, so each parent is only looked up once per
+ * batch however many links it receives, and the reparse data of every link is built in the same buffer. Nothing at
+ * the path of a link is replaced. Falls back to CreateReparsePoint when NtCreateFile isn't available or a parent
+ * directory can't be opened.
+ *
+ * @param Requests The links to create. The result of each is stored in the request.
+ * @param NumRequests The number of links to create.
+ */
+void CreateReparsePoints(LinkRequest* Requests, size_t NumRequests);
+
+#endif //REPARSEPOINT_H
@@ -0,0 +1,71 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef ROOTSCHEDULER_H
+#define ROOTSCHEDULER_H
+#pragma once
+
+#include <Windows.h>
+#include <vector>
+
+/** The maximum number of volumes whose roots are processed at the same time. */
+#define MAX_ROOT_VOLUMES 64
+
+/**
+ * The callback that a utility implements to process each root of its path list. It is invoked concurrently for roots
+ * on different volumes and must be thread-safe.
+ */
+class RootAction
+{
+public:
+	virtual ~RootAction() {}
+
+	/**
+	 * Called for each root.
+	 *
+	 * @param Index The index of the root in the list given to ScheduleRoots.
+	 * @param Path The root as it was given on the command line.
+	 * @return Returns zero if the root was processed, otherwise a non-zero value if an error occurred.
+	 */
+	virtual DWORD OnRoot(size_t Index, LPCTSTR Path) = 0;
+};
+
+/**
+ * Processes a list of roots, grouped by the volume that holds them. The roots of one volume are processed one after
+ * the other, in the order given, while the volumes are processed concurrently so that each disk or file server works
+ * with its own set of walker threads. A failing root doesn't stop the others.
+ *
+ * @param Roots The roots to process.
+ * @param Action The action to invoke for each root.
+ * @param bConcurrent Set to false to process every root on the calling thread, in the order given.
+ * @return Returns zero if every root was processed, otherwise the error of the first root that failed.
+ */
+DWORD ScheduleRoots(const std::vector<LPCTSTR>& Roots, RootAction& Action, bool bConcurrent);
+
+#endif //ROOTSCHEDULER_H
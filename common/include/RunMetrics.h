@@ -0,0 +1,215 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef RUNMETRICS_H
+#define RUNMETRICS_H
+#pragma once
+
+#include <Windows.h>
+
+#include "LinkStats.h"
+#include "LinkTrace.h"
+
+/** The number of latency buckets of each histogram. Bucket n counts the calls that took [2^n, 2^(n+1)) microseconds. */
+#define METRIC_LATENCY_BUCKETS 24
+
+/** The number of sets of counters that threads spread their updates over so that they rarely share a cache line. */
+#define METRIC_SHARDS 64
+
+/**
+ * The file system operations whose latency is measured.
+ */
+enum MetricOp
+{
+	/** Opening a directory listing or reading the next batch of entries. */
+	MetricEnumerate,
+	/** Reading the reparse data of a link. */
+	MetricGetTarget,
+	/** Writing the reparse data of a link. */
+	MetricSetTarget,
+	/** Deleting a link or its reparse data. */
+	MetricDelete,
+	/** Creating the file object of a new link. */
+	MetricCreate,
+	NUM_METRIC_OPS
+};
+
+/**
+ * The counts of discovered file objects.
+ */
+enum MetricCounter
+{
+	/** The directory entries listed by the walk. */
+	MetricEntries,
+	/** The directories listed by the walk. */
+	MetricDirectories,
+	NUM_METRIC_COUNTERS
+};
+
+/**
+ * The queues whose depth is reported.
+ */
+enum MetricQueue
+{
+	/** The directories waiting for a walker thread. */
+	MetricWalkQueue,
+	/** The entries waiting for a reader of a pipelined copy. */
+	MetricReadQueue,
+	/** The entries waiting for a writer of a pipelined copy. */
+	MetricWriteQueue,
+	/** The overlapped link requests in flight. */
+	MetricAsyncQueue,
+	NUM_METRIC_QUEUES
+};
+
+/** Set by StartMetrics before any other thread is started and cleared by StopMetrics. Nothing is counted while it is
+ * false. */
+extern bool bCollectMetrics;
+
+/** Set while the latency of operations is measured, for /STATS, /ADAPT or /MAXIOPS. */
+extern bool bMeasureOps;
+
+/**
+ * Waits for the turn of an operation under /MAXIOPS, traces its start and returns the time it starts at. Only called
+ * through StartLatency.
+ */
+LONGLONG BeginOp(MetricOp Op, DWORD PathLength);
+
+/**
+ * Returns the time to pass to RecordLatency once the operation is done, or zero if operations are neither measured
+ * nor traced. Called as each file system operation starts, which is also where /MAXIOPS holds operations back.
+ *
+ * @param Op The operation that starts.
+ * @param PathLength The length, in characters, of the path handed to the file system, or zero for an operation on an
+ *			open handle.
+ */
+inline LONGLONG StartLatency(MetricOp Op, DWORD PathLength)
+{
+	return bMeasureOps || bTraceEnabled ? BeginOp(Op, PathLength) : 0;
+}
+
+/**
+ * Adds the time elapsed since StartLatency to the histogram of the given operation, and to the window of the
+ * controller of the calling thread if it has one (see ThreadControllerScope), then traces its end.
+ *
+ * @param Op The operation that was measured.
+ * @param Start The time returned by StartLatency. Nothing is recorded if it is zero.
+ * @param PathLength The length, in characters, of the path handed to the file system, or of the target read from or
+ *			written to an open link.
+ * @param Result The error code of the operation, or zero if it was successful.
+ */
+void RecordLatency(MetricOp Op, LONGLONG Start, DWORD PathLength, DWORD Result);
+
+/**
+ * Adds to one of the counts of discovered file objects.
+ */
+void CountMetric(MetricCounter Counter, LONG Amount);
+
+/**
+ * Adds to, or subtracts from, the depth of one of the queues.
+ */
+void AdjustQueueDepth(MetricQueue Queue, LONG Amount);
+
+/**
+ * Measures the latency of an operation for as long as it is in scope.
+ */
+class MetricTimer
+{
+public:
+	MetricTimer(MetricOp InOp, DWORD InPathLength)
+		: Op(InOp)
+		, PathLength(InPathLength)
+		, Result(0)
+		, Start(StartLatency(InOp, InPathLength))
+	{
+	}
+
+	~MetricTimer()
+	{
+		RecordLatency(Op, Start, PathLength, Result);
+	}
+
+	/**
+	 * Sets the error code the operation is traced with and returns it.
+	 */
+	DWORD SetResult(DWORD InResult)
+	{
+		Result = InResult;
+		return Result;
+	}
+
+private:
+	MetricTimer(const MetricTimer&);
+	MetricTimer& operator=(const MetricTimer&);
+
+	MetricOp Op;
+	DWORD PathLength;
+	DWORD Result;
+	LONGLONG Start;
+};
+
+/**
+ * Starts collecting metrics and reporting them at a fixed interval, one JSON object per line, until StopMetrics is
+ * called. Each report holds the totals since the start of the run along with the rates over the last interval, the
+ * current queue depths and the latency histogram of every operation.
+ *
+ * @param IntervalMs The time between two reports, in milliseconds.
+ * @param OutputPath The file to append the reports to, or NULL to write them to stderr.
+ * @param Stats The statistics of the utility, for the error and skip counts.
+ * @param NumProcessed The count of links the utility has processed.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD StartMetrics(DWORD IntervalMs, LPCTSTR OutputPath, const LinkStats& Stats, const AtomicCounter& NumProcessed);
+
+/**
+ * Starts measuring operations for the concurrency controllers of /ADAPT, and holding them back to at most MaxIops a
+ * second for /MAXIOPS, until StopMetrics is called. Must be called before any other thread is started.
+ *
+ * @param MaxIops The highest number of file system operations to start each second, across every thread, or zero for
+ *			no limit.
+ * @param bAdaptive Set to true when the walks adapt their concurrency to the latency of the operations.
+ */
+void StartOpControl(DWORD MaxIops, bool bAdaptive);
+
+/**
+ * Writes a last report and stops the reporting thread, along with the measurements started by StartOpControl.
+ */
+void StopMetrics();
+
+/**
+ * Parses a /STATS:<seconds>[,file] command line option.
+ *
+ * @param Arg The command line argument to parse.
+ * @param IntervalMs Set to the time between two reports, in milliseconds. [OUT]
+ * @param Path The buffer to write the path of the output file to, or an empty string for stderr. [OUT]
+ * @param PathSize The size of the Path buffer, in characters.
+ */
+void ParseStatsOption(LPCTSTR Arg, DWORD& IntervalMs, LPTSTR Path, size_t PathSize);
+
+#endif //RUNMETRICS_H
@@ -0,0 +1,79 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef STRINGMATCH_H
+#define STRINGMATCH_H
+#pragma once
+
+#include <Windows.h>
+
+/**
+ * Returns the upper case form of a character, as used by the file system to compare names. The mapping is the
+ * ordinal, locale independent one that NTFS stores in its upcase table.
+ *
+ * @param Char The character to convert.
+ * @return Returns the upper case form of Char, or Char itself if it has none.
+ */
+WCHAR UpcaseChar(WCHAR Char);
+
+/**
+ * Finds an occurrence of the string Sub in string Str, ignoring case the way the file system does. The search is
+ * vectorized with AVX2 or SSE2 when the processor supports it, otherwise it falls back to a scalar search. The
+ * implementation is chosen once at startup.
+ *
+ * @param Str The string to search for the substring.
+ * @param StrLength The length of Str, in characters.
+ * @param Sub The string to search for in Str.
+ * @param SubLength The length of Sub, in characters.
+ * @param Dir The direction to perform the search in. Set to 1 to find the first occurrence, set to -1 to find the
+ *		last occurrence.
+ * @return Returns the starting index of the substring in Str or -1 if not found.
+ */
+int StrFindNoCase(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir = 1);
+
+/**
+ * Searches a string for an occurrence of a provided search string, ignoring case, and replaces it with another. When
+ * the search string isn't found the source string is copied as is.
+ *
+ * @param SrcStr The source string to search for the substring and perform replacement on.
+ * @param SrcLength The length of SrcStr, in characters.
+ * @param Search The substring to search for.
+ * @param SearchLength The length of Search, in characters.
+ * @param Replace The string to replace the substring with.
+ * @param ReplaceLength The length of Replace, in characters.
+ * @param DestStr The destination to write the resulting string to. Must hold at least SrcLength + ReplaceLength + 1
+ *			characters. [OUT]
+ * @param Dir The direction to perform the search in. Set to 1 to replace the first occurrence, set to -1 to replace
+ *		the last occurrence.
+ * @return Returns the length of the resulting string, in characters, not including the null terminator.
+ */
+size_t StrReplaceNoCase(LPCWSTR SrcStr, size_t SrcLength, LPCWSTR Search, size_t SearchLength, LPCWSTR Replace,
+	size_t ReplaceLength, LPWSTR DestStr, int Dir = 1);
+
+#endif //STRINGMATCH_H
@@ -0,0 +1,108 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TARGETCACHE_H
+#define TARGETCACHE_H
+#pragma once
+
+#include <Windows.h>
+#include <unordered_map>
+
+#include "PathBuffer.h"
+
+/** The number of independently locked parts of a target cache, so that threads probing different targets rarely wait. */
+#define TARGET_CACHE_SHARDS 16
+
+/**
+ * Remembers whether link targets exist, and their attributes, so that validating many links that point into the same
+ * directories probes each distinct target only once. Missing targets are remembered too. Targets are identified by
+ * their absolute path, ignoring case and the extended-length prefix. The cache can be used from multiple threads at
+ * once; two threads asking for the same unknown target at the same time may both probe it.
+ */
+class TargetCache
+{
+public:
+	TargetCache();
+	~TargetCache();
+
+	/**
+	 * Looks up the attributes of a target, probing the file system the first time the target is asked for.
+	 *
+	 * @param Key The absolute path of the target as returned by ResolveLinkTarget.
+	 * @param Attributes Set to the attributes of the target, or INVALID_FILE_ATTRIBUTES if it doesn't exist. [OUT]
+	 * @return Returns zero if the existence of the target is known, otherwise the error that prevented it from being
+	 *		probed. Such errors aren't cached.
+	 */
+	DWORD Lookup(const tstring& Key, DWORD& Attributes);
+
+	/**
+	 * Forgets every target, for when they may have changed since they were probed.
+	 */
+	void Clear();
+
+private:
+	TargetCache(const TargetCache&);
+	TargetCache& operator=(const TargetCache&);
+
+	struct Shard
+	{
+		CRITICAL_SECTION Lock;
+		/** The attributes of each target probed, keyed by its upper case path. */
+		std::unordered_map<tstring, DWORD> Entries;
+	};
+
+	Shard Shards[TARGET_CACHE_SHARDS];
+};
+
+/**
+ * Works out the absolute path that a link target refers to. Relative symbolic link targets are resolved against the
+ * directory of the link, and '.' and '..' components are removed without touching the file system.
+ *
+ * @param LinkPath The full path of the link.
+ * @param Target The target of the link, as given to CreateReparsePoint.
+ * @param Path The absolute path of the target, without the extended-length prefix. [OUT]
+ */
+void ResolveLinkTarget(LPCTSTR LinkPath, LPCTSTR Target, tstring& Path);
+
+/**
+ * Checks that the target of a link exists and is of the kind the link expects. Directory links must point to directories
+ * and file links to files.
+ *
+ * @param Cache The cache of targets probed so far.
+ * @param LinkPath The full path of the link.
+ * @param ReparseTag The reparse tag of the link.
+ * @param bDirectory Set to true if the link is a directory. Junctions always are.
+ * @param Target The target of the link.
+ * @param bBroken Set to true if the target is missing or of the wrong kind, false otherwise. [OUT]
+ * @return Returns zero if the target could be checked, otherwise a non-zero value if an error occurred.
+ */
+DWORD VerifyLinkTarget(TargetCache& Cache, LPCTSTR LinkPath, DWORD ReparseTag, bool bDirectory, LPCTSTR Target,
+	bool& bBroken);
+
+#endif //TARGETCACHE_H
@@ -0,0 +1,187 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TREEWALKER_H
+#define TREEWALKER_H
+#pragma once
+
+#include <Windows.h>
+
+#include "LinkStats.h"
+#include "PathBuffer.h"
+
+/** The maximum number of worker threads that can be used to walk a directory tree. */
+#define MAX_WALK_THREADS 128
+
+/** The number of worker threads used when /MT is specified without a count. */
+#define DEFAULT_WALK_THREADS 8
+
+class WalkFilter;
+
+/**
+ * A file object discovered while walking a directory tree.
+ */
+struct WalkEntry
+{
+	/** The full path of the file object. */
+	LPCTSTR Path;
+	/**
+	 * The path of the file object relative to the root of the walk. This is an empty string for the root itself,
+	 * otherwise it always begins with a '\'.
+	 */
+	LPCTSTR RelativePath;
+	/** The level of the file object in the filesystem tree. The root is at level zero. */
+	int Depth;
+	/** The file attributes reported by the directory enumeration. */
+	DWORD Attributes;
+	/** The reparse tag reported by the directory enumeration, or zero if the file object is not a reparse point. */
+	DWORD ReparseTag;
+	/**
+	 * Scratch memory owned by the calling worker for the strings the action needs while handling the entry. The arena
+	 * is reset before each callback.
+	 */
+	StringArena* Arena;
+};
+
+/**
+ * The set of callbacks that a utility implements to act upon the file objects discovered while walking a directory
+ * tree. When the walk uses more than one worker thread the callbacks are invoked concurrently and must be thread-safe.
+ */
+class LinkAction
+{
+public:
+	virtual ~LinkAction() {}
+
+	/**
+	 * Called for each directory in the tree before its contents are enumerated.
+	 *
+	 * @param Entry The directory that is about to be enumerated.
+	 * @return Returns zero if the contents of the directory should be enumerated, otherwise a non-zero error code.
+	 */
+	virtual DWORD OnDirectory(const WalkEntry& Entry)
+	{
+		UNREFERENCED_PARAMETER(Entry);
+		return 0;
+	}
+
+	/**
+	 * Called for each reparse point discovered in the tree. The attributes and reparse tag of the entry are taken from
+	 * the directory enumeration so no further queries are needed to tell a junction from a symbolic link.
+	 *
+	 * @param Entry The reparse point that was discovered.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero error code.
+	 */
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry) = 0;
+
+	/**
+	 * Called for each file that is neither a directory nor a reparse point, only while WalkOptions::bFiles is set.
+	 *
+	 * @param Entry The file that was discovered.
+	 * @return Returns zero if the operation was successful, otherwise a non-zero error code.
+	 */
+	virtual DWORD OnFile(const WalkEntry& Entry)
+	{
+		UNREFERENCED_PARAMETER(Entry);
+		return 0;
+	}
+
+	/**
+	 * Called for each directory whose contents could not be enumerated in full, after the error has been reported. This
+	 * tells a walk that missed parts of the tree apart from one where the action merely failed or skipped some links.
+	 *
+	 * @param Entry The directory that could not be enumerated.
+	 * @param Error The error that stopped the enumeration.
+	 */
+	virtual void OnDirectoryIncomplete(const WalkEntry& Entry, DWORD Error)
+	{
+		UNREFERENCED_PARAMETER(Entry);
+		UNREFERENCED_PARAMETER(Error);
+	}
+};
+
+struct WalkOptions
+{
+	/** The maximum file tree depth to traverse before stopping. */
+	int MaxDepth;
+	/** The number of worker threads used to enumerate directories. */
+	int NumThreads;
+	/** Set to true to discover reparse points from the volume metadata instead of enumerating every directory. */
+	bool bFast;
+	/** Set to true to visit the directories level by level instead of depth-first. */
+	bool bBreadthFirst;
+	/** Set to true to let a controller adapt the number of workers busy at once, NumThreads at most. */
+	bool bAdaptive;
+	/**
+	 * Set to true to hand the ordinary files to the action as well (see LinkAction::OnFile). Only the walk that
+	 * enumerates each directory finds them, so fast discovery and link indexes are ignored.
+	 */
+	bool bFiles;
+	/** The path of a link index to replay instead of walking the tree, or NULL to always walk it (see WalkIndex). */
+	LPCTSTR IndexPath;
+	/** The entries to leave out of the walk, or NULL to visit every entry (see WalkFilter). */
+	const WalkFilter* Filter;
+
+	WalkOptions()
+		: MaxDepth(-1)
+		, NumThreads(1)
+		, bFast(false)
+		, bBreadthFirst(false)
+		, bAdaptive(false)
+		, bFiles(false)
+		, IndexPath(NULL)
+		, Filter(NULL)
+	{
+	}
+};
+
+/**
+ * Walks the directory tree at the given root and invokes the action for each directory and reparse point found.
+ * Directories are distributed among a pool of work-stealing worker threads. Any failure reported by the action or
+ * encountered during enumeration is counted in Stats and does not stop the walk. When fast discovery is requested the
+ * reparse points are read from the volume metadata instead (see ScanReparsePoints), falling back to the walk if the
+ * volume can't be scanned. When a link index is given the links are replayed from it while it is up to date. A filter
+ * is evaluated on each entry as it is enumerated, so excluded directories are never opened.
+ *
+ * @param Root The path of the directory tree or reparse point to walk.
+ * @param Action The action to perform on each file object discovered.
+ * @param Options The options that control the walk.
+ * @param Stats The statistics to record failures and skipped file objects to.
+ * @return Returns zero if the root could be walked, otherwise a non-zero error code.
+ */
+DWORD WalkTree(LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats);
+
+/**
+ * Parses the thread count of a /MT[:n] command line option.
+ *
+ * @param Arg The command line argument to parse.
+ * @return Returns the number of worker threads requested, clamped to the range supported by WalkTree.
+ */
+int ParseThreadCount(LPCTSTR Arg);
+
+#endif //TREEWALKER_H
@@ -0,0 +1,72 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef VOLUMESCAN_H
+#define VOLUMESCAN_H
+#pragma once
+
+#include <Windows.h>
+
+#include "LinkStats.h"
+#include "TreeWalker.h"
+
+/**
+ * Opens the NTFS volume that contains the given path for reading its metadata. This requires the process to be
+ * running elevated and fails with ERROR_NOT_SUPPORTED for remote volumes and file systems other than NTFS.
+ *
+ * @param Path A path on the volume to open.
+ * @param hVolume The handle of the opened volume. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD OpenVolume(LPCTSTR Path, HANDLE& hVolume);
+
+/**
+ * Retrieves the file reference number that identifies the given file object within its volume.
+ *
+ * @param Path The path of the file object.
+ * @param FileReference The file reference number of the file object. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value if an error occurred.
+ */
+DWORD GetFileReference(LPCTSTR Path, DWORDLONG& FileReference);
+
+/**
+ * Discovers the reparse points beneath the given root directory by scanning the master file table of its volume with
+ * FSCTL_ENUM_USN_DATA instead of enumerating every directory. The action is invoked for each directory that leads to
+ * a reparse point, from the top down, followed by each reparse point found.
+ *
+ * @param Root The path of the directory tree to scan.
+ * @param Action The action to perform on each file object discovered.
+ * @param Options The options that control the scan.
+ * @param Stats The statistics to record failures and skipped file objects to.
+ * @return Returns zero if the volume was scanned, otherwise a non-zero error code. No action is invoked when the
+ *		volume can't be scanned so the caller may fall back to walking the tree.
+ */
+DWORD ScanReparsePoints(LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats);
+
+#endif //VOLUMESCAN_H
@@ -0,0 +1,181 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef WALKFILTER_H
+#define WALKFILTER_H
+#pragma once
+
+#include <Windows.h>
+#include <vector>
+
+#include "PathBuffer.h"
+#include "TreeWalker.h"
+
+/** The junctions, and the volume mount points that share their reparse tag. */
+#define WALK_LINK_JUNCTION 0x1
+
+/** The symbolic links. */
+#define WALK_LINK_SYMLINK 0x2
+
+/** Every kind of link. Reparse points of any other kind are only visited while no link type is singled out. */
+#define WALK_LINK_ALL (WALK_LINK_JUNCTION | WALK_LINK_SYMLINK)
+
+/**
+ * The entries to leave out of a walk (/XD, /XJ and /TYPE). The filter is evaluated on the attributes, reparse tag and
+ * name reported by the directory enumeration, so an excluded directory is never opened and an excluded link is never
+ * handed to the action.
+ *
+ * Directory patterns are matched against names, ignoring case the way the file system does, and may use the '*' and
+ * '?' wildcards. They are folded to upper case once as they are added, and patterns without wildcards are kept apart
+ * so that they are compared by length first.
+ */
+class WalkFilter
+{
+public:
+	WalkFilter();
+
+	/**
+	 * Adds a pattern of directory names to exclude (/XD). Directory links with a matching name are excluded as well.
+	 *
+	 * @param Pattern The name, or wildcard pattern, of the directories to exclude.
+	 */
+	void ExcludeDirectory(LPCTSTR Pattern);
+
+	/**
+	 * Excludes every junction (/XJ).
+	 */
+	void ExcludeJunctions();
+
+	/**
+	 * Limits the walk to the given kinds of link (/TYPE).
+	 *
+	 * @param Types The kinds of link to keep, "junction" and/or "symlink" separated by '|' or ','.
+	 * @return Returns true if every kind was recognized, otherwise false and the filter is left unchanged.
+	 */
+	bool SetLinkTypes(LPCTSTR Types);
+
+	/**
+	 * Returns true if the filter leaves nothing out, in which case it needn't be evaluated at all.
+	 */
+	bool IsEmpty() const
+	{
+		return Literals.empty() && Patterns.empty() && LinkTypes == WALK_LINK_ALL && !bOnlyLinks;
+	}
+
+	/**
+	 * Returns true if a directory is excluded, along with everything beneath it.
+	 *
+	 * @param Name The name of the directory.
+	 * @param NameLength The length of the name, in characters.
+	 */
+	bool IsDirectoryExcluded(LPCTSTR Name, size_t NameLength) const;
+
+	/**
+	 * Returns true if a reparse point is excluded.
+	 *
+	 * @param Name The name of the reparse point.
+	 * @param NameLength The length of the name, in characters.
+	 * @param Attributes The file attributes of the reparse point.
+	 * @param ReparseTag The reparse tag of the reparse point.
+	 */
+	bool IsLinkExcluded(LPCTSTR Name, size_t NameLength, DWORD Attributes, DWORD ReparseTag) const;
+
+	/**
+	 * Returns true if an entry discovered other than by enumerating its parent is excluded, i.e. from the volume
+	 * metadata, a link index or the change journal. Each directory leading to it is matched as well.
+	 *
+	 * @param RelativePath The path of the entry relative to the root of the walk, beginning with a '\'.
+	 * @param Attributes The file attributes of the entry.
+	 * @param ReparseTag The reparse tag of the entry, or zero if it isn't a reparse point.
+	 */
+	bool IsPathExcluded(LPCTSTR RelativePath, DWORD Attributes, DWORD ReparseTag) const;
+
+private:
+	/** The directory names to exclude, in upper case. */
+	std::vector<tstring> Literals;
+	/** The directory patterns with wildcards to exclude, in upper case. */
+	std::vector<tstring> Patterns;
+	/** The kinds of link to visit, a combination of the WALK_LINK_* flags. */
+	DWORD LinkTypes;
+	/** Set once /TYPE singles out a kind of link, leaving out the reparse points that aren't links at all. */
+	bool bOnlyLinks;
+};
+
+/**
+ * Hands an action only the entries a filter leaves in. Used for the walks that discover their entries other than by
+ * enumerating each directory, where the filter can't be applied any earlier. Without a filter every entry is handed on.
+ */
+class FilteredLinkAction : public LinkAction
+{
+public:
+	FilteredLinkAction(LinkAction& InAction, const WalkFilter* InFilter)
+		: Action(InAction)
+		, Filter(InFilter)
+	{
+	}
+
+	virtual DWORD OnDirectory(const WalkEntry& Entry)
+	{
+		if (Filter != NULL && Filter->IsPathExcluded(Entry.RelativePath, Entry.Attributes, 0))
+		{
+			return 0;
+		}
+
+		return Action.OnDirectory(Entry);
+	}
+
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry)
+	{
+		if (Filter != NULL && Filter->IsPathExcluded(Entry.RelativePath, Entry.Attributes, Entry.ReparseTag))
+		{
+			return 0;
+		}
+
+		return Action.OnReparsePoint(Entry);
+	}
+
+	virtual DWORD OnFile(const WalkEntry& Entry)
+	{
+		return Action.OnFile(Entry);
+	}
+
+	virtual void OnDirectoryIncomplete(const WalkEntry& Entry, DWORD Error)
+	{
+		Action.OnDirectoryIncomplete(Entry, Error);
+	}
+
+private:
+	FilteredLinkAction(const FilteredLinkAction&);
+	FilteredLinkAction& operator=(const FilteredLinkAction&);
+
+	LinkAction& Action;
+	const WalkFilter* Filter;
+};
+
+#endif //WALKFILTER_H
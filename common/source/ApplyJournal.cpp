@@ -0,0 +1,335 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ApplyJournal.h"
+#include "ReparsePoint.h"
+
+namespace
+{
+
+/**
+ * The first line of every journal, followed by the name of the utility, the number of operations of the manifest and
+ * the content hash of the manifest.
+ */
+#define JOURNAL_SIGNATURE "ntfslinkutils journal 2"
+
+/** The record of a batch of operations that was begun. */
+#define JOURNAL_BEGIN 'B'
+
+/** The record of a range of operations that was finished. */
+#define JOURNAL_FINISH 'F'
+
+/**
+ * Parses the index range of a record, "<kind>\t<begin>\t<end>", checking that it lies within the manifest.
+ */
+bool ParseRange(const char* Line, const char* LineEnd, size_t NumOps, size_t& Begin, size_t& End)
+{
+	if (LineEnd - Line < 5 || Line[1] != '\t')
+	{
+		return false;
+	}
+
+	char* Pos = NULL;
+	Begin = (size_t)_strtoui64(Line + 2, &Pos, 10);
+	if (Pos >= LineEnd || *Pos != '\t')
+	{
+		return false;
+	}
+
+	End = (size_t)_strtoui64(Pos + 1, &Pos, 10);
+	return Pos == LineEnd && Begin <= End && End <= NumOps;
+}
+
+} // namespace
+
+ApplyJournal::ApplyJournal()
+	: hFile(INVALID_HANDLE_VALUE)
+	, NumAppended(0)
+	, NumFlushed(0)
+	, bFlushing(false)
+	, WriteError(0)
+	, NumDone(0)
+{
+	InitializeCriticalSection(&Lock);
+	InitializeConditionVariable(&Flushed);
+}
+
+ApplyJournal::~ApplyJournal()
+{
+	Close();
+	DeleteCriticalSection(&Lock);
+}
+
+DWORD ApplyJournal::Open(LPCTSTR InPath, LPCTSTR Tool, size_t NumOps, DWORDLONG ManifestHash, bool bResume)
+{
+	Close();
+
+	Path = InPath;
+	States.assign(NumOps, STATE_PENDING);
+	NumDone = 0;
+	WriteError = 0;
+
+	// The header ties the journal to the manifest it records the progress of, down to its contents, so that the
+	// operations of one manifest are never skipped because another one with as many operations was applied
+	char ToolName[64];
+	if (WideCharToMultiByte(CP_UTF8, 0, Tool, -1, ToolName, sizeof(ToolName), NULL, NULL) == 0)
+	{
+		return GetLastError();
+	}
+
+	char Header[160];
+	sprintf_s(Header, "%s\t%s\t%Iu\t%016I64x\n", JOURNAL_SIGNATURE, ToolName, NumOps, ManifestHash);
+
+	// Nobody else may write to the journal while it is in use
+	hFile = CreateFile(Path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		bResume ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	DWORD result = bResume ? Load(Header) : 0;
+	if (result != 0)
+	{
+		CloseHandle(hFile);
+		hFile = INVALID_HANDLE_VALUE;
+		return result;
+	}
+
+	// A new journal starts with its header, which Load leaves out when there was nothing to keep
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		result = GetLastError();
+	}
+	else if (fileSize.QuadPart == 0)
+	{
+		result = Append(Header, strlen(Header), true);
+	}
+
+	if (result != 0)
+	{
+		CloseHandle(hFile);
+		hFile = INVALID_HANDLE_VALUE;
+	}
+
+	return result;
+}
+
+DWORD ApplyJournal::Load(const std::string& Header)
+{
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		return GetLastError();
+	}
+
+	if (fileSize.QuadPart >= MAXLONG)
+	{
+		return ERROR_FILE_TOO_LARGE;
+	}
+
+	std::vector<char> Bytes((size_t)fileSize.QuadPart + 1);
+	DWORD bytesRead = 0;
+	if (!ReadFile(hFile, &Bytes[0], (DWORD)fileSize.QuadPart, &bytesRead, NULL))
+	{
+		return GetLastError();
+	}
+
+	// Only complete lines count. The last one may have been cut short by the crash that interrupted the run.
+	size_t Length = bytesRead;
+	while (Length > 0 && Bytes[Length - 1] != '\n')
+	{
+		Length--;
+	}
+
+	if (Length > 0 && (Length < Header.size() || memcmp(&Bytes[0], Header.c_str(), Header.size()) != 0))
+	{
+		return ERROR_INVALID_DATA;
+	}
+
+	size_t NumOps = States.size();
+	size_t Start = Length > 0 ? Header.size() : 0;
+	while (Start < Length)
+	{
+		const char* Line = &Bytes[Start];
+		const char* LineEnd = (const char*)memchr(Line, '\n', Length - Start);
+		Start = LineEnd - &Bytes[0] + 1;
+
+		size_t Begin = 0;
+		size_t End = 0;
+		if ((Line[0] != JOURNAL_BEGIN && Line[0] != JOURNAL_FINISH) || !ParseRange(Line, LineEnd, NumOps, Begin, End))
+		{
+			return ERROR_INVALID_DATA;
+		}
+
+		// A batch may be begun again by a resumed run, which never undoes what an earlier one finished
+		BYTE State = Line[0] == JOURNAL_FINISH ? STATE_DONE : STATE_BEGUN;
+		for (size_t i = Begin; i < End; i++)
+		{
+			if (States[i] < State)
+			{
+				NumDone += State == STATE_DONE ? 1 : 0;
+				States[i] = State;
+			}
+		}
+	}
+
+	// Carry on from the end of the last complete record
+	LARGE_INTEGER Pos;
+	Pos.QuadPart = (LONGLONG)Length;
+	if (!SetFilePointerEx(hFile, Pos, NULL, FILE_BEGIN) || !SetEndOfFile(hFile))
+	{
+		return GetLastError();
+	}
+
+	return 0;
+}
+
+DWORD ApplyJournal::BeginOps(size_t Begin, size_t End)
+{
+	char Record[64];
+	int Length = sprintf_s(Record, "%c\t%Iu\t%Iu\n", JOURNAL_BEGIN, Begin, End);
+	return Append(Record, (size_t)Length, true);
+}
+
+void ApplyJournal::FinishOps(size_t Begin, size_t End)
+{
+	if (Begin < End)
+	{
+		char Record[64];
+		int Length = sprintf_s(Record, "%c\t%Iu\t%Iu\n", JOURNAL_FINISH, Begin, End);
+		Append(Record, (size_t)Length, false);
+	}
+}
+
+DWORD ApplyJournal::Append(const char* Record, size_t Length, bool bDurable)
+{
+	EnterCriticalSection(&Lock);
+
+	Pending.append(Record, Length);
+	ULONGLONG RecordNum = ++NumAppended;
+
+	while (bDurable && NumFlushed < RecordNum && WriteError == 0)
+	{
+		if (bFlushing)
+		{
+			// The group being written may not hold this record, in which case the next writer takes it
+			SleepConditionVariableCS(&Flushed, &Lock, INFINITE);
+			continue;
+		}
+
+		// Write every record added so far, including those of the threads waiting on this one
+		std::string Group;
+		Group.swap(Pending);
+		ULONGLONG GroupEnd = NumAppended;
+		bFlushing = true;
+		LeaveCriticalSection(&Lock);
+
+		DWORD result = 0;
+		DWORD bytesWritten = 0;
+		if (!WriteFile(hFile, Group.data(), (DWORD)Group.size(), &bytesWritten, NULL) || !FlushFileBuffers(hFile))
+		{
+			result = GetLastError();
+		}
+
+		EnterCriticalSection(&Lock);
+		bFlushing = false;
+		if (result != 0)
+		{
+			WriteError = result;
+		}
+		else
+		{
+			NumFlushed = GroupEnd;
+		}
+		WakeAllConditionVariable(&Flushed);
+	}
+
+	DWORD result = bDurable && NumFlushed < RecordNum ? WriteError : 0;
+	LeaveCriticalSection(&Lock);
+	return result;
+}
+
+DWORD ApplyJournal::Close()
+{
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return 0;
+	}
+
+	// Write the finished operations still pending
+	DWORD result = Append("", 0, true);
+
+	CloseHandle(hFile);
+	hFile = INVALID_HANDLE_VALUE;
+	Pending.clear();
+	NumAppended = 0;
+	NumFlushed = 0;
+	return result;
+}
+
+DWORD GetLinkOpProgress(HANDLE hLink, const LinkOp& Op, StringArena& Arena, LinkOpProgress& Progress)
+{
+	Progress = LINK_OP_CHANGED;
+
+	ReparsePointInfo Info;
+	DWORD result = QueryReparsePoint(hLink, Info);
+	if (result == ERROR_NOT_A_REPARSE_POINT)
+	{
+		Progress = LINK_OP_NO_REPARSE_DATA;
+		return 0;
+	}
+
+	if (result == 0)
+	{
+		size_t TargetSize = GetReparsePointTargetSize(Info);
+		LPTSTR Target = Arena.Allocate(TargetSize);
+		result = GetReparsePointTarget(Info, Target, TargetSize);
+
+		if (result == 0 && Info.ReparseTag == Op.ReparseTag)
+		{
+			if (_tcscmp(Target, Op.OldTarget) == 0)
+			{
+				Progress = LINK_OP_PLANNED;
+			}
+			else if (_tcscmp(Target, Op.NewTarget) == 0)
+			{
+				Progress = LINK_OP_DONE;
+			}
+		}
+	}
+
+	return result;
+}
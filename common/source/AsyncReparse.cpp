@@ -0,0 +1,444 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "AsyncReparse.h"
+#include "ErrorMessage.h"
+#include "RunMetrics.h"
+
+/** The size of the fields common to all reparse data buffers (tag, data length and reserved). */
+#define REPARSE_DATA_HEADER_SIZE FIELD_OFFSET(REPARSE_DATA_BUFFER, GenericReparseBuffer)
+
+namespace
+{
+
+/** The request a link is waiting on. */
+enum RequestState
+{
+	/** FSCTL_GET_REPARSE_POINT. */
+	ReadState,
+	/** FSCTL_SET_REPARSE_POINT over the existing reparse data. */
+	WriteInPlaceState,
+	/** FSCTL_DELETE_REPARSE_POINT ahead of the write. */
+	DeleteState,
+	/** FSCTL_SET_REPARSE_POINT once the existing reparse data is gone. */
+	WriteState
+};
+
+/** The operation measured for the request of each state. */
+const MetricOp StateOps[] = { MetricGetTarget, MetricSetTarget, MetricDelete, MetricSetTarget };
+
+} // namespace
+
+/**
+ * A link in flight along with the buffers its requests read from and write to, which must stay put until the requests
+ * complete.
+ */
+struct AsyncLinkQueue::Request
+{
+	OVERLAPPED Overlapped;
+	HANDLE hLink;
+	int State;
+	/** The time the request in flight was issued, for its latency. */
+	LONGLONG IssueTime;
+	AsyncLink Link;
+	/** The header passed to FSCTL_DELETE_REPARSE_POINT. */
+	REPARSE_DATA_BUFFER DeleteHeader;
+	/** The size of the new reparse data, in bytes. */
+	DWORD DataSize;
+	/** The new reparse data. */
+	union
+	{
+		REPARSE_DATA_BUFFER Header;
+		BYTE Raw[MAXIMUM_REPARSE_DATA_BUFFER_SIZE];
+	} Data;
+};
+
+AsyncLinkQueue::AsyncLinkQueue(AsyncLinkAction& InAction, LinkStats& InStats)
+	: Action(InAction)
+	, Stats(InStats)
+	, bInPlace(true)
+	, bAdaptive(false)
+	, Port(NULL)
+{
+	InitializeCriticalSection(&Lock);
+	InitializeConditionVariable(&RequestFreed);
+}
+
+AsyncLinkQueue::~AsyncLinkQueue()
+{
+	Finish();
+
+	if (Port != NULL)
+	{
+		CloseHandle(Port);
+	}
+
+	for (size_t i = 0; i < Requests.size(); i++)
+	{
+		delete Requests[i];
+	}
+
+	DeleteCriticalSection(&Lock);
+}
+
+DWORD AsyncLinkQueue::Start(int MaxRequests, bool bInPlaceWrites, bool bAdaptiveRequests)
+{
+	bInPlace = bInPlaceWrites;
+	bAdaptive = bAdaptiveRequests;
+
+	Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, ASYNC_COMPLETION_THREADS);
+	if (Port == NULL)
+	{
+		return GetLastError();
+	}
+
+	// Every request is allocated up front so that the buffers of a link are never allocated while walking
+	int NumRequests = MaxRequests < 1 ? 1 : (MaxRequests > MAX_ASYNC_REQUESTS ? MAX_ASYNC_REQUESTS : MaxRequests);
+	Requests.reserve(NumRequests);
+	FreeRequests.reserve(NumRequests);
+	for (int i = 0; i < NumRequests; i++)
+	{
+		Request* Req = new Request();
+		Req->hLink = INVALID_HANDLE_VALUE;
+		Requests.push_back(Req);
+		FreeRequests.push_back(Req);
+	}
+	Controller.Start(NumRequests);
+
+	DWORD result = 0;
+	for (int i = 0; i < ASYNC_COMPLETION_THREADS; i++)
+	{
+		HANDLE hThread = CreateThread(NULL, 0, CompletionThreadProc, this, 0, NULL);
+		if (hThread == NULL)
+		{
+			result = GetLastError();
+			continue;
+		}
+
+		Threads.push_back(hThread);
+	}
+
+	// A single thread is enough to drain the port
+	return Threads.empty() ? result : 0;
+}
+
+DWORD AsyncLinkQueue::Submit(LPCTSTR Path, DWORD Attributes, DWORD DesiredAccess)
+{
+	// The link is opened before waiting for a free request so that slow opens overlap with the requests in flight
+	HANDLE hLink = CreateFile(Path, DesiredAccess, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (hLink == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	if (CreateIoCompletionPort(hLink, Port, 0, 0) == NULL)
+	{
+		DWORD result = GetLastError();
+		CloseHandle(hLink);
+		return result;
+	}
+
+	// The controller never allows more links in flight than there are requests, so one is always free once it lets
+	// this one through
+	if (bAdaptive)
+	{
+		Controller.Acquire();
+	}
+
+	EnterCriticalSection(&Lock);
+	while (FreeRequests.empty())
+	{
+		SleepConditionVariableCS(&RequestFreed, &Lock, INFINITE);
+	}
+
+	Request* Req = FreeRequests.back();
+	FreeRequests.pop_back();
+	LeaveCriticalSection(&Lock);
+
+	Req->hLink = hLink;
+	Req->Link.Path = Path;
+	Req->Link.Attributes = Attributes;
+	Req->Link.Info.ReparseTag = 0;
+	Req->Link.Target = TEXT("");
+	Req->Link.NewTarget = NULL;
+	Req->Link.Arena.Reset();
+	AdjustQueueDepth(MetricAsyncQueue, 1);
+
+	// Once the link is submitted any failure is reported along with the other completions
+	DWORD result = Issue(*Req, ReadState);
+	if (result != 0)
+	{
+		Complete(*Req, result);
+	}
+
+	return 0;
+}
+
+void AsyncLinkQueue::Finish()
+{
+	if (Threads.empty())
+	{
+		return;
+	}
+
+	EnterCriticalSection(&Lock);
+	while (FreeRequests.size() < Requests.size())
+	{
+		SleepConditionVariableCS(&RequestFreed, &Lock, INFINITE);
+	}
+	LeaveCriticalSection(&Lock);
+
+	// A packet without an overlapped structure tells a completion thread to exit
+	for (size_t i = 0; i < Threads.size(); i++)
+	{
+		PostQueuedCompletionStatus(Port, 0, 0, NULL);
+	}
+
+	for (size_t i = 0; i < Threads.size(); i++)
+	{
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+	}
+	Threads.clear();
+
+	// Release the port and the requests so that the next start begins afresh
+	CloseHandle(Port);
+	Port = NULL;
+	for (size_t i = 0; i < Requests.size(); i++)
+	{
+		delete Requests[i];
+	}
+	Requests.clear();
+	FreeRequests.clear();
+}
+
+DWORD WINAPI AsyncLinkQueue::CompletionThreadProc(LPVOID Param)
+{
+	((AsyncLinkQueue*)Param)->RunCompletions();
+	return 0;
+}
+
+void AsyncLinkQueue::RunCompletions()
+{
+	// The latency of every request is measured as it completes
+	ThreadControllerScope Scope(bAdaptive ? &Controller : NULL);
+
+	for (;;)
+	{
+		DWORD bytesTransferred = 0;
+		ULONG_PTR key = 0;
+		LPOVERLAPPED pOverlapped = NULL;
+		BOOL bSuccess = GetQueuedCompletionStatus(Port, &bytesTransferred, &key, &pOverlapped, INFINITE);
+		if (pOverlapped == NULL)
+		{
+			break;
+		}
+
+		Request* Req = CONTAINING_RECORD(pOverlapped, Request, Overlapped);
+		OnCompletion(*Req, bSuccess ? 0 : GetLastError(), bytesTransferred);
+	}
+}
+
+void AsyncLinkQueue::OnCompletion(Request& Req, DWORD Result, DWORD BytesTransferred)
+{
+	AsyncLink& Link = Req.Link;
+
+	// Like their synchronous counterparts, the reads and writes are traced with the length of the target they carry
+	DWORD TargetLength = 0;
+	if (Req.State == WriteInPlaceState || Req.State == WriteState)
+	{
+		TargetLength = GetReparseDataTargetLength(Req.Data.Header);
+	}
+	else if (Req.State == ReadState && Result == 0)
+	{
+		TargetLength = GetReparseDataTargetLength(Link.Info.Data.Header);
+	}
+	RecordLatency(StateOps[Req.State], Req.IssueTime, TargetLength, Result);
+
+	switch (Req.State)
+	{
+	case ReadState:
+		if (Result == 0)
+		{
+			Result = ParseReparseData(Link.Info, BytesTransferred);
+		}
+
+		if (Result == 0 &&
+			(Link.Info.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT || Link.Info.ReparseTag == IO_REPARSE_TAG_SYMLINK))
+		{
+			size_t TargetSize = GetReparsePointTargetSize(Link.Info);
+			LPTSTR Target = Link.Arena.Allocate(TargetSize);
+			Result = GetReparsePointTarget(Link.Info, Target, TargetSize);
+			Link.Target = Target;
+		}
+
+		if (Result == 0)
+		{
+			Result = Action.OnReadLink(Link);
+		}
+
+		if (Result == 0 && Link.NewTarget != NULL)
+		{
+			// Build the new reparse data up front so that an invalid target never leaves the link without any
+			Result = BuildReparseData(Link.Info.ReparseTag, Link.NewTarget, &Req.Data.Header, sizeof(Req.Data),
+				&Req.DataSize);
+			if (Result == 0)
+			{
+				Result = Issue(Req, bInPlace ? WriteInPlaceState : DeleteState);
+				if (Result == 0)
+				{
+					return;
+				}
+			}
+		}
+		break;
+	case WriteInPlaceState:
+		// Fall back to removing the existing reparse data on file systems that can't replace it
+		if (Result == ERROR_INVALID_FUNCTION || Result == ERROR_NOT_SUPPORTED || Result == ERROR_REPARSE_TAG_MISMATCH)
+		{
+			Result = Issue(Req, DeleteState);
+			if (Result == 0)
+			{
+				return;
+			}
+		}
+		else if (Result == 0)
+		{
+			Action.OnLinkWritten(Link);
+		}
+		break;
+	case DeleteState:
+		if (Result == 0)
+		{
+			Result = Issue(Req, WriteState);
+			if (Result == 0)
+			{
+				return;
+			}
+		}
+		break;
+	case WriteState:
+		if (Result == 0)
+		{
+			Action.OnLinkWritten(Link);
+		}
+		break;
+	}
+
+	Complete(Req, Result);
+}
+
+DWORD AsyncLinkQueue::Issue(Request& Req, int State)
+{
+	Req.State = State;
+	Req.IssueTime = StartLatency(StateOps[State], State == WriteInPlaceState || State == WriteState ?
+		GetReparseDataTargetLength(Req.Data.Header) : 0);
+	memset(&Req.Overlapped, 0, sizeof(Req.Overlapped));
+
+	// The completion is queued to the port even when the request completes right away
+	BOOL bIssued = FALSE;
+	switch (State)
+	{
+	case ReadState:
+		bIssued = DeviceIoControl(Req.hLink, FSCTL_GET_REPARSE_POINT, NULL, 0, &Req.Link.Info.Data,
+			sizeof(Req.Link.Info.Data), NULL, &Req.Overlapped);
+		break;
+	case DeleteState:
+		// Microsoft reparse tags are deleted by passing just the header of the reparse data
+		memset(&Req.DeleteHeader, 0, sizeof(Req.DeleteHeader));
+		Req.DeleteHeader.ReparseTag = Req.Link.Info.ReparseTag;
+		bIssued = DeviceIoControl(Req.hLink, FSCTL_DELETE_REPARSE_POINT, &Req.DeleteHeader, REPARSE_DATA_HEADER_SIZE,
+			NULL, 0, NULL, &Req.Overlapped);
+		break;
+	default:
+		bIssued = DeviceIoControl(Req.hLink, FSCTL_SET_REPARSE_POINT, &Req.Data, Req.DataSize, NULL, 0, NULL,
+			&Req.Overlapped);
+		break;
+	}
+
+	if (!bIssued && GetLastError() != ERROR_IO_PENDING)
+	{
+		// No completion will be queued for the request
+		DWORD result = GetLastError();
+		RecordLatency(StateOps[State], Req.IssueTime, 0, result);
+		return result;
+	}
+
+	return 0;
+}
+
+void AsyncLinkQueue::Complete(Request& Req, DWORD Result)
+{
+	if (Result != 0)
+	{
+		Stats.NumFailed++;
+		PrintErrorMessage(Result, Req.Link.Path.c_str());
+		if (bAdaptive)
+		{
+			Controller.RecordFailure(Result);
+		}
+	}
+
+	CloseHandle(Req.hLink);
+	Req.hLink = INVALID_HANDLE_VALUE;
+	AdjustQueueDepth(MetricAsyncQueue, -1);
+
+	EnterCriticalSection(&Lock);
+	FreeRequests.push_back(&Req);
+	LeaveCriticalSection(&Lock);
+
+	if (bAdaptive)
+	{
+		Controller.Release();
+	}
+
+	// Both submitters waiting for a request and Finish waiting for all of them are woken
+	WakeAllConditionVariable(&RequestFreed);
+}
+
+int ParseAsyncRequestCount(LPCTSTR Arg)
+{
+	// The count is optional, e.g. /ASYNC or /ASYNC:512
+	LPCTSTR Count = _tcschr(Arg, ':');
+	if (Count == NULL)
+	{
+		return DEFAULT_ASYNC_REQUESTS;
+	}
+
+	int NumRequests = _ttoi(Count + 1);
+	if (NumRequests < 1)
+	{
+		return 1;
+	}
+
+	return NumRequests > MAX_ASYNC_REQUESTS ? MAX_ASYNC_REQUESTS : NumRequests;
+}
@@ -0,0 +1,765 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "ChangeJournal.h"
+#include "ErrorMessage.h"
+#include "PathBuffer.h"
+#include "VolumeScan.h"
+#include "WalkFilter.h"
+
+/** The size of the buffer that receives the records of the change journal. */
+#define JOURNAL_BUFFER_SIZE (64 * 1024)
+
+/** The changes that may leave a link with a stale target. */
+#define LINK_CHANGE_REASONS (USN_REASON_REPARSE_POINT_CHANGE | USN_REASON_FILE_CREATE | USN_REASON_RENAME_NEW_NAME)
+
+/** The longest line of a checkpoint file, which ends with the path of a root. */
+#define CHECKPOINT_LINE_LENGTH (32768 + 64)
+
+/** The changes that may add links to a tree, remove them from it or move them around. */
+#define TREE_CHANGE_REASONS (USN_REASON_REPARSE_POINT_CHANGE | USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE | \
+	USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME)
+
+namespace
+{
+
+/**
+ * Retrieves the normalized DOS path of an open file object without the \\?\ prefix.
+ */
+DWORD GetFinalPath(HANDLE hFile, tstring& Path)
+{
+	// The required size is returned when the buffer is too small, so try again once with a large enough buffer
+	std::vector<TCHAR> Buffer(MAX_PATH);
+	DWORD length = GetFinalPathNameByHandle(hFile, &Buffer[0], MAX_PATH, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+	if (length >= MAX_PATH)
+	{
+		Buffer.resize(length + 1);
+		length = GetFinalPathNameByHandle(hFile, &Buffer[0], length + 1, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+	}
+
+	if (length == 0)
+	{
+		return GetLastError();
+	}
+	else if (length >= Buffer.size())
+	{
+		return ERROR_INSUFFICIENT_BUFFER;
+	}
+
+	if (_tcsncmp(&Buffer[0], TEXT("\\\\?\\UNC\\"), 8) == 0)
+	{
+		Path = TEXT("\\\\");
+		Path += &Buffer[8];
+	}
+	else if (_tcsncmp(&Buffer[0], TEXT("\\\\?\\"), 4) == 0)
+	{
+		Path = &Buffer[4];
+	}
+	else
+	{
+		Path = &Buffer[0];
+	}
+
+	return 0;
+}
+
+/**
+ * Opens the volume that holds the given path and queries its change journal along with its serial number and, if
+ * requested, the normalized path.
+ */
+DWORD OpenJournal(LPCTSTR Path, HANDLE& hVolume, USN_JOURNAL_DATA_V0& JournalData, DWORD& VolumeSerial,
+	tstring* FinalPath = NULL)
+{
+	HANDLE hFile = CreateFile(Path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	BY_HANDLE_FILE_INFORMATION FileInfo;
+	DWORD result = GetFileInformationByHandle(hFile, &FileInfo) ? 0 : GetLastError();
+	if (result == 0 && FinalPath != NULL)
+	{
+		result = GetFinalPath(hFile, *FinalPath);
+	}
+	CloseHandle(hFile);
+
+	if (result == 0)
+	{
+		VolumeSerial = FileInfo.dwVolumeSerialNumber;
+		result = OpenVolume(Path, hVolume);
+	}
+
+	if (result == 0)
+	{
+		DWORD bytesReturned = 0;
+		if (!DeviceIoControl(hVolume, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &JournalData, sizeof(JournalData),
+			&bytesReturned, NULL))
+		{
+			result = GetLastError();
+			CloseHandle(hVolume);
+			hVolume = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Collects the file reference numbers of the reparse points changed between the checkpoint and StopUsn, along with
+ * those of the directories created or moved in that time.
+ */
+DWORD ReadChanges(HANDLE hVolume, const JournalCheckpoint& Since, USN StopUsn, std::vector<DWORDLONG>& ChangedLinks,
+	std::vector<DWORDLONG>& ChangedDirs)
+{
+	std::vector<BYTE> Buffer(JOURNAL_BUFFER_SIZE);
+
+	READ_USN_JOURNAL_DATA_V0 ReadData;
+	ReadData.StartUsn = Since.NextUsn;
+	ReadData.ReasonMask = LINK_CHANGE_REASONS;
+	ReadData.ReturnOnlyOnClose = FALSE;
+	ReadData.Timeout = 0;
+	ReadData.BytesToWaitFor = 0;
+	ReadData.UsnJournalID = Since.JournalId;
+
+	while (ReadData.StartUsn < StopUsn)
+	{
+		DWORD bytesReturned = 0;
+		if (!DeviceIoControl(hVolume, FSCTL_READ_USN_JOURNAL, &ReadData, sizeof(ReadData), &Buffer[0], (DWORD)Buffer.size(),
+			&bytesReturned, NULL))
+		{
+			return GetLastError();
+		}
+
+		// The output starts with the USN to continue reading from
+		if (bytesReturned <= sizeof(USN))
+		{
+			break;
+		}
+
+		BYTE* Pos = &Buffer[0] + sizeof(USN);
+		BYTE* End = &Buffer[0] + bytesReturned;
+		while (Pos < End)
+		{
+			const USN_RECORD* Record = (const USN_RECORD*)Pos;
+			if (Record->RecordLength == 0)
+			{
+				break;
+			}
+			Pos += Record->RecordLength;
+
+			if (Record->MajorVersion != 2 || Record->Usn >= StopUsn)
+			{
+				continue;
+			}
+
+			if ((Record->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+			{
+				ChangedLinks.push_back(Record->FileReferenceNumber);
+			}
+			// A directory moved into the tree brings along links that have no records of their own
+			else if ((Record->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 &&
+				(Record->Reason & (USN_REASON_FILE_CREATE | USN_REASON_RENAME_NEW_NAME)) != 0)
+			{
+				ChangedDirs.push_back(Record->FileReferenceNumber);
+			}
+		}
+
+		ReadData.StartUsn = *(USN*)&Buffer[0];
+	}
+
+	// A file object usually shows up several times, e.g. once when created and again when closed
+	std::sort(ChangedLinks.begin(), ChangedLinks.end());
+	ChangedLinks.erase(std::unique(ChangedLinks.begin(), ChangedLinks.end()), ChangedLinks.end());
+	std::sort(ChangedDirs.begin(), ChangedDirs.end());
+	ChangedDirs.erase(std::unique(ChangedDirs.begin(), ChangedDirs.end()), ChangedDirs.end());
+	return 0;
+}
+
+/**
+ * Finds the path relative to the root of a changed file object. Returns false if it no longer exists, is not beneath
+ * the root or can't be queried, the latter being counted as a failure.
+ */
+bool LocateChange(HANDLE hVolume, DWORDLONG Frn, const tstring& RootFinalPath, tstring& RelativePath,
+	FILE_ATTRIBUTE_TAG_INFO& TagInfo, LinkStats& Stats)
+{
+	FILE_ID_DESCRIPTOR FileId;
+	FileId.dwSize = sizeof(FileId);
+	FileId.Type = FileIdType;
+	FileId.FileId.QuadPart = (LONGLONG)Frn;
+
+	// File objects that have been deleted since the change was recorded can no longer be opened
+	HANDLE hFile = OpenFileById(hVolume, &FileId, FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	tstring FinalPath;
+	DWORD result = GetFinalPath(hFile, FinalPath);
+	if (result == 0 && !GetFileInformationByHandleEx(hFile, FileAttributeTagInfo, &TagInfo, sizeof(TagInfo)))
+	{
+		result = GetLastError();
+	}
+	CloseHandle(hFile);
+
+	if (result != 0)
+	{
+		Stats.NumFailed++;
+		PrintErrorMessage(result, FinalPath.c_str());
+		return false;
+	}
+
+	// Only file objects beneath the root are of interest, matching on a whole path component
+	size_t rootLength = RootFinalPath.size();
+	if (FinalPath.size() <= rootLength || FinalPath[rootLength] != '\\' ||
+		_tcsnicmp(FinalPath.c_str(), RootFinalPath.c_str(), rootLength) != 0)
+	{
+		return false;
+	}
+
+	RelativePath = FinalPath.substr(rootLength);
+	return true;
+}
+
+/**
+ * Orders relative paths so that the paths beneath a directory immediately follow it, by sorting the separator before
+ * any other character.
+ */
+bool IsPathBefore(const tstring& Left, const tstring& Right)
+{
+	size_t length = std::min(Left.size(), Right.size());
+	for (size_t i = 0; i < length; i++)
+	{
+		if (Left[i] != Right[i])
+		{
+			return Left[i] == '\\' || (Right[i] != '\\' && Left[i] < Right[i]);
+		}
+	}
+
+	return Left.size() < Right.size();
+}
+
+/**
+ * Returns true if a relative path is one of the given directories or beneath it. The directories must be ordered by
+ * IsPathBefore and none of them may be beneath another.
+ */
+bool IsPathInDirectories(const std::vector<tstring>& Dirs, const tstring& Path)
+{
+	// Only the last directory ordered before the path can hold it, as any other in between would be beneath that one
+	std::vector<tstring>::const_iterator it = std::upper_bound(Dirs.begin(), Dirs.end(), Path, IsPathBefore);
+	if (it == Dirs.begin())
+	{
+		return false;
+	}
+
+	--it;
+	return Path.size() >= it->size() && Path.compare(0, it->size(), *it) == 0 &&
+		(Path.size() == it->size() || Path[it->size()] == '\\');
+}
+
+/**
+ * Hands an action the entries of a walk that starts beneath the actual root, with their relative paths and depths made
+ * relative to that root again.
+ */
+class RebasedLinkAction : public LinkAction
+{
+public:
+	RebasedLinkAction(LinkAction& InAction, LPCTSTR InRelativeRoot, int InDepth)
+		: Action(InAction)
+		, RelativeRoot(InRelativeRoot)
+		, Depth(InDepth)
+	{
+	}
+
+	virtual DWORD OnDirectory(const WalkEntry& Entry)
+	{
+		WalkEntry Rebased = Rebase(Entry);
+		return Action.OnDirectory(Rebased);
+	}
+
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry)
+	{
+		WalkEntry Rebased = Rebase(Entry);
+		return Action.OnReparsePoint(Rebased);
+	}
+
+	virtual DWORD OnFile(const WalkEntry& Entry)
+	{
+		WalkEntry Rebased = Rebase(Entry);
+		return Action.OnFile(Rebased);
+	}
+
+	virtual void OnDirectoryIncomplete(const WalkEntry& Entry, DWORD Error)
+	{
+		WalkEntry Rebased = Rebase(Entry);
+		Action.OnDirectoryIncomplete(Rebased, Error);
+	}
+
+private:
+	RebasedLinkAction(const RebasedLinkAction&);
+	RebasedLinkAction& operator=(const RebasedLinkAction&);
+
+	WalkEntry Rebase(const WalkEntry& Entry) const
+	{
+		WalkEntry Rebased = Entry;
+		Rebased.RelativePath = JoinPath(*Entry.Arena, RelativeRoot, Entry.RelativePath);
+		Rebased.Depth = Entry.Depth + Depth;
+		return Rebased;
+	}
+
+	LinkAction& Action;
+	LPCTSTR RelativeRoot;
+	int Depth;
+};
+
+/**
+ * Invokes the action for a changed reparse point found beneath the root.
+ */
+void ProcessChangedLink(LPCTSTR Root, const tstring& RelativePath, const FILE_ATTRIBUTE_TAG_INFO& TagInfo,
+	LinkAction& Action, const WalkOptions& Options, LinkStats& Stats)
+{
+	int Depth = (int)std::count(RelativePath.begin(), RelativePath.end(), '\\');
+	if (Options.MaxDepth >= 0 && Depth > Options.MaxDepth)
+	{
+		return;
+	}
+
+	tstring Path = JoinPath(Root, RelativePath);
+	StringArena Arena;
+
+	WalkEntry LinkEntry;
+	LinkEntry.Path = Path.c_str();
+	LinkEntry.RelativePath = RelativePath.c_str();
+	LinkEntry.Depth = Depth;
+	LinkEntry.Attributes = TagInfo.FileAttributes;
+	LinkEntry.ReparseTag = TagInfo.ReparseTag;
+	LinkEntry.Arena = &Arena;
+
+	DWORD result = Action.OnReparsePoint(LinkEntry);
+	if (result != 0)
+	{
+		Stats.NumFailed++;
+		PrintErrorMessage(result, Path.c_str());
+	}
+}
+
+/**
+ * Walks a directory created or moved beneath the root as part of the tree, so the links it holds are found even though
+ * the journal has no record of them.
+ */
+void WalkChangedDirectory(LPCTSTR Root, const tstring& RelativePath, LinkAction& Action, const WalkOptions& Options,
+	LinkStats& Stats)
+{
+	int Depth = (int)std::count(RelativePath.begin(), RelativePath.end(), '\\');
+	if ((Options.MaxDepth >= 0 && Depth > Options.MaxDepth) ||
+		(Options.Filter != NULL && Options.Filter->IsPathExcluded(RelativePath.c_str(), FILE_ATTRIBUTE_DIRECTORY, 0)))
+	{
+		return;
+	}
+
+	// The volume metadata and a link index both describe the whole volume or tree, the directory is simply enumerated
+	WalkOptions DirOptions = Options;
+	DirOptions.MaxDepth = Options.MaxDepth >= 0 ? Options.MaxDepth - Depth : -1;
+	DirOptions.bFast = false;
+	DirOptions.IndexPath = NULL;
+
+	tstring Path = JoinPath(Root, RelativePath);
+	RebasedLinkAction Rebased(Action, RelativePath.c_str(), Depth);
+	WalkTree(Path.c_str(), Rebased, DirOptions, Stats);
+}
+
+} // namespace
+
+const JournalCheckpoint* FindCheckpoint(const JournalCheckpointList& Checkpoints, DWORD VolumeSerial,
+	const tstring& Root)
+{
+	for (size_t i = 0; i < Checkpoints.size(); i++)
+	{
+		if (Checkpoints[i].VolumeSerial == VolumeSerial && _tcsicmp(Checkpoints[i].Root.c_str(), Root.c_str()) == 0)
+		{
+			return &Checkpoints[i];
+		}
+	}
+
+	return NULL;
+}
+
+DWORD LoadCheckpoints(LPCTSTR Path, JournalCheckpointList& Checkpoints)
+{
+	FILE* File = NULL;
+	if (_tfopen_s(&File, Path, TEXT("r, ccs=UTF-8")) != 0 || File == NULL)
+	{
+		// There is nothing to load before the first run
+		DWORD attributes = GetFileAttributes(Path);
+		return attributes == INVALID_FILE_ATTRIBUTES ? 0 : ERROR_READ_FAULT;
+	}
+
+	// Each line holds the volume serial number, the journal identifier, the next USN and the root up to the line end
+	std::vector<TCHAR> Line(CHECKPOINT_LINE_LENGTH);
+	while (_fgetts(&Line[0], (int)Line.size(), File) != NULL)
+	{
+		TCHAR* Pos = &Line[0];
+		JournalCheckpoint Checkpoint;
+		Checkpoint.VolumeSerial = (DWORD)_tcstoul(Pos, &Pos, 16);
+		Checkpoint.JournalId = _tcstoui64(Pos, &Pos, 16);
+		Checkpoint.NextUsn = (USN)_tcstoui64(Pos, &Pos, 10);
+		if (*Pos == ' ')
+		{
+			Checkpoint.Root = Pos + 1;
+		}
+
+		// Lines of the older format that lack the root are dropped, costing each of their roots one full walk
+		size_t length = Checkpoint.Root.find_last_not_of(TEXT("\r\n"));
+		Checkpoint.Root.erase(length == tstring::npos ? 0 : length + 1);
+		if (!Checkpoint.Root.empty())
+		{
+			Checkpoints.push_back(Checkpoint);
+		}
+	}
+
+	fclose(File);
+	return 0;
+}
+
+DWORD SaveCheckpoints(LPCTSTR Path, const JournalCheckpointList& Checkpoints)
+{
+	// Keep what the file holds for the roots this run didn't visit
+	JournalCheckpointList Existing;
+	DWORD result = LoadCheckpoints(Path, Existing);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	FILE* File = NULL;
+	if (_tfopen_s(&File, Path, TEXT("w, ccs=UTF-8")) != 0 || File == NULL)
+	{
+		return ERROR_WRITE_FAULT;
+	}
+
+	for (size_t i = 0; i < Checkpoints.size(); i++)
+	{
+		_ftprintf(File, TEXT("%08lx %016llx %lld %s\n"), Checkpoints[i].VolumeSerial, Checkpoints[i].JournalId,
+			Checkpoints[i].NextUsn, Checkpoints[i].Root.c_str());
+	}
+
+	for (size_t i = 0; i < Existing.size(); i++)
+	{
+		if (FindCheckpoint(Checkpoints, Existing[i].VolumeSerial, Existing[i].Root) == NULL)
+		{
+			_ftprintf(File, TEXT("%08lx %016llx %lld %s\n"), Existing[i].VolumeSerial, Existing[i].JournalId,
+				Existing[i].NextUsn, Existing[i].Root.c_str());
+		}
+	}
+
+	result = ferror(File) != 0 ? ERROR_WRITE_FAULT : 0;
+	fclose(File);
+	return result;
+}
+
+DWORD GetJournalCheckpoint(LPCTSTR Path, JournalCheckpoint& Checkpoint)
+{
+	HANDLE hVolume = INVALID_HANDLE_VALUE;
+	USN_JOURNAL_DATA_V0 JournalData;
+	DWORD result = OpenJournal(Path, hVolume, JournalData, Checkpoint.VolumeSerial);
+	if (result == 0)
+	{
+		Checkpoint.JournalId = JournalData.UsnJournalID;
+		Checkpoint.NextUsn = JournalData.NextUsn;
+		CloseHandle(hVolume);
+	}
+
+	return result;
+}
+
+DWORD HasTreeChanged(LPCTSTR Root, const JournalCheckpoint& Since, bool& bChanged)
+{
+	bChanged = true;
+
+	HANDLE hVolume = INVALID_HANDLE_VALUE;
+	USN_JOURNAL_DATA_V0 JournalData;
+	DWORD VolumeSerial = 0;
+	tstring RootFinalPath;
+	DWORD result = OpenJournal(Root, hVolume, JournalData, VolumeSerial, &RootFinalPath);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	if (VolumeSerial != Since.VolumeSerial || JournalData.UsnJournalID != Since.JournalId ||
+		Since.NextUsn < JournalData.LowestValidUsn)
+	{
+		CloseHandle(hVolume);
+		return 0;
+	}
+
+	if (!RootFinalPath.empty() && RootFinalPath[RootFinalPath.size() - 1] == '\\')
+	{
+		RootFinalPath.erase(RootFinalPath.size() - 1);
+	}
+
+	// Whether each parent directory seen so far is part of the tree, as most changes share a handful of parents
+	std::unordered_map<DWORDLONG, bool> InTree;
+
+	std::vector<BYTE> Buffer(JOURNAL_BUFFER_SIZE);
+
+	READ_USN_JOURNAL_DATA_V0 ReadData;
+	ReadData.StartUsn = Since.NextUsn;
+	ReadData.ReasonMask = TREE_CHANGE_REASONS;
+	ReadData.ReturnOnlyOnClose = FALSE;
+	ReadData.Timeout = 0;
+	ReadData.BytesToWaitFor = 0;
+	ReadData.UsnJournalID = Since.JournalId;
+
+	// Stop at the first change that matters, there is no need to read the rest of the journal
+	bChanged = false;
+	while (!bChanged && ReadData.StartUsn < JournalData.NextUsn)
+	{
+		DWORD bytesReturned = 0;
+		if (!DeviceIoControl(hVolume, FSCTL_READ_USN_JOURNAL, &ReadData, sizeof(ReadData), &Buffer[0], (DWORD)Buffer.size(),
+			&bytesReturned, NULL))
+		{
+			result = GetLastError();
+			bChanged = true;
+			break;
+		}
+
+		// The output starts with the USN to continue reading from
+		if (bytesReturned <= sizeof(USN))
+		{
+			break;
+		}
+
+		BYTE* Pos = &Buffer[0] + sizeof(USN);
+		BYTE* End = &Buffer[0] + bytesReturned;
+		while (Pos < End && !bChanged)
+		{
+			const USN_RECORD* Record = (const USN_RECORD*)Pos;
+			if (Record->RecordLength == 0)
+			{
+				break;
+			}
+			Pos += Record->RecordLength;
+
+			if ((Record->FileAttributes & (FILE_ATTRIBUTE_REPARSE_POINT | FILE_ATTRIBUTE_DIRECTORY)) == 0)
+			{
+				continue;
+			}
+
+			// A link that was only retargeted is still the same link in the same place
+			if ((Record->Reason & TREE_CHANGE_REASONS) == USN_REASON_REPARSE_POINT_CHANGE &&
+				(Record->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+			{
+				continue;
+			}
+
+			std::unordered_map<DWORDLONG, bool>::const_iterator it = InTree.find(Record->ParentFileReferenceNumber);
+			if (it != InTree.end())
+			{
+				bChanged = it->second;
+				continue;
+			}
+
+			// A parent that can't be opened any more may well have been part of the tree
+			FILE_ID_DESCRIPTOR FileId;
+			FileId.dwSize = sizeof(FileId);
+			FileId.Type = FileIdType;
+			FileId.FileId.QuadPart = (LONGLONG)Record->ParentFileReferenceNumber;
+
+			tstring ParentPath;
+			HANDLE hParent = OpenFileById(hVolume, &FileId, FILE_READ_ATTRIBUTES,
+				FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, FILE_FLAG_BACKUP_SEMANTICS);
+			if (hParent == INVALID_HANDLE_VALUE || GetFinalPath(hParent, ParentPath) != 0)
+			{
+				bChanged = true;
+			}
+			else
+			{
+				size_t rootLength = RootFinalPath.size();
+				bChanged = ParentPath.size() >= rootLength &&
+					(ParentPath.size() == rootLength || ParentPath[rootLength] == '\\') &&
+					_tcsnicmp(ParentPath.c_str(), RootFinalPath.c_str(), rootLength) == 0;
+			}
+
+			if (hParent != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(hParent);
+			}
+
+			InTree[Record->ParentFileReferenceNumber] = bChanged;
+		}
+
+		ReadData.StartUsn = *(USN*)&Buffer[0];
+	}
+
+	CloseHandle(hVolume);
+	return result;
+}
+
+DWORD WalkChanges(LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats,
+	const JournalCheckpointList& Since, JournalCheckpointList& Next)
+{
+	// The volume serial number and the normalized path of the root identify where the changes must be looked for
+	HANDLE hRoot = CreateFile(Root, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (hRoot == INVALID_HANDLE_VALUE)
+	{
+		DWORD result = GetLastError();
+		Stats.NumFailed++;
+		PrintErrorMessage(result, Root);
+		return result;
+	}
+
+	tstring RootFinalPath;
+	BY_HANDLE_FILE_INFORMATION RootInfo;
+	DWORD result = GetFinalPath(hRoot, RootFinalPath);
+	if (result == 0 && !GetFileInformationByHandle(hRoot, &RootInfo))
+	{
+		result = GetLastError();
+	}
+	CloseHandle(hRoot);
+
+	// A root that is itself a link is simply processed again
+	if (result == 0 && (RootInfo.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+	{
+		return WalkTree(Root, Action, Options, Stats);
+	}
+
+	// Paths beneath the root are matched on the separator that follows it
+	if (!RootFinalPath.empty() && RootFinalPath[RootFinalPath.size() - 1] == '\\')
+	{
+		RootFinalPath.erase(RootFinalPath.size() - 1);
+	}
+
+	// Reading the change journal takes the same privileges as scanning the volume
+	HANDLE hVolume = INVALID_HANDLE_VALUE;
+	USN_JOURNAL_DATA_V0 JournalData;
+	if (result == 0)
+	{
+		result = OpenVolume(Root, hVolume);
+		if (result == 0)
+		{
+			DWORD bytesReturned = 0;
+			if (!DeviceIoControl(hVolume, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &JournalData, sizeof(JournalData),
+				&bytesReturned, NULL))
+			{
+				result = GetLastError();
+			}
+		}
+	}
+
+	if (result != 0)
+	{
+		if (hVolume != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(hVolume);
+		}
+
+		_tprintf(TEXT("The change journal is unavailable for %s, walking the directory tree instead.\n"),
+			GetDisplayPath(Root));
+		return WalkTree(Root, Action, Options, Stats);
+	}
+
+	// Remember where the journal is now before making any changes so that nothing is missed by the next run
+	if (FindCheckpoint(Next, RootInfo.dwVolumeSerialNumber, RootFinalPath) == NULL)
+	{
+		JournalCheckpoint Current;
+		Current.VolumeSerial = RootInfo.dwVolumeSerialNumber;
+		Current.JournalId = JournalData.UsnJournalID;
+		Current.NextUsn = JournalData.NextUsn;
+		Current.Root = RootFinalPath;
+		Next.push_back(Current);
+	}
+
+	// Without a checkpoint that is still covered by the journal every link has to be visited
+	const JournalCheckpoint* Checkpoint = FindCheckpoint(Since, RootInfo.dwVolumeSerialNumber, RootFinalPath);
+	std::vector<DWORDLONG> ChangedLinks;
+	std::vector<DWORDLONG> ChangedDirs;
+	if (Checkpoint == NULL || Checkpoint->JournalId != JournalData.UsnJournalID ||
+		Checkpoint->NextUsn < JournalData.LowestValidUsn ||
+		ReadChanges(hVolume, *Checkpoint, JournalData.NextUsn, ChangedLinks, ChangedDirs) != 0)
+	{
+		CloseHandle(hVolume);
+		return WalkTree(Root, Action, Options, Stats);
+	}
+
+	// Only the outermost of the changed directories need to be walked, the others are part of them
+	std::vector<tstring> Dirs;
+	for (size_t i = 0; i < ChangedDirs.size(); i++)
+	{
+		tstring RelativePath;
+		FILE_ATTRIBUTE_TAG_INFO TagInfo;
+		if (LocateChange(hVolume, ChangedDirs[i], RootFinalPath, RelativePath, TagInfo, Stats) &&
+			(TagInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0)
+		{
+			Dirs.push_back(RelativePath);
+		}
+	}
+
+	std::sort(Dirs.begin(), Dirs.end(), IsPathBefore);
+	std::vector<tstring> OuterDirs;
+	for (size_t i = 0; i < Dirs.size(); i++)
+	{
+		if (!IsPathInDirectories(OuterDirs, Dirs[i]))
+		{
+			OuterDirs.push_back(Dirs[i]);
+		}
+	}
+
+	// The changed links are found without enumerating their directories so the filter is evaluated on their paths,
+	// leaving out those the walks of the changed directories visit anyway
+	FilteredLinkAction Filtered(Action, Options.Filter);
+	for (size_t i = 0; i < ChangedLinks.size(); i++)
+	{
+		tstring RelativePath;
+		FILE_ATTRIBUTE_TAG_INFO TagInfo;
+		if (LocateChange(hVolume, ChangedLinks[i], RootFinalPath, RelativePath, TagInfo, Stats) &&
+			(TagInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 && !IsPathInDirectories(OuterDirs, RelativePath))
+		{
+			ProcessChangedLink(Root, RelativePath, TagInfo, Filtered, Options, Stats);
+		}
+	}
+
+	CloseHandle(hVolume);
+
+	for (size_t i = 0; i < OuterDirs.size(); i++)
+	{
+		WalkChangedDirectory(Root, OuterDirs[i], Action, Options, Stats);
+	}
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "ConcurrencyControl.h"
+
+namespace
+{
+
+/** The controller of each thread, if any. */
+__declspec(thread) ConcurrencyController* ThreadController = NULL;
+
+} // namespace
+
+ConcurrencyController::ConcurrencyController()
+	: MaxLimit(1)
+	, Limit(1)
+	, NumActive(0)
+{
+	InitializeCriticalSection(&Lock);
+	InitializeConditionVariable(&SlotFreed);
+	Start(1);
+}
+
+ConcurrencyController::~ConcurrencyController()
+{
+	DeleteCriticalSection(&Lock);
+}
+
+void ConcurrencyController::Start(int InMaxLimit)
+{
+	MaxLimit = InMaxLimit < 1 ? 1 : InMaxLimit;
+	Limit = (MaxLimit + 1) / 2;
+	NumActive = 0;
+	NumWindowOps = 0;
+	NumCongested = 0;
+	memset(WindowOps, 0, sizeof(WindowOps));
+	memset(WindowMicros, 0, sizeof(WindowMicros));
+	memset(BaselineMicros, 0, sizeof(BaselineMicros));
+}
+
+void ConcurrencyController::Acquire()
+{
+	EnterCriticalSection(&Lock);
+	while (NumActive >= Limit)
+	{
+		SleepConditionVariableCS(&SlotFreed, &Lock, INFINITE);
+	}
+	NumActive++;
+	LeaveCriticalSection(&Lock);
+}
+
+void ConcurrencyController::Release()
+{
+	EnterCriticalSection(&Lock);
+	NumActive--;
+	LeaveCriticalSection(&Lock);
+
+	WakeConditionVariable(&SlotFreed);
+}
+
+void ConcurrencyController::RecordLatency(MetricOp Op, LONGLONG Micros)
+{
+	EnterCriticalSection(&Lock);
+	WindowOps[Op]++;
+	WindowMicros[Op] += Micros;
+	if (++NumWindowOps >= CONTROL_WINDOW_OPS)
+	{
+		EndWindow();
+	}
+	LeaveCriticalSection(&Lock);
+}
+
+void ConcurrencyController::RecordFailure(DWORD Result)
+{
+	if (!IsCongestionError(Result))
+	{
+		return;
+	}
+
+	// Backing off can't wait for the window to fill up when the server is already turning requests away
+	EnterCriticalSection(&Lock);
+	NumCongested++;
+	EndWindow();
+	LeaveCriticalSection(&Lock);
+}
+
+void ConcurrencyController::EndWindow()
+{
+	bool bCongested = NumCongested > 0;
+	for (int Op = 0; Op < NUM_METRIC_OPS; Op++)
+	{
+		if (WindowOps[Op] < CONTROL_MIN_SAMPLES)
+		{
+			continue;
+		}
+
+		LONGLONG Mean = WindowMicros[Op] / WindowOps[Op];
+		LONGLONG& Baseline = BaselineMicros[Op];
+		if (Baseline != 0 && Mean > Baseline * CONTROL_LATENCY_FACTOR)
+		{
+			bCongested = true;
+		}
+
+		// The lowest mean seen, allowed to drift up by a sixteenth each window
+		LONGLONG Drifted = Baseline + Baseline / 16 + 1;
+		Baseline = Baseline == 0 || Mean < Drifted ? Mean : Drifted;
+	}
+
+	int OldLimit = Limit;
+	if (bCongested)
+	{
+		Limit = Limit > 1 ? Limit / 2 : 1;
+	}
+	else if (Limit < MaxLimit)
+	{
+		Limit = Limit + 1;
+	}
+
+	NumWindowOps = 0;
+	NumCongested = 0;
+	memset(WindowOps, 0, sizeof(WindowOps));
+	memset(WindowMicros, 0, sizeof(WindowMicros));
+
+	if (Limit > OldLimit)
+	{
+		WakeConditionVariable(&SlotFreed);
+	}
+}
+
+bool IsCongestionError(DWORD Result)
+{
+	switch (Result)
+	{
+	case ERROR_SHARING_VIOLATION:
+	case ERROR_LOCK_VIOLATION:
+	case ERROR_BUSY:
+	case ERROR_NETWORK_BUSY:
+	case ERROR_REQ_NOT_ACCEP:
+	case ERROR_SEM_TIMEOUT:
+	case ERROR_NO_SYSTEM_RESOURCES:
+	case ERROR_WORKING_SET_QUOTA:
+		return true;
+	}
+
+	return false;
+}
+
+ConcurrencyController* GetThreadController()
+{
+	return ThreadController;
+}
+
+ThreadControllerScope::ThreadControllerScope(ConcurrencyController* Controller)
+	: Previous(ThreadController)
+{
+	ThreadController = Controller;
+}
+
+ThreadControllerScope::~ThreadControllerScope()
+{
+	ThreadController = Previous;
+}
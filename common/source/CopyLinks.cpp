@@ -0,0 +1,546 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "CopyLinks.h"
+#include "ErrorMessage.h"
+#include "ReparsePoint.h"
+#include "RunMetrics.h"
+
+/** The number of items each queue of a pipelined copy holds before the stage feeding it has to wait. */
+#define PIPELINE_QUEUE_SIZE 4096
+
+/** The number of directories and links the writers of a pipelined copy take from their queue at a time. */
+#define PIPELINE_BATCH_SIZE 256
+
+namespace
+{
+
+/**
+ * Fills in the request to create a copy of a link from its prepared reparse data.
+ */
+void SetLinkRequest(LinkRequest& Request, LPCTSTR DestPath, const PreparedLink& Link, bool bDirectory)
+{
+	Request.Path = DestPath;
+	Request.ReparseTag = Link.ReparseTag;
+	Request.Target = Link.Target.c_str();
+	Request.bDirectory = bDirectory;
+	Request.Data = Link.GetData();
+	Request.DataSize = (DWORD)Link.Data.size();
+}
+
+} // namespace
+
+/**
+ * A directory or reparse point on its way through the stages of a pipelined copy.
+ */
+struct CopyLinkPipeline::CopyItem
+{
+	/** The full path of the source file object. */
+	tstring SrcPath;
+	/** The full path of the copy at the destination. */
+	tstring DestPath;
+	/** The copy to create, filled in by the read stage. */
+	const PreparedLink* Link;
+	/** The copy prepared by the read stage when the cache had no room for it. */
+	PreparedLink Prepared;
+	/** The file attributes of the source file object. */
+	DWORD Attributes;
+	/** The reparse tag of the source file object, or zero for a directory. */
+	DWORD ReparseTag;
+};
+
+CopyLinkAction::CopyLinkAction(const CopyLinkOptions& InOptions, CopyLinkStats& InStats, DestinationCache& InDestDirs,
+	const RebaseMap& InRules, LPCTSTR InDestRoot)
+	: Options(InOptions)
+	, Stats(InStats)
+	, DestDirs(InDestDirs)
+	, Rules(InRules)
+	, DestRoot(InDestRoot)
+{
+}
+
+DWORD CopyLinkAction::OnDirectory(const WalkEntry& Entry)
+{
+	// Make sure the the destination directory exists. If not create it.
+	return DestDirs.EnsureDirectory(Entry.Path, JoinPath(*Entry.Arena, DestRoot, Entry.RelativePath));
+}
+
+DWORD CopyLinkAction::OnReparsePoint(const WalkEntry& Entry)
+{
+	LPCTSTR DestPath = JoinPath(*Entry.Arena, DestRoot, Entry.RelativePath);
+
+	return CopyLink(Entry.Path, Entry.Attributes, Entry.ReparseTag, DestPath, *Entry.Arena);
+}
+
+DWORD CopyLinkAction::OnFile(const WalkEntry& Entry)
+{
+	// Only a few files have more than one link, so they are looked at by the walk itself
+	return CopyHardLink(Entry.Path, JoinPath(*Entry.Arena, DestRoot, Entry.RelativePath));
+}
+
+DWORD CopyLinkAction::PrepareLink(const ReparsePointInfo& Info, StringArena& Arena, PreparedLink& Storage,
+	const PreparedLink*& Link)
+{
+	Link = PreparedLinks.Find(Info);
+	if (Link != NULL)
+	{
+		return 0;
+	}
+
+	size_t TargetSize = GetReparsePointTargetSize(Info);
+	LPTSTR Target = Arena.Allocate(TargetSize);
+	DWORD result = GetReparsePointTarget(Info, Target, TargetSize);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	Storage = PreparedLink();
+	Storage.ReparseTag = Info.ReparseTag;
+	Storage.bVolume = IsVolumeTarget(Info.ReparseTag, Target);
+	if (Storage.bVolume)
+	{
+		// Another volume is the same wherever the tree is copied to
+		Storage.Target = Target;
+	}
+	else
+	{
+		// If specified, rebase the target to the new root
+		Storage.Target = RebaseLinkTarget(Options, Rules, Target, Arena);
+
+		Storage.Data.resize(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
+		DWORD DataSize = 0;
+		result = BuildReparseData(Storage.ReparseTag, Storage.Target.c_str(), (REPARSE_DATA_BUFFER*)&Storage.Data[0],
+			(DWORD)Storage.Data.size(), &DataSize);
+		if (result != 0)
+		{
+			return result;
+		}
+		Storage.Data.resize(DataSize);
+	}
+
+	Link = PreparedLinks.Add(Info, Storage);
+	if (Link == NULL)
+	{
+		Link = &Storage;
+	}
+
+	return 0;
+}
+
+DWORD CopyLinkAction::ReadLink(LPCTSTR SrcPath, StringArena& Arena, PreparedLink& Storage, const PreparedLink*& Link)
+{
+	HANDLE hSrc = OpenReparsePoint(SrcPath, FILE_READ_ATTRIBUTES);
+	if (hSrc == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	// Retrieve the existing target
+	ReparsePointInfo Info;
+	DWORD result = QueryReparsePoint(hSrc, Info);
+	CloseHandle(hSrc);
+
+	if (result != 0)
+	{
+		return result;
+	}
+
+	return PrepareLink(Info, Arena, Storage, Link);
+}
+
+DWORD CopyLinkAction::CheckLinkTarget(LPCTSTR DestPath, const PreparedLink& Link, bool bDirectory, bool& bBroken)
+{
+	bBroken = false;
+	if (!Options.bVerify)
+	{
+		return 0;
+	}
+
+	DWORD result = 0;
+	if (Link.bVolume)
+	{
+		// The volume has to be attached to this machine for it to be mounted
+		bBroken = GetFileAttributes(Link.Target.c_str()) == INVALID_FILE_ATTRIBUTES;
+	}
+	else
+	{
+		result = VerifyLinkTarget(Targets, DestPath, Link.ReparseTag, bDirectory, Link.Target.c_str(), bBroken);
+	}
+
+	if (result == 0 && bBroken)
+	{
+		_tprintf(TEXT("Broken target: %s -> %s\n"), GetDisplayPath(DestPath), Link.Target.c_str());
+		Stats.NumBroken++;
+	}
+
+	return result;
+}
+
+void CopyLinkAction::CountCopiedLink(LPCTSTR DestPath, DWORD ReparseTag, LPCTSTR DestTarget)
+{
+	if (Options.bVerbose)
+	{
+		LPCTSTR Kind = TEXT("symbolic link");
+		if (ReparseTag == IO_REPARSE_TAG_MOUNT_POINT)
+		{
+			Kind = IsVolumeTarget(ReparseTag, DestTarget) ? TEXT("volume mount point") : TEXT("junction");
+		}
+
+		_tprintf(TEXT("%s created for %s <<===>> %s\n"), Kind, GetDisplayPath(DestPath), DestTarget);
+	}
+
+	Stats.NumCopied++;
+}
+
+DWORD CopyLinkAction::WriteLink(LPCTSTR SrcPath, LPCTSTR DestPath, const PreparedLink& Link, bool bDirectory)
+{
+	DWORD result = 0;
+	if (Link.bVolume)
+	{
+		result = CreateDestinationMountPoint(DestDirs, DestPath, Link.Target.c_str(), SrcPath);
+	}
+	else
+	{
+		LinkRequest Request;
+		SetLinkRequest(Request, DestPath, Link, bDirectory);
+		result = CreateDestinationLink(DestDirs, Request, SrcPath);
+	}
+
+	if (result == 0)
+	{
+		CountCopiedLink(DestPath, Link.ReparseTag, Link.Target.c_str());
+	}
+
+	return result;
+}
+
+DWORD CopyLinkAction::CopyHardLink(LPCTSTR SrcPath, LPCTSTR DestPath)
+{
+	BY_HANDLE_FILE_INFORMATION Info;
+	DWORD result = GetFileInformation(SrcPath, Info);
+	if (result != 0 || Info.nNumberOfLinks <= 1)
+	{
+		return result;
+	}
+
+	tstring LeaderPath;
+	if (HardLinks.Join(Info, DestPath, LeaderPath))
+	{
+		return 0;
+	}
+
+	result = CreateDestinationHardLink(DestPath, LeaderPath.c_str());
+	if (result == ERROR_FILE_NOT_FOUND)
+	{
+		// The files themselves are copied by other means, the group is only linked once they are there
+		_tprintf(TEXT("Hard link group not copied: %s\n"), GetDisplayPath(SrcPath));
+		Stats.NumSkipped++;
+		return 0;
+	}
+
+	if (result == 0)
+	{
+		if (Options.bVerbose)
+		{
+			_tprintf(TEXT("hard link created for %s <<===>> %s\n"), GetDisplayPath(DestPath),
+				GetDisplayPath(LeaderPath.c_str()));
+		}
+
+		Stats.NumCopied++;
+	}
+
+	return result;
+}
+
+bool CopyLinkAction::IsCopyableLink(LPCTSTR SrcPath, DWORD ReparseTag)
+{
+	// Is this a junction or a symlink?
+	if (ReparseTag != IO_REPARSE_TAG_MOUNT_POINT && ReparseTag != IO_REPARSE_TAG_SYMLINK)
+	{
+		_tprintf(TEXT("Unrecognized reparse point: %s\n"), GetDisplayPath(SrcPath));
+		Stats.NumSkipped++;
+		return false;
+	}
+
+	return true;
+}
+
+DWORD CopyLinkAction::CopyLink(LPCTSTR SrcPath, DWORD Attributes, DWORD ReparseTag, LPCTSTR DestPath,
+	StringArena& Arena)
+{
+	if (!IsCopyableLink(SrcPath, ReparseTag))
+	{
+		return 0;
+	}
+
+	bool bDirectory = (Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	bool bBroken = false;
+	PreparedLink Storage;
+	const PreparedLink* Link = NULL;
+	DWORD result = ReadLink(SrcPath, Arena, Storage, Link);
+	if (result == 0)
+	{
+		result = CheckLinkTarget(DestPath, *Link, bDirectory, bBroken);
+	}
+
+	if (result == 0 && !bBroken)
+	{
+		result = WriteLink(SrcPath, DestPath, *Link, bDirectory);
+	}
+
+	return result;
+}
+
+CopyLinkPipeline::CopyLinkPipeline(const CopyLinkOptions& InOptions, CopyLinkStats& InStats,
+	DestinationCache& InDestDirs, const RebaseMap& InRules, LPCTSTR InDestRoot)
+	: CopyLinkAction(InOptions, InStats, InDestDirs, InRules, InDestRoot)
+	, ReadQueue(PIPELINE_QUEUE_SIZE)
+	, WriteQueue(PIPELINE_QUEUE_SIZE)
+{
+}
+
+CopyLinkPipeline::~CopyLinkPipeline()
+{
+	Finish();
+}
+
+DWORD CopyLinkPipeline::Start(int NumReaders, int NumWriters)
+{
+	for (int i = 0; i < NumReaders; i++)
+	{
+		HANDLE hThread = CreateThread(NULL, 0, ReaderThreadProc, this, 0, NULL);
+		if (hThread != NULL)
+		{
+			Readers.push_back(hThread);
+		}
+	}
+
+	for (int i = 0; i < NumWriters; i++)
+	{
+		HANDLE hThread = CreateThread(NULL, 0, WriterThreadProc, this, 0, NULL);
+		if (hThread != NULL)
+		{
+			Writers.push_back(hThread);
+		}
+	}
+
+	if (Readers.empty() || Writers.empty())
+	{
+		DWORD result = GetLastError();
+		Finish();
+		return result != 0 ? result : ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	return 0;
+}
+
+void CopyLinkPipeline::Finish()
+{
+	ReadQueue.Close();
+	WaitForThreads(Readers);
+
+	WriteQueue.Close();
+	WaitForThreads(Writers);
+}
+
+DWORD CopyLinkPipeline::OnDirectory(const WalkEntry& Entry)
+{
+	CopyItem* Item = new CopyItem();
+	Item->SrcPath = Entry.Path;
+	Item->DestPath = JoinPath(DestRoot, Entry.RelativePath);
+	Item->Link = NULL;
+	Item->Attributes = Entry.Attributes;
+	Item->ReparseTag = 0;
+	AdjustQueueDepth(MetricWriteQueue, 1);
+	WriteQueue.Push(Item);
+	return 0;
+}
+
+DWORD CopyLinkPipeline::OnReparsePoint(const WalkEntry& Entry)
+{
+	if (IsCopyableLink(Entry.Path, Entry.ReparseTag))
+	{
+		CopyItem* Item = new CopyItem();
+		Item->SrcPath = Entry.Path;
+		Item->DestPath = JoinPath(DestRoot, Entry.RelativePath);
+		Item->Link = NULL;
+		Item->Attributes = Entry.Attributes;
+		Item->ReparseTag = Entry.ReparseTag;
+		AdjustQueueDepth(MetricReadQueue, 1);
+		ReadQueue.Push(Item);
+	}
+
+	return 0;
+}
+
+DWORD WINAPI CopyLinkPipeline::ReaderThreadProc(LPVOID Param)
+{
+	((CopyLinkPipeline*)Param)->RunReader();
+	return 0;
+}
+
+DWORD WINAPI CopyLinkPipeline::WriterThreadProc(LPVOID Param)
+{
+	((CopyLinkPipeline*)Param)->RunWriter();
+	return 0;
+}
+
+void CopyLinkPipeline::WaitForThreads(std::vector<HANDLE>& Threads)
+{
+	for (size_t i = 0; i < Threads.size(); i++)
+	{
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+	}
+	Threads.clear();
+}
+
+void CopyLinkPipeline::RunReader()
+{
+	StringArena Arena;
+	CopyItem* Item = NULL;
+	while (ReadQueue.Pop(Item))
+	{
+		AdjustQueueDepth(MetricReadQueue, -1);
+		Arena.Reset();
+
+		bool bBroken = false;
+		DWORD result = ReadLink(Item->SrcPath.c_str(), Arena, Item->Prepared, Item->Link);
+		if (result == 0)
+		{
+			result = CheckLinkTarget(Item->DestPath.c_str(), *Item->Link,
+				(Item->Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0, bBroken);
+		}
+
+		if (result != 0)
+		{
+			Stats.NumFailed++;
+			PrintErrorMessage(result, Item->SrcPath.c_str());
+			delete Item;
+			continue;
+		}
+
+		if (bBroken)
+		{
+			delete Item;
+			continue;
+		}
+
+		AdjustQueueDepth(MetricWriteQueue, 1);
+		WriteQueue.Push(Item);
+	}
+}
+
+void CopyLinkPipeline::RunWriter()
+{
+	CopyItem* Items[PIPELINE_BATCH_SIZE];
+	std::vector<CopyItem*> Links;
+	std::vector<LinkRequest> Requests;
+	std::vector<LPCTSTR> Templates;
+	Links.reserve(PIPELINE_BATCH_SIZE);
+	Requests.reserve(PIPELINE_BATCH_SIZE);
+	Templates.reserve(PIPELINE_BATCH_SIZE);
+
+	size_t NumItems = 0;
+	while ((NumItems = WriteQueue.PopMany(Items, PIPELINE_BATCH_SIZE)) > 0)
+	{
+		AdjustQueueDepth(MetricWriteQueue, -(LONG)NumItems);
+
+		// The directories come first so that the links of the batch find their parents
+		Links.clear();
+		for (size_t i = 0; i < NumItems; i++)
+		{
+			if (Items[i]->ReparseTag != 0 && !Items[i]->Link->bVolume)
+			{
+				Links.push_back(Items[i]);
+				continue;
+			}
+
+			if (Items[i]->ReparseTag != 0)
+			{
+				// Volumes are mounted through the mount manager, one at a time
+				DWORD result = WriteLink(Items[i]->SrcPath.c_str(), Items[i]->DestPath.c_str(), *Items[i]->Link, true);
+				if (result != 0)
+				{
+					Stats.NumFailed++;
+					PrintErrorMessage(result, Items[i]->DestPath.c_str());
+				}
+
+				delete Items[i];
+				continue;
+			}
+
+			// A link of the directory may have been written first, in which case the directory already exists
+			DWORD result = DestDirs.EnsureDirectory(Items[i]->SrcPath.c_str(), Items[i]->DestPath.c_str());
+			if (result != 0)
+			{
+				Stats.NumFailed++;
+				PrintErrorMessage(result, Items[i]->DestPath.c_str());
+			}
+
+			delete Items[i];
+		}
+
+		if (Links.empty())
+		{
+			continue;
+		}
+
+		Requests.resize(Links.size());
+		Templates.resize(Links.size());
+		for (size_t i = 0; i < Links.size(); i++)
+		{
+			Requests[i] = LinkRequest();
+			SetLinkRequest(Requests[i], Links[i]->DestPath.c_str(), *Links[i]->Link,
+				(Links[i]->Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+			Templates[i] = Links[i]->SrcPath.c_str();
+		}
+
+		// A link may get here before its directory does, its missing parents then take after those of the source
+		CreateDestinationLinks(DestDirs, &Requests[0], Requests.size(), &Templates[0]);
+
+		for (size_t i = 0; i < Links.size(); i++)
+		{
+			if (Requests[i].Result == 0)
+			{
+				CountCopiedLink(Requests[i].Path, Requests[i].ReparseTag, Requests[i].Target);
+			}
+			else
+			{
+				Stats.NumFailed++;
+				PrintErrorMessage(Requests[i].Result, Requests[i].Path);
+			}
+
+			delete Links[i];
+		}
+	}
+}
@@ -0,0 +1,547 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <strsafe.h>
+#include <vector>
+
+#include "DestinationCache.h"
+#include "DirectoryEnumerator.h"
+#include "PathBuffer.h"
+#include "ReparsePoint.h"
+#include "StringMatch.h"
+
+DestinationCache::DestinationCache()
+{
+	InitializeCriticalSection(&Lock);
+}
+
+DestinationCache::~DestinationCache()
+{
+	DeleteCriticalSection(&Lock);
+}
+
+/** The size of the chunks two copies of a file are compared in. */
+#define COMPARE_BUFFER_SIZE (64 * 1024)
+
+/** The number of names tried for the temporary hard link that replaces a copy before giving up. */
+#define MAX_TEMP_LINK_ATTEMPTS 64
+
+namespace
+{
+
+/**
+ * Reads a file up to the given number of bytes or its end, whichever comes first.
+ */
+DWORD ReadChunk(HANDLE hFile, BYTE* Buffer, DWORD Size, DWORD& NumRead)
+{
+	NumRead = 0;
+	while (NumRead < Size)
+	{
+		DWORD bytesRead = 0;
+		if (!ReadFile(hFile, Buffer + NumRead, Size - NumRead, &bytesRead, NULL))
+		{
+			return GetLastError();
+		}
+		else if (bytesRead == 0)
+		{
+			break;
+		}
+
+		NumRead += bytesRead;
+	}
+
+	return 0;
+}
+
+/**
+ * Compares the contents of two files byte by byte.
+ */
+DWORD IsSameContent(LPCTSTR PathA, LPCTSTR PathB, bool& bSame)
+{
+	bSame = false;
+
+	HANDLE hFileA = CreateFile(PathA, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFileA == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	HANDLE hFileB = CreateFile(PathB, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFileB == INVALID_HANDLE_VALUE)
+	{
+		DWORD result = GetLastError();
+		CloseHandle(hFileA);
+		return result;
+	}
+
+	std::vector<BYTE> BufferA(COMPARE_BUFFER_SIZE);
+	std::vector<BYTE> BufferB(COMPARE_BUFFER_SIZE);
+	DWORD result = 0;
+	for (;;)
+	{
+		DWORD NumReadA = 0;
+		DWORD NumReadB = 0;
+		result = ReadChunk(hFileA, &BufferA[0], COMPARE_BUFFER_SIZE, NumReadA);
+		if (result == 0)
+		{
+			result = ReadChunk(hFileB, &BufferB[0], COMPARE_BUFFER_SIZE, NumReadB);
+		}
+
+		if (result != 0 || NumReadA != NumReadB || memcmp(&BufferA[0], &BufferB[0], NumReadA) != 0)
+		{
+			break;
+		}
+		else if (NumReadA == 0)
+		{
+			bSame = true;
+			break;
+		}
+	}
+
+	CloseHandle(hFileB);
+	CloseHandle(hFileA);
+	return result;
+}
+
+/**
+ * Creates a hard link to an existing file beside the given path under a name nothing else uses, in the manner of
+ * GetTempFileName.
+ */
+DWORD CreateTempHardLink(LPCTSTR Path, LPCTSTR ExistingPath, tstring& TempPath)
+{
+	DWORD Unique = GetTickCount() ^ (GetCurrentThreadId() << 16);
+	for (int i = 0; i < MAX_TEMP_LINK_ATTEMPTS; i++)
+	{
+		TCHAR Suffix[32];
+		StringCchPrintf(Suffix, ARRAYSIZE(Suffix), TEXT(".%08lx.lnktmp"), Unique + i);
+		TempPath = Path;
+		TempPath += Suffix;
+
+		if (CreateHardLink(TempPath.c_str(), ExistingPath, NULL))
+		{
+			return 0;
+		}
+
+		DWORD result = GetLastError();
+		if (result != ERROR_ALREADY_EXISTS && result != ERROR_FILE_EXISTS)
+		{
+			return result;
+		}
+	}
+
+	return ERROR_FILE_EXISTS;
+}
+
+/**
+ * Creates the missing parent directories of a destination path, from those of the source if its path is given.
+ */
+DWORD CreateMissingParents(DestinationCache& Cache, LPCTSTR TemplatePath, LPCTSTR Path)
+{
+	return TemplatePath != NULL ? Cache.EnsureParentDirectories(TemplatePath, Path) : CreateParentDirectories(Path);
+}
+
+} // namespace
+
+DWORDLONG DestinationCache::HashPath(LPCTSTR Path, size_t Length)
+{
+	// Paths that only differ by case or by a trailing separator name the same directory
+	while (Length > 0 && Path[Length - 1] == '\\')
+	{
+		Length--;
+	}
+
+	// FNV-1a
+	DWORDLONG Hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < Length; i++)
+	{
+		Hash ^= UpcaseChar(Path[i]);
+		Hash *= 1099511628211ULL;
+	}
+
+	return Hash;
+}
+
+void DestinationCache::MarkEmpty(LPCTSTR DirPath)
+{
+	DWORDLONG Hash = HashPath(DirPath, _tcslen(DirPath));
+
+	EnterCriticalSection(&Lock);
+	EmptyDirs.insert(Hash);
+	LeaveCriticalSection(&Lock);
+}
+
+void DestinationCache::Clear()
+{
+	EnterCriticalSection(&Lock);
+	EmptyDirs.clear();
+	LeaveCriticalSection(&Lock);
+}
+
+DWORD DestinationCache::EnsureDirectory(LPCTSTR TemplatePath, LPCTSTR DirPath)
+{
+	// Creating the directory straight away saves probing for it first
+	if (CreateDirectoryEx(TemplatePath, DirPath, NULL))
+	{
+		MarkEmpty(DirPath);
+		return 0;
+	}
+
+	DWORD result = GetLastError();
+	return result == ERROR_ALREADY_EXISTS ? 0 : result;
+}
+
+DWORD DestinationCache::EnsureParentDirectories(LPCTSTR TemplatePath, LPCTSTR Path)
+{
+	// Climb up both paths until a parent can be created or already exists, remembering the ones that were missing
+	tstring Template = TemplatePath;
+	tstring Parent = Path;
+	std::vector<std::pair<tstring, tstring> > Missing;
+	for (;;)
+	{
+		size_t Separator = Parent.find_last_of('\\');
+		if (Separator == tstring::npos || Separator == 0)
+		{
+			return ERROR_PATH_NOT_FOUND;
+		}
+		Parent.resize(Separator);
+
+		// The source may run out of parents before the destination does
+		size_t TemplateSeparator = Template.find_last_of('\\');
+		Template.resize(TemplateSeparator == tstring::npos ? 0 : TemplateSeparator);
+
+		DWORD result = CreateFromTemplate(Template, Parent);
+		if (result == 0 || result == ERROR_ALREADY_EXISTS)
+		{
+			break;
+		}
+		else if (result != ERROR_PATH_NOT_FOUND)
+		{
+			return result;
+		}
+
+		Missing.push_back(std::make_pair(Template, Parent));
+	}
+
+	// Then create the missing directories on the way back down
+	for (size_t i = Missing.size(); i > 0; i--)
+	{
+		DWORD result = CreateFromTemplate(Missing[i - 1].first, Missing[i - 1].second);
+		if (result != 0 && result != ERROR_ALREADY_EXISTS)
+		{
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+DWORD DestinationCache::CreateFromTemplate(const tstring& TemplatePath, const tstring& DirPath)
+{
+	BOOL bCreated = FALSE;
+	DWORD result = ERROR_PATH_NOT_FOUND;
+	if (!TemplatePath.empty())
+	{
+		bCreated = CreateDirectoryEx(TemplatePath.c_str(), DirPath.c_str(), NULL);
+		result = bCreated ? 0 : GetLastError();
+	}
+
+	// Above the source tree the template may be a volume root, which can't serve as one
+	if (!bCreated && (TemplatePath.empty() || (result != ERROR_PATH_NOT_FOUND && result != ERROR_ALREADY_EXISTS)))
+	{
+		bCreated = CreateDirectory(DirPath.c_str(), NULL);
+		result = bCreated ? 0 : GetLastError();
+	}
+
+	if (bCreated)
+	{
+		MarkEmpty(DirPath.c_str());
+	}
+
+	return result;
+}
+
+bool DestinationCache::IsInEmptyDirectory(LPCTSTR Path) const
+{
+	LPCTSTR Separator = _tcsrchr(Path, '\\');
+	if (Separator == NULL)
+	{
+		return false;
+	}
+
+	DWORDLONG Hash = HashPath(Path, Separator - Path);
+
+	EnterCriticalSection(&Lock);
+	bool bEmpty = EmptyDirs.find(Hash) != EmptyDirs.end();
+	LeaveCriticalSection(&Lock);
+
+	return bEmpty;
+}
+
+DWORD CreateDestinationLink(DestinationCache& Cache, LPCTSTR DestPath, DWORD ReparseTag, LPCTSTR TargetPath,
+	bool bDirectory, LPCTSTR TemplatePath)
+{
+	LinkRequest Request;
+	Request.Path = DestPath;
+	Request.ReparseTag = ReparseTag;
+	Request.Target = TargetPath;
+	Request.bDirectory = bDirectory;
+	return CreateDestinationLink(Cache, Request, TemplatePath);
+}
+
+DWORD CreateDestinationLink(DestinationCache& Cache, const LinkRequest& Request, LPCTSTR TemplatePath)
+{
+	// Delete any existing link at the destination, unless there can't be one
+	bool bEmpty = Cache.IsInEmptyDirectory(Request.Path);
+	DWORD result = bEmpty ? 0 : RemoveExistingLink(Request.Path);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	result = CreateReparsePoint(Request);
+	if (result == ERROR_PATH_NOT_FOUND && CreateMissingParents(Cache, TemplatePath, Request.Path) == 0)
+	{
+		result = CreateReparsePoint(Request);
+	}
+	else if (bEmpty && (result == ERROR_ALREADY_EXISTS || result == ERROR_FILE_EXISTS))
+	{
+		// Something got there after all, replace it the usual way
+		result = RemoveExistingLink(Request.Path);
+		if (result == 0)
+		{
+			result = CreateReparsePoint(Request);
+		}
+	}
+
+	return result;
+}
+
+DWORD CreateDestinationMountPoint(DestinationCache& Cache, LPCTSTR DestPath, LPCTSTR VolumeName,
+	LPCTSTR TemplatePath)
+{
+	// Delete any existing link at the destination, unless there can't be one
+	bool bEmpty = Cache.IsInEmptyDirectory(DestPath);
+	DWORD result = bEmpty ? 0 : RemoveExistingLink(DestPath);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	result = CreateVolumeMountPoint(DestPath, VolumeName);
+	if (result == ERROR_PATH_NOT_FOUND && CreateMissingParents(Cache, TemplatePath, DestPath) == 0)
+	{
+		result = CreateVolumeMountPoint(DestPath, VolumeName);
+	}
+	else if (bEmpty && result == ERROR_ALREADY_EXISTS)
+	{
+		// Something got there after all, replace it the usual way
+		result = RemoveExistingLink(DestPath);
+		if (result == 0)
+		{
+			result = CreateVolumeMountPoint(DestPath, VolumeName);
+		}
+	}
+
+	return result;
+}
+
+DWORD CreateDestinationHardLink(LPCTSTR DestPath, LPCTSTR ExistingPath)
+{
+	DWORD result = CreateHardLink(DestPath, ExistingPath, NULL) ? 0 : GetLastError();
+	if (result == ERROR_PATH_NOT_FOUND && CreateParentDirectories(DestPath) == 0)
+	{
+		result = CreateHardLink(DestPath, ExistingPath, NULL) ? 0 : GetLastError();
+	}
+
+	if (result != ERROR_ALREADY_EXISTS)
+	{
+		return result;
+	}
+
+	BY_HANDLE_FILE_INFORMATION DestInfo;
+	BY_HANDLE_FILE_INFORMATION ExistingInfo;
+	result = GetFileInformation(DestPath, DestInfo);
+	if (result == 0)
+	{
+		result = GetFileInformation(ExistingPath, ExistingInfo);
+	}
+
+	if (result != 0)
+	{
+		return result;
+	}
+
+	if (IsSameFile(DestInfo, ExistingInfo))
+	{
+		// Linked by an earlier run
+		return 0;
+	}
+
+	// Only a copy of the same contents is replaced, anything else at the destination is left alone. The size and last
+	// write time rule out most other files before their contents are read
+	if ((DestInfo.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) != 0 ||
+		DestInfo.nFileSizeHigh != ExistingInfo.nFileSizeHigh || DestInfo.nFileSizeLow != ExistingInfo.nFileSizeLow ||
+		CompareFileTime(&DestInfo.ftLastWriteTime, &ExistingInfo.ftLastWriteTime) != 0)
+	{
+		return ERROR_FILE_EXISTS;
+	}
+
+	bool bSame = false;
+	result = IsSameContent(DestPath, ExistingPath, bSame);
+	if (result != 0)
+	{
+		return result;
+	}
+	else if (!bSame)
+	{
+		return ERROR_FILE_EXISTS;
+	}
+
+	// Link beside the copy first so that the destination is never missing
+	tstring TempPath;
+	result = CreateTempHardLink(DestPath, ExistingPath, TempPath);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	if (!MoveFileEx(TempPath.c_str(), DestPath, MOVEFILE_REPLACE_EXISTING))
+	{
+		result = GetLastError();
+		DeleteFile(TempPath.c_str());
+	}
+
+	return result;
+}
+
+DWORD GetFileInformation(LPCTSTR Path, BY_HANDLE_FILE_INFORMATION& Info)
+{
+	HANDLE hFile = CreateFile(Path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	DWORD result = GetFileInformationByHandle(hFile, &Info) ? 0 : GetLastError();
+	CloseHandle(hFile);
+	return result;
+}
+
+void CreateDestinationLinks(DestinationCache& Cache, LinkRequest* Requests, size_t NumRequests,
+	const LPCTSTR* TemplatePaths)
+{
+	// Clear the way for the links that may replace an existing one, the others go straight into the batch
+	std::vector<LinkRequest> Batch;
+	std::vector<size_t> BatchIdx;
+	Batch.reserve(NumRequests);
+	BatchIdx.reserve(NumRequests);
+	for (size_t i = 0; i < NumRequests; i++)
+	{
+		Requests[i].Result = Cache.IsInEmptyDirectory(Requests[i].Path) ? 0 : RemoveExistingLink(Requests[i].Path);
+		if (Requests[i].Result == 0)
+		{
+			Batch.push_back(Requests[i]);
+			BatchIdx.push_back(i);
+		}
+	}
+
+	if (!Batch.empty())
+	{
+		CreateReparsePoints(&Batch[0], Batch.size());
+	}
+
+	for (size_t i = 0; i < Batch.size(); i++)
+	{
+		LinkRequest& Request = Requests[BatchIdx[i]];
+		Request.Result = Batch[i].Result;
+		if (Request.Result == ERROR_PATH_NOT_FOUND || Request.Result == ERROR_ALREADY_EXISTS ||
+			Request.Result == ERROR_FILE_EXISTS)
+		{
+			Request.Result = CreateDestinationLink(Cache, Request,
+				TemplatePaths != NULL ? TemplatePaths[BatchIdx[i]] : NULL);
+		}
+	}
+}
+
+DWORD RenameDestinationLink(const DestinationCache& Cache, HANDLE hLink, LPCTSTR DestPath)
+{
+	// Delete any existing link at the destination, unless there can't be one
+	bool bEmpty = Cache.IsInEmptyDirectory(DestPath);
+	DWORD result = bEmpty ? 0 : RemoveExistingLink(DestPath);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	result = RenameReparsePoint(hLink, DestPath);
+	if (result == ERROR_PATH_NOT_FOUND && CreateParentDirectories(DestPath) == 0)
+	{
+		result = RenameReparsePoint(hLink, DestPath);
+	}
+	else if (bEmpty && (result == ERROR_ALREADY_EXISTS || result == ERROR_FILE_EXISTS))
+	{
+		// Something got there after all, replace it the usual way
+		result = RemoveExistingLink(DestPath);
+		if (result == 0)
+		{
+			result = RenameReparsePoint(hLink, DestPath);
+		}
+	}
+
+	return result;
+}
+
+DWORD IsDirectoryEmpty(LPCTSTR DirPath, bool& bEmpty)
+{
+	bEmpty = true;
+
+	// Only the first entry is needed
+	DirectoryEnumerator Enumerator(ENUMERATE_FIND_FILE_EX);
+	DWORD result = Enumerator.Open(DirPath);
+	if (result == ERROR_FILE_NOT_FOUND || result == ERROR_PATH_NOT_FOUND)
+	{
+		return 0;
+	}
+
+	DirectoryEntry Entry;
+	if (result == 0)
+	{
+		result = Enumerator.Next(Entry);
+		bEmpty = result == ERROR_NO_MORE_FILES;
+		if (result == ERROR_NO_MORE_FILES)
+		{
+			result = 0;
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,254 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "DirectoryEnumerator.h"
+#include "RunMetrics.h"
+
+namespace
+{
+
+/**
+ * Returns true for the '.' and '..' entries of a directory listing.
+ */
+bool IsDotEntry(LPCWSTR Name, size_t NameLength)
+{
+	return (NameLength == 1 && Name[0] == '.') || (NameLength == 2 && Name[0] == '.' && Name[1] == '.');
+}
+
+} // namespace
+
+DirectoryEnumerator::DirectoryEnumerator(EnumerateMethod InMethod, DWORD BufferSize)
+	: Method(InMethod)
+	, PathLength(0)
+	, bBasicUnsupported(false)
+	, hFind(INVALID_HANDLE_VALUE)
+	, bPending(false)
+	, hDirectory(INVALID_HANDLE_VALUE)
+	, Buffer((BufferSize + sizeof(LONGLONG) - 1) / sizeof(LONGLONG))
+	, NextOffset(-1)
+	, Name(MAX_PATH)
+{
+#ifndef UNICODE
+	// The names returned by GetFileInformationByHandleEx are always wide
+	if (Method == ENUMERATE_FILE_INFORMATION)
+	{
+		Method = ENUMERATE_FIND_FILE_EX;
+	}
+#endif
+}
+
+DirectoryEnumerator::~DirectoryEnumerator()
+{
+	Close();
+}
+
+DWORD DirectoryEnumerator::Open(LPCTSTR Directory)
+{
+	Close();
+
+	PathLength = (DWORD)_tcslen(Directory);
+	MetricTimer Timer(MetricEnumerate, PathLength);
+
+	if (Method == ENUMERATE_FILE_INFORMATION)
+	{
+		DWORD result = OpenHandle(Directory);
+
+		// Filesystems and redirectors that don't support the information class are read through FindFirstFileEx
+		if (result != ERROR_INVALID_PARAMETER && result != ERROR_INVALID_FUNCTION && result != ERROR_NOT_SUPPORTED)
+		{
+			return Timer.SetResult(result);
+		}
+
+		Close();
+	}
+
+	return Timer.SetResult(OpenFind(Directory, Method != ENUMERATE_FIND_FILE));
+}
+
+DWORD DirectoryEnumerator::OpenFind(LPCTSTR Directory, bool bBasic)
+{
+	// The search path must include '\*'
+	SearchPath.Assign(Directory, _tcslen(Directory));
+	SearchPath.Push(TEXT("*"));
+
+	if (bBasic && !bBasicUnsupported)
+	{
+		hFind = FindFirstFileEx(SearchPath.c_str(), FindExInfoBasic, &FindData, FindExSearchNameMatch, NULL,
+			FIND_FIRST_EX_LARGE_FETCH);
+		if (hFind == INVALID_HANDLE_VALUE && GetLastError() == ERROR_INVALID_PARAMETER)
+		{
+			// Neither the basic information level nor large fetches exist before Windows 7
+			bBasicUnsupported = true;
+		}
+	}
+
+	if (hFind == INVALID_HANDLE_VALUE && (!bBasic || bBasicUnsupported))
+	{
+		hFind = FindFirstFileEx(SearchPath.c_str(), FindExInfoStandard, &FindData, FindExSearchNameMatch, NULL, 0);
+	}
+
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	bPending = true;
+	return 0;
+}
+
+DWORD DirectoryEnumerator::OpenHandle(LPCTSTR Directory)
+{
+	hDirectory = CreateFile(Directory, FILE_LIST_DIRECTORY | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (hDirectory == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	// Fill the buffer right away so that unsupported filesystems are detected while a fallback is still possible
+	if (!GetFileInformationByHandleEx(hDirectory, FileIdBothDirectoryInfo, &Buffer[0],
+		(DWORD)(Buffer.size() * sizeof(LONGLONG))))
+	{
+		DWORD result = GetLastError();
+		if (result != ERROR_NO_MORE_FILES)
+		{
+			return result;
+		}
+	}
+	else
+	{
+		NextOffset = 0;
+	}
+
+	return 0;
+}
+
+DWORD DirectoryEnumerator::Next(DirectoryEntry& Entry)
+{
+	if (hDirectory != INVALID_HANDLE_VALUE)
+	{
+		return NextHandle(Entry);
+	}
+	else if (hFind != INVALID_HANDLE_VALUE)
+	{
+		return NextFind(Entry);
+	}
+
+	return ERROR_NO_MORE_FILES;
+}
+
+DWORD DirectoryEnumerator::NextFind(DirectoryEntry& Entry)
+{
+	for (;;)
+	{
+		if (!bPending)
+		{
+			MetricTimer Timer(MetricEnumerate, PathLength);
+			if (!FindNextFile(hFind, &FindData))
+			{
+				return Timer.SetResult(GetLastError());
+			}
+		}
+		bPending = false;
+
+		// Ignore the '.' and '..' entries
+		if (FindData.cFileName[0] == 0 ||
+			(FindData.cFileName[0] == '.' && FindData.cFileName[1] == 0) ||
+			(FindData.cFileName[0] == '.' && FindData.cFileName[1] == '.' && FindData.cFileName[2] == 0))
+		{
+			continue;
+		}
+
+		// The reparse tag is reported in dwReserved0 for reparse points
+		Entry.Name = FindData.cFileName;
+		Entry.Attributes = FindData.dwFileAttributes;
+		Entry.ReparseTag = (FindData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ? FindData.dwReserved0 : 0;
+		return 0;
+	}
+}
+
+DWORD DirectoryEnumerator::NextHandle(DirectoryEntry& Entry)
+{
+	for (;;)
+	{
+		if (NextOffset < 0)
+		{
+			MetricTimer Timer(MetricEnumerate, PathLength);
+			if (!GetFileInformationByHandleEx(hDirectory, FileIdBothDirectoryInfo, &Buffer[0],
+				(DWORD)(Buffer.size() * sizeof(LONGLONG))))
+			{
+				return Timer.SetResult(GetLastError());
+			}
+			NextOffset = 0;
+		}
+
+		FILE_ID_BOTH_DIR_INFO* Info = (FILE_ID_BOTH_DIR_INFO*)((BYTE*)&Buffer[0] + NextOffset);
+		NextOffset = Info->NextEntryOffset != 0 ? NextOffset + (LONG)Info->NextEntryOffset : -1;
+
+		size_t NameLength = Info->FileNameLength / sizeof(WCHAR);
+		if (NameLength == 0 || IsDotEntry(Info->FileName, NameLength))
+		{
+			continue;
+		}
+
+		// The names in the buffer aren't null-terminated
+		if (NameLength + 1 > Name.size())
+		{
+			Name.resize(NameLength + 1);
+		}
+		memcpy(&Name[0], Info->FileName, NameLength * sizeof(WCHAR));
+		Name[NameLength] = 0;
+
+		// The filesystem reports the reparse tag in place of the extended attribute size for reparse points
+		Entry.Name = (LPCTSTR)&Name[0];
+		Entry.Attributes = Info->FileAttributes;
+		Entry.ReparseTag = (Info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ? Info->EaSize : 0;
+		return 0;
+	}
+}
+
+void DirectoryEnumerator::Close()
+{
+	if (hFind != INVALID_HANDLE_VALUE)
+	{
+		FindClose(hFind);
+		hFind = INVALID_HANDLE_VALUE;
+	}
+
+	if (hDirectory != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hDirectory);
+		hDirectory = INVALID_HANDLE_VALUE;
+	}
+
+	bPending = false;
+	NextOffset = -1;
+}
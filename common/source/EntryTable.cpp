@@ -0,0 +1,145 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "EntryTable.h"
+
+size_t StringPool::IdHash::operator()(DWORD Id) const
+{
+	// FNV-1a over the characters of the string
+	size_t Hash = 2166136261U;
+	for (LPCTSTR Str = &(*Chars)[Id]; *Str != 0; Str++)
+	{
+		Hash = (Hash ^ (size_t)*Str) * 16777619U;
+	}
+
+	return Hash;
+}
+
+StringPool::StringPool()
+	: Ids(0, IdHash(&Chars), IdEqual(&Chars))
+{
+}
+
+DWORD StringPool::Intern(LPCTSTR Str, size_t Length)
+{
+	// Add the string up front so that it can be looked up by its offset, then take it back out if it was there already
+	DWORD Id = (DWORD)Chars.size();
+	Chars.insert(Chars.end(), Str, Str + Length);
+	Chars.push_back(0);
+
+	std::pair<std::unordered_set<DWORD, IdHash, IdEqual>::iterator, bool> Inserted = Ids.insert(Id);
+	if (!Inserted.second)
+	{
+		Chars.resize(Id);
+		return *Inserted.first;
+	}
+
+	return Id;
+}
+
+DWORD EntryTable::AddEntry(DWORD Parent, LPCTSTR Name, size_t NameLength, DWORD InAttributes, DWORD ReparseTag,
+	LPCTSTR Target)
+{
+	DWORD NameId = Strings.Intern(Name, NameLength);
+	DWORD TargetId = Target != NULL ? Strings.Intern(Target, _tcslen(Target)) : ENTRY_TABLE_NONE;
+
+	DWORDLONG Key = ((DWORDLONG)Parent << 32) | NameId;
+	std::unordered_map<DWORDLONG, DWORD>::const_iterator it = Children.find(Key);
+	if (it != Children.end())
+	{
+		Attributes[it->second] = InAttributes;
+		ReparseTags[it->second] = ReparseTag;
+		Targets[it->second] = TargetId;
+		return it->second;
+	}
+
+	DWORD Index = (DWORD)Parents.size();
+	Parents.push_back(Parent);
+	Names.push_back(NameId);
+	Attributes.push_back(InAttributes);
+	ReparseTags.push_back(ReparseTag);
+	Targets.push_back(TargetId);
+	Children[Key] = Index;
+	return Index;
+}
+
+DWORD EntryTable::AddPath(LPCTSTR Path, DWORD InAttributes, DWORD ReparseTag, LPCTSTR Target)
+{
+	DWORD Parent = ENTRY_TABLE_NONE;
+	LPCTSTR Component = Path;
+	for (LPCTSTR Separator = _tcschr(Component, '\\'); Separator != NULL; Separator = _tcschr(Component, '\\'))
+	{
+		// The directories leading to the entry are looked up before being added, so that they keep what they were
+		// added with
+		DWORD NameId = Strings.Intern(Component, Separator - Component);
+		DWORDLONG Key = ((DWORDLONG)Parent << 32) | NameId;
+		std::unordered_map<DWORDLONG, DWORD>::const_iterator it = Children.find(Key);
+		if (it != Children.end())
+		{
+			Parent = it->second;
+		}
+		else
+		{
+			Parent = AddEntry(Parent, Component, Separator - Component, FILE_ATTRIBUTE_DIRECTORY, 0, NULL);
+		}
+
+		Component = Separator + 1;
+	}
+
+	return AddEntry(Parent, Component, _tcslen(Component), InAttributes, ReparseTag, Target);
+}
+
+LPCTSTR EntryTable::GetPath(DWORD Index, StringArena& Arena) const
+{
+	// Measure the path first so that it can be written from its end in a single allocation
+	size_t Length = 0;
+	for (DWORD i = Index; i != ENTRY_TABLE_NONE; i = Parents[i])
+	{
+		Length += _tcslen(Strings.Get(Names[i])) + (Parents[i] != ENTRY_TABLE_NONE ? 1 : 0);
+	}
+
+	LPTSTR Path = Arena.Allocate(Length + 1);
+	Path[Length] = 0;
+	for (DWORD i = Index; i != ENTRY_TABLE_NONE; i = Parents[i])
+	{
+		LPCTSTR Name = Strings.Get(Names[i]);
+		size_t NameLength = _tcslen(Name);
+		Length -= NameLength;
+		memcpy(&Path[Length], Name, NameLength * sizeof(TCHAR));
+
+		if (Parents[i] != ENTRY_TABLE_NONE)
+		{
+			Path[--Length] = '\\';
+		}
+	}
+
+	return Path;
+}
@@ -0,0 +1,343 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "ApplyJournal.h"
+#include "ErrorMessage.h"
+#include "FixLinks.h"
+#include "LinkTrace.h"
+#include "ReparsePoint.h"
+#include "StringMatch.h"
+
+namespace
+{
+
+/**
+ * Returns the change to a link read by the completion port, without its new target.
+ */
+LinkOp GetAsyncOp(const AsyncLink& Link)
+{
+	LinkOp Op;
+	Op.ReparseTag = Link.Info.ReparseTag;
+	Op.Attributes = Link.Attributes;
+	Op.Path = Link.Path.c_str();
+	Op.OldTarget = Link.Target;
+	return Op;
+}
+
+} // namespace
+
+LinkFixer::LinkFixer(const FixLinkOptions& InOptions, FixLinkStats& InStats, const RebaseMap& InRules,
+	ManifestWriter* InPlan)
+	: Options(InOptions)
+	, Stats(InStats)
+	, Rules(InRules)
+	, Plan(InPlan)
+{
+}
+
+bool LinkFixer::IsFixableLink(LPCTSTR Path, DWORD ReparseTag)
+{
+	// Is this a junction or a symlink?
+	if (ReparseTag != IO_REPARSE_TAG_MOUNT_POINT && ReparseTag != IO_REPARSE_TAG_SYMLINK)
+	{
+		_tprintf(TEXT("Unrecognized reparse point: %s\n"), GetDisplayPath(Path));
+		Stats.NumSkipped++;
+		return false;
+	}
+
+	return true;
+}
+
+void LinkFixer::SkipChangedLink(LPCTSTR Path)
+{
+	_tprintf(TEXT("Changed since the plan was made: %s\n"), GetDisplayPath(Path));
+	Stats.NumSkipped++;
+}
+
+LPCTSTR LinkFixer::RebaseTarget(LPCTSTR Target, StringArena& Arena) const
+{
+	// The links left untouched are traced with ERROR_NOT_FOUND
+	TraceTimer Trace(TraceRebase, Target);
+	if (Options.RebaseMapPath[0] != 0)
+	{
+		// Rebase the target with the longest matching rule, leaving links no rule matches untouched
+		LPCTSTR NewTarget = Rules.Apply(Target, Arena);
+		if (NewTarget == NULL)
+		{
+			Trace.SetResult(ERROR_NOT_FOUND);
+		}
+		return NewTarget;
+	}
+
+	// Links whose target doesn't contain the old base are left untouched, which spares them being written back as is
+	size_t TargetLength = _tcslen(Target);
+	size_t OldBaseLength = _tcslen(Options.OldTargetBase);
+	if (StrFindNoCase(Target, TargetLength, Options.OldTargetBase, OldBaseLength, -1) < 0)
+	{
+		Trace.SetResult(ERROR_NOT_FOUND);
+		return NULL;
+	}
+
+	// Perform a string replace on the target path
+	// The replacement is made at most once so the result never grows by more than the new base
+	size_t NewBaseLength = _tcslen(Options.NewTargetBase);
+	LPTSTR NewTarget = Arena.Allocate(TargetLength + NewBaseLength + 1);
+	StrReplaceNoCase(Target, TargetLength, Options.OldTargetBase, OldBaseLength, Options.NewTargetBase, NewBaseLength,
+		NewTarget, -1);
+	return NewTarget;
+}
+
+DWORD LinkFixer::PlanFix(HANDLE hLink, LinkOp& Op, StringArena& Arena) const
+{
+	// Retrieve the existing target
+	DWORD result = ReadLinkTarget(hLink, Op.ReparseTag, Op.OldTarget, Arena);
+	if (result == 0)
+	{
+		Op.NewTarget = RebaseTarget(Op.OldTarget, Arena);
+	}
+
+	return result;
+}
+
+bool LinkFixer::IsBrokenTarget(const LinkOp& Op)
+{
+	if (!Options.bVerify)
+	{
+		return false;
+	}
+
+	bool bBroken = false;
+	DWORD result = VerifyLinkTarget(Targets, Op.Path, Op.ReparseTag, (Op.Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
+		Op.NewTarget, bBroken);
+	if (result != 0)
+	{
+		PrintErrorMessage(result, Op.NewTarget);
+		Stats.NumFailed++;
+		return true;
+	}
+
+	if (bBroken)
+	{
+		_tprintf(TEXT("Broken target: %s -> %s\n"), GetDisplayPath(Op.Path), Op.NewTarget);
+		Stats.NumBroken++;
+	}
+
+	return bBroken;
+}
+
+bool LinkFixer::ShouldFixLink(const LinkOp& Op)
+{
+	if (Op.NewTarget == NULL)
+	{
+		Stats.NumSkipped++;
+		return false;
+	}
+
+	// Links that would point at nothing are left as they are
+	if (_tcscmp(Op.NewTarget, Op.OldTarget) != 0 && IsBrokenTarget(Op))
+	{
+		return false;
+	}
+
+	if (Plan == NULL)
+	{
+		return true;
+	}
+
+	// Links that keep their target have nothing to apply
+	if (_tcscmp(Op.NewTarget, Op.OldTarget) == 0)
+	{
+		Stats.NumSkipped++;
+	}
+	else
+	{
+		Plan->Write(Op);
+
+		if (Options.bVerbose)
+		{
+			_tprintf(TEXT("%s %s target planned. old=%s, new=%s\n"),
+				Op.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT ? TEXT("junction") : TEXT("symlink"),
+				GetDisplayPath(Op.Path), Op.OldTarget, Op.NewTarget);
+		}
+	}
+
+	return false;
+}
+
+void LinkFixer::CountFixedLink(const LinkOp& Op)
+{
+	Stats.NumModified++;
+
+	if (Options.bVerbose)
+	{
+		_tprintf(TEXT("%s %s target modified. old=%s, new=%s\n"),
+			Op.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT ? TEXT("junction") : TEXT("symlink"),
+			GetDisplayPath(Op.Path), Op.OldTarget, Op.NewTarget);
+	}
+}
+
+DWORD LinkFixer::FixLink(HANDLE hLink, const LinkOp& Op)
+{
+	// Write the reparse data for the new target
+	DWORD result = RetargetReparsePoint(hLink, Op.ReparseTag, Op.NewTarget, Options.bInPlace);
+	if (result == 0)
+	{
+		CountFixedLink(Op);
+	}
+
+	return result;
+}
+
+DWORD FixLinkAction::OnReparsePoint(const WalkEntry& Entry)
+{
+	if (!Fixer.IsFixableLink(Entry.Path, Entry.ReparseTag))
+	{
+		return 0;
+	}
+
+	// Open the link once and use the same handle to read the existing target and write the new one. A plan only
+	// reads it.
+	DWORD DesiredAccess = Fixer.IsPlanning() ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+	if (AsyncLinks != NULL)
+	{
+		return AsyncLinks->Submit(Entry.Path, Entry.Attributes, DesiredAccess);
+	}
+
+	LinkOp Op;
+	Op.Attributes = Entry.Attributes;
+	Op.Path = Entry.Path;
+
+	HANDLE hLink = OpenReparsePoint(Op.Path, DesiredAccess);
+	if (hLink == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	DWORD result = Fixer.PlanFix(hLink, Op, *Entry.Arena);
+	if (result == 0 && Fixer.ShouldFixLink(Op))
+	{
+		result = Fixer.FixLink(hLink, Op);
+	}
+
+	CloseHandle(hLink);
+	return result;
+}
+
+DWORD FixLinkAsyncAction::OnReadLink(AsyncLink& Link)
+{
+	// The link may have been replaced by another kind of reparse point since it was discovered
+	if (!Fixer.IsFixableLink(Link.Path.c_str(), Link.Info.ReparseTag))
+	{
+		return 0;
+	}
+
+	LinkOp Op = GetAsyncOp(Link);
+	Op.NewTarget = Fixer.RebaseTarget(Op.OldTarget, Link.Arena);
+	if (Fixer.ShouldFixLink(Op))
+	{
+		Link.NewTarget = Op.NewTarget;
+	}
+
+	return 0;
+}
+
+void FixLinkAsyncAction::OnLinkWritten(const AsyncLink& Link)
+{
+	LinkOp Op = GetAsyncOp(Link);
+	Op.NewTarget = Link.NewTarget;
+	Fixer.CountFixedLink(Op);
+}
+
+DWORD FixApplyAction::OnLinkOp(const LinkOp& Op, StringArena& Arena)
+{
+	HANDLE hLink = OpenReparsePoint(Op.Path, GENERIC_READ | GENERIC_WRITE);
+	if (hLink == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	bool bUnchanged = false;
+	DWORD result = CheckPlannedTarget(hLink, Op, Arena, bUnchanged);
+	if (result == 0 && !bUnchanged)
+	{
+		Fixer.SkipChangedLink(Op.Path);
+	}
+	else if (result == 0 && !Fixer.IsBrokenTarget(Op))
+	{
+		result = Fixer.FixLink(hLink, Op);
+	}
+
+	CloseHandle(hLink);
+	return result;
+}
+
+DWORD FixApplyAction::OnResumeLinkOp(const LinkOp& Op, StringArena& Arena)
+{
+	HANDLE hLink = OpenReparsePoint(Op.Path, GENERIC_READ | GENERIC_WRITE);
+	if (hLink == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	LinkOpProgress Progress = LINK_OP_CHANGED;
+	DWORD result = GetLinkOpProgress(hLink, Op, Arena, Progress);
+	if (result != 0)
+	{
+		// The link couldn't be read
+	}
+	else if (Progress == LINK_OP_PLANNED)
+	{
+		if (!Fixer.IsBrokenTarget(Op))
+		{
+			result = Fixer.FixLink(hLink, Op);
+		}
+	}
+	else if (Progress == LINK_OP_NO_REPARSE_DATA)
+	{
+		// /NOINPLACE got as far as deleting the old reparse data, which leaves an ordinary file or directory
+		result = SetReparsePoint(hLink, Op.ReparseTag, Op.NewTarget);
+		if (result == 0)
+		{
+			Fixer.CountFixedLink(Op);
+		}
+	}
+	else if (Progress == LINK_OP_DONE)
+	{
+		Fixer.CountFixedLink(Op);
+	}
+	else
+	{
+		Fixer.SkipChangedLink(Op.Path);
+	}
+
+	CloseHandle(hLink);
+	return result;
+}
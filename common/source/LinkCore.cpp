@@ -0,0 +1,340 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <strsafe.h>
+
+#include "ErrorMessage.h"
+#include "LinkCore.h"
+#include "LinkTrace.h"
+#include "ReparsePoint.h"
+#include "RootScheduler.h"
+#include "RunMetrics.h"
+#include "StringMatch.h"
+#include "StringUtils.h"
+
+namespace
+{
+
+/**
+ * Runs the job of each root handed out by the scheduler.
+ */
+class LinkJobRootAction : public RootAction
+{
+public:
+	LinkJobRootAction(LinkJob* InJobs, const WalkOptions& InOptions, LinkStats& InStats)
+		: Jobs(InJobs)
+		, Options(InOptions)
+		, Stats(InStats)
+	{
+	}
+
+	virtual DWORD OnRoot(size_t Index, LPCTSTR Path)
+	{
+		UNREFERENCED_PARAMETER(Path);
+		return RunLinkJob(Jobs[Index], Options, Stats);
+	}
+
+private:
+	LinkJobRootAction(const LinkJobRootAction&);
+	LinkJobRootAction& operator=(const LinkJobRootAction&);
+
+	LinkJob* Jobs;
+	const WalkOptions& Options;
+	LinkStats& Stats;
+};
+
+} // namespace
+
+WalkOptions LinkToolOptions::GetWalkOptions() const
+{
+	WalkOptions walkOptions;
+	walkOptions.MaxDepth = MaxDepth;
+	walkOptions.NumThreads = NumThreads;
+	walkOptions.bFast = bFast;
+	walkOptions.bBreadthFirst = bBreadthFirst;
+	walkOptions.bAdaptive = bAdaptive;
+	walkOptions.IndexPath = IndexPath[0] != 0 ? IndexPath : NULL;
+	walkOptions.Filter = !Filter.IsEmpty() ? &Filter : NULL;
+	return walkOptions;
+}
+
+DWORD RemoveLinkAction::OnReparsePoint(const WalkEntry& Entry)
+{
+	// Is this a junction or a symlink?
+	if (Entry.ReparseTag != IO_REPARSE_TAG_MOUNT_POINT && Entry.ReparseTag != IO_REPARSE_TAG_SYMLINK)
+	{
+		_tprintf(TEXT("Unrecognized reparse point: %s\n"), GetDisplayPath(Entry.Path));
+		Stats.NumSkipped++;
+		return 0;
+	}
+
+	// Delete the link through the handle it was opened with
+	HANDLE hLink = OpenReparsePoint(Entry.Path, DELETE);
+	if (hLink == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	DWORD result = RemoveReparsePoint(hLink);
+	CloseHandle(hLink);
+	if (result == 0)
+	{
+		NumDeleted++;
+	}
+
+	return result;
+}
+
+bool ParseLinkToolOption(LPCTSTR Arg, LinkToolOptions& Options)
+{
+	if (StrFind(Arg, TEXT("/LEV")) >= 0 || StrFind(Arg, TEXT("/lev")) >= 0)
+	{
+		Options.MaxDepth = _ttoi(&Arg[5]);
+	}
+	else if (StrFind(Arg, TEXT("/MAXIOPS:")) >= 0 || StrFind(Arg, TEXT("/maxiops:")) >= 0)
+	{
+		int MaxIops = _ttoi(&Arg[9]);
+		Options.MaxIops = MaxIops > 0 ? (DWORD)MaxIops : 0;
+	}
+	else if (StrFind(Arg, TEXT("/ADAPT")) >= 0 || StrFind(Arg, TEXT("/adapt")) >= 0)
+	{
+		Options.bAdaptive = true;
+	}
+	else if (StrFind(Arg, TEXT("/MT")) >= 0 || StrFind(Arg, TEXT("/mt")) >= 0)
+	{
+		Options.NumThreads = ParseThreadCount(Arg);
+	}
+	else if (StrFind(Arg, TEXT("/BFS")) >= 0 || StrFind(Arg, TEXT("/bfs")) >= 0)
+	{
+		Options.bBreadthFirst = true;
+	}
+	else if (StrFind(Arg, TEXT("/FAST")) >= 0 || StrFind(Arg, TEXT("/fast")) >= 0)
+	{
+		Options.bFast = true;
+	}
+	else if (StrFind(Arg, TEXT("/INDEX:")) >= 0 || StrFind(Arg, TEXT("/index:")) >= 0)
+	{
+		StringCchCopy(Options.IndexPath, ARRAYSIZE(Options.IndexPath), &Arg[7]);
+	}
+	else if (StrFind(Arg, TEXT("/STATS")) >= 0 || StrFind(Arg, TEXT("/stats")) >= 0)
+	{
+		ParseStatsOption(Arg, Options.StatsInterval, Options.StatsPath, ARRAYSIZE(Options.StatsPath));
+	}
+	else if (StrFind(Arg, TEXT("/XD:")) >= 0 || StrFind(Arg, TEXT("/xd:")) >= 0)
+	{
+		// May be given once for each directory name or pattern to exclude
+		Options.Filter.ExcludeDirectory(&Arg[4]);
+	}
+	else if (StrFind(Arg, TEXT("/XJ")) >= 0 || StrFind(Arg, TEXT("/xj")) >= 0)
+	{
+		Options.Filter.ExcludeJunctions();
+	}
+	else if (StrFind(Arg, TEXT("/TYPE:")) >= 0 || StrFind(Arg, TEXT("/type:")) >= 0)
+	{
+		if (!Options.Filter.SetLinkTypes(&Arg[6]))
+		{
+			_tprintf(TEXT("Warning: Unrecognized link type in %s, the option is ignored.\n"), Arg);
+		}
+	}
+	else if (StrFind(Arg, TEXT("/V")) >= 0 || StrFind(Arg, TEXT("/v")) >= 0)
+	{
+		Options.bVerbose = true;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool ParseLinkCopyOption(LPCTSTR Arg, LinkCopyOptions& Options)
+{
+	if (StrFind(Arg, TEXT("/EMPTYDEST")) >= 0 || StrFind(Arg, TEXT("/emptydest")) >= 0)
+	{
+		Options.bEmptyDest = true;
+	}
+	else if (StrFind(Arg, TEXT("/RMAP:")) >= 0 || StrFind(Arg, TEXT("/rmap:")) >= 0)
+	{
+		StringCchCopy(Options.RebaseMapPath, ARRAYSIZE(Options.RebaseMapPath), &Arg[6]);
+	}
+	else
+	{
+		return ParseLinkToolOption(Arg, Options);
+	}
+
+	return true;
+}
+
+DWORD StartToolMetrics(const LinkToolOptions& Options, const LinkStats& Stats, const AtomicCounter& NumProcessed)
+{
+	StartOpControl(Options.MaxIops, Options.bAdaptive);
+
+	if (Options.StatsInterval == 0)
+	{
+		return 0;
+	}
+
+	DWORD result = StartMetrics(Options.StatsInterval, Options.StatsPath[0] != 0 ? Options.StatsPath : NULL, Stats,
+		NumProcessed);
+	if (result != 0)
+	{
+		_tprintf(TEXT("Error: Unable to write the statistics file %s.\n"), Options.StatsPath);
+	}
+
+	return result;
+}
+
+DWORD LoadRebaseRules(LPCTSTR Path, bool bVerbose, RebaseMap& Rules)
+{
+	DWORD result = Rules.Load(Path);
+	if (result != 0)
+	{
+		_tprintf(TEXT("Error: Unable to read the rebase map %s.\n"), Path);
+		return result;
+	}
+
+	if (bVerbose)
+	{
+		_tprintf(TEXT("Loaded %lu rebase rules.\n"), (ULONG)Rules.GetNumRules());
+	}
+
+	return 0;
+}
+
+DWORD ReadLinkTarget(HANDLE hLink, DWORD& ReparseTag, LPCTSTR& Target, StringArena& Arena)
+{
+	ReparsePointInfo Info;
+	DWORD result = QueryReparsePoint(hLink, Info);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	size_t TargetSize = GetReparsePointTargetSize(Info);
+	LPTSTR Buffer = Arena.Allocate(TargetSize);
+	result = GetReparsePointTarget(Info, Buffer, TargetSize);
+
+	ReparseTag = Info.ReparseTag;
+	Target = Buffer;
+	return result;
+}
+
+LPCTSTR RebaseLinkTarget(const LinkCopyOptions& Options, const RebaseMap& Rules, LPCTSTR Target, StringArena& Arena)
+{
+	TraceTimer Trace(TraceRebase, Target);
+
+	LPCTSTR MappedTarget = Rules.Apply(Target, Arena);
+	if (MappedTarget != NULL)
+	{
+		return MappedTarget;
+	}
+
+	if (Options.NewTargetBase[0] != 0 && Options.OldTargetBase[0] != 0)
+	{
+		// The replacement is made at most once so the result never grows by more than the new base
+		size_t TargetLength = _tcslen(Target);
+		size_t NewBaseLength = _tcslen(Options.NewTargetBase);
+		LPTSTR NewTarget = Arena.Allocate(TargetLength + NewBaseLength + 1);
+		StrReplaceNoCase(Target, TargetLength, Options.OldTargetBase, _tcslen(Options.OldTargetBase),
+			Options.NewTargetBase, NewBaseLength, NewTarget, -1);
+		return NewTarget;
+	}
+
+	// Traced apart from the targets that were rebased
+	Trace.SetResult(ERROR_NOT_FOUND);
+	return Target;
+}
+
+DWORD GetCopyPaths(LPCTSTR Src, LPCTSTR Dest, const LinkCopyOptions& Options, DestinationCache& DestDirs,
+	tstring& SrcPath, tstring& DestPath, LinkStats& Stats)
+{
+	// Expand the source to a full path. The extended-length syntax lifts the MAX_PATH limit for deep trees.
+	if (GetLongPath(Src, SrcPath) != 0)
+	{
+		Stats.NumFailed++;
+		_tprintf(TEXT("Invalid source path specified.\n"));
+		return 1;
+	}
+
+	// Expand the destination to a full path
+	if (GetLongPath(Dest, DestPath) != 0)
+	{
+		Stats.NumFailed++;
+		_tprintf(TEXT("Invalid destination path specified.\n"));
+		return 1;
+	}
+
+	// A destination asserted to be empty holds no links to replace
+	if (Options.bEmptyDest)
+	{
+		bool bEmpty = false;
+		DWORD result = IsDirectoryEmpty(DestPath.c_str(), bEmpty);
+		if (result != 0 || !bEmpty)
+		{
+			Stats.NumFailed++;
+			_tprintf(TEXT("Error: The destination %s is not empty.\n"), GetDisplayPath(DestPath.c_str()));
+			return 1;
+		}
+
+		DestDirs.MarkEmpty(DestPath.c_str());
+	}
+
+	return 0;
+}
+
+DWORD RunLinkJob(LinkJob& Job, const WalkOptions& Options, LinkStats& Stats)
+{
+	tstring RootPath;
+	Job.Result = GetLongPath(Job.Root, RootPath);
+	if (Job.Result != 0)
+	{
+		Stats.NumFailed++;
+		PrintErrorMessage(Job.Result, Job.Root);
+		return Job.Result;
+	}
+
+	Job.Result = WalkTree(RootPath.c_str(), *Job.Action, Options, Stats);
+	return Job.Result;
+}
+
+DWORD RunLinkJobs(LinkJob* Jobs, size_t NumJobs, const WalkOptions& Options, LinkStats& Stats)
+{
+	std::vector<LPCTSTR> Roots;
+	Roots.reserve(NumJobs);
+	for (size_t i = 0; i < NumJobs; i++)
+	{
+		Roots.push_back(Jobs[i].Root);
+	}
+
+	LinkJobRootAction Action(Jobs, Options, Stats);
+	return ScheduleRoots(Roots, Action, Options.IndexPath == NULL);
+}
@@ -0,0 +1,638 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <unordered_map>
+
+#include "ChangeJournal.h"
+#include "EntryTable.h"
+#include "ErrorMessage.h"
+#include "LinkIndex.h"
+#include "PathBuffer.h"
+
+namespace
+{
+
+/** The number of links a worker claims at a time when replaying an index. */
+#define LINK_INDEX_BATCH_SIZE 64
+
+/**
+ * Wraps the action of a live walk to record every link it is handed, so that the walk can be saved as an index.
+ */
+class IndexRecorder : public LinkAction
+{
+public:
+	IndexRecorder(LinkAction& InAction)
+		: Action(InAction)
+		, bComplete(true)
+	{
+		InitializeCriticalSection(&Lock);
+
+		// The root is always the first directory, its name is filled in when the index is saved
+		LinkIndexDirectory RootDir;
+		RootDir.Parent = LINK_INDEX_NO_PARENT;
+		RootDir.Name = 0;
+		RootDir.Depth = 0;
+		Directories.push_back(RootDir);
+	}
+
+	~IndexRecorder()
+	{
+		DeleteCriticalSection(&Lock);
+	}
+
+	virtual DWORD OnDirectory(const WalkEntry& Entry)
+	{
+		// The walk doesn't enter a directory the action failed on
+		DWORD result = Action.OnDirectory(Entry);
+		if (result != 0)
+		{
+			SetIncomplete();
+		}
+
+		return result;
+	}
+
+	virtual DWORD OnReparsePoint(const WalkEntry& Entry)
+	{
+		// A root that is itself a link has no place in the directory table
+		EnterCriticalSection(&Lock);
+		if (Entry.Depth > 0)
+		{
+			AddLink(Entry);
+		}
+		else
+		{
+			bComplete = false;
+		}
+		LeaveCriticalSection(&Lock);
+
+		return Action.OnReparsePoint(Entry);
+	}
+
+	virtual DWORD OnFile(const WalkEntry& Entry)
+	{
+		return Action.OnFile(Entry);
+	}
+
+	virtual void OnDirectoryIncomplete(const WalkEntry& Entry, DWORD Error)
+	{
+		SetIncomplete();
+		Action.OnDirectoryIncomplete(Entry, Error);
+	}
+
+	/**
+	 * Returns true if the walk reached every directory and every link could be recorded. Links the action failed
+	 * on or skipped are still part of the tree and don't count against it.
+	 */
+	bool IsComplete() const
+	{
+		return bComplete;
+	}
+
+	/**
+	 * Writes the recorded links to an index file. The file is written under a temporary name first so that a failed
+	 * write never leaves a truncated index behind.
+	 */
+	DWORD Save(LPCTSTR Path, LPCTSTR Root, const JournalCheckpoint& Checkpoint, int MaxDepth)
+	{
+		const std::vector<TCHAR>& Pool = Strings.GetChars();
+
+		LinkIndexHeader Header;
+		Header.Signature = LINK_INDEX_SIGNATURE;
+		Header.Version = LINK_INDEX_VERSION;
+		Header.VolumeSerial = Checkpoint.VolumeSerial;
+		Header.MaxDepth = MaxDepth;
+		Header.JournalId = Checkpoint.JournalId;
+		Header.NextUsn = Checkpoint.NextUsn;
+		Header.RootPath = Strings.Intern(Root, _tcslen(Root));
+		Header.NumDirectories = (DWORD)Directories.size();
+		Header.NumLinks = (DWORD)Links.size();
+		Header.PoolSize = (DWORD)Pool.size();
+		Directories[0].Name = Header.RootPath;
+
+		tstring TempPath = Path;
+		TempPath += TEXT(".tmp");
+		HANDLE hFile = CreateFile(TempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			return GetLastError();
+		}
+
+		DWORD result = WriteBlock(hFile, &Header, sizeof(Header));
+		if (result == 0)
+		{
+			result = WriteBlock(hFile, &Directories[0], Directories.size() * sizeof(LinkIndexDirectory));
+		}
+		if (result == 0 && !Links.empty())
+		{
+			result = WriteBlock(hFile, &Links[0], Links.size() * sizeof(LinkIndexLink));
+		}
+		if (result == 0)
+		{
+			result = WriteBlock(hFile, &Pool[0], Pool.size() * sizeof(WCHAR));
+		}
+		CloseHandle(hFile);
+
+		if (result == 0 && !MoveFileEx(TempPath.c_str(), Path, MOVEFILE_REPLACE_EXISTING))
+		{
+			result = GetLastError();
+		}
+
+		if (result != 0)
+		{
+			DeleteFile(TempPath.c_str());
+		}
+
+		return result;
+	}
+
+private:
+	IndexRecorder(const IndexRecorder&);
+	IndexRecorder& operator=(const IndexRecorder&);
+
+	void SetIncomplete()
+	{
+		EnterCriticalSection(&Lock);
+		bComplete = false;
+		LeaveCriticalSection(&Lock);
+	}
+
+	/**
+	 * Records a link along with the chain of directories leading to it. Called with the lock held.
+	 */
+	void AddLink(const WalkEntry& Entry)
+	{
+		// Relative paths of links always begin with a separator
+		DWORD Parent = 0;
+		LPCTSTR Component = Entry.RelativePath + 1;
+		for (LPCTSTR Separator = _tcschr(Component, '\\'); Separator != NULL; Separator = _tcschr(Component, '\\'))
+		{
+			DWORD Name = Strings.Intern(Component, Separator - Component);
+			DWORDLONG Key = ((DWORDLONG)Parent << 32) | Name;
+			std::unordered_map<DWORDLONG, DWORD>::const_iterator it = Children.find(Key);
+			if (it != Children.end())
+			{
+				Parent = it->second;
+			}
+			else
+			{
+				LinkIndexDirectory Dir;
+				Dir.Parent = Parent;
+				Dir.Name = Name;
+				Dir.Depth = Directories[Parent].Depth + 1;
+
+				Parent = (DWORD)Directories.size();
+				Directories.push_back(Dir);
+				Children[Key] = Parent;
+			}
+
+			Component = Separator + 1;
+		}
+
+		LinkIndexLink Link;
+		Link.Parent = Parent;
+		Link.Name = Strings.Intern(Component, _tcslen(Component));
+		Link.Attributes = Entry.Attributes;
+		Link.ReparseTag = Entry.ReparseTag;
+		Links.push_back(Link);
+	}
+
+	static DWORD WriteBlock(HANDLE hFile, const void* Data, size_t Size)
+	{
+		DWORD bytesWritten = 0;
+		if (!WriteFile(hFile, Data, (DWORD)Size, &bytesWritten, NULL))
+		{
+			return GetLastError();
+		}
+
+		return bytesWritten == Size ? 0 : ERROR_WRITE_FAULT;
+	}
+
+	LinkAction& Action;
+	CRITICAL_SECTION Lock;
+	bool bComplete;
+	std::vector<LinkIndexDirectory> Directories;
+	std::vector<LinkIndexLink> Links;
+	/** The string pool of the index, laid out as it is written. */
+	StringPool Strings;
+	/** The index of every directory recorded so far, keyed on its parent index and name offset. */
+	std::unordered_map<DWORDLONG, DWORD> Children;
+};
+
+/**
+ * A link index file mapped into memory.
+ */
+class IndexView
+{
+public:
+	IndexView()
+		: hFile(INVALID_HANDLE_VALUE)
+		, hMapping(NULL)
+		, View(NULL)
+		, Size(0)
+	{
+	}
+
+	~IndexView()
+	{
+		Close();
+	}
+
+	/**
+	 * Maps the index file at the given path.
+	 */
+	DWORD Open(LPCTSTR Path)
+	{
+		hFile = CreateFile(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			return GetLastError();
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(hFile, &fileSize))
+		{
+			return GetLastError();
+		}
+
+		if (fileSize.QuadPart < (LONGLONG)sizeof(LinkIndexHeader) || (ULONGLONG)fileSize.QuadPart > (SIZE_T)-1)
+		{
+			return ERROR_INVALID_DATA;
+		}
+		Size = (size_t)fileSize.QuadPart;
+
+		hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping == NULL)
+		{
+			return GetLastError();
+		}
+
+		View = (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+		return View != NULL ? 0 : GetLastError();
+	}
+
+	void Close()
+	{
+		if (View != NULL)
+		{
+			UnmapViewOfFile(View);
+			View = NULL;
+		}
+
+		if (hMapping != NULL)
+		{
+			CloseHandle(hMapping);
+			hMapping = NULL;
+		}
+
+		if (hFile != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(hFile);
+			hFile = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	/**
+	 * Checks that the file is a well formed index of the given root, taken with a depth that covers MaxDepth. Every
+	 * offset and index is checked up front so that the replay can trust them.
+	 */
+	bool IsValid(LPCTSTR Root, int MaxDepth) const
+	{
+		const LinkIndexHeader& Header = GetHeader();
+		if (Header.Signature != LINK_INDEX_SIGNATURE || Header.Version != LINK_INDEX_VERSION ||
+			Header.NumDirectories == 0 || Header.PoolSize == 0)
+		{
+			return false;
+		}
+
+		ULONGLONG ExpectedSize = sizeof(LinkIndexHeader) + (ULONGLONG)Header.NumDirectories * sizeof(LinkIndexDirectory) +
+			(ULONGLONG)Header.NumLinks * sizeof(LinkIndexLink) + (ULONGLONG)Header.PoolSize * sizeof(WCHAR);
+		if (ExpectedSize != Size)
+		{
+			return false;
+		}
+
+		const WCHAR* Pool = GetPool();
+		if (Pool[Header.PoolSize - 1] != 0 || Header.RootPath >= Header.PoolSize || _tcsicmp(&Pool[Header.RootPath], Root) != 0)
+		{
+			return false;
+		}
+
+		// An index of a shallower walk is missing the deeper links
+		if (Header.MaxDepth >= 0 && (MaxDepth < 0 || MaxDepth > Header.MaxDepth))
+		{
+			return false;
+		}
+
+		const LinkIndexDirectory* Directories = GetDirectories();
+		if (Directories[0].Parent != LINK_INDEX_NO_PARENT || Directories[0].Depth != 0)
+		{
+			return false;
+		}
+
+		for (DWORD i = 1; i < Header.NumDirectories; i++)
+		{
+			const LinkIndexDirectory& Dir = Directories[i];
+			if (Dir.Parent >= i || Dir.Name >= Header.PoolSize || Dir.Depth != Directories[Dir.Parent].Depth + 1)
+			{
+				return false;
+			}
+		}
+
+		const LinkIndexLink* Links = GetLinks();
+		for (DWORD i = 0; i < Header.NumLinks; i++)
+		{
+			const LinkIndexLink& Link = Links[i];
+			if (Link.Parent >= Header.NumDirectories || Link.Name >= Header.PoolSize)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	const LinkIndexHeader& GetHeader() const
+	{
+		return *(const LinkIndexHeader*)View;
+	}
+
+	const LinkIndexDirectory* GetDirectories() const
+	{
+		return (const LinkIndexDirectory*)(View + sizeof(LinkIndexHeader));
+	}
+
+	const LinkIndexLink* GetLinks() const
+	{
+		return (const LinkIndexLink*)(GetDirectories() + GetHeader().NumDirectories);
+	}
+
+	const WCHAR* GetPool() const
+	{
+		return (const WCHAR*)(GetLinks() + GetHeader().NumLinks);
+	}
+
+	JournalCheckpoint GetCheckpoint() const
+	{
+		JournalCheckpoint Checkpoint;
+		Checkpoint.VolumeSerial = GetHeader().VolumeSerial;
+		Checkpoint.JournalId = GetHeader().JournalId;
+		Checkpoint.NextUsn = GetHeader().NextUsn;
+		return Checkpoint;
+	}
+
+private:
+	IndexView(const IndexView&);
+	IndexView& operator=(const IndexView&);
+
+	HANDLE hFile;
+	HANDLE hMapping;
+	const BYTE* View;
+	size_t Size;
+};
+
+/**
+ * The state shared by the threads replaying the links of an index.
+ */
+struct ReplayContext
+{
+	const IndexView* Index;
+	LPCTSTR Root;
+	LinkAction* Action;
+	const WalkOptions* Options;
+	LinkStats* Stats;
+	/** The path of each directory relative to the root. */
+	const std::vector<tstring>* RelativePaths;
+	/** The result of the action for each directory. Links beneath a directory that failed are skipped. */
+	const std::vector<DWORD>* Results;
+	/** The index of the next batch of links to hand out. */
+	volatile LONG NextBatch;
+};
+
+void ReplayBatches(ReplayContext& Context)
+{
+	StringArena Arena;
+	const LinkIndexDirectory* Directories = Context.Index->GetDirectories();
+	const LinkIndexLink* Links = Context.Index->GetLinks();
+	const WCHAR* Pool = Context.Index->GetPool();
+	DWORD NumLinks = Context.Index->GetHeader().NumLinks;
+	int MaxDepth = Context.Options->MaxDepth;
+
+	for (;;)
+	{
+		size_t Begin = (size_t)(InterlockedIncrement(&Context.NextBatch) - 1) * LINK_INDEX_BATCH_SIZE;
+		if (Begin >= NumLinks)
+		{
+			break;
+		}
+
+		size_t End = Begin + LINK_INDEX_BATCH_SIZE < NumLinks ? Begin + LINK_INDEX_BATCH_SIZE : NumLinks;
+		for (size_t i = Begin; i < End; i++)
+		{
+			const LinkIndexLink& Link = Links[i];
+			int Depth = (int)Directories[Link.Parent].Depth + 1;
+			if ((*Context.Results)[Link.Parent] != 0 || (MaxDepth >= 0 && Depth > MaxDepth))
+			{
+				continue;
+			}
+
+			Arena.Reset();
+
+			const tstring& ParentPath = (*Context.RelativePaths)[Link.Parent];
+			LPCTSTR Name = &Pool[Link.Name];
+			size_t NameLength = _tcslen(Name);
+			LPTSTR RelativePath = Arena.Allocate(ParentPath.size() + NameLength + 2);
+			memcpy(RelativePath, ParentPath.c_str(), ParentPath.size() * sizeof(TCHAR));
+			RelativePath[ParentPath.size()] = '\\';
+			memcpy(RelativePath + ParentPath.size() + 1, Name, (NameLength + 1) * sizeof(TCHAR));
+
+			WalkEntry LinkEntry;
+			LinkEntry.Path = JoinPath(Arena, Context.Root, RelativePath);
+			LinkEntry.RelativePath = RelativePath;
+			LinkEntry.Depth = Depth;
+			LinkEntry.Attributes = Link.Attributes;
+			LinkEntry.ReparseTag = Link.ReparseTag;
+			LinkEntry.Arena = &Arena;
+
+			DWORD result = Context.Action->OnReparsePoint(LinkEntry);
+			if (result != 0)
+			{
+				Context.Stats->NumFailed++;
+				PrintErrorMessage(result, LinkEntry.Path);
+			}
+		}
+	}
+}
+
+DWORD WINAPI ReplayThreadProc(LPVOID Param)
+{
+	ReplayBatches(*(ReplayContext*)Param);
+	return 0;
+}
+
+/**
+ * Invokes the action for the directories and links of a validated index, as a walk of the tree would.
+ */
+void ReplayIndex(const IndexView& Index, LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats)
+{
+	const LinkIndexHeader& Header = Index.GetHeader();
+	const LinkIndexDirectory* Directories = Index.GetDirectories();
+	const WCHAR* Pool = Index.GetPool();
+
+	// Directories are stored parents first, so a single pass resolves their paths and hands them to the action before
+	// any of their contents
+	std::vector<tstring> RelativePaths(Header.NumDirectories);
+	std::vector<DWORD> Results(Header.NumDirectories, 0);
+	StringArena Arena;
+	for (DWORD i = 0; i < Header.NumDirectories; i++)
+	{
+		const LinkIndexDirectory& Dir = Directories[i];
+		if (i > 0)
+		{
+			RelativePaths[i] = RelativePaths[Dir.Parent] + TEXT("\\");
+			RelativePaths[i] += &Pool[Dir.Name];
+			Results[i] = Results[Dir.Parent];
+		}
+
+		// Directories beyond the maximum depth can't contain any links of interest
+		if (Results[i] != 0 || (Options.MaxDepth >= 0 && (int)Dir.Depth >= Options.MaxDepth && i > 0))
+		{
+			continue;
+		}
+
+		Arena.Reset();
+
+		WalkEntry DirEntry;
+		DirEntry.Path = JoinPath(Arena, Root, RelativePaths[i].c_str());
+		DirEntry.RelativePath = RelativePaths[i].c_str();
+		DirEntry.Depth = (int)Dir.Depth;
+		DirEntry.Attributes = FILE_ATTRIBUTE_DIRECTORY;
+		DirEntry.ReparseTag = 0;
+		DirEntry.Arena = &Arena;
+
+		Results[i] = Action.OnDirectory(DirEntry);
+		if (Results[i] != 0)
+		{
+			Stats.NumFailed++;
+			PrintErrorMessage(Results[i], DirEntry.Path);
+		}
+	}
+
+	ReplayContext Context;
+	Context.Index = &Index;
+	Context.Root = Root;
+	Context.Action = &Action;
+	Context.Options = &Options;
+	Context.Stats = &Stats;
+	Context.RelativePaths = &RelativePaths;
+	Context.Results = &Results;
+	Context.NextBatch = 0;
+
+	// There is no point in starting more threads than there are batches
+	size_t NumBatches = (Header.NumLinks + LINK_INDEX_BATCH_SIZE - 1) / LINK_INDEX_BATCH_SIZE;
+	int NumWorkers = Options.NumThreads < 1 ? 1 : (Options.NumThreads > MAX_WALK_THREADS ? MAX_WALK_THREADS : Options.NumThreads);
+	if ((size_t)NumWorkers > NumBatches)
+	{
+		NumWorkers = NumBatches > 0 ? (int)NumBatches : 1;
+	}
+
+	// The calling thread acts as the first worker
+	std::vector<HANDLE> Threads;
+	for (int i = 1; i < NumWorkers; i++)
+	{
+		HANDLE hThread = CreateThread(NULL, 0, ReplayThreadProc, &Context, 0, NULL);
+		if (hThread != NULL)
+		{
+			Threads.push_back(hThread);
+		}
+	}
+
+	ReplayBatches(Context);
+
+	for (size_t i = 0; i < Threads.size(); i++)
+	{
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+	}
+}
+
+} // namespace
+
+DWORD WalkIndex(LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats)
+{
+	WalkOptions LiveOptions = Options;
+	LiveOptions.IndexPath = NULL;
+
+	// Replay the index if nothing beneath the root has changed since it was taken
+	IndexView Index;
+	DWORD result = Index.Open(Options.IndexPath);
+	if (result == 0)
+	{
+		bool bChanged = true;
+		if (Index.IsValid(Root, Options.MaxDepth) && HasTreeChanged(Root, Index.GetCheckpoint(), bChanged) == 0 && !bChanged)
+		{
+			ReplayIndex(Index, Root, Action, Options, Stats);
+			return 0;
+		}
+
+		_tprintf(TEXT("The link index %s is out of date, walking the directory tree instead.\n"),
+			GetDisplayPath(Options.IndexPath));
+	}
+	Index.Close();
+
+	// The journal position is taken before the walk so that any change made while walking invalidates the new index
+	JournalCheckpoint Checkpoint;
+	if (GetJournalCheckpoint(Root, Checkpoint) != 0)
+	{
+		_tprintf(TEXT("The change journal of %s can't be read, the link index %s is not used.\n"), GetDisplayPath(Root),
+			GetDisplayPath(Options.IndexPath));
+		return WalkTree(Root, Action, LiveOptions, Stats);
+	}
+
+	IndexRecorder Recorder(Action);
+	result = WalkTree(Root, Recorder, LiveOptions, Stats);
+
+	// Links beneath a directory that couldn't be enumerated would be missing from the index for good
+	if (result != 0 || !Recorder.IsComplete())
+	{
+		_tprintf(TEXT("The link index %s was not written as parts of the tree could not be walked.\n"),
+			GetDisplayPath(Options.IndexPath));
+		return result;
+	}
+
+	DWORD saveResult = Recorder.Save(Options.IndexPath, Root, Checkpoint, Options.MaxDepth);
+	if (saveResult != 0)
+	{
+		PrintErrorMessage(saveResult, Options.IndexPath);
+	}
+
+	return result;
+}
@@ -0,0 +1,399 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "ApplyJournal.h"
+#include "ErrorMessage.h"
+#include "LinkManifest.h"
+#include "ReparsePoint.h"
+#include "TreeWalker.h"
+
+namespace
+{
+
+/** The first line of every manifest, followed by the name of the utility it was planned by. */
+#define MANIFEST_SIGNATURE TEXT("ntfslinkutils manifest 1")
+
+/** The number of tab separated fields on each line of a manifest. */
+#define NUM_MANIFEST_FIELDS 6
+
+/**
+ * The state shared by the threads applying a manifest.
+ */
+struct ApplyContext
+{
+	const LinkManifest* Manifest;
+	LinkOpAction* Action;
+	LinkStats* Stats;
+	ApplyJournal* Journal;
+	/** The index of the next batch of operations to hand out. */
+	volatile LONG NextBatch;
+};
+
+void ApplyBatches(ApplyContext& Context)
+{
+	StringArena Arena;
+	const LinkManifest& Manifest = *Context.Manifest;
+	size_t NumOps = Manifest.GetNumOps();
+
+	for (;;)
+	{
+		size_t Begin = (size_t)(InterlockedIncrement(&Context.NextBatch) - 1) * LINK_OP_BATCH_SIZE;
+		if (Begin >= NumOps)
+		{
+			break;
+		}
+
+		size_t End = Begin + LINK_OP_BATCH_SIZE < NumOps ? Begin + LINK_OP_BATCH_SIZE : NumOps;
+		ApplyJournal* Journal = Context.Journal;
+		if (Journal != NULL)
+		{
+			// Batches an earlier run finished have nothing left to do
+			size_t First = Begin;
+			while (First < End && Journal->IsDone(First))
+			{
+				First++;
+			}
+
+			if (First == End)
+			{
+				continue;
+			}
+
+			// Nothing is touched before the batch is known to have begun, should the run be interrupted
+			DWORD result = Journal->BeginOps(Begin, End);
+			if (result != 0)
+			{
+				Context.Stats->NumFailed += (LONG)(End - Begin);
+				PrintErrorMessage(result, Journal->GetPath());
+				continue;
+			}
+		}
+
+		// The operations that succeeded are recorded as finished in runs between failures
+		size_t Finished = Begin;
+		for (size_t i = Begin; i < End; i++)
+		{
+			if (Journal != NULL && Journal->IsDone(i))
+			{
+				continue;
+			}
+
+			// The paths of the operation are only put together now that the link is about to be touched
+			Arena.Reset();
+			LinkOp Op;
+			Manifest.GetOp(i, Op, Arena);
+
+			DWORD result = Journal != NULL && Journal->IsUnfinished(i) ?
+				Context.Action->OnResumeLinkOp(Op, Arena) : Context.Action->OnLinkOp(Op, Arena);
+			if (result != 0)
+			{
+				Context.Stats->NumFailed++;
+				PrintErrorMessage(result, Op.Path);
+
+				if (Journal != NULL)
+				{
+					Journal->FinishOps(Finished, i);
+				}
+				Finished = i + 1;
+			}
+		}
+
+		if (Journal != NULL)
+		{
+			Journal->FinishOps(Finished, End);
+		}
+	}
+}
+
+DWORD WINAPI ApplyThreadProc(LPVOID Param)
+{
+	ApplyBatches(*(ApplyContext*)Param);
+	return 0;
+}
+
+} // namespace
+
+ManifestWriter::ManifestWriter()
+	: File(NULL)
+	, NumOps(0)
+{
+	InitializeCriticalSection(&Lock);
+}
+
+ManifestWriter::~ManifestWriter()
+{
+	Close();
+	DeleteCriticalSection(&Lock);
+}
+
+DWORD ManifestWriter::Open(LPCTSTR Path, LPCTSTR Tool)
+{
+	if (_tfopen_s(&File, Path, TEXT("w, ccs=UTF-8")) != 0 || File == NULL)
+	{
+		File = NULL;
+		return ERROR_WRITE_FAULT;
+	}
+
+	NumOps = 0;
+
+	// Links are written one line at a time from every worker, so buffer generously
+	setvbuf(File, NULL, _IOFBF, 1024 * 1024);
+
+	_ftprintf(File, TEXT("%s\t%s\n"), MANIFEST_SIGNATURE, Tool);
+	return ferror(File) != 0 ? ERROR_WRITE_FAULT : 0;
+}
+
+void ManifestWriter::Write(const LinkOp& Op)
+{
+	// Tabs and line breaks can't appear in paths so they delimit the fields unambiguously
+	EnterCriticalSection(&Lock);
+	_ftprintf(File, TEXT("%c\t%08lx\t%s\t%s\t%s\t%s\n"), Op.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT ? 'J' : 'S',
+		Op.Attributes, Op.Path, Op.DestPath, Op.OldTarget, Op.NewTarget);
+	NumOps++;
+	LeaveCriticalSection(&Lock);
+}
+
+DWORD ManifestWriter::Close()
+{
+	if (File == NULL)
+	{
+		return 0;
+	}
+
+	DWORD result = (fflush(File) != 0 || ferror(File) != 0) ? ERROR_WRITE_FAULT : 0;
+	fclose(File);
+	File = NULL;
+	return result;
+}
+
+DWORD LinkManifest::Load(LPCTSTR Path, LPCTSTR Tool)
+{
+	HANDLE hFile = CreateFile(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	// Read the whole file at once and convert it in a single pass
+	DWORD result = 0;
+	LARGE_INTEGER fileSize;
+	std::vector<char> Bytes;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		result = GetLastError();
+	}
+	else if (fileSize.QuadPart >= MAXLONG)
+	{
+		result = ERROR_FILE_TOO_LARGE;
+	}
+	else
+	{
+		Bytes.resize((size_t)fileSize.QuadPart + 1);
+		DWORD bytesRead = 0;
+		if (!ReadFile(hFile, &Bytes[0], (DWORD)fileSize.QuadPart, &bytesRead, NULL))
+		{
+			result = GetLastError();
+		}
+		Bytes.resize(bytesRead);
+	}
+	CloseHandle(hFile);
+
+	if (result != 0)
+	{
+		return result;
+	}
+
+	// FNV-1a
+	ContentHash = 14695981039346656037ULL;
+	for (size_t i = 0; i < Bytes.size(); i++)
+	{
+		ContentHash ^= (BYTE)Bytes[i];
+		ContentHash *= 1099511628211ULL;
+	}
+
+	// Skip the byte order mark
+	size_t Start = 0;
+	if (Bytes.size() >= 3 && Bytes[0] == '\xEF' && Bytes[1] == '\xBB' && Bytes[2] == '\xBF')
+	{
+		Start = 3;
+	}
+
+	int NumBytes = (int)(Bytes.size() - Start);
+	int NumChars = NumBytes > 0 ? MultiByteToWideChar(CP_UTF8, 0, &Bytes[Start], NumBytes, NULL, 0) : 0;
+	std::vector<TCHAR> Text(NumChars + 1);
+	if (NumChars > 0)
+	{
+		MultiByteToWideChar(CP_UTF8, 0, &Bytes[Start], NumBytes, &Text[0], NumChars);
+	}
+	Text[NumChars] = 0;
+
+	// Split the text into lines and fields in place, keeping only what the entry table doesn't already hold
+	Links.clear();
+	Dests.clear();
+	NewTargets.clear();
+	int LineNumber = 0;
+	for (LPTSTR Line = &Text[0]; *Line != 0 && result == 0; )
+	{
+		LineNumber++;
+
+		LPTSTR Next = _tcschr(Line, '\n');
+		if (Next != NULL)
+		{
+			*Next++ = 0;
+		}
+		else
+		{
+			Next = Line + _tcslen(Line);
+		}
+
+		size_t LineLength = _tcslen(Line);
+		if (LineLength > 0 && Line[LineLength - 1] == '\r')
+		{
+			Line[LineLength - 1] = 0;
+		}
+
+		LPTSTR Fields[NUM_MANIFEST_FIELDS];
+		size_t NumFields = 0;
+		for (LPTSTR Field = Line; Field != NULL && NumFields < NUM_MANIFEST_FIELDS; NumFields++)
+		{
+			Fields[NumFields] = Field;
+			Field = _tcschr(Field, '\t');
+			if (Field != NULL)
+			{
+				*Field++ = 0;
+			}
+		}
+
+		if (LineNumber == 1)
+		{
+			if (NumFields != 2 || _tcscmp(Fields[0], MANIFEST_SIGNATURE) != 0 || _tcscmp(Fields[1], Tool) != 0)
+			{
+				_tprintf(TEXT("Error: %s is not a manifest planned by %s.\n"), Path, Tool);
+				result = ERROR_INVALID_DATA;
+			}
+		}
+		else if (Line[0] != 0)
+		{
+			if (NumFields != NUM_MANIFEST_FIELDS || (Fields[0][0] != 'J' && Fields[0][0] != 'S') || Fields[2][0] == 0 ||
+				Fields[5][0] == 0)
+			{
+				_tprintf(TEXT("Error: Invalid operation on line %d of %s.\n"), LineNumber, Path);
+				result = ERROR_INVALID_DATA;
+			}
+			else
+			{
+				DWORD ReparseTag = Fields[0][0] == 'J' ? IO_REPARSE_TAG_MOUNT_POINT : IO_REPARSE_TAG_SYMLINK;
+				DWORD Attributes = (DWORD)_tcstoul(Fields[1], NULL, 16);
+				Links.push_back(Entries.AddPath(Fields[2], Attributes, ReparseTag, Fields[4]));
+				Dests.push_back(Fields[3][0] != 0 ? Entries.AddPath(Fields[3], Attributes, ReparseTag, Fields[5]) :
+					ENTRY_TABLE_NONE);
+				NewTargets.push_back(Entries.GetStrings().Intern(Fields[5], _tcslen(Fields[5])));
+			}
+		}
+
+		Line = Next;
+	}
+
+	if (result == 0 && LineNumber == 0)
+	{
+		_tprintf(TEXT("Error: %s is not a manifest planned by %s.\n"), Path, Tool);
+		result = ERROR_INVALID_DATA;
+	}
+
+	return result;
+}
+
+void LinkManifest::GetOp(size_t Index, LinkOp& Op, StringArena& Arena) const
+{
+	DWORD Link = Links[Index];
+	Op.ReparseTag = Entries.GetReparseTag(Link);
+	Op.Attributes = Entries.GetAttributes(Link);
+	Op.Path = Entries.GetPath(Link, Arena);
+	Op.DestPath = Dests[Index] != ENTRY_TABLE_NONE ? Entries.GetPath(Dests[Index], Arena) : TEXT("");
+	Op.OldTarget = Entries.GetTarget(Link);
+	Op.NewTarget = Entries.GetStrings().Get(NewTargets[Index]);
+}
+
+DWORD CheckPlannedTarget(HANDLE hLink, const LinkOp& Op, StringArena& Arena, bool& bUnchanged)
+{
+	bUnchanged = false;
+
+	ReparsePointInfo Info;
+	DWORD result = QueryReparsePoint(hLink, Info);
+	if (result == 0)
+	{
+		size_t TargetSize = GetReparsePointTargetSize(Info);
+		LPTSTR Target = Arena.Allocate(TargetSize);
+		result = GetReparsePointTarget(Info, Target, TargetSize);
+
+		bUnchanged = result == 0 && Info.ReparseTag == Op.ReparseTag && _tcscmp(Target, Op.OldTarget) == 0;
+	}
+
+	return result;
+}
+
+void ApplyManifest(const LinkManifest& Manifest, LinkOpAction& Action, int NumThreads, LinkStats& Stats,
+	ApplyJournal* Journal)
+{
+	ApplyContext Context;
+	Context.Manifest = &Manifest;
+	Context.Action = &Action;
+	Context.Stats = &Stats;
+	Context.Journal = Journal;
+	Context.NextBatch = 0;
+
+	// There is no point in starting more threads than there are batches
+	size_t NumBatches = (Manifest.GetNumOps() + LINK_OP_BATCH_SIZE - 1) / LINK_OP_BATCH_SIZE;
+	int NumWorkers = NumThreads < 1 ? 1 : (NumThreads > MAX_WALK_THREADS ? MAX_WALK_THREADS : NumThreads);
+	if ((size_t)NumWorkers > NumBatches)
+	{
+		NumWorkers = NumBatches > 0 ? (int)NumBatches : 1;
+	}
+
+	// The calling thread acts as the first worker
+	std::vector<HANDLE> Threads;
+	for (int i = 1; i < NumWorkers; i++)
+	{
+		HANDLE hThread = CreateThread(NULL, 0, ApplyThreadProc, &Context, 0, NULL);
+		if (hThread != NULL)
+		{
+			Threads.push_back(hThread);
+		}
+	}
+
+	ApplyBatches(Context);
+
+	for (size_t i = 0; i < Threads.size(); i++)
+	{
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+	}
+}
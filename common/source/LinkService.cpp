@@ -0,0 +1,671 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <fcntl.h>
+#include <io.h>
+#include <sddl.h>
+#include <vector>
+
+#include "LinkService.h"
+#include "PathBuffer.h"
+
+namespace
+{
+
+/** The largest request a service accepts, in characters. */
+#define MAX_SERVICE_REQUEST_CHARS (64 * 1024)
+
+/**
+ * The kinds of frame a service sends back to its client.
+ */
+enum ServiceFrameType
+{
+	/** A chunk of the console output of the job. */
+	ServiceOutput = 1,
+	/** The exit code of the job, always the last frame. */
+	ServiceExit = 2,
+	/** The error the request was turned down with before anything ran, instead of any other frame. */
+	ServiceRejected = 3
+};
+
+/**
+ * The header of each frame a service sends back to its client. Size bytes of payload follow it.
+ */
+struct ServiceFrame
+{
+	DWORD Type;
+	DWORD Size;
+};
+
+/**
+ * The state of the thread that relays the console output of a job to the client.
+ */
+struct RelayContext
+{
+	/** The read end of the pipe the job's console output is redirected to. */
+	HANDLE hRead;
+	/** The pipe connected to the client. */
+	HANDLE hPipe;
+};
+
+/**
+ * The user a token belongs to and its integrity level.
+ */
+struct TokenIdentity
+{
+	/** The SID of the user. */
+	std::vector<BYTE> UserSid;
+	/** The relative identifier of the mandatory label, e.g. SECURITY_MANDATORY_HIGH_RID when elevated. */
+	DWORD IntegrityLevel;
+
+	TokenIdentity()
+		: IntegrityLevel(0)
+	{
+	}
+};
+
+bool WriteAll(HANDLE hPipe, const void* Data, DWORD Size)
+{
+	const BYTE* Pos = (const BYTE*)Data;
+	while (Size > 0)
+	{
+		DWORD bytesWritten = 0;
+		if (!WriteFile(hPipe, Pos, Size, &bytesWritten, NULL))
+		{
+			return false;
+		}
+
+		Pos += bytesWritten;
+		Size -= bytesWritten;
+	}
+
+	return true;
+}
+
+bool ReadAll(HANDLE hPipe, void* Data, DWORD Size)
+{
+	BYTE* Pos = (BYTE*)Data;
+	while (Size > 0)
+	{
+		DWORD bytesRead = 0;
+		if (!ReadFile(hPipe, Pos, Size, &bytesRead, NULL) || bytesRead == 0)
+		{
+			return false;
+		}
+
+		Pos += bytesRead;
+		Size -= bytesRead;
+	}
+
+	return true;
+}
+
+bool WriteFrame(HANDLE hPipe, DWORD Type, const void* Data, DWORD Size)
+{
+	ServiceFrame Frame;
+	Frame.Type = Type;
+	Frame.Size = Size;
+	return WriteAll(hPipe, &Frame, sizeof(Frame)) && WriteAll(hPipe, Data, Size);
+}
+
+void GetPipeName(LPCTSTR Tool, tstring& PipeName)
+{
+	PipeName = LINK_SERVICE_PIPE_PREFIX;
+	PipeName += Tool;
+}
+
+/**
+ * Reads one kind of information from a token into a buffer of the size it needs.
+ */
+DWORD QueryTokenInformation(HANDLE hToken, TOKEN_INFORMATION_CLASS InfoClass, std::vector<BYTE>& Info)
+{
+	DWORD Size = 0;
+	GetTokenInformation(hToken, InfoClass, NULL, 0, &Size);
+	if (Size == 0)
+	{
+		return GetLastError();
+	}
+
+	Info.resize(Size);
+	return GetTokenInformation(hToken, InfoClass, &Info[0], Size, &Size) ? 0 : GetLastError();
+}
+
+DWORD GetTokenIdentity(HANDLE hToken, TokenIdentity& Identity)
+{
+	std::vector<BYTE> Info;
+	DWORD result = QueryTokenInformation(hToken, TokenUser, Info);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	PSID UserSid = ((TOKEN_USER*)&Info[0])->User.Sid;
+	Identity.UserSid.assign((BYTE*)UserSid, (BYTE*)UserSid + GetLengthSid(UserSid));
+
+	result = QueryTokenInformation(hToken, TokenIntegrityLevel, Info);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	PSID LabelSid = ((TOKEN_MANDATORY_LABEL*)&Info[0])->Label.Sid;
+	Identity.IntegrityLevel = *GetSidSubAuthority(LabelSid, *GetSidSubAuthorityCount(LabelSid) - 1);
+	return 0;
+}
+
+DWORD GetProcessIdentity(HANDLE hProcess, TokenIdentity& Identity)
+{
+	HANDLE hToken = NULL;
+	if (!OpenProcessToken(hProcess, TOKEN_QUERY, &hToken))
+	{
+		return GetLastError();
+	}
+
+	DWORD result = GetTokenIdentity(hToken, Identity);
+	CloseHandle(hToken);
+	return result;
+}
+
+bool IsSameUser(const TokenIdentity& A, const TokenIdentity& B)
+{
+	return !A.UserSid.empty() && !B.UserSid.empty() && EqualSid((PSID)&A.UserSid[0], (PSID)&B.UserSid[0]);
+}
+
+/**
+ * Builds the security descriptor of the pipe of a service, which lets no one but the user running the service connect.
+ * The descriptor is freed with LocalFree.
+ */
+DWORD CreatePipeSecurity(const TokenIdentity& Service, PSECURITY_DESCRIPTOR& Descriptor)
+{
+	LPTSTR SidString = NULL;
+	if (!ConvertSidToStringSid((PSID)&Service.UserSid[0], &SidString))
+	{
+		return GetLastError();
+	}
+
+	tstring Sddl = TEXT("D:P(A;;GA;;;");
+	Sddl += SidString;
+	Sddl += TEXT(")");
+	LocalFree(SidString);
+
+	return ConvertStringSecurityDescriptorToSecurityDescriptor(Sddl.c_str(), SDDL_REVISION_1, &Descriptor, NULL) ?
+		0 : GetLastError();
+}
+
+/**
+ * Checks that the client a service thread impersonates may have its job run. The threads that a job starts run with the
+ * token of the service rather than the client's, so the client has to be the same user at an integrity level at least
+ * as high as the service's: an unelevated client never gets an elevated service to act for it.
+ */
+DWORD CheckClient(const TokenIdentity& Service)
+{
+	HANDLE hToken = NULL;
+	if (!OpenThreadToken(GetCurrentThread(), TOKEN_QUERY, TRUE, &hToken))
+	{
+		return GetLastError();
+	}
+
+	TokenIdentity Client;
+	DWORD result = GetTokenIdentity(hToken, Client);
+	CloseHandle(hToken);
+
+	if (result == 0 && (!IsSameUser(Client, Service) || Client.IntegrityLevel < Service.IntegrityLevel))
+	{
+		result = ERROR_ACCESS_DENIED;
+	}
+
+	return result;
+}
+
+/**
+ * Checks that the process serving a pipe is run by the same user as this one, so that an invocation is never handed to
+ * whichever process happened to create the pipe first.
+ */
+DWORD CheckServer(HANDLE hPipe)
+{
+	ULONG ServerId = 0;
+	if (!GetNamedPipeServerProcessId(hPipe, &ServerId))
+	{
+		return GetLastError();
+	}
+
+	HANDLE hServer = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, ServerId);
+	if (hServer == NULL)
+	{
+		return GetLastError();
+	}
+
+	TokenIdentity Server;
+	TokenIdentity Self;
+	DWORD result = GetProcessIdentity(hServer, Server);
+	CloseHandle(hServer);
+	if (result == 0)
+	{
+		result = GetProcessIdentity(GetCurrentProcess(), Self);
+	}
+
+	if (result == 0 && !IsSameUser(Server, Self))
+	{
+		result = ERROR_ACCESS_DENIED;
+	}
+
+	return result;
+}
+
+DWORD WINAPI RelayThreadProc(LPVOID Param)
+{
+	RelayContext& Relay = *(RelayContext*)Param;
+
+	// Keep draining the output after the client went away so that the job never blocks on a full pipe
+	BYTE Buffer[LINK_SERVICE_BUFFER_SIZE];
+	bool bConnected = true;
+	DWORD bytesRead = 0;
+	while (ReadFile(Relay.hRead, Buffer, sizeof(Buffer), &bytesRead, NULL) && bytesRead > 0)
+	{
+		if (bConnected)
+		{
+			bConnected = WriteFrame(Relay.hPipe, ServiceOutput, Buffer, bytesRead);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Points a CRT file descriptor at the given one, returning a copy of the previous one to restore it from, or -1.
+ */
+int RedirectDescriptor(int Fd, int NewFd)
+{
+	int SavedFd = _dup(Fd);
+	_dup2(NewFd, Fd);
+	return SavedFd;
+}
+
+void RestoreDescriptor(int Fd, int SavedFd)
+{
+	if (SavedFd >= 0)
+	{
+		_dup2(SavedFd, Fd);
+		_close(SavedFd);
+	}
+	else
+	{
+		_close(Fd);
+	}
+}
+
+/**
+ * Runs a job with everything it prints to stdout and stderr sent to the client, returning its exit code.
+ */
+DWORD RunRelayedJob(HANDLE hPipe, LinkServiceJob& Job, std::vector<TCHAR*>& Args)
+{
+	RelayContext Relay;
+	Relay.hPipe = hPipe;
+	HANDLE hWrite = NULL;
+	HANDLE hThread = NULL;
+	int Fd = -1;
+	if (CreatePipe(&Relay.hRead, &hWrite, NULL, 0))
+	{
+		Fd = _open_osfhandle((intptr_t)hWrite, _O_TEXT);
+		hThread = Fd >= 0 ? CreateThread(NULL, 0, RelayThreadProc, &Relay, 0, NULL) : NULL;
+		if (Fd < 0)
+		{
+			CloseHandle(hWrite);
+		}
+	}
+
+	if (hThread == NULL)
+	{
+		DWORD result = GetLastError();
+		if (Fd >= 0)
+		{
+			_close(Fd);
+		}
+
+		if (hWrite != NULL)
+		{
+			CloseHandle(Relay.hRead);
+		}
+
+		return result;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	int SavedOut = RedirectDescriptor(1, Fd);
+	int SavedErr = RedirectDescriptor(2, Fd);
+	_close(Fd);
+
+	DWORD ExitCode = (DWORD)Job.Run((int)Args.size() - 2, &Args[1]);
+
+	// Closing the last write end of the pipe ends the relay once it has sent everything
+	fflush(stdout);
+	fflush(stderr);
+	RestoreDescriptor(1, SavedOut);
+	RestoreDescriptor(2, SavedErr);
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+	CloseHandle(Relay.hRead);
+	return ExitCode;
+}
+
+/**
+ * Reads and throws away the rest of a request that is turned down, so that the client gets to read the answer.
+ */
+void DiscardRequest(HANDLE hPipe, ULONGLONG Size)
+{
+	BYTE Buffer[LINK_SERVICE_BUFFER_SIZE];
+	while (Size > 0)
+	{
+		DWORD Chunk = Size < sizeof(Buffer) ? (DWORD)Size : (DWORD)sizeof(Buffer);
+		if (!ReadAll(hPipe, Buffer, Chunk))
+		{
+			return;
+		}
+
+		Size -= Chunk;
+	}
+}
+
+/**
+ * Reads a single request from a connected client, runs it as the client and sends back its output and exit code.
+ */
+void ServeJob(HANDLE hPipe, LinkServiceJob& Job, const TokenIdentity& Service)
+{
+	// The request is the working directory of the client followed by its arguments, each terminated by a null
+	DWORD NumChars = 0;
+	if (!ReadAll(hPipe, &NumChars, sizeof(NumChars)))
+	{
+		return;
+	}
+
+	if (NumChars == 0 || NumChars > MAX_SERVICE_REQUEST_CHARS)
+	{
+		DWORD result = ERROR_BUFFER_OVERFLOW;
+		DiscardRequest(hPipe, (ULONGLONG)NumChars * sizeof(TCHAR));
+		WriteFrame(hPipe, ServiceRejected, &result, sizeof(result));
+		return;
+	}
+
+	std::vector<TCHAR> Text(NumChars + 1, 0);
+	if (!ReadAll(hPipe, &Text[0], NumChars * sizeof(TCHAR)))
+	{
+		return;
+	}
+
+	std::vector<TCHAR*> Args;
+	for (size_t Pos = 0; Pos < NumChars; Pos += _tcslen(&Text[Pos]) + 1)
+	{
+		Args.push_back(&Text[Pos]);
+	}
+
+	// Everything the job does on this thread, starting with changing to the client's directory, is done as the client
+	DWORD result = ImpersonateNamedPipeClient(hPipe) ? 0 : GetLastError();
+	bool bImpersonating = result == 0;
+	if (result == 0)
+	{
+		result = CheckClient(Service);
+	}
+
+	if (result != 0)
+	{
+		if (bImpersonating)
+		{
+			RevertToSelf();
+		}
+
+		WriteFrame(hPipe, ServiceRejected, &result, sizeof(result));
+		return;
+	}
+
+	DWORD ExitCode = ERROR_INVALID_PARAMETER;
+	if (Args.size() >= 2 && !SetCurrentDirectory(Args[0]))
+	{
+		ExitCode = GetLastError();
+	}
+	else if (Args.size() >= 2)
+	{
+		Args.push_back(NULL);
+		ExitCode = RunRelayedJob(hPipe, Job, Args);
+	}
+
+	RevertToSelf();
+	WriteFrame(hPipe, ServiceExit, &ExitCode, sizeof(ExitCode));
+}
+
+} // namespace
+
+int RunLinkTool(LPCTSTR Tool, int argc, TCHAR* argv[], LinkServiceJob& Job)
+{
+	// The options that choose where the invocation runs are never passed on to the utility
+	bool bServe = false;
+	bool bService = false;
+	std::vector<TCHAR*> Args;
+	for (int i = 0; i < argc; i++)
+	{
+		if (i > 0 && _tcsicmp(argv[i], TEXT("/SERVE")) == 0)
+		{
+			bServe = true;
+		}
+		else if (i > 0 && _tcsicmp(argv[i], TEXT("/SERVICE")) == 0)
+		{
+			bService = true;
+		}
+		else
+		{
+			Args.push_back(argv[i]);
+		}
+	}
+
+	int NumArgs = (int)Args.size();
+	Args.push_back(NULL);
+
+	if (bServe)
+	{
+		return (int)RunLinkService(Tool, Job);
+	}
+
+	if (bService)
+	{
+		int ExitCode = 0;
+		DWORD result = ForwardToLinkService(Tool, NumArgs, &Args[0], ExitCode);
+		if (result == 0)
+		{
+			return ExitCode;
+		}
+
+		// Nothing ran in the service in these cases, so the invocation is run here instead
+		if (result == ERROR_ACCESS_DENIED)
+		{
+			_tprintf(TEXT("Warning: The %s service is run by another user, running locally instead.\n"), Tool);
+		}
+		else if (result == ERROR_REQUEST_REFUSED || result == ERROR_BUFFER_OVERFLOW)
+		{
+			_tprintf(TEXT("Warning: The %s service turned the invocation down, running locally instead.\n"), Tool);
+		}
+		else if (result != ERROR_FILE_NOT_FOUND)
+		{
+			_tprintf(TEXT("Error: Lost the connection to the %s service.\n"), Tool);
+			return (int)result;
+		}
+	}
+
+	return Job.Run(NumArgs, &Args[0]);
+}
+
+DWORD RunLinkService(LPCTSTR Tool, LinkServiceJob& Job)
+{
+	TokenIdentity Service;
+	PSECURITY_DESCRIPTOR Descriptor = NULL;
+	DWORD result = GetProcessIdentity(GetCurrentProcess(), Service);
+	if (result == 0)
+	{
+		result = CreatePipeSecurity(Service, Descriptor);
+	}
+
+	if (result != 0)
+	{
+		_tprintf(TEXT("Error: Unable to secure the pipe of the %s service.\n"), Tool);
+		return result;
+	}
+
+	SECURITY_ATTRIBUTES Security;
+	Security.nLength = sizeof(Security);
+	Security.lpSecurityDescriptor = Descriptor;
+	Security.bInheritHandle = FALSE;
+
+	// A single instance makes clients queue up so that jobs never run side by side
+	tstring PipeName;
+	GetPipeName(Tool, PipeName);
+	HANDLE hPipe = CreateNamedPipe(PipeName.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, LINK_SERVICE_BUFFER_SIZE,
+		LINK_SERVICE_BUFFER_SIZE, 0, &Security);
+	LocalFree(Descriptor);
+	if (hPipe == INVALID_HANDLE_VALUE)
+	{
+		result = GetLastError();
+		_tprintf(TEXT("Error: Unable to create the pipe %s.\n"), PipeName.c_str());
+		return result;
+	}
+
+	// Each job changes to the directory of its client, so the service changes back to its own after it
+	std::vector<TCHAR> ServiceDir(GetCurrentDirectory(0, NULL) + 1, 0);
+	GetCurrentDirectory((DWORD)ServiceDir.size(), &ServiceDir[0]);
+
+	_tprintf(TEXT("Serving %s requests on %s.\n"), Tool, PipeName.c_str());
+	fflush(stdout);
+
+	for (;;)
+	{
+		// A client that gave up before it was connected leaves nothing to serve, anything else stops the service
+		result = ConnectNamedPipe(hPipe, NULL) ? 0 : GetLastError();
+		if (result == 0 || result == ERROR_PIPE_CONNECTED)
+		{
+			ServeJob(hPipe, Job, Service);
+			FlushFileBuffers(hPipe);
+			SetCurrentDirectory(&ServiceDir[0]);
+		}
+		else if (result != ERROR_NO_DATA)
+		{
+			_tprintf(TEXT("Error: Unable to connect to a client on %s.\n"), PipeName.c_str());
+			CloseHandle(hPipe);
+			return result;
+		}
+
+		DisconnectNamedPipe(hPipe);
+	}
+}
+
+DWORD ForwardToLinkService(LPCTSTR Tool, int argc, TCHAR* argv[], int& ExitCode)
+{
+	// Relative paths are resolved against the working directory of this process
+	std::vector<TCHAR> Text(GetCurrentDirectory(0, NULL) + 1, 0);
+	DWORD DirLength = GetCurrentDirectory((DWORD)Text.size(), &Text[0]);
+	Text.resize(DirLength + 1);
+	for (int i = 0; i < argc; i++)
+	{
+		Text.insert(Text.end(), argv[i], argv[i] + _tcslen(argv[i]) + 1);
+	}
+
+	if (Text.size() > MAX_SERVICE_REQUEST_CHARS)
+	{
+		return ERROR_BUFFER_OVERFLOW;
+	}
+
+	tstring PipeName;
+	GetPipeName(Tool, PipeName);
+
+	HANDLE hPipe = INVALID_HANDLE_VALUE;
+	for (;;)
+	{
+		hPipe = CreateFile(PipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if (hPipe != INVALID_HANDLE_VALUE)
+		{
+			break;
+		}
+
+		// The service takes one job at a time, so wait for the one it is running to finish
+		DWORD result = GetLastError();
+		if (result == ERROR_PIPE_BUSY && WaitNamedPipe(PipeName.c_str(), NMPWAIT_WAIT_FOREVER))
+		{
+			continue;
+		}
+
+		if (result == ERROR_PIPE_BUSY)
+		{
+			result = GetLastError();
+		}
+		return result == ERROR_PATH_NOT_FOUND ? ERROR_FILE_NOT_FOUND : result;
+	}
+
+	DWORD result = CheckServer(hPipe);
+	if (result != 0)
+	{
+		CloseHandle(hPipe);
+		return ERROR_ACCESS_DENIED;
+	}
+
+	DWORD NumChars = (DWORD)Text.size();
+	if (!WriteAll(hPipe, &NumChars, sizeof(NumChars)) || !WriteAll(hPipe, &Text[0], NumChars * sizeof(TCHAR)))
+	{
+		result = GetLastError();
+	}
+
+	// Relay the output until the exit code arrives
+	HANDLE hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	BYTE Buffer[LINK_SERVICE_BUFFER_SIZE];
+	while (result == 0)
+	{
+		ServiceFrame Frame;
+		if (!ReadAll(hPipe, &Frame, sizeof(Frame)) || Frame.Size > sizeof(Buffer) || !ReadAll(hPipe, Buffer, Frame.Size))
+		{
+			result = ERROR_BROKEN_PIPE;
+		}
+		else if (Frame.Type == ServiceExit && Frame.Size == sizeof(DWORD))
+		{
+			ExitCode = (int)*(DWORD*)Buffer;
+			break;
+		}
+		else if (Frame.Type == ServiceRejected)
+		{
+			result = ERROR_REQUEST_REFUSED;
+		}
+		else if (Frame.Type == ServiceOutput)
+		{
+			DWORD bytesWritten = 0;
+			WriteFile(hOutput, Buffer, Frame.Size, &bytesWritten, NULL);
+		}
+	}
+
+	CloseHandle(hPipe);
+	return result;
+}
@@ -0,0 +1,257 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <evntprov.h>
+#include <winmeta.h>
+#include <vector>
+
+#include "LinkTrace.h"
+
+bool bTraceEnabled = false;
+
+namespace
+{
+
+/** The channel of self-describing events, whose first two data descriptors describe the provider and the event. */
+#define TRACE_CHANNEL_SELF_DESCRIBING 11
+
+/** The types of the data descriptors that carry the description of the provider and of the event. */
+#define TRACE_DATA_EVENT_METADATA 1
+#define TRACE_DATA_PROVIDER_METADATA 2
+
+/** The EventSetInformation class that hands the provider description to ETW. */
+#define TRACE_PROVIDER_SET_TRAITS 2
+
+/** The input types of the event fields, as in TDH_INTYPE. */
+#define TRACE_FIELD_UINT32 8
+#define TRACE_FIELD_UINT64 10
+
+/** The keywords that events can be enabled by, one for each area of the tools. */
+#define TRACE_KEYWORD_ENUMERATE 0x1
+#define TRACE_KEYWORD_REPARSE 0x2
+#define TRACE_KEYWORD_REBASE 0x4
+
+/**
+ * The name of the provider and its identifier, which is derived from the name in the same way as for EventSource
+ * and TraceLogging providers so that a session can enable it as *ntfslinkutils.
+ */
+const char ProviderName[] = "ntfslinkutils";
+const GUID ProviderId = { 0x999f489e, 0xfd95, 0x5091, { 0xaa, 0xb9, 0x11, 0x11, 0x6d, 0xdb, 0xab, 0x56 } };
+
+/** The names and keywords of the events of each task. */
+const char* const TaskNames[NUM_TRACE_TASKS] = { "Enumerate", "GetTarget", "SetTarget", "Delete", "Create", "Rebase" };
+const ULONGLONG TaskKeywords[NUM_TRACE_TASKS] = { TRACE_KEYWORD_ENUMERATE, TRACE_KEYWORD_REPARSE,
+	TRACE_KEYWORD_REPARSE, TRACE_KEYWORD_REPARSE, TRACE_KEYWORD_REPARSE, TRACE_KEYWORD_REBASE };
+
+typedef ULONG (WINAPI* EventSetInformationProc)(REGHANDLE RegHandle, int InformationClass, PVOID EventInformation,
+	ULONG InformationLength);
+
+/**
+ * Appends a string along with its null terminator to a description.
+ */
+void AppendName(std::vector<char>& Metadata, const char* Name)
+{
+	Metadata.insert(Metadata.end(), Name, Name + strlen(Name) + 1);
+}
+
+/**
+ * Appends a field to the description of an event.
+ */
+void AppendField(std::vector<char>& Metadata, const char* Name, BYTE Type)
+{
+	AppendName(Metadata, Name);
+	Metadata.push_back((char)Type);
+}
+
+/**
+ * Writes the total size of a description into its first two bytes, which were reserved for it.
+ */
+void SetMetadataSize(std::vector<char>& Metadata)
+{
+	USHORT Size = (USHORT)Metadata.size();
+	memcpy(&Metadata[0], &Size, sizeof(Size));
+}
+
+/**
+ * The registration of the provider and the self-describing layout of each of its events, built once at startup. The
+ * events don't need a manifest to be decoded by WPA or tracerpt.
+ */
+struct TraceProvider
+{
+	REGHANDLE hProvider;
+	LARGE_INTEGER Frequency;
+	/** The description of the provider: its size, then its name. */
+	std::vector<char> Traits;
+	/** The description of the start and stop events of each task: its size, the tags, the name, then the fields. */
+	std::vector<char> StartMetadata[NUM_TRACE_TASKS];
+	std::vector<char> StopMetadata[NUM_TRACE_TASKS];
+
+	TraceProvider();
+	~TraceProvider();
+};
+
+void NTAPI OnEnableProvider(LPCGUID SourceId, ULONG IsEnabled, UCHAR Level, ULONGLONG MatchAnyKeyword,
+	ULONGLONG MatchAllKeyword, PEVENT_FILTER_DESCRIPTOR FilterData, PVOID CallbackContext);
+
+TraceProvider Provider;
+
+TraceProvider::TraceProvider()
+	: hProvider(0)
+{
+	QueryPerformanceFrequency(&Frequency);
+
+	Traits.resize(sizeof(USHORT));
+	AppendName(Traits, ProviderName);
+	SetMetadataSize(Traits);
+
+	for (int Task = 0; Task < NUM_TRACE_TASKS; Task++)
+	{
+		std::vector<char>& Start = StartMetadata[Task];
+		Start.resize(sizeof(USHORT) + 1);
+		AppendName(Start, TaskNames[Task]);
+		AppendField(Start, "PathLength", TRACE_FIELD_UINT32);
+		SetMetadataSize(Start);
+
+		std::vector<char>& Stop = StopMetadata[Task];
+		Stop.resize(sizeof(USHORT) + 1);
+		AppendName(Stop, TaskNames[Task]);
+		AppendField(Stop, "PathLength", TRACE_FIELD_UINT32);
+		AppendField(Stop, "Result", TRACE_FIELD_UINT32);
+		AppendField(Stop, "DurationUs", TRACE_FIELD_UINT64);
+		SetMetadataSize(Stop);
+	}
+
+	if (EventRegister(&ProviderId, OnEnableProvider, NULL, &hProvider) != ERROR_SUCCESS)
+	{
+		hProvider = 0;
+		return;
+	}
+
+	// Windows 8 and later keep the description of the provider alongside its registration
+	HMODULE hAdvapi = GetModuleHandle(TEXT("advapi32.dll"));
+	EventSetInformationProc SetInformation =
+		hAdvapi != NULL ? (EventSetInformationProc)GetProcAddress(hAdvapi, "EventSetInformation") : NULL;
+	if (SetInformation != NULL)
+	{
+		SetInformation(hProvider, TRACE_PROVIDER_SET_TRAITS, &Traits[0], (ULONG)Traits.size());
+	}
+}
+
+TraceProvider::~TraceProvider()
+{
+	bTraceEnabled = false;
+	if (hProvider != 0)
+	{
+		EventUnregister(hProvider);
+		hProvider = 0;
+	}
+}
+
+void NTAPI OnEnableProvider(LPCGUID SourceId, ULONG IsEnabled, UCHAR Level, ULONGLONG MatchAnyKeyword,
+	ULONGLONG MatchAllKeyword, PEVENT_FILTER_DESCRIPTOR FilterData, PVOID CallbackContext)
+{
+	UNREFERENCED_PARAMETER(SourceId);
+	UNREFERENCED_PARAMETER(Level);
+	UNREFERENCED_PARAMETER(MatchAnyKeyword);
+	UNREFERENCED_PARAMETER(MatchAllKeyword);
+	UNREFERENCED_PARAMETER(FilterData);
+	UNREFERENCED_PARAMETER(CallbackContext);
+
+	if (IsEnabled == EVENT_CONTROL_CODE_ENABLE_PROVIDER)
+	{
+		bTraceEnabled = true;
+	}
+	else if (IsEnabled == EVENT_CONTROL_CODE_DISABLE_PROVIDER)
+	{
+		// Another session may still have the provider enabled
+		bTraceEnabled = Provider.hProvider != 0 && EventProviderEnabled(Provider.hProvider, 0, 0) != FALSE;
+	}
+}
+
+/**
+ * Writes an event of a task along with its description.
+ */
+void WriteEvent(TraceTask Task, UCHAR Opcode, const std::vector<char>& Metadata, EVENT_DATA_DESCRIPTOR* Data,
+	ULONG NumData)
+{
+	if (Provider.hProvider == 0)
+	{
+		return;
+	}
+
+	EVENT_DESCRIPTOR Descriptor;
+	EventDescCreate(&Descriptor, 0, 0, TRACE_CHANNEL_SELF_DESCRIBING, WINEVENT_LEVEL_VERBOSE, 0, Opcode,
+		TaskKeywords[Task]);
+
+	EventDataDescCreate(&Data[0], &Provider.Traits[0], (ULONG)Provider.Traits.size());
+	Data[0].Reserved = TRACE_DATA_PROVIDER_METADATA;
+	EventDataDescCreate(&Data[1], &Metadata[0], (ULONG)Metadata.size());
+	Data[1].Reserved = TRACE_DATA_EVENT_METADATA;
+
+	EventWrite(Provider.hProvider, &Descriptor, NumData, Data);
+}
+
+} // namespace
+
+void TraceStart(TraceTask Task, DWORD PathLength)
+{
+	EVENT_DATA_DESCRIPTOR Data[3];
+	EventDataDescCreate(&Data[2], &PathLength, sizeof(PathLength));
+	WriteEvent(Task, WINEVENT_OPCODE_START, Provider.StartMetadata[Task], Data, ARRAYSIZE(Data));
+}
+
+void TraceStop(TraceTask Task, DWORD PathLength, DWORD Result, LONGLONG Micros)
+{
+	ULONGLONG Duration = Micros > 0 ? (ULONGLONG)Micros : 0;
+
+	EVENT_DATA_DESCRIPTOR Data[5];
+	EventDataDescCreate(&Data[2], &PathLength, sizeof(PathLength));
+	EventDataDescCreate(&Data[3], &Result, sizeof(Result));
+	EventDataDescCreate(&Data[4], &Duration, sizeof(Duration));
+	WriteEvent(Task, WINEVENT_OPCODE_STOP, Provider.StopMetadata[Task], Data, ARRAYSIZE(Data));
+}
+
+void TraceTimer::Begin(LPCTSTR Path)
+{
+	PathLength = Path != NULL ? (DWORD)_tcslen(Path) : 0;
+	TraceStart(Task, PathLength);
+
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+	Start = Now.QuadPart;
+}
+
+void TraceTimer::End()
+{
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+	TraceStop(Task, PathLength, Result, (Now.QuadPart - Start) * 1000000 / Provider.Frequency.QuadPart);
+}
@@ -0,0 +1,281 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "ApplyJournal.h"
+#include "ErrorMessage.h"
+#include "MoveLinks.h"
+#include "ReparsePoint.h"
+
+namespace
+{
+
+/**
+ * Moves a single reparse point to its destination by renaming it, which keeps its reparse data, security descriptor
+ * and timestamps. The reparse data is only rewritten when the target changes.
+ *
+ * @param DestDirs The known state of the destination directories.
+ * @param hSrc The handle of the source reparse point, opened with DELETE access.
+ * @param Op The move to carry out.
+ * @return Returns zero if the operation was successful, ERROR_NOT_SAME_DEVICE if the destination is on another volume,
+ *		otherwise a non-zero value on failure.
+ */
+DWORD RenameLink(const DestinationCache& DestDirs, HANDLE hSrc, const LinkOp& Op)
+{
+	DWORD result = RenameDestinationLink(DestDirs, hSrc, Op.DestPath);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	if (_tcscmp(Op.NewTarget, Op.OldTarget) != 0)
+	{
+		// The source handle has no write access, which a rename doesn't need
+		HANDLE hDest = OpenReparsePoint(Op.DestPath, GENERIC_READ | GENERIC_WRITE);
+		if (hDest == INVALID_HANDLE_VALUE)
+		{
+			return GetLastError();
+		}
+
+		result = RetargetReparsePoint(hDest, Op.ReparseTag, Op.NewTarget, true);
+		CloseHandle(hDest);
+	}
+
+	return result;
+}
+
+/**
+ * Moves a single reparse point to its destination with its new target. Links are renamed while bRenameLinks is set,
+ * otherwise they are recreated at the destination and the originals are removed.
+ *
+ * @param Options The options of the move.
+ * @param Stats The statistics to record the move to.
+ * @param DestDirs The known state of the destination directories.
+ * @param bRenameLinks Set while links can be moved by renaming them, cleared once a rename reports another volume.
+ *		[IN/OUT]
+ * @param hSrc The handle of the source reparse point, opened with DELETE access.
+ * @param Op The move to carry out.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD MoveLink(const MoveLinkOptions& Options, MoveLinkStats& Stats, DestinationCache& DestDirs,
+	volatile LONG& bRenameLinks, HANDLE hSrc, const LinkOp& Op)
+{
+	DWORD result = ERROR_NOT_SAME_DEVICE;
+	if (bRenameLinks)
+	{
+		result = RenameLink(DestDirs, hSrc, Op);
+		if (result == ERROR_NOT_SAME_DEVICE)
+		{
+			InterlockedExchange(&bRenameLinks, FALSE);
+		}
+	}
+
+	bool bRenamed = result == 0;
+	if (result == ERROR_NOT_SAME_DEVICE)
+	{
+		// Create the link at the destination, replacing any link already there. Applying a manifest doesn't walk the
+		// source tree, so the destination directories may still be missing.
+		bool bDirectory = (Op.Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		result = CreateDestinationLink(DestDirs, Op.DestPath, Op.ReparseTag, Op.NewTarget, bDirectory);
+	}
+
+	if (result == 0)
+	{
+		if (Options.bVerbose)
+		{
+			_tprintf(TEXT("%s %s for %s <<===>> %s\n"),
+				Op.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT ? TEXT("junction") : TEXT("symbolic link"),
+				bRenamed ? TEXT("renamed") : TEXT("created"), GetDisplayPath(Op.DestPath), Op.NewTarget);
+		}
+
+		Stats.NumMoved++;
+
+		// Remove the original
+		if (!bRenamed)
+		{
+			result = RemoveReparsePoint(hSrc);
+		}
+	}
+
+	return result;
+}
+
+} // namespace
+
+MoveLinkAction::MoveLinkAction(const MoveLinkOptions& InOptions, MoveLinkStats& InStats, DestinationCache& InDestDirs,
+	const RebaseMap& InRules, LPCTSTR InDestRoot, bool bSameVolume, ManifestWriter* InPlan)
+	: Options(InOptions)
+	, Stats(InStats)
+	, DestDirs(InDestDirs)
+	, Rules(InRules)
+	, DestRoot(InDestRoot)
+	, Plan(InPlan)
+	, bRenameLinks(bSameVolume ? TRUE : FALSE)
+{
+}
+
+DWORD MoveLinkAction::OnDirectory(const WalkEntry& Entry)
+{
+	if (Plan != NULL)
+	{
+		return 0;
+	}
+
+	// Make sure the the destination directory exists. If not create it.
+	return DestDirs.EnsureDirectory(Entry.Path, JoinPath(*Entry.Arena, DestRoot, Entry.RelativePath));
+}
+
+DWORD MoveLinkAction::OnReparsePoint(const WalkEntry& Entry)
+{
+	// Is this a junction or a symlink?
+	if (Entry.ReparseTag != IO_REPARSE_TAG_MOUNT_POINT && Entry.ReparseTag != IO_REPARSE_TAG_SYMLINK)
+	{
+		_tprintf(TEXT("Unrecognized reparse point: %s\n"), GetDisplayPath(Entry.Path));
+		Stats.NumSkipped++;
+		return 0;
+	}
+
+	LinkOp Op;
+	Op.Attributes = Entry.Attributes;
+	Op.Path = Entry.Path;
+	Op.DestPath = JoinPath(*Entry.Arena, DestRoot, Entry.RelativePath);
+
+	// Open the source link once and keep the handle for removing it after the move. A plan only reads it.
+	HANDLE hSrc = OpenReparsePoint(Op.Path, Plan != NULL ? FILE_READ_ATTRIBUTES : FILE_READ_ATTRIBUTES | DELETE);
+	if (hSrc == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	// Work out the move by reading the existing target and rebasing it
+	DWORD result = ReadLinkTarget(hSrc, Op.ReparseTag, Op.OldTarget, *Entry.Arena);
+	if (result == 0)
+	{
+		Op.NewTarget = RebaseLinkTarget(Options, Rules, Op.OldTarget, *Entry.Arena);
+	}
+
+	if (result == 0 && Plan != NULL)
+	{
+		Plan->Write(Op);
+
+		if (Options.bVerbose)
+		{
+			_tprintf(TEXT("%s planned for %s <<===>> %s\n"),
+				Op.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT ? TEXT("junction") : TEXT("symbolic link"),
+				GetDisplayPath(Op.DestPath), Op.NewTarget);
+		}
+	}
+	else if (result == 0)
+	{
+		result = MoveLink(Options, Stats, DestDirs, bRenameLinks, hSrc, Op);
+	}
+
+	CloseHandle(hSrc);
+	return result;
+}
+
+MoveApplyAction::MoveApplyAction(const MoveLinkOptions& InOptions, MoveLinkStats& InStats,
+	DestinationCache& InDestDirs)
+	: Options(InOptions)
+	, Stats(InStats)
+	, DestDirs(InDestDirs)
+	, bRenameLinks(TRUE)
+{
+}
+
+DWORD MoveApplyAction::OnLinkOp(const LinkOp& Op, StringArena& Arena)
+{
+	HANDLE hSrc = OpenReparsePoint(Op.Path, FILE_READ_ATTRIBUTES | DELETE);
+	if (hSrc == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	bool bUnchanged = false;
+	DWORD result = CheckPlannedTarget(hSrc, Op, Arena, bUnchanged);
+	if (result == 0 && !bUnchanged)
+	{
+		_tprintf(TEXT("Changed since the plan was made: %s\n"), GetDisplayPath(Op.Path));
+		Stats.NumSkipped++;
+	}
+	else if (result == 0)
+	{
+		result = MoveLink(Options, Stats, DestDirs, bRenameLinks, hSrc, Op);
+	}
+
+	CloseHandle(hSrc);
+	return result;
+}
+
+DWORD MoveApplyAction::OnResumeLinkOp(const LinkOp& Op, StringArena& Arena)
+{
+	// A source that is still there was either not moved yet or recreated at the destination without being removed.
+	// Moving it again replaces whatever is at the destination.
+	HANDLE hSrc = OpenReparsePoint(Op.Path, FILE_READ_ATTRIBUTES);
+	if (hSrc != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hSrc);
+		return OnLinkOp(Op, Arena);
+	}
+
+	DWORD result = GetLastError();
+	if (result != ERROR_FILE_NOT_FOUND && result != ERROR_PATH_NOT_FOUND)
+	{
+		return result;
+	}
+
+	// Otherwise the link reached the destination, though a rename may have stopped short of the new target
+	HANDLE hDest = OpenReparsePoint(Op.DestPath, GENERIC_READ | GENERIC_WRITE);
+	if (hDest == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	LinkOpProgress Progress = LINK_OP_CHANGED;
+	result = GetLinkOpProgress(hDest, Op, Arena, Progress);
+	bool bMoved = Progress == LINK_OP_PLANNED || Progress == LINK_OP_DONE;
+	if (result == 0 && !bMoved)
+	{
+		_tprintf(TEXT("Changed since the plan was made: %s\n"), GetDisplayPath(Op.DestPath));
+		Stats.NumSkipped++;
+	}
+	else if (result == 0 && Progress == LINK_OP_PLANNED && _tcscmp(Op.NewTarget, Op.OldTarget) != 0)
+	{
+		result = RetargetReparsePoint(hDest, Op.ReparseTag, Op.NewTarget, true);
+	}
+
+	if (result == 0 && bMoved)
+	{
+		Stats.NumMoved++;
+	}
+
+	CloseHandle(hDest);
+	return result;
+}
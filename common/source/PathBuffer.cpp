@@ -0,0 +1,276 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "PathBuffer.h"
+
+/** The size of the paths reserved up front, in characters. */
+#define INITIAL_PATH_SIZE MAX_PATH
+
+/** The size of the blocks allocated by the string arena, in characters. */
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+PathBuffer::PathBuffer()
+	: Buffer(INITIAL_PATH_SIZE)
+	, Length(0)
+{
+	Buffer[0] = 0;
+}
+
+void PathBuffer::Reserve(size_t NumChars)
+{
+	if (NumChars > Buffer.size())
+	{
+		// Grow geometrically so that deep trees only reallocate a handful of times
+		size_t NewSize = Buffer.size() * 2;
+		Buffer.resize(NewSize > NumChars ? NewSize : NumChars);
+	}
+}
+
+void PathBuffer::Assign(LPCTSTR Path, size_t PathLength)
+{
+	Reserve(PathLength + 1);
+	memcpy(&Buffer[0], Path, PathLength * sizeof(TCHAR));
+	Length = PathLength;
+	Buffer[Length] = 0;
+}
+
+size_t PathBuffer::Push(LPCTSTR Component)
+{
+	size_t PrevLength = Length;
+	size_t ComponentLength = _tcslen(Component);
+	bool bSeparator = Length == 0 || Buffer[Length - 1] != '\\';
+
+	Reserve(Length + ComponentLength + 2);
+	if (bSeparator)
+	{
+		Buffer[Length++] = '\\';
+	}
+	memcpy(&Buffer[Length], Component, ComponentLength * sizeof(TCHAR));
+	Length += ComponentLength;
+	Buffer[Length] = 0;
+
+	return PrevLength;
+}
+
+void PathBuffer::Append(LPCTSTR RelativePath)
+{
+	if (RelativePath[0] == '\\')
+	{
+		RelativePath++;
+	}
+
+	if (RelativePath[0] != 0)
+	{
+		Push(RelativePath);
+	}
+}
+
+void PathBuffer::Pop(size_t PathLength)
+{
+	Length = PathLength;
+	Buffer[Length] = 0;
+}
+
+StringArena::StringArena()
+	: CurrentBlock(0)
+	, Used(0)
+{
+}
+
+StringArena::~StringArena()
+{
+	for (size_t i = 0; i < Blocks.size(); i++)
+	{
+		delete[] Blocks[i].Data;
+	}
+}
+
+LPTSTR StringArena::Allocate(size_t NumChars)
+{
+	// Move on to the next block that is large enough, allocating one if needed
+	while (CurrentBlock < Blocks.size() && Used + NumChars > Blocks[CurrentBlock].Size)
+	{
+		CurrentBlock++;
+		Used = 0;
+	}
+
+	if (CurrentBlock == Blocks.size())
+	{
+		Block NewBlock;
+		NewBlock.Size = NumChars > ARENA_BLOCK_SIZE ? NumChars : ARENA_BLOCK_SIZE;
+		NewBlock.Data = new TCHAR[NewBlock.Size];
+		Blocks.push_back(NewBlock);
+		Used = 0;
+	}
+
+	LPTSTR Str = Blocks[CurrentBlock].Data + Used;
+	Used += NumChars;
+	Str[0] = 0;
+	return Str;
+}
+
+void StringArena::Reset()
+{
+	CurrentBlock = 0;
+	Used = 0;
+}
+
+DWORD GetLongPath(LPCTSTR Path, tstring& LongPath)
+{
+	// Extended-length and device paths are never normalized so they are used as is
+	if (_tcsncmp(Path, TEXT("\\\\?\\"), 4) == 0 || _tcsncmp(Path, TEXT("\\\\.\\"), 4) == 0)
+	{
+		LongPath = Path;
+		return 0;
+	}
+
+	DWORD length = GetFullPathName(Path, 0, NULL, NULL);
+	if (length == 0)
+	{
+		return GetLastError();
+	}
+
+	std::vector<TCHAR> FullPath(length);
+	length = GetFullPathName(Path, length, &FullPath[0], NULL);
+	if (length == 0)
+	{
+		return GetLastError();
+	}
+
+	// UNC paths become \\?\UNC\server\share
+	if (FullPath[0] == '\\' && FullPath[1] == '\\')
+	{
+		LongPath = TEXT("\\\\?\\UNC");
+		LongPath += &FullPath[1];
+	}
+	else
+	{
+		LongPath = TEXT("\\\\?\\");
+		LongPath += &FullPath[0];
+	}
+
+	return 0;
+}
+
+tstring JoinPath(LPCTSTR Root, const tstring& RelativePath)
+{
+	tstring Path = Root;
+	if (!Path.empty() && Path[Path.size() - 1] == '\\' && !RelativePath.empty() && RelativePath[0] == '\\')
+	{
+		Path.append(RelativePath, 1, tstring::npos);
+	}
+	else
+	{
+		Path += RelativePath;
+	}
+
+	return Path;
+}
+
+LPCTSTR JoinPath(StringArena& Arena, LPCTSTR Root, LPCTSTR RelativePath)
+{
+	size_t rootLength = _tcslen(Root);
+	if (rootLength > 0 && Root[rootLength - 1] == '\\' && RelativePath[0] == '\\')
+	{
+		RelativePath++;
+	}
+
+	size_t relativeLength = _tcslen(RelativePath);
+	LPTSTR Path = Arena.Allocate(rootLength + relativeLength + 1);
+	memcpy(Path, Root, rootLength * sizeof(TCHAR));
+	memcpy(Path + rootLength, RelativePath, (relativeLength + 1) * sizeof(TCHAR));
+	return Path;
+}
+
+DWORD CreateParentDirectories(LPCTSTR Path)
+{
+	// Climb up until a parent can be created or already exists, remembering the ones that were missing
+	tstring Parent = Path;
+	std::vector<size_t> Missing;
+	for (;;)
+	{
+		size_t Separator = Parent.find_last_of('\\');
+		if (Separator == tstring::npos || Separator == 0)
+		{
+			return ERROR_PATH_NOT_FOUND;
+		}
+
+		Parent.resize(Separator);
+		if (CreateDirectory(Parent.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			break;
+		}
+
+		if (GetLastError() != ERROR_PATH_NOT_FOUND)
+		{
+			return GetLastError();
+		}
+
+		Missing.push_back(Separator);
+	}
+
+	// Then create the missing directories on the way back down
+	for (size_t i = Missing.size(); i > 0; i--)
+	{
+		Parent.assign(Path, Missing[i - 1]);
+		if (!CreateDirectory(Parent.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		{
+			return GetLastError();
+		}
+	}
+
+	return 0;
+}
+
+LPCTSTR GetDisplayPath(LPCTSTR Path)
+{
+	// UNC paths can't be shortened without copying them so they are displayed as is
+	if (_tcsncmp(Path, TEXT("\\\\?\\"), 4) == 0 && _tcsncmp(Path, TEXT("\\\\?\\UNC\\"), 8) != 0)
+	{
+		return Path + 4;
+	}
+
+	return Path;
+}
+
+bool IsSameVolume(LPCTSTR Path, LPCTSTR OtherPath)
+{
+	// Volume mount points are part of the answer, so a volume mounted into a folder counts as another volume
+	std::vector<TCHAR> Volume(_tcslen(Path) + 1);
+	std::vector<TCHAR> OtherVolume(_tcslen(OtherPath) + 1);
+	if (!GetVolumePathName(Path, &Volume[0], (DWORD)Volume.size()) ||
+		!GetVolumePathName(OtherPath, &OtherVolume[0], (DWORD)OtherVolume.size()))
+	{
+		return false;
+	}
+
+	return _tcsicmp(&Volume[0], &OtherVolume[0]) == 0;
+}
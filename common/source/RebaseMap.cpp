@@ -0,0 +1,274 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <map>
+
+#include "RebaseMap.h"
+
+namespace
+{
+
+/** The longest line accepted in a rule file, in characters. Each rule holds two paths of up to 32767 characters. */
+#define MAX_RULE_LINE (2 * 32768)
+
+/**
+ * A node of the trie while it is being built.
+ */
+struct BuildNode
+{
+	std::map<TCHAR, size_t> Children;
+	int RuleIdx;
+
+	BuildNode()
+		: RuleIdx(-1)
+	{
+	}
+};
+
+/**
+ * Returns the length of the path without its trailing separators so that rules compare on whole components.
+ */
+size_t GetBaseLength(LPCTSTR Path)
+{
+	size_t Length = _tcslen(Path);
+	while (Length > 1 && Path[Length - 1] == '\\')
+	{
+		Length--;
+	}
+
+	return Length;
+}
+
+/**
+ * Strips the leading and trailing white space of a string in place.
+ */
+LPTSTR Trim(LPTSTR Str)
+{
+	while (*Str == ' ' || *Str == '\t')
+	{
+		Str++;
+	}
+
+	size_t Length = _tcslen(Str);
+	while (Length > 0 && (Str[Length - 1] == ' ' || Str[Length - 1] == '\t' || Str[Length - 1] == '\r' ||
+		Str[Length - 1] == '\n'))
+	{
+		Str[--Length] = 0;
+	}
+
+	return Str;
+}
+
+} // namespace
+
+RebaseMap::RebaseMap()
+{
+}
+
+DWORD RebaseMap::Load(LPCTSTR Path)
+{
+	FILE* File = NULL;
+	if (_tfopen_s(&File, Path, TEXT("r, ccs=UTF-8")) != 0 || File == NULL)
+	{
+		DWORD attributes = GetFileAttributes(Path);
+		return attributes == INVALID_FILE_ATTRIBUTES ? ERROR_FILE_NOT_FOUND : ERROR_READ_FAULT;
+	}
+
+	DWORD result = 0;
+	std::vector<TCHAR> Line(MAX_RULE_LINE);
+	int LineNumber = 0;
+	while (result == 0 && _fgetts(&Line[0], (int)Line.size(), File) != NULL)
+	{
+		LineNumber++;
+
+		LPTSTR Rule = Trim(&Line[0]);
+		if (Rule[0] == 0 || Rule[0] == ';')
+		{
+			continue;
+		}
+
+		// '|' can't appear in a path so it separates the old base from the new one unambiguously
+		LPTSTR Separator = _tcschr(Rule, '|');
+		if (Separator == NULL)
+		{
+			_tprintf(TEXT("Error: Missing '|' on line %d of %s.\n"), LineNumber, Path);
+			result = ERROR_INVALID_DATA;
+			break;
+		}
+
+		*Separator = 0;
+		LPTSTR OldBase = Trim(Rule);
+		LPTSTR NewBase = Trim(Separator + 1);
+		if (OldBase[0] == 0 || NewBase[0] == 0)
+		{
+			_tprintf(TEXT("Error: Empty path on line %d of %s.\n"), LineNumber, Path);
+			result = ERROR_INVALID_DATA;
+			break;
+		}
+
+		AddRule(OldBase, NewBase);
+	}
+
+	if (result == 0 && ferror(File) != 0)
+	{
+		result = ERROR_READ_FAULT;
+	}
+	fclose(File);
+
+	if (result == 0)
+	{
+		Compile();
+	}
+
+	return result;
+}
+
+void RebaseMap::AddRule(LPCTSTR OldBase, LPCTSTR NewBase)
+{
+	Rule NewRule;
+	NewRule.OldBase.assign(OldBase, GetBaseLength(OldBase));
+	NewRule.NewBase.assign(NewBase, GetBaseLength(NewBase));
+	Rules.push_back(NewRule);
+}
+
+void RebaseMap::Compile()
+{
+	// Insert every rule into a temporary trie. Later rules for the same base replace earlier ones.
+	std::vector<BuildNode> BuildNodes(1);
+	for (size_t i = 0; i < Rules.size(); i++)
+	{
+		const tstring& OldBase = Rules[i].OldBase;
+
+		size_t NodeIdx = 0;
+		for (size_t c = 0; c < OldBase.size(); c++)
+		{
+			TCHAR Char = Fold(OldBase[c]);
+			std::map<TCHAR, size_t>::iterator Child = BuildNodes[NodeIdx].Children.find(Char);
+			if (Child != BuildNodes[NodeIdx].Children.end())
+			{
+				NodeIdx = Child->second;
+			}
+			else
+			{
+				BuildNodes[NodeIdx].Children[Char] = BuildNodes.size();
+				NodeIdx = BuildNodes.size();
+				BuildNodes.push_back(BuildNode());
+			}
+		}
+
+		BuildNodes[NodeIdx].RuleIdx = (int)i;
+	}
+
+	// Flatten the trie so that the children of each node are contiguous and sorted, ready for a binary search
+	Nodes.resize(BuildNodes.size());
+	Edges.clear();
+	Edges.reserve(BuildNodes.size() - 1);
+	for (size_t i = 0; i < BuildNodes.size(); i++)
+	{
+		Nodes[i].FirstEdge = (UINT)Edges.size();
+		Nodes[i].NumEdges = (UINT)BuildNodes[i].Children.size();
+		Nodes[i].RuleIdx = BuildNodes[i].RuleIdx;
+
+		for (std::map<TCHAR, size_t>::const_iterator Child = BuildNodes[i].Children.begin();
+			Child != BuildNodes[i].Children.end(); ++Child)
+		{
+			Edge NewEdge;
+			NewEdge.Char = Child->first;
+			NewEdge.Child = (UINT)Child->second;
+			Edges.push_back(NewEdge);
+		}
+	}
+}
+
+const RebaseMap::Node* RebaseMap::FindChild(const Node& Parent, TCHAR Char) const
+{
+	UINT Low = Parent.FirstEdge;
+	UINT High = Parent.FirstEdge + Parent.NumEdges;
+	while (Low < High)
+	{
+		UINT Mid = Low + (High - Low) / 2;
+		if (Edges[Mid].Char < Char)
+		{
+			Low = Mid + 1;
+		}
+		else
+		{
+			High = Mid;
+		}
+	}
+
+	if (Low < Parent.FirstEdge + Parent.NumEdges && Edges[Low].Char == Char)
+	{
+		return &Nodes[Edges[Low].Child];
+	}
+
+	return NULL;
+}
+
+LPCTSTR RebaseMap::Apply(LPCTSTR Target, StringArena& Arena) const
+{
+	if (Nodes.empty())
+	{
+		return NULL;
+	}
+
+	// Walk down the trie once, remembering the deepest rule that ends on a component boundary of the target
+	int MatchIdx = -1;
+	size_t MatchLength = 0;
+	const Node* Current = &Nodes[0];
+	for (size_t i = 0; Current != NULL; i++)
+	{
+		if (Current->RuleIdx >= 0 && (Target[i] == 0 || Target[i] == '\\'))
+		{
+			MatchIdx = Current->RuleIdx;
+			MatchLength = i;
+		}
+
+		if (Target[i] == 0)
+		{
+			break;
+		}
+
+		Current = FindChild(*Current, Fold(Target[i]));
+	}
+
+	if (MatchIdx < 0)
+	{
+		return NULL;
+	}
+
+	const tstring& NewBase = Rules[MatchIdx].NewBase;
+	size_t RestLength = _tcslen(Target + MatchLength);
+	LPTSTR NewTarget = Arena.Allocate(NewBase.size() + RestLength + 1);
+	memcpy(NewTarget, NewBase.c_str(), NewBase.size() * sizeof(TCHAR));
+	memcpy(NewTarget + NewBase.size(), Target + MatchLength, (RestLength + 1) * sizeof(TCHAR));
+	return NewTarget;
+}
@@ -0,0 +1,110 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <functional>
+
+#include "ReparseDataCache.h"
+
+/** The size of the fields that come before the data of every kind of reparse point. */
+#define REPARSE_DATA_HEADER_SIZE FIELD_OFFSET(REPARSE_DATA_BUFFER, GenericReparseBuffer)
+
+ReparseDataCache::ReparseDataCache()
+{
+	for (int i = 0; i < REPARSE_DATA_CACHE_SHARDS; i++)
+	{
+		InitializeCriticalSection(&Shards[i].Lock);
+	}
+}
+
+ReparseDataCache::~ReparseDataCache()
+{
+	for (int i = 0; i < REPARSE_DATA_CACHE_SHARDS; i++)
+	{
+		DeleteCriticalSection(&Shards[i].Lock);
+	}
+}
+
+std::string ReparseDataCache::GetKey(const ReparsePointInfo& Info)
+{
+	size_t Size = REPARSE_DATA_HEADER_SIZE + Info.Data.Header.ReparseDataLength;
+	if (Size > sizeof(Info.Data.Raw))
+	{
+		Size = sizeof(Info.Data.Raw);
+	}
+
+	return std::string((const char*)Info.Data.Raw, Size);
+}
+
+const PreparedLink* ReparseDataCache::Find(const ReparsePointInfo& Info) const
+{
+	std::string Key = GetKey(Info);
+	const Shard& Part = Shards[std::hash<std::string>()(Key) % REPARSE_DATA_CACHE_SHARDS];
+
+	EnterCriticalSection(&Part.Lock);
+	std::unordered_map<std::string, PreparedLink>::const_iterator Entry = Part.Entries.find(Key);
+	const PreparedLink* Link = Entry != Part.Entries.end() ? &Entry->second : NULL;
+	LeaveCriticalSection(&Part.Lock);
+
+	return Link;
+}
+
+const PreparedLink* ReparseDataCache::Add(const ReparsePointInfo& Info, const PreparedLink& Link)
+{
+	std::string Key = GetKey(Info);
+	Shard& Part = Shards[std::hash<std::string>()(Key) % REPARSE_DATA_CACHE_SHARDS];
+
+	// The elements of the map stay where they are as it grows, so the copy can be handed out beyond the lock. Nothing
+	// is ever evicted for the same reason
+	const PreparedLink* Cached = NULL;
+	EnterCriticalSection(&Part.Lock);
+	std::unordered_map<std::string, PreparedLink>::const_iterator Entry = Part.Entries.find(Key);
+	if (Entry != Part.Entries.end())
+	{
+		Cached = &Entry->second;
+	}
+	else if (Part.Entries.size() < REPARSE_DATA_CACHE_MAX_ENTRIES / REPARSE_DATA_CACHE_SHARDS)
+	{
+		Cached = &Part.Entries.insert(std::make_pair(Key, Link)).first->second;
+	}
+	LeaveCriticalSection(&Part.Lock);
+
+	return Cached;
+}
+
+void ReparseDataCache::Clear()
+{
+	for (int i = 0; i < REPARSE_DATA_CACHE_SHARDS; i++)
+	{
+		EnterCriticalSection(&Shards[i].Lock);
+		Shards[i].Entries.clear();
+		LeaveCriticalSection(&Shards[i].Lock);
+	}
+}
@@ -0,0 +1,808 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <strsafe.h>
+#include <vector>
+
+#include "PathBuffer.h"
+#include "RunMetrics.h"
+#include "ReparsePoint.h"
+
+#ifndef UNICODE
+#error "ReparsePoint requires a Unicode build."
+#endif
+
+/** The size of the fields common to all reparse data buffers (tag, data length and reserved). */
+#define REPARSE_DATA_HEADER_SIZE FIELD_OFFSET(REPARSE_DATA_BUFFER, GenericReparseBuffer)
+
+/** The prefix of absolute paths in the NT object namespace. */
+#define NT_PATH_PREFIX L"\\??\\"
+#define NT_PATH_PREFIX_LENGTH 4
+
+/** The prefix of UNC paths in the NT object namespace. */
+#define NT_UNC_PATH_PREFIX L"\\??\\UNC\\"
+#define NT_UNC_PATH_PREFIX_LENGTH 8
+
+/** The prefix of the volume names that volume mount points point to in the NT object namespace. */
+#define NT_VOLUME_PREFIX L"\\??\\Volume{"
+#define NT_VOLUME_PREFIX_LENGTH 11
+
+namespace
+{
+
+/**
+ * Returns true if Str begins with the given prefix.
+ */
+bool StartsWith(LPCWSTR Str, size_t StrLength, LPCWSTR Prefix, size_t PrefixLength)
+{
+	return StrLength >= PrefixLength && memcmp(Str, Prefix, PrefixLength * sizeof(WCHAR)) == 0;
+}
+
+/**
+ * Returns the start of the path buffer of the given reparse data.
+ */
+const WCHAR* GetPathBuffer(const ReparsePointInfo& Info)
+{
+	if (Info.ReparseTag == IO_REPARSE_TAG_SYMLINK)
+	{
+		return Info.Data.Header.SymbolicLinkReparseBuffer.PathBuffer;
+	}
+
+	return Info.Data.Header.MountPointReparseBuffer.PathBuffer;
+}
+
+/**
+ * A buffer large enough to hold the reparse data of any reparse point.
+ */
+union ReparseDataBuffer
+{
+	REPARSE_DATA_BUFFER Header;
+	BYTE Raw[MAXIMUM_REPARSE_DATA_BUFFER_SIZE];
+};
+
+/**
+ * Writes previously built reparse data to an open file object.
+ */
+DWORD WriteReparseData(HANDLE hLink, const REPARSE_DATA_BUFFER& Data, DWORD DataSize)
+{
+	MetricTimer Timer(MetricSetTarget, GetReparseDataTargetLength(Data));
+	DWORD bytesReturned = 0;
+	if (!DeviceIoControl(hLink, FSCTL_SET_REPARSE_POINT, (LPVOID)&Data, DataSize, NULL, 0, &bytesReturned, NULL))
+	{
+		return Timer.SetResult(GetLastError());
+	}
+
+	return 0;
+}
+
+/** The native API types used to create links relative to their parent directory, with flags from ntfstypes.h. */
+typedef LONG NTSTATUS;
+
+struct NtUnicodeString
+{
+	USHORT Length;
+	USHORT MaximumLength;
+	PWSTR Buffer;
+};
+
+struct NtObjectAttributes
+{
+	ULONG Length;
+	HANDLE RootDirectory;
+	NtUnicodeString* ObjectName;
+	ULONG Attributes;
+	PVOID SecurityDescriptor;
+	PVOID SecurityQualityOfService;
+};
+
+struct NtIoStatusBlock
+{
+	union
+	{
+		NTSTATUS Status;
+		PVOID Pointer;
+	};
+	ULONG_PTR Information;
+};
+
+typedef NTSTATUS (WINAPI* NtCreateFileProc)(PHANDLE FileHandle, ACCESS_MASK DesiredAccess,
+	NtObjectAttributes* ObjectAttributes, NtIoStatusBlock* IoStatusBlock, PLARGE_INTEGER AllocationSize,
+	ULONG FileAttributes, ULONG ShareAccess, ULONG CreateDisposition, ULONG CreateOptions, PVOID EaBuffer,
+	ULONG EaLength);
+typedef ULONG (WINAPI* RtlNtStatusToDosErrorProc)(NTSTATUS Status);
+
+/**
+ * The native API entry points, looked up once at startup. Both are NULL if ntdll doesn't export them.
+ */
+struct NativeApi
+{
+	NtCreateFileProc NtCreateFile;
+	RtlNtStatusToDosErrorProc RtlNtStatusToDosError;
+
+	NativeApi()
+		: NtCreateFile(NULL)
+		, RtlNtStatusToDosError(NULL)
+	{
+		HMODULE hNtdll = GetModuleHandle(TEXT("ntdll.dll"));
+		if (hNtdll != NULL)
+		{
+			NtCreateFile = (NtCreateFileProc)GetProcAddress(hNtdll, "NtCreateFile");
+			RtlNtStatusToDosError = (RtlNtStatusToDosErrorProc)GetProcAddress(hNtdll, "RtlNtStatusToDosError");
+		}
+
+		if (NtCreateFile == NULL || RtlNtStatusToDosError == NULL)
+		{
+			NtCreateFile = NULL;
+			RtlNtStatusToDosError = NULL;
+		}
+	}
+};
+
+const NativeApi Native;
+
+/**
+ * Returns the length of the parent directory part of a path, i.e. the position of its last separator.
+ */
+size_t GetParentLength(LPCTSTR Path)
+{
+	LPCTSTR Separator = _tcsrchr(Path, '\\');
+	return Separator != NULL ? Separator - Path : 0;
+}
+
+/**
+ * Orders link requests by parent directory so that the links of each directory are created together.
+ */
+struct ParentOrder
+{
+	const LinkRequest* Requests;
+
+	bool operator()(size_t Left, size_t Right) const
+	{
+		LPCTSTR LeftPath = Requests[Left].Path;
+		LPCTSTR RightPath = Requests[Right].Path;
+		size_t LeftLength = GetParentLength(LeftPath);
+		size_t RightLength = GetParentLength(RightPath);
+
+		int order = _tcsnicmp(LeftPath, RightPath, LeftLength < RightLength ? LeftLength : RightLength);
+		return order != 0 ? order < 0 : LeftLength < RightLength;
+	}
+};
+
+/**
+ * Creates a single link relative to an open handle of its parent directory.
+ */
+DWORD CreateRelativeReparsePoint(HANDLE hParent, const LinkRequest& Request, ReparseDataBuffer& Data)
+{
+	// Reparse data the caller already built is written as is
+	const REPARSE_DATA_BUFFER* LinkData = Request.Data;
+	DWORD dataSize = Request.DataSize;
+	DWORD result = 0;
+	if (LinkData == NULL)
+	{
+		result = BuildReparseData(Request.ReparseTag, Request.Target, &Data.Header, sizeof(Data), &dataSize);
+		if (result != 0)
+		{
+			return result;
+		}
+		LinkData = &Data.Header;
+	}
+
+	LPCTSTR Name = Request.Path + GetParentLength(Request.Path) + 1;
+	NtUnicodeString ObjectName;
+	ObjectName.Length = (USHORT)(_tcslen(Name) * sizeof(WCHAR));
+	ObjectName.MaximumLength = ObjectName.Length;
+	ObjectName.Buffer = (PWSTR)Name;
+
+	NtObjectAttributes Attributes;
+	Attributes.Length = sizeof(Attributes);
+	Attributes.RootDirectory = hParent;
+	Attributes.ObjectName = &ObjectName;
+	Attributes.Attributes = OBJ_CASE_INSENSITIVE;
+	Attributes.SecurityDescriptor = NULL;
+	Attributes.SecurityQualityOfService = NULL;
+
+	// Directories are created and opened in one go
+	bool bDirectory = Request.bDirectory || Request.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT;
+	ULONG CreateOptions = (bDirectory ? FILE_DIRECTORY_FILE : FILE_NON_DIRECTORY_FILE) |
+		FILE_OPEN_REPARSE_POINT | FILE_OPEN_FOR_BACKUP_INTENT | FILE_SYNCHRONOUS_IO_NONALERT;
+
+	HANDLE hLink = NULL;
+	NtIoStatusBlock IoStatus;
+	LONGLONG CreateStart = StartLatency(MetricCreate, ObjectName.Length / sizeof(WCHAR));
+	NTSTATUS status = Native.NtCreateFile(&hLink, GENERIC_WRITE | DELETE | SYNCHRONIZE, &Attributes, &IoStatus, NULL,
+		FILE_ATTRIBUTE_NORMAL, 0, FILE_CREATE, CreateOptions, NULL, 0);
+	result = status < 0 ? Native.RtlNtStatusToDosError(status) : 0;
+	RecordLatency(MetricCreate, CreateStart, ObjectName.Length / sizeof(WCHAR), result);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	result = WriteReparseData(hLink, *LinkData, dataSize);
+	if (result != 0)
+	{
+		// Don't leave an ordinary file or directory behind in place of the link
+		RemoveReparsePoint(hLink);
+	}
+
+	CloseHandle(hLink);
+	return result;
+}
+
+} // namespace
+
+HANDLE OpenReparsePoint(LPCTSTR Path, DWORD DesiredAccess)
+{
+	// FILE_FLAG_OPEN_REPARSE_POINT opens the link itself while FILE_FLAG_BACKUP_SEMANTICS is required for directories
+	return CreateFile(Path, DesiredAccess, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+}
+
+DWORD QueryReparsePoint(HANDLE hLink, ReparsePointInfo& Info)
+{
+	LONGLONG Start = StartLatency(MetricGetTarget, 0);
+
+	DWORD bytesReturned = 0;
+	DWORD result = 0;
+	if (!DeviceIoControl(hLink, FSCTL_GET_REPARSE_POINT, NULL, 0, &Info.Data, sizeof(Info.Data), &bytesReturned, NULL))
+	{
+		result = GetLastError();
+	}
+	else
+	{
+		result = ParseReparseData(Info, bytesReturned);
+	}
+
+	RecordLatency(MetricGetTarget, Start, result == 0 ? GetReparseDataTargetLength(Info.Data.Header) : 0, result);
+	return result;
+}
+
+DWORD ParseReparseData(ReparsePointInfo& Info, DWORD DataSize)
+{
+	const REPARSE_DATA_BUFFER& Buffer = Info.Data.Header;
+	Info.ReparseTag = Buffer.ReparseTag;
+	Info.Flags = 0;
+
+	DWORD pathBufferOffset = 0;
+	switch (Buffer.ReparseTag)
+	{
+	case IO_REPARSE_TAG_MOUNT_POINT:
+		Info.SubstituteNameOffset = Buffer.MountPointReparseBuffer.SubstituteNameOffset / sizeof(WCHAR);
+		Info.SubstituteNameLength = Buffer.MountPointReparseBuffer.SubstituteNameLength / sizeof(WCHAR);
+		Info.PrintNameOffset = Buffer.MountPointReparseBuffer.PrintNameOffset / sizeof(WCHAR);
+		Info.PrintNameLength = Buffer.MountPointReparseBuffer.PrintNameLength / sizeof(WCHAR);
+		pathBufferOffset = FIELD_OFFSET(REPARSE_DATA_BUFFER, MountPointReparseBuffer.PathBuffer);
+		break;
+	case IO_REPARSE_TAG_SYMLINK:
+		Info.SubstituteNameOffset = Buffer.SymbolicLinkReparseBuffer.SubstituteNameOffset / sizeof(WCHAR);
+		Info.SubstituteNameLength = Buffer.SymbolicLinkReparseBuffer.SubstituteNameLength / sizeof(WCHAR);
+		Info.PrintNameOffset = Buffer.SymbolicLinkReparseBuffer.PrintNameOffset / sizeof(WCHAR);
+		Info.PrintNameLength = Buffer.SymbolicLinkReparseBuffer.PrintNameLength / sizeof(WCHAR);
+		Info.Flags = Buffer.SymbolicLinkReparseBuffer.Flags;
+		pathBufferOffset = FIELD_OFFSET(REPARSE_DATA_BUFFER, SymbolicLinkReparseBuffer.PathBuffer);
+		break;
+	default:
+		// Other reparse points carry data we don't understand
+		Info.SubstituteNameOffset = 0;
+		Info.SubstituteNameLength = 0;
+		Info.PrintNameOffset = 0;
+		Info.PrintNameLength = 0;
+		return 0;
+	}
+
+	// Make sure both names are within the data returned by the file system
+	DWORD substituteEnd = pathBufferOffset + (Info.SubstituteNameOffset + Info.SubstituteNameLength) * sizeof(WCHAR);
+	DWORD printEnd = pathBufferOffset + (Info.PrintNameOffset + Info.PrintNameLength) * sizeof(WCHAR);
+	if (substituteEnd > DataSize || printEnd > DataSize)
+	{
+		return ERROR_INVALID_REPARSE_DATA;
+	}
+
+	return 0;
+}
+
+DWORD GetReparsePointTarget(const ReparsePointInfo& Info, LPTSTR TargetPath, size_t TargetSize)
+{
+	if (Info.ReparseTag != IO_REPARSE_TAG_MOUNT_POINT && Info.ReparseTag != IO_REPARSE_TAG_SYMLINK)
+	{
+		return ERROR_REPARSE_TAG_INVALID;
+	}
+
+	// The substitute name is what the file system actually follows, the print name is only used as a fallback
+	const WCHAR* Name = GetPathBuffer(Info) + Info.SubstituteNameOffset;
+	size_t NameLength = Info.SubstituteNameLength;
+	if (NameLength == 0)
+	{
+		Name = GetPathBuffer(Info) + Info.PrintNameOffset;
+		NameLength = Info.PrintNameLength;
+	}
+
+	// Convert absolute paths from the NT namespace back to a DOS path
+	HRESULT hr;
+	if (StartsWith(Name, NameLength, NT_UNC_PATH_PREFIX, NT_UNC_PATH_PREFIX_LENGTH))
+	{
+		hr = StringCchCopy(TargetPath, TargetSize, TEXT("\\\\"));
+		if (SUCCEEDED(hr))
+		{
+			hr = StringCchCatN(TargetPath, TargetSize, Name + NT_UNC_PATH_PREFIX_LENGTH,
+				NameLength - NT_UNC_PATH_PREFIX_LENGTH);
+		}
+	}
+	else if (StartsWith(Name, NameLength, NT_VOLUME_PREFIX, NT_VOLUME_PREFIX_LENGTH))
+	{
+		// Volume names have no DOS form so they keep the extended-length prefix, as in \\?\Volume{GUID}
+		hr = StringCchCopy(TargetPath, TargetSize, TEXT("\\\\?\\"));
+		if (SUCCEEDED(hr))
+		{
+			hr = StringCchCatN(TargetPath, TargetSize, Name + NT_PATH_PREFIX_LENGTH, NameLength - NT_PATH_PREFIX_LENGTH);
+		}
+	}
+	else if (StartsWith(Name, NameLength, NT_PATH_PREFIX, NT_PATH_PREFIX_LENGTH))
+	{
+		hr = StringCchCopyN(TargetPath, TargetSize, Name + NT_PATH_PREFIX_LENGTH, NameLength - NT_PATH_PREFIX_LENGTH);
+	}
+	else
+	{
+		hr = StringCchCopyN(TargetPath, TargetSize, Name, NameLength);
+	}
+
+	return SUCCEEDED(hr) ? 0 : ERROR_INSUFFICIENT_BUFFER;
+}
+
+DWORD GetReparseDataTargetLength(const REPARSE_DATA_BUFFER& Data)
+{
+	switch (Data.ReparseTag)
+	{
+	case IO_REPARSE_TAG_MOUNT_POINT:
+		return Data.MountPointReparseBuffer.SubstituteNameLength / sizeof(WCHAR);
+	case IO_REPARSE_TAG_SYMLINK:
+		return Data.SymbolicLinkReparseBuffer.SubstituteNameLength / sizeof(WCHAR);
+	}
+
+	return 0;
+}
+
+size_t GetReparsePointTargetSize(const ReparsePointInfo& Info)
+{
+	// Converting a UNC path back from the NT namespace never makes it longer than the name itself
+	size_t NameLength = Info.SubstituteNameLength != 0 ? Info.SubstituteNameLength : Info.PrintNameLength;
+	return NameLength + 1;
+}
+
+DWORD BuildReparseData(DWORD ReparseTag, LPCTSTR TargetPath, REPARSE_DATA_BUFFER* Buffer, DWORD BufferSize,
+	DWORD* DataSize)
+{
+	size_t targetLength = 0;
+	if (FAILED(StringCchLength(TargetPath, MAXIMUM_REPARSE_DATA_BUFFER_SIZE / sizeof(WCHAR), &targetLength)) ||
+		targetLength == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	// Absolute targets must be stored in the NT namespace while symbolic links may also store relative targets as is
+	LPCWSTR Prefix = L"";
+	LPCWSTR Rest = TargetPath;
+	LPCWSTR PrintName = TargetPath;
+	ULONG Flags = 0;
+	if (StartsWith(TargetPath, targetLength, NT_PATH_PREFIX, NT_PATH_PREFIX_LENGTH))
+	{
+		PrintName = TargetPath + NT_PATH_PREFIX_LENGTH;
+	}
+	else if (StartsWith(TargetPath, targetLength, L"\\\\?\\UNC\\", 8))
+	{
+		Prefix = NT_UNC_PATH_PREFIX;
+		Rest = TargetPath + 8;
+	}
+	else if (StartsWith(TargetPath, targetLength, L"\\\\?\\", 4))
+	{
+		Prefix = NT_PATH_PREFIX;
+		Rest = TargetPath + 4;
+	}
+	else if (StartsWith(TargetPath, targetLength, L"\\\\", 2))
+	{
+		Prefix = NT_UNC_PATH_PREFIX;
+		Rest = TargetPath + 2;
+	}
+	else if (targetLength >= 2 && TargetPath[1] == ':')
+	{
+		Prefix = NT_PATH_PREFIX;
+	}
+	else if (ReparseTag == IO_REPARSE_TAG_SYMLINK)
+	{
+		Flags = SYMLINK_FLAG_RELATIVE;
+	}
+	else
+	{
+		// Junctions can only point to absolute paths
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	DWORD headerSize;
+	WCHAR* PathBuffer;
+	if (ReparseTag == IO_REPARSE_TAG_MOUNT_POINT)
+	{
+		headerSize = FIELD_OFFSET(REPARSE_DATA_BUFFER, MountPointReparseBuffer.PathBuffer);
+		PathBuffer = Buffer->MountPointReparseBuffer.PathBuffer;
+	}
+	else if (ReparseTag == IO_REPARSE_TAG_SYMLINK)
+	{
+		headerSize = FIELD_OFFSET(REPARSE_DATA_BUFFER, SymbolicLinkReparseBuffer.PathBuffer);
+		PathBuffer = Buffer->SymbolicLinkReparseBuffer.PathBuffer;
+	}
+	else
+	{
+		return ERROR_REPARSE_TAG_INVALID;
+	}
+
+	// Both names are stored back to back, each followed by a null terminator
+	size_t prefixLength = wcslen(Prefix);
+	size_t restLength = targetLength - (Rest - TargetPath);
+	size_t printLength = targetLength - (PrintName - TargetPath);
+	size_t substituteBytes = (prefixLength + restLength) * sizeof(WCHAR);
+	size_t printBytes = printLength * sizeof(WCHAR);
+	size_t totalSize = headerSize + substituteBytes + sizeof(WCHAR) + printBytes + sizeof(WCHAR);
+	if (totalSize > BufferSize || totalSize > MAXIMUM_REPARSE_DATA_BUFFER_SIZE)
+	{
+		return ERROR_INSUFFICIENT_BUFFER;
+	}
+
+	memset(Buffer, 0, headerSize);
+	Buffer->ReparseTag = ReparseTag;
+	Buffer->ReparseDataLength = (USHORT)(totalSize - REPARSE_DATA_HEADER_SIZE);
+
+	memcpy(PathBuffer, Prefix, prefixLength * sizeof(WCHAR));
+	memcpy(PathBuffer + prefixLength, Rest, restLength * sizeof(WCHAR));
+	PathBuffer[prefixLength + restLength] = 0;
+	memcpy(PathBuffer + prefixLength + restLength + 1, PrintName, printBytes);
+	PathBuffer[prefixLength + restLength + 1 + printLength] = 0;
+
+	USHORT printOffset = (USHORT)(substituteBytes + sizeof(WCHAR));
+	if (ReparseTag == IO_REPARSE_TAG_MOUNT_POINT)
+	{
+		Buffer->MountPointReparseBuffer.SubstituteNameOffset = 0;
+		Buffer->MountPointReparseBuffer.SubstituteNameLength = (USHORT)substituteBytes;
+		Buffer->MountPointReparseBuffer.PrintNameOffset = printOffset;
+		Buffer->MountPointReparseBuffer.PrintNameLength = (USHORT)printBytes;
+	}
+	else
+	{
+		Buffer->SymbolicLinkReparseBuffer.SubstituteNameOffset = 0;
+		Buffer->SymbolicLinkReparseBuffer.SubstituteNameLength = (USHORT)substituteBytes;
+		Buffer->SymbolicLinkReparseBuffer.PrintNameOffset = printOffset;
+		Buffer->SymbolicLinkReparseBuffer.PrintNameLength = (USHORT)printBytes;
+		Buffer->SymbolicLinkReparseBuffer.Flags = Flags;
+	}
+
+	*DataSize = (DWORD)totalSize;
+	return 0;
+}
+
+DWORD SetReparsePoint(HANDLE hLink, DWORD ReparseTag, LPCTSTR TargetPath)
+{
+	ReparseDataBuffer Data;
+	DWORD dataSize = 0;
+	DWORD result = BuildReparseData(ReparseTag, TargetPath, &Data.Header, sizeof(Data), &dataSize);
+	if (result == 0)
+	{
+		result = WriteReparseData(hLink, Data.Header, dataSize);
+	}
+
+	return result;
+}
+
+DWORD DeleteReparsePoint(HANDLE hLink, DWORD ReparseTag)
+{
+	// Microsoft reparse tags are deleted by passing just the header of the reparse data
+	REPARSE_DATA_BUFFER Header;
+	memset(&Header, 0, sizeof(Header));
+	Header.ReparseTag = ReparseTag;
+
+	MetricTimer Timer(MetricDelete, 0);
+	DWORD bytesReturned = 0;
+	if (!DeviceIoControl(hLink, FSCTL_DELETE_REPARSE_POINT, &Header, REPARSE_DATA_HEADER_SIZE, NULL, 0, &bytesReturned,
+		NULL))
+	{
+		return Timer.SetResult(GetLastError());
+	}
+
+	return 0;
+}
+
+DWORD RetargetReparsePoint(HANDLE hLink, DWORD ReparseTag, LPCTSTR TargetPath, bool bInPlace)
+{
+	// Build the new reparse data up front so that an invalid target never leaves the link without any
+	ReparseDataBuffer Data;
+	DWORD dataSize = 0;
+	DWORD result = BuildReparseData(ReparseTag, TargetPath, &Data.Header, sizeof(Data), &dataSize);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	if (bInPlace)
+	{
+		// NTFS replaces the reparse data of an existing reparse point as long as the tag matches
+		result = WriteReparseData(hLink, Data.Header, dataSize);
+		if (result != ERROR_INVALID_FUNCTION && result != ERROR_NOT_SUPPORTED && result != ERROR_REPARSE_TAG_MISMATCH)
+		{
+			return result;
+		}
+	}
+
+	// Otherwise remove the existing reparse data before writing the new one
+	result = DeleteReparsePoint(hLink, ReparseTag);
+	if (result == 0)
+	{
+		result = WriteReparseData(hLink, Data.Header, dataSize);
+	}
+
+	return result;
+}
+
+DWORD RemoveReparsePoint(HANDLE hLink)
+{
+	MetricTimer Timer(MetricDelete, 0);
+
+	// Marking the handle for deletion removes the link when the handle is closed
+	FILE_DISPOSITION_INFO dispositionInfo;
+	dispositionInfo.DeleteFile = TRUE;
+	if (!SetFileInformationByHandle(hLink, FileDispositionInfo, &dispositionInfo, sizeof(dispositionInfo)))
+	{
+		return Timer.SetResult(GetLastError());
+	}
+
+	return 0;
+}
+
+DWORD RenameReparsePoint(HANDLE hLink, LPCTSTR NewPath)
+{
+	// The file system expects an NT path, which for extended-length and device paths only differs by the prefix
+	if (_tcsncmp(NewPath, TEXT("\\\\?\\"), 4) != 0 && _tcsncmp(NewPath, TEXT("\\\\.\\"), 4) != 0)
+	{
+		return ERROR_INVALID_NAME;
+	}
+
+	size_t pathLength = _tcslen(NewPath);
+	std::vector<BYTE> Buffer(sizeof(FILE_RENAME_INFO) + pathLength * sizeof(WCHAR));
+	FILE_RENAME_INFO* renameInfo = (FILE_RENAME_INFO*)&Buffer[0];
+	renameInfo->ReplaceIfExists = FALSE;
+	renameInfo->RootDirectory = NULL;
+	renameInfo->FileNameLength = (DWORD)(pathLength * sizeof(WCHAR));
+	memcpy(renameInfo->FileName, NewPath, (pathLength + 1) * sizeof(WCHAR));
+	renameInfo->FileName[1] = '?';
+	renameInfo->FileName[2] = '?';
+
+	if (!SetFileInformationByHandle(hLink, FileRenameInfo, renameInfo, (DWORD)Buffer.size()))
+	{
+		return GetLastError();
+	}
+
+	return 0;
+}
+
+DWORD RemoveExistingLink(LPCTSTR Path)
+{
+	HANDLE hLink = OpenReparsePoint(Path, DELETE | FILE_READ_ATTRIBUTES);
+	if (hLink == INVALID_HANDLE_VALUE)
+	{
+		DWORD result = GetLastError();
+		return (result == ERROR_FILE_NOT_FOUND || result == ERROR_PATH_NOT_FOUND) ? 0 : result;
+	}
+
+	// Only junctions and symbolic links are deleted, anything else at the path is left in place
+	DWORD result = 0;
+	FILE_ATTRIBUTE_TAG_INFO tagInfo;
+	if (GetFileInformationByHandleEx(hLink, FileAttributeTagInfo, &tagInfo, sizeof(tagInfo)))
+	{
+		if ((tagInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 &&
+			(tagInfo.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT || tagInfo.ReparseTag == IO_REPARSE_TAG_SYMLINK))
+		{
+			result = RemoveReparsePoint(hLink);
+		}
+	}
+	else
+	{
+		result = GetLastError();
+	}
+
+	CloseHandle(hLink);
+	return result;
+}
+
+DWORD CreateReparsePoint(LPCTSTR Link, DWORD ReparseTag, LPCTSTR TargetPath, bool bDirectory)
+{
+	// Build the reparse data up front so that an invalid target never leaves a file object behind
+	ReparseDataBuffer Data;
+	DWORD dataSize = 0;
+	DWORD result = BuildReparseData(ReparseTag, TargetPath, &Data.Header, sizeof(Data), &dataSize);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	return CreateReparsePointFromData(Link, Data.Header, dataSize, bDirectory);
+}
+
+DWORD CreateReparsePoint(const LinkRequest& Request)
+{
+	if (Request.Data != NULL)
+	{
+		return CreateReparsePointFromData(Request.Path, *Request.Data, Request.DataSize, Request.bDirectory);
+	}
+
+	return CreateReparsePoint(Request.Path, Request.ReparseTag, Request.Target, Request.bDirectory);
+}
+
+DWORD CreateReparsePointFromData(LPCTSTR Link, const REPARSE_DATA_BUFFER& Data, DWORD DataSize, bool bDirectory)
+{
+	if (Data.ReparseTag == IO_REPARSE_TAG_MOUNT_POINT)
+	{
+		bDirectory = true;
+	}
+
+	// Create the file object that will carry the reparse data and keep the handle for writing it
+	HANDLE hLink;
+	DWORD LinkLength = (DWORD)_tcslen(Link);
+	LONGLONG CreateStart = StartLatency(MetricCreate, LinkLength);
+	if (bDirectory)
+	{
+		if (!CreateDirectory(Link, NULL))
+		{
+			DWORD result = GetLastError();
+			RecordLatency(MetricCreate, CreateStart, LinkLength, result);
+			return result;
+		}
+
+		hLink = OpenReparsePoint(Link, GENERIC_WRITE | DELETE);
+		if (hLink == INVALID_HANDLE_VALUE)
+		{
+			DWORD result = GetLastError();
+			RemoveDirectory(Link);
+			RecordLatency(MetricCreate, CreateStart, LinkLength, result);
+			return result;
+		}
+	}
+	else
+	{
+		hLink = CreateFile(Link, GENERIC_WRITE | DELETE, 0, NULL, CREATE_NEW,
+			FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+		if (hLink == INVALID_HANDLE_VALUE)
+		{
+			DWORD result = GetLastError();
+			RecordLatency(MetricCreate, CreateStart, LinkLength, result);
+			return result;
+		}
+	}
+	RecordLatency(MetricCreate, CreateStart, LinkLength, 0);
+
+	DWORD result = WriteReparseData(hLink, Data, DataSize);
+	if (result != 0)
+	{
+		// Don't leave an ordinary file or directory behind in place of the link
+		RemoveReparsePoint(hLink);
+	}
+
+	CloseHandle(hLink);
+	return result;
+}
+
+bool IsVolumeTarget(DWORD ReparseTag, LPCTSTR TargetPath)
+{
+	// \\?\Volume{ followed by the 36 characters of the GUID, the closing brace and the separator, and nothing more
+	return ReparseTag == IO_REPARSE_TAG_MOUNT_POINT && _tcsncmp(TargetPath, TEXT("\\\\?\\Volume{"), 11) == 0 &&
+		_tcslen(TargetPath) == 49 && TargetPath[47] == '}' && TargetPath[48] == '\\';
+}
+
+DWORD CreateVolumeMountPoint(LPCTSTR Link, LPCTSTR VolumeName)
+{
+	DWORD LinkLength = (DWORD)_tcslen(Link);
+	LONGLONG CreateStart = StartLatency(MetricCreate, LinkLength);
+	DWORD result = CreateDirectory(Link, NULL) ? 0 : GetLastError();
+	RecordLatency(MetricCreate, CreateStart, LinkLength, result);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	// The mount manager writes the reparse data itself and expects the directory with a trailing separator
+	tstring MountPoint(Link, LinkLength);
+	MountPoint += '\\';
+
+	MetricTimer Timer(MetricSetTarget, (DWORD)_tcslen(VolumeName));
+	if (!SetVolumeMountPoint(MountPoint.c_str(), VolumeName))
+	{
+		result = Timer.SetResult(GetLastError());
+		RemoveDirectory(Link);
+	}
+
+	return result;
+}
+
+void CreateReparsePoints(LinkRequest* Requests, size_t NumRequests)
+{
+	if (Native.NtCreateFile == NULL)
+	{
+		for (size_t i = 0; i < NumRequests; i++)
+		{
+			Requests[i].Result = CreateReparsePoint(Requests[i]);
+		}
+		return;
+	}
+
+	// Visit the requests grouped by parent directory without reordering the caller's array
+	std::vector<size_t> Order(NumRequests);
+	for (size_t i = 0; i < NumRequests; i++)
+	{
+		Order[i] = i;
+	}
+
+	ParentOrder Compare;
+	Compare.Requests = Requests;
+	std::sort(Order.begin(), Order.end(), Compare);
+
+	ReparseDataBuffer Data;
+	HANDLE hParent = INVALID_HANDLE_VALUE;
+	tstring ParentPath;
+	for (size_t i = 0; i < NumRequests; i++)
+	{
+		LinkRequest& Request = Requests[Order[i]];
+		size_t ParentLength = GetParentLength(Request.Path);
+
+		if (i == 0 || ParentPath.size() != ParentLength || _tcsnicmp(ParentPath.c_str(), Request.Path, ParentLength) != 0)
+		{
+			if (hParent != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(hParent);
+			}
+
+			ParentPath.assign(Request.Path, ParentLength);
+			hParent = ParentLength > 0 ? CreateFile(ParentPath.c_str(), FILE_TRAVERSE | FILE_ADD_FILE | FILE_ADD_SUBDIRECTORY,
+				FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS,
+				NULL) : INVALID_HANDLE_VALUE;
+		}
+
+		// Reporting why the parent can't be opened is left to the path based creation
+		if (hParent == INVALID_HANDLE_VALUE)
+		{
+			Request.Result = CreateReparsePoint(Request);
+		}
+		else
+		{
+			Request.Result = CreateRelativeReparsePoint(hParent, Request, Data);
+		}
+	}
+
+	if (hParent != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hParent);
+	}
+}
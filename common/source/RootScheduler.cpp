@@ -0,0 +1,205 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <strsafe.h>
+#include <vector>
+
+#include "PathBuffer.h"
+#include "RootScheduler.h"
+#include "StringMatch.h"
+
+namespace
+{
+
+/**
+ * The roots that live on the same volume.
+ */
+struct VolumeGroup
+{
+	/** Identifies the volume, by serial number when it can be queried and by mount path otherwise. */
+	tstring Key;
+	/** The indices of the roots of the volume, in the order given. */
+	std::vector<size_t> Roots;
+};
+
+/**
+ * The state shared by the threads that process the volume groups.
+ */
+struct ScheduleContext
+{
+	const std::vector<LPCTSTR>* Roots;
+	const std::vector<VolumeGroup>* Groups;
+	RootAction* Action;
+	/** The result of each root, in the order given. */
+	std::vector<DWORD> Results;
+	/** The index of the next group to hand out. */
+	volatile LONG NextGroup;
+};
+
+/**
+ * Works out the key of the volume that holds the given path. Paths whose volume can't be determined get a key of their
+ * own so that the walk reports the error.
+ */
+void GetVolumeKey(LPCTSTR Path, tstring& Key)
+{
+	// The mount path of an absolute path fits in the path plus a separator, a relative one may need a larger buffer
+	std::vector<TCHAR> Buffer(std::max<size_t>(_tcslen(Path) + 2, MAX_PATH));
+	while (!GetVolumePathName(Path, &Buffer[0], (DWORD)Buffer.size()))
+	{
+		if (GetLastError() != ERROR_FILENAME_EXCED_RANGE || Buffer.size() >= UNICODE_STRING_MAX_CHARS)
+		{
+			Key = Path;
+			return;
+		}
+
+		Buffer.resize(Buffer.size() * 2);
+	}
+	LPCTSTR VolumePath = &Buffer[0];
+
+	// Different mount paths and shares can lead to the same volume
+	DWORD VolumeSerial = 0;
+	if (GetVolumeInformation(VolumePath, NULL, 0, &VolumeSerial, NULL, NULL, NULL, 0))
+	{
+		TCHAR Serial[16];
+		StringCchPrintf(Serial, ARRAYSIZE(Serial), TEXT("%08lx"), VolumeSerial);
+		Key = Serial;
+		return;
+	}
+
+	Key = VolumePath;
+	for (size_t i = 0; i < Key.size(); i++)
+	{
+		Key[i] = UpcaseChar(Key[i]);
+	}
+}
+
+/**
+ * Processes the roots of each group handed out until there are none left.
+ */
+void ProcessGroups(ScheduleContext& Context)
+{
+	for (;;)
+	{
+		LONG GroupIdx = InterlockedIncrement(&Context.NextGroup) - 1;
+		if ((size_t)GroupIdx >= Context.Groups->size())
+		{
+			break;
+		}
+
+		const VolumeGroup& Group = (*Context.Groups)[GroupIdx];
+		for (size_t i = 0; i < Group.Roots.size(); i++)
+		{
+			size_t RootIdx = Group.Roots[i];
+			Context.Results[RootIdx] = Context.Action->OnRoot(RootIdx, (*Context.Roots)[RootIdx]);
+		}
+	}
+}
+
+DWORD WINAPI ScheduleThreadProc(LPVOID Param)
+{
+	ProcessGroups(*(ScheduleContext*)Param);
+	return 0;
+}
+
+} // namespace
+
+DWORD ScheduleRoots(const std::vector<LPCTSTR>& Roots, RootAction& Action, bool bConcurrent)
+{
+	// Group the roots by volume, keeping the volumes in the order they first appear
+	std::vector<VolumeGroup> Groups;
+	if (bConcurrent)
+	{
+		for (size_t i = 0; i < Roots.size(); i++)
+		{
+			tstring Key;
+			GetVolumeKey(Roots[i], Key);
+
+			size_t GroupIdx = 0;
+			while (GroupIdx < Groups.size() && Groups[GroupIdx].Key != Key)
+			{
+				GroupIdx++;
+			}
+
+			if (GroupIdx == Groups.size())
+			{
+				Groups.push_back(VolumeGroup());
+				Groups.back().Key = Key;
+			}
+			Groups[GroupIdx].Roots.push_back(i);
+		}
+	}
+	else if (!Roots.empty())
+	{
+		Groups.push_back(VolumeGroup());
+		for (size_t i = 0; i < Roots.size(); i++)
+		{
+			Groups.back().Roots.push_back(i);
+		}
+	}
+
+	ScheduleContext Context;
+	Context.Roots = &Roots;
+	Context.Groups = &Groups;
+	Context.Action = &Action;
+	Context.Results.resize(Roots.size(), 0);
+	Context.NextGroup = 0;
+
+	// The calling thread processes the first volume
+	size_t NumWorkers = Groups.size() > MAX_ROOT_VOLUMES ? MAX_ROOT_VOLUMES : Groups.size();
+	std::vector<HANDLE> Threads;
+	for (size_t i = 1; i < NumWorkers; i++)
+	{
+		HANDLE hThread = CreateThread(NULL, 0, ScheduleThreadProc, &Context, 0, NULL);
+		if (hThread != NULL)
+		{
+			Threads.push_back(hThread);
+		}
+	}
+
+	ProcessGroups(Context);
+
+	for (size_t i = 0; i < Threads.size(); i++)
+	{
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+	}
+
+	for (size_t i = 0; i < Context.Results.size(); i++)
+	{
+		if (Context.Results[i] != 0)
+		{
+			return Context.Results[i];
+		}
+	}
+
+	return 0;
+}
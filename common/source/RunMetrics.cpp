@@ -0,0 +1,428 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <strsafe.h>
+
+#include "ConcurrencyControl.h"
+#include "RunMetrics.h"
+
+/** The time between two reports when /STATS is given without an interval, in seconds. */
+#define DEFAULT_STATS_INTERVAL 10
+
+bool bCollectMetrics = false;
+bool bMeasureOps = false;
+
+namespace
+{
+
+/** The names of the operations and queues in the reports. */
+const char* const OpNames[NUM_METRIC_OPS] = { "enumerate", "get_target", "set_target", "delete", "create" };
+const char* const QueueNames[NUM_METRIC_QUEUES] = { "walk", "read", "write", "async" };
+
+/**
+ * The counters updated by the threads that map to the same shard. Each shard starts on its own cache line so that
+ * threads mapping to different shards never contend.
+ */
+struct DECLSPEC_ALIGN(64) MetricShard
+{
+	volatile LONG Counters[NUM_METRIC_COUNTERS];
+	volatile LONG Latencies[NUM_METRIC_OPS][METRIC_LATENCY_BUCKETS];
+	/** The total time spent in each operation, in microseconds. */
+	volatile LONGLONG TotalMicros[NUM_METRIC_OPS];
+};
+
+/**
+ * The sum of every shard at one point in time.
+ */
+struct MetricsSnapshot
+{
+	LONGLONG Counters[NUM_METRIC_COUNTERS];
+	LONGLONG Latencies[NUM_METRIC_OPS][METRIC_LATENCY_BUCKETS];
+	LONGLONG TotalMicros[NUM_METRIC_OPS];
+	LONG NumProcessed;
+};
+
+/**
+ * The state of the reporting thread.
+ */
+struct MetricsReporter
+{
+	DWORD IntervalMs;
+	FILE* File;
+	const LinkStats* Stats;
+	const AtomicCounter* NumProcessed;
+	HANDLE hStopEvent;
+	HANDLE hThread;
+	LARGE_INTEGER StartTime;
+	/** The totals of the previous report, for the rates over the interval. */
+	MetricsSnapshot Last;
+	double LastElapsed;
+};
+
+LARGE_INTEGER QueryFrequency()
+{
+	LARGE_INTEGER Result;
+	QueryPerformanceFrequency(&Result);
+	return Result;
+}
+
+MetricShard Shards[METRIC_SHARDS];
+volatile LONG QueueDepths[NUM_METRIC_QUEUES];
+/** Known from startup since operations are also timed while they are traced, with neither /STATS nor /ADAPT. */
+LARGE_INTEGER Frequency = QueryFrequency();
+MetricsReporter Reporter;
+
+/** The time between the starts of two operations under /MAXIOPS, in performance counter ticks, or zero for no limit. */
+LONGLONG IoInterval = 0;
+/** The earliest time the next operation may start under /MAXIOPS. */
+volatile LONGLONG NextIoStart = 0;
+
+MetricShard& GetShard()
+{
+	// Thread identifiers are multiples of four
+	return Shards[(GetCurrentThreadId() >> 2) % METRIC_SHARDS];
+}
+
+void TakeSnapshot(MetricsSnapshot& Snapshot)
+{
+	memset(&Snapshot, 0, sizeof(Snapshot));
+	for (int i = 0; i < METRIC_SHARDS; i++)
+	{
+		const MetricShard& Shard = Shards[i];
+		for (int j = 0; j < NUM_METRIC_COUNTERS; j++)
+		{
+			Snapshot.Counters[j] += Shard.Counters[j];
+		}
+
+		for (int Op = 0; Op < NUM_METRIC_OPS; Op++)
+		{
+			for (int Bucket = 0; Bucket < METRIC_LATENCY_BUCKETS; Bucket++)
+			{
+				Snapshot.Latencies[Op][Bucket] += Shard.Latencies[Op][Bucket];
+			}
+			Snapshot.TotalMicros[Op] += Shard.TotalMicros[Op];
+		}
+	}
+
+	Snapshot.NumProcessed = Reporter.NumProcessed->Get();
+}
+
+/**
+ * Returns the upper bound of the bucket that the given fraction of the calls fall under, in microseconds.
+ */
+LONGLONG GetPercentile(const LONGLONG* Buckets, LONGLONG Count, double Fraction)
+{
+	LONGLONG Threshold = (LONGLONG)(Count * Fraction + 0.5);
+	LONGLONG Seen = 0;
+	for (int i = 0; i < METRIC_LATENCY_BUCKETS; i++)
+	{
+		Seen += Buckets[i];
+		if (Seen > 0 && Seen >= Threshold)
+		{
+			return 1LL << (i + 1);
+		}
+	}
+
+	return 1LL << METRIC_LATENCY_BUCKETS;
+}
+
+double GetRate(LONGLONG Now, LONGLONG Last, double Seconds)
+{
+	return Seconds > 0 ? (double)(Now - Last) / Seconds : 0;
+}
+
+void WriteReport(bool bFinal)
+{
+	MetricsSnapshot Now;
+	TakeSnapshot(Now);
+
+	LARGE_INTEGER Time;
+	QueryPerformanceCounter(&Time);
+	double Elapsed = (double)(Time.QuadPart - Reporter.StartTime.QuadPart) / (double)Frequency.QuadPart;
+	double Interval = Elapsed - Reporter.LastElapsed;
+	const MetricsSnapshot& Last = Reporter.Last;
+
+	// Nothing but numbers and fixed names goes into a report so no escaping is needed
+	FILE* File = Reporter.File;
+	fprintf(File, "{\"elapsed\":%.1f,\"final\":%s,\"entries\":%lld,\"dirs\":%lld,\"links\":%ld,\"failed\":%ld,"
+		"\"skipped\":%ld,\"entries_per_sec\":%.1f,\"dirs_per_sec\":%.1f,\"links_per_sec\":%.1f,\"queues\":{",
+		Elapsed, bFinal ? "true" : "false", Now.Counters[MetricEntries], Now.Counters[MetricDirectories],
+		Now.NumProcessed, Reporter.Stats->NumFailed.Get(), Reporter.Stats->NumSkipped.Get(),
+		GetRate(Now.Counters[MetricEntries], Last.Counters[MetricEntries], Interval),
+		GetRate(Now.Counters[MetricDirectories], Last.Counters[MetricDirectories], Interval),
+		GetRate(Now.NumProcessed, Last.NumProcessed, Interval));
+
+	for (int i = 0; i < NUM_METRIC_QUEUES; i++)
+	{
+		fprintf(File, "%s\"%s\":%ld", i > 0 ? "," : "", QueueNames[i], QueueDepths[i]);
+	}
+
+	fprintf(File, "},\"latency_us\":{");
+	for (int Op = 0; Op < NUM_METRIC_OPS; Op++)
+	{
+		LONGLONG Count = 0;
+		int NumBuckets = 0;
+		for (int Bucket = 0; Bucket < METRIC_LATENCY_BUCKETS; Bucket++)
+		{
+			Count += Now.Latencies[Op][Bucket];
+			if (Now.Latencies[Op][Bucket] != 0)
+			{
+				NumBuckets = Bucket + 1;
+			}
+		}
+
+		fprintf(File, "%s\"%s\":{\"count\":%lld,\"mean\":%.1f,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"buckets\":[",
+			Op > 0 ? "," : "", OpNames[Op], Count, Count > 0 ? (double)Now.TotalMicros[Op] / Count : 0.0,
+			GetPercentile(Now.Latencies[Op], Count, 0.5), GetPercentile(Now.Latencies[Op], Count, 0.9),
+			GetPercentile(Now.Latencies[Op], Count, 0.99));
+
+		// Trailing empty buckets are left out
+		for (int Bucket = 0; Bucket < NumBuckets; Bucket++)
+		{
+			fprintf(File, "%s%lld", Bucket > 0 ? "," : "", Now.Latencies[Op][Bucket]);
+		}
+		fprintf(File, "]}");
+	}
+	fprintf(File, "}}\n");
+	fflush(File);
+
+	Reporter.Last = Now;
+	Reporter.LastElapsed = Elapsed;
+}
+
+DWORD WINAPI ReportThreadProc(LPVOID Param)
+{
+	UNREFERENCED_PARAMETER(Param);
+
+	while (WaitForSingleObject(Reporter.hStopEvent, Reporter.IntervalMs) == WAIT_TIMEOUT)
+	{
+		WriteReport(false);
+	}
+
+	return 0;
+}
+
+} // namespace
+
+LONGLONG BeginOp(MetricOp Op, DWORD PathLength)
+{
+	// The trace begins once the operation is let through so that its duration leaves out the wait for /MAXIOPS
+	static_assert((int)TraceCreate == (int)MetricCreate, "The trace tasks must follow the order of the operations.");
+
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+	if (IoInterval == 0)
+	{
+		if (bTraceEnabled)
+		{
+			TraceStart((TraceTask)Op, PathLength);
+		}
+		return Now.QuadPart;
+	}
+
+	// Each operation takes the next start time of the schedule. A schedule that fell behind carries on from now so that
+	// idle time is never saved up for a burst.
+	LONGLONG Next;
+	LONGLONG Start;
+	do
+	{
+		Next = NextIoStart;
+		Start = Next > Now.QuadPart ? Next : Now.QuadPart;
+	} while (InterlockedCompareExchange64(&NextIoStart, Start + IoInterval, Next) != Next);
+
+	if (Start > Now.QuadPart)
+	{
+		Sleep((DWORD)((Start - Now.QuadPart) * 1000 / Frequency.QuadPart));
+		QueryPerformanceCounter(&Now);
+	}
+
+	if (bTraceEnabled)
+	{
+		TraceStart((TraceTask)Op, PathLength);
+	}
+	return Now.QuadPart;
+}
+
+void RecordLatency(MetricOp Op, LONGLONG Start, DWORD PathLength, DWORD Result)
+{
+	if (Start == 0)
+	{
+		return;
+	}
+
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+	LONGLONG Micros = (Now.QuadPart - Start) * 1000000 / Frequency.QuadPart;
+
+	if (bTraceEnabled)
+	{
+		TraceStop((TraceTask)Op, PathLength, Result, Micros);
+	}
+
+	ConcurrencyController* Controller = GetThreadController();
+	if (Controller != NULL)
+	{
+		Controller->RecordLatency(Op, Micros);
+	}
+
+	if (!bCollectMetrics)
+	{
+		return;
+	}
+
+	int Bucket = 0;
+	while (Bucket < METRIC_LATENCY_BUCKETS - 1 && (Micros >> (Bucket + 1)) != 0)
+	{
+		Bucket++;
+	}
+
+	MetricShard& Shard = GetShard();
+	InterlockedIncrement(&Shard.Latencies[Op][Bucket]);
+	InterlockedExchangeAdd64(&Shard.TotalMicros[Op], Micros);
+}
+
+void CountMetric(MetricCounter Counter, LONG Amount)
+{
+	if (bCollectMetrics)
+	{
+		InterlockedExchangeAdd(&GetShard().Counters[Counter], Amount);
+	}
+}
+
+void AdjustQueueDepth(MetricQueue Queue, LONG Amount)
+{
+	if (bCollectMetrics)
+	{
+		InterlockedExchangeAdd(&QueueDepths[Queue], Amount);
+	}
+}
+
+DWORD StartMetrics(DWORD IntervalMs, LPCTSTR OutputPath, const LinkStats& Stats, const AtomicCounter& NumProcessed)
+{
+	Reporter.File = stderr;
+	if (OutputPath != NULL && _tfopen_s(&Reporter.File, OutputPath, TEXT("a")) != 0)
+	{
+		Reporter.File = NULL;
+		return ERROR_WRITE_FAULT;
+	}
+
+	Reporter.IntervalMs = IntervalMs;
+	Reporter.Stats = &Stats;
+	Reporter.NumProcessed = &NumProcessed;
+	Reporter.LastElapsed = 0;
+	memset(&Reporter.Last, 0, sizeof(Reporter.Last));
+
+	// A service runs many jobs in the same process, each of which reports from zero
+	memset(Shards, 0, sizeof(Shards));
+	memset((void*)QueueDepths, 0, sizeof(QueueDepths));
+
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Reporter.StartTime);
+	bCollectMetrics = true;
+	bMeasureOps = true;
+
+	Reporter.hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	Reporter.hThread = Reporter.hStopEvent != NULL ? CreateThread(NULL, 0, ReportThreadProc, NULL, 0, NULL) : NULL;
+	if (Reporter.hThread == NULL)
+	{
+		DWORD result = GetLastError();
+		StopMetrics();
+		return result;
+	}
+
+	return 0;
+}
+
+void StopMetrics()
+{
+	if (Reporter.hThread != NULL)
+	{
+		SetEvent(Reporter.hStopEvent);
+		WaitForSingleObject(Reporter.hThread, INFINITE);
+		CloseHandle(Reporter.hThread);
+		Reporter.hThread = NULL;
+
+		WriteReport(true);
+	}
+	bCollectMetrics = false;
+	bMeasureOps = false;
+	IoInterval = 0;
+
+	if (Reporter.hStopEvent != NULL)
+	{
+		CloseHandle(Reporter.hStopEvent);
+		Reporter.hStopEvent = NULL;
+	}
+
+	if (Reporter.File != NULL && Reporter.File != stderr)
+	{
+		fclose(Reporter.File);
+	}
+	Reporter.File = NULL;
+}
+
+void StartOpControl(DWORD MaxIops, bool bAdaptive)
+{
+	QueryPerformanceFrequency(&Frequency);
+
+	LARGE_INTEGER Now;
+	QueryPerformanceCounter(&Now);
+	NextIoStart = Now.QuadPart;
+	IoInterval = MaxIops > 0 ? Frequency.QuadPart / MaxIops : 0;
+	if (MaxIops > 0 && IoInterval == 0)
+	{
+		IoInterval = 1;
+	}
+
+	bMeasureOps = bCollectMetrics || bAdaptive || IoInterval != 0;
+}
+
+void ParseStatsOption(LPCTSTR Arg, DWORD& IntervalMs, LPTSTR Path, size_t PathSize)
+{
+	// Both the interval and the file are optional, e.g. /STATS, /STATS:30 or /STATS:30,run.jsonl
+	int Seconds = DEFAULT_STATS_INTERVAL;
+	Path[0] = 0;
+
+	LPCTSTR Value = _tcschr(Arg, ':');
+	if (Value != NULL)
+	{
+		Seconds = _ttoi(Value + 1);
+
+		LPCTSTR File = _tcschr(Value, ',');
+		if (File != NULL)
+		{
+			StringCchCopy(Path, PathSize, File + 1);
+		}
+	}
+
+	IntervalMs = (DWORD)(Seconds < 1 ? DEFAULT_STATS_INTERVAL : Seconds) * 1000;
+}
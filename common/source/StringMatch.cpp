@@ -0,0 +1,393 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <intrin.h>
+#include <vector>
+
+#include "StringMatch.h"
+
+namespace
+{
+
+/** The number of characters in the basic multilingual plane, each of which has an entry in the upcase table. */
+#define NUM_CHARS 0x10000
+
+typedef int (*FindFunc)(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir);
+
+int FindScalar(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir);
+int FindSSE2(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir);
+int FindAVX2(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir);
+
+/**
+ * The upcase table along with the search implementation best suited to the processor. Both are set up before main
+ * runs so that the worker threads never race to initialize them.
+ */
+class CaseTable
+{
+public:
+	CaseTable();
+
+	WCHAR Upcase[NUM_CHARS];
+	FindFunc Find;
+
+private:
+	void MapRange(UINT Begin, UINT End);
+};
+
+CaseTable Table;
+
+inline WCHAR Fold(WCHAR Char)
+{
+	return Table.Upcase[Char];
+}
+
+bool IsSSE2Supported()
+{
+#if defined(_M_X64)
+	return true;
+#else
+	int Info[4];
+	__cpuid(Info, 1);
+	return (Info[3] & (1 << 26)) != 0;
+#endif
+}
+
+bool IsAVX2Supported()
+{
+	int Info[4];
+	__cpuid(Info, 0);
+	if (Info[0] < 7)
+	{
+		return false;
+	}
+
+	// The operating system must also save the upper half of the YMM registers on context switches
+	__cpuid(Info, 1);
+	const int OSXSAVE = 1 << 27;
+	const int AVX = 1 << 28;
+	if ((Info[2] & (OSXSAVE | AVX)) != (OSXSAVE | AVX) || (_xgetbv(0) & 6) != 6)
+	{
+		return false;
+	}
+
+	__cpuidex(Info, 7, 0);
+	return (Info[1] & (1 << 5)) != 0;
+}
+
+CaseTable::CaseTable()
+	: Find(FindScalar)
+{
+	for (UINT i = 0; i < NUM_CHARS; i++)
+	{
+		Upcase[i] = (WCHAR)i;
+	}
+
+	// Surrogates only have a case as pairs, which a table of single characters can't represent
+	MapRange(0x0001, 0xD800);
+	MapRange(0xE000, NUM_CHARS);
+
+	// The vectorized searches fold ASCII themselves, which is only correct if the table agrees
+	for (WCHAR c = 0; c < 0x80; c++)
+	{
+		WCHAR Expected = (c >= 'a' && c <= 'z') ? (WCHAR)(c - ('a' - 'A')) : c;
+		if (Upcase[c] != Expected)
+		{
+			return;
+		}
+	}
+
+	if (IsAVX2Supported())
+	{
+		Find = FindAVX2;
+	}
+	else if (IsSSE2Supported())
+	{
+		Find = FindSSE2;
+	}
+}
+
+void CaseTable::MapRange(UINT Begin, UINT End)
+{
+	// The invariant locale gives the same ordinal mapping the file system uses to compare names
+	int Count = (int)(End - Begin);
+	std::vector<WCHAR> Mapped(Count);
+	if (LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, &Upcase[Begin], Count, &Mapped[0], Count, NULL, NULL,
+		0) == Count)
+	{
+		memcpy(&Upcase[Begin], &Mapped[0], Count * sizeof(WCHAR));
+	}
+}
+
+/**
+ * Returns true if Sub, ignoring case, is found at the start of Str.
+ */
+inline bool MatchesAt(LPCWSTR Str, LPCWSTR Sub, size_t SubLength)
+{
+	for (size_t i = 0; i < SubLength; i++)
+	{
+		if (Fold(Str[i]) != Fold(Sub[i]))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Compares Sub against every position of Str in [Begin, End), walking in the given direction.
+ */
+int ScanRange(LPCWSTR Str, size_t Begin, size_t End, LPCWSTR Sub, size_t SubLength, int Dir)
+{
+	if (Dir >= 0)
+	{
+		for (size_t i = Begin; i < End; i++)
+		{
+			if (MatchesAt(Str + i, Sub, SubLength))
+			{
+				return (int)i;
+			}
+		}
+	}
+	else
+	{
+		for (size_t i = End; i > Begin; i--)
+		{
+			if (MatchesAt(Str + i - 1, Sub, SubLength))
+			{
+				return (int)(i - 1);
+			}
+		}
+	}
+
+	return -1;
+}
+
+int FindScalar(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir)
+{
+	return ScanRange(Str, 0, StrLength - SubLength + 1, Sub, SubLength, Dir);
+}
+
+/**
+ * Fully compares the candidate positions of a block, given as a mask with two bits per character, in the given
+ * direction.
+ */
+int MatchCandidates(LPCWSTR Str, size_t Start, UINT Mask, LPCWSTR Sub, size_t SubLength, int Dir)
+{
+	while (Mask != 0)
+	{
+		DWORD Bit;
+		if (Dir >= 0)
+		{
+			_BitScanForward(&Bit, Mask);
+		}
+		else
+		{
+			_BitScanReverse(&Bit, Mask);
+		}
+
+		size_t Pos = Start + Bit / 2;
+		if (MatchesAt(Str + Pos, Sub, SubLength))
+		{
+			return (int)Pos;
+		}
+
+		Mask &= ~(3u << (Bit & ~1u));
+	}
+
+	return -1;
+}
+
+/**
+ * Finds the candidate positions of 8 characters at a time with SSE2.
+ */
+struct SSE2Block
+{
+	static const size_t Width = 8;
+
+	static __m128i FoldAscii(__m128i Chars)
+	{
+		__m128i Lower = _mm_and_si128(_mm_cmpgt_epi16(Chars, _mm_set1_epi16('a' - 1)),
+			_mm_cmplt_epi16(Chars, _mm_set1_epi16('z' + 1)));
+		return _mm_sub_epi16(Chars, _mm_and_si128(Lower, _mm_set1_epi16('a' - 'A')));
+	}
+
+	/**
+	 * Returns two bits for every position of the block whose first and last characters match those of the search
+	 * string, or sets bAscii to false if the block can't be folded without the upcase table.
+	 */
+	static UINT Candidates(LPCWSTR Str, size_t LastOffset, WCHAR First, WCHAR Last, bool& bAscii)
+	{
+		__m128i Firsts = _mm_loadu_si128((const __m128i*)Str);
+		__m128i Lasts = _mm_loadu_si128((const __m128i*)(Str + LastOffset));
+
+		__m128i NonAscii = _mm_and_si128(_mm_or_si128(Firsts, Lasts), _mm_set1_epi16((short)0xFF80));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(NonAscii, _mm_setzero_si128())) != 0xFFFF)
+		{
+			bAscii = false;
+			return 0;
+		}
+
+		__m128i Matches = _mm_and_si128(_mm_cmpeq_epi16(FoldAscii(Firsts), _mm_set1_epi16((short)First)),
+			_mm_cmpeq_epi16(FoldAscii(Lasts), _mm_set1_epi16((short)Last)));
+		return (UINT)_mm_movemask_epi8(Matches);
+	}
+};
+
+/**
+ * Finds the candidate positions of 16 characters at a time with AVX2.
+ */
+struct AVX2Block
+{
+	static const size_t Width = 16;
+
+	static __m256i FoldAscii(__m256i Chars)
+	{
+		__m256i Lower = _mm256_andnot_si256(_mm256_cmpgt_epi16(Chars, _mm256_set1_epi16('z')),
+			_mm256_cmpgt_epi16(Chars, _mm256_set1_epi16('a' - 1)));
+		return _mm256_sub_epi16(Chars, _mm256_and_si256(Lower, _mm256_set1_epi16('a' - 'A')));
+	}
+
+	static UINT Candidates(LPCWSTR Str, size_t LastOffset, WCHAR First, WCHAR Last, bool& bAscii)
+	{
+		__m256i Firsts = _mm256_loadu_si256((const __m256i*)Str);
+		__m256i Lasts = _mm256_loadu_si256((const __m256i*)(Str + LastOffset));
+
+		if (!_mm256_testz_si256(_mm256_or_si256(Firsts, Lasts), _mm256_set1_epi16((short)0xFF80)))
+		{
+			bAscii = false;
+			return 0;
+		}
+
+		__m256i Matches = _mm256_and_si256(_mm256_cmpeq_epi16(FoldAscii(Firsts), _mm256_set1_epi16((short)First)),
+			_mm256_cmpeq_epi16(FoldAscii(Lasts), _mm256_set1_epi16((short)Last)));
+		return (UINT)_mm256_movemask_epi8(Matches);
+	}
+};
+
+/**
+ * Searches a block of positions at a time, only comparing in full the positions whose first and last characters
+ * match. Blocks holding characters outside of ASCII are compared with the upcase table instead.
+ */
+template <class Block>
+int FindVector(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir)
+{
+	size_t LastOffset = SubLength - 1;
+	size_t NumPositions = StrLength - SubLength + 1;
+	WCHAR First = Fold(Sub[0]);
+	WCHAR Last = Fold(Sub[LastOffset]);
+
+	if (Dir >= 0)
+	{
+		size_t Start = 0;
+		for (; Start + Block::Width <= NumPositions; Start += Block::Width)
+		{
+			bool bAscii = true;
+			UINT Mask = Block::Candidates(Str + Start, LastOffset, First, Last, bAscii);
+			int result = bAscii ? MatchCandidates(Str, Start, Mask, Sub, SubLength, Dir) :
+				ScanRange(Str, Start, Start + Block::Width, Sub, SubLength, Dir);
+			if (result >= 0)
+			{
+				return result;
+			}
+		}
+
+		return ScanRange(Str, Start, NumPositions, Sub, SubLength, Dir);
+	}
+
+	size_t End = NumPositions;
+	for (; End >= Block::Width; End -= Block::Width)
+	{
+		size_t Start = End - Block::Width;
+		bool bAscii = true;
+		UINT Mask = Block::Candidates(Str + Start, LastOffset, First, Last, bAscii);
+		int result = bAscii ? MatchCandidates(Str, Start, Mask, Sub, SubLength, Dir) :
+			ScanRange(Str, Start, End, Sub, SubLength, Dir);
+		if (result >= 0)
+		{
+			return result;
+		}
+	}
+
+	return ScanRange(Str, 0, End, Sub, SubLength, Dir);
+}
+
+int FindSSE2(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir)
+{
+	return FindVector<SSE2Block>(Str, StrLength, Sub, SubLength, Dir);
+}
+
+int FindAVX2(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir)
+{
+	int result = FindVector<AVX2Block>(Str, StrLength, Sub, SubLength, Dir);
+
+	// Avoid the penalty of switching back to legacy SSE code with the upper halves of the registers in use
+	_mm256_zeroupper();
+	return result;
+}
+
+} // namespace
+
+WCHAR UpcaseChar(WCHAR Char)
+{
+	return Fold(Char);
+}
+
+int StrFindNoCase(LPCWSTR Str, size_t StrLength, LPCWSTR Sub, size_t SubLength, int Dir)
+{
+	if (SubLength == 0 || SubLength > StrLength)
+	{
+		return -1;
+	}
+
+	return Table.Find(Str, StrLength, Sub, SubLength, Dir);
+}
+
+size_t StrReplaceNoCase(LPCWSTR SrcStr, size_t SrcLength, LPCWSTR Search, size_t SearchLength, LPCWSTR Replace,
+	size_t ReplaceLength, LPWSTR DestStr, int Dir)
+{
+	int Idx = StrFindNoCase(SrcStr, SrcLength, Search, SearchLength, Dir);
+	if (Idx < 0)
+	{
+		memcpy(DestStr, SrcStr, SrcLength * sizeof(WCHAR));
+		DestStr[SrcLength] = 0;
+		return SrcLength;
+	}
+
+	size_t RestLength = SrcLength - Idx - SearchLength;
+	memcpy(DestStr, SrcStr, Idx * sizeof(WCHAR));
+	memcpy(DestStr + Idx, Replace, ReplaceLength * sizeof(WCHAR));
+	memcpy(DestStr + Idx + ReplaceLength, SrcStr + Idx + SearchLength, RestLength * sizeof(WCHAR));
+
+	size_t DestLength = Idx + ReplaceLength + RestLength;
+	DestStr[DestLength] = 0;
+	return DestLength;
+}
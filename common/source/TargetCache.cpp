@@ -0,0 +1,272 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <functional>
+#include <vector>
+
+#include "ReparsePoint.h"
+#include "StringMatch.h"
+#include "TargetCache.h"
+
+namespace
+{
+
+/**
+ * Returns the length of the root of an absolute path without the extended-length prefix: "C:" for drive paths and
+ * "\\server\share" for UNC paths. Returns zero if the path has no root.
+ */
+size_t GetRootLength(const tstring& Path)
+{
+	if (Path.size() >= 2 && Path[1] == ':')
+	{
+		return 2;
+	}
+
+	if (Path.size() >= 2 && Path[0] == '\\' && Path[1] == '\\')
+	{
+		// Skip the server and the share
+		size_t ServerEnd = Path.find('\\', 2);
+		if (ServerEnd == tstring::npos)
+		{
+			return Path.size();
+		}
+
+		size_t ShareEnd = Path.find('\\', ServerEnd + 1);
+		return ShareEnd == tstring::npos ? Path.size() : ShareEnd;
+	}
+
+	return 0;
+}
+
+/**
+ * Removes the extended-length prefix of a path, turning \\?\UNC\server\share back into \\server\share.
+ */
+void StripLongPrefix(LPCTSTR Path, tstring& Stripped)
+{
+	if (_tcsncmp(Path, TEXT("\\\\?\\UNC\\"), 8) == 0)
+	{
+		Stripped = TEXT("\\\\");
+		Stripped += Path + 8;
+	}
+	else if (_tcsncmp(Path, TEXT("\\\\?\\"), 4) == 0)
+	{
+		Stripped = Path + 4;
+	}
+	else
+	{
+		Stripped = Path;
+	}
+}
+
+/**
+ * Returns true if the file system reports that a path names nothing, as opposed to not being able to tell.
+ */
+bool IsMissing(DWORD Error)
+{
+	return Error == ERROR_FILE_NOT_FOUND || Error == ERROR_PATH_NOT_FOUND || Error == ERROR_INVALID_NAME ||
+		Error == ERROR_BAD_NETPATH || Error == ERROR_BAD_NET_NAME || Error == ERROR_INVALID_DRIVE;
+}
+
+} // namespace
+
+TargetCache::TargetCache()
+{
+	for (int i = 0; i < TARGET_CACHE_SHARDS; i++)
+	{
+		InitializeCriticalSection(&Shards[i].Lock);
+	}
+}
+
+TargetCache::~TargetCache()
+{
+	for (int i = 0; i < TARGET_CACHE_SHARDS; i++)
+	{
+		DeleteCriticalSection(&Shards[i].Lock);
+	}
+}
+
+DWORD TargetCache::Lookup(const tstring& Key, DWORD& Attributes)
+{
+	// Paths that only differ by case name the same target
+	tstring UpperKey(Key);
+	for (size_t i = 0; i < UpperKey.size(); i++)
+	{
+		UpperKey[i] = UpcaseChar(UpperKey[i]);
+	}
+
+	Shard& Part = Shards[std::hash<tstring>()(UpperKey) % TARGET_CACHE_SHARDS];
+
+	EnterCriticalSection(&Part.Lock);
+	std::unordered_map<tstring, DWORD>::const_iterator Entry = Part.Entries.find(UpperKey);
+	bool bFound = Entry != Part.Entries.end();
+	if (bFound)
+	{
+		Attributes = Entry->second;
+	}
+	LeaveCriticalSection(&Part.Lock);
+
+	if (bFound)
+	{
+		return 0;
+	}
+
+	// Probe in the extended-length syntax so that long targets aren't cut off at MAX_PATH
+	tstring ProbePath;
+	if (Key.size() >= 2 && Key[0] == '\\' && Key[1] == '\\')
+	{
+		ProbePath = TEXT("\\\\?\\UNC");
+		ProbePath.append(Key, 1, tstring::npos);
+	}
+	else
+	{
+		ProbePath = TEXT("\\\\?\\") + Key;
+	}
+
+	WIN32_FILE_ATTRIBUTE_DATA Data;
+	if (GetFileAttributesEx(ProbePath.c_str(), GetFileExInfoStandard, &Data))
+	{
+		Attributes = Data.dwFileAttributes;
+	}
+	else
+	{
+		DWORD result = GetLastError();
+		if (!IsMissing(result))
+		{
+			return result;
+		}
+
+		Attributes = INVALID_FILE_ATTRIBUTES;
+	}
+
+	EnterCriticalSection(&Part.Lock);
+	Part.Entries[UpperKey] = Attributes;
+	LeaveCriticalSection(&Part.Lock);
+
+	return 0;
+}
+
+void TargetCache::Clear()
+{
+	for (int i = 0; i < TARGET_CACHE_SHARDS; i++)
+	{
+		EnterCriticalSection(&Shards[i].Lock);
+		Shards[i].Entries.clear();
+		LeaveCriticalSection(&Shards[i].Lock);
+	}
+}
+
+void ResolveLinkTarget(LPCTSTR LinkPath, LPCTSTR Target, tstring& Path)
+{
+	tstring Link;
+	StripLongPrefix(LinkPath, Link);
+
+	tstring Combined;
+	if (Target[0] == '\\' && Target[1] == '\\')
+	{
+		StripLongPrefix(Target, Combined);
+	}
+	else if (Target[0] != 0 && Target[1] == ':')
+	{
+		Combined = Target;
+	}
+	else if (Target[0] == '\\')
+	{
+		// Rooted targets are on the volume of the link
+		Combined.assign(Link, 0, GetRootLength(Link));
+		Combined += Target;
+	}
+	else
+	{
+		size_t Separator = Link.rfind('\\');
+		Combined.assign(Link, 0, Separator == tstring::npos ? 0 : Separator);
+		Combined += '\\';
+		Combined += Target;
+	}
+
+	// Rebuild the path from its components, dropping '.' and letting '..' remove the previous one but never the root
+	size_t RootLength = GetRootLength(Combined);
+	Path.assign(Combined, 0, RootLength);
+	std::vector<size_t> Starts;
+	size_t Pos = RootLength;
+	while (Pos < Combined.size())
+	{
+		size_t End = Combined.find('\\', Pos);
+		if (End == tstring::npos)
+		{
+			End = Combined.size();
+		}
+
+		size_t Length = End - Pos;
+		if (Length == 0 || (Length == 1 && Combined[Pos] == '.'))
+		{
+			// Empty and current directory components name nothing new
+		}
+		else if (Length == 2 && Combined[Pos] == '.' && Combined[Pos + 1] == '.')
+		{
+			if (!Starts.empty())
+			{
+				Path.resize(Starts.back());
+				Starts.pop_back();
+			}
+		}
+		else
+		{
+			Starts.push_back(Path.size());
+			Path += '\\';
+			Path.append(Combined, Pos, Length);
+		}
+
+		Pos = End + 1;
+	}
+
+	if (Path.size() == RootLength)
+	{
+		Path += '\\';
+	}
+}
+
+DWORD VerifyLinkTarget(TargetCache& Cache, LPCTSTR LinkPath, DWORD ReparseTag, bool bDirectory, LPCTSTR Target,
+	bool& bBroken)
+{
+	tstring Key;
+	ResolveLinkTarget(LinkPath, Target, Key);
+
+	DWORD Attributes = INVALID_FILE_ATTRIBUTES;
+	DWORD result = Cache.Lookup(Key, Attributes);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	bool bWantDirectory = bDirectory || ReparseTag == IO_REPARSE_TAG_MOUNT_POINT;
+	bBroken = Attributes == INVALID_FILE_ATTRIBUTES || ((Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0) != bWantDirectory;
+	return 0;
+}
@@ -0,0 +1,653 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <deque>
+#include <stdlib.h>
+#include <vector>
+
+#include "ConcurrencyControl.h"
+#include "DirectoryEnumerator.h"
+#include "ErrorMessage.h"
+#include "LinkIndex.h"
+#include "PathBuffer.h"
+#include "RunMetrics.h"
+#include "TreeWalker.h"
+#include "VolumeScan.h"
+#include "WalkFilter.h"
+
+namespace
+{
+
+/**
+ * A directory that is waiting to be enumerated by one of the workers. Only the name of the directory is stored, the rest
+ * of its path is shared with its parent so that queued directories stay small regardless of the depth of the tree.
+ */
+struct WalkItem
+{
+	/** The parent directory, or NULL for the root of the walk. */
+	WalkItem* Parent;
+	/** The number of references held on the directory by the queue and by its queued sub-directories. */
+	volatile LONG RefCount;
+	/** The level of the directory in the filesystem tree. */
+	int Depth;
+	/** The file attributes of the directory. */
+	DWORD Attributes;
+	/** The length of Name, in characters. */
+	size_t NameLength;
+	/** The name of the directory, or the full path of the root. Allocated along with the item. */
+	TCHAR Name[1];
+};
+
+/**
+ * Allocates a new directory item holding a reference on its parent.
+ */
+WalkItem* CreateItem(WalkItem* Parent, LPCTSTR Name, int Depth, DWORD Attributes)
+{
+	size_t NameLength = _tcslen(Name);
+	WalkItem* Item = (WalkItem*)malloc(sizeof(WalkItem) + NameLength * sizeof(TCHAR));
+	Item->Parent = Parent;
+	Item->RefCount = 1;
+	Item->Depth = Depth;
+	Item->Attributes = Attributes;
+	Item->NameLength = NameLength;
+	memcpy(Item->Name, Name, (NameLength + 1) * sizeof(TCHAR));
+
+	if (Parent != NULL)
+	{
+		InterlockedIncrement(&Parent->RefCount);
+	}
+
+	return Item;
+}
+
+/**
+ * Releases a reference on the given directory item. Freeing an item releases its reference on the parent in turn.
+ */
+void ReleaseItem(WalkItem* Item)
+{
+	while (Item != NULL && InterlockedDecrement(&Item->RefCount) == 0)
+	{
+		WalkItem* Parent = Item->Parent;
+		free(Item);
+		Item = Parent;
+	}
+}
+
+/**
+ * The queue of directories owned by a single worker. The owner takes work from the back of the queue for a depth-first
+ * walk, or from the front for a breadth-first walk, while idle workers steal from the front.
+ */
+struct WorkQueue
+{
+	CRITICAL_SECTION Lock;
+	std::deque<WalkItem*> Items;
+};
+
+/**
+ * The buffers a worker reuses for every directory it enumerates.
+ */
+struct WorkerBuffers
+{
+	/** The full path of the entry being processed. */
+	PathBuffer Path;
+	/** The path of the entry being processed relative to the root of the walk. */
+	PathBuffer RelativePath;
+	/** The scratch memory handed to the action. */
+	StringArena Arena;
+	/** The ancestors of the directory being processed, used to rebuild its path. */
+	std::vector<WalkItem*> Chain;
+	/** Reads the listing of the directory being processed. */
+	DirectoryEnumerator Enumerator;
+};
+
+class TreeWalker
+{
+public:
+	TreeWalker(LinkAction& InAction, const WalkOptions& InOptions, LinkStats& InStats);
+	~TreeWalker();
+
+	/**
+	 * Walks the tree starting at the given directory and returns once every directory has been processed.
+	 */
+	void Run(WalkItem* RootItem);
+
+private:
+	TreeWalker(const TreeWalker&);
+	TreeWalker& operator=(const TreeWalker&);
+
+	struct WorkerParam
+	{
+		TreeWalker* Walker;
+		int WorkerIdx;
+	};
+
+	static DWORD WINAPI WorkerThreadProc(LPVOID Param);
+
+	void WorkerLoop(int WorkerIdx);
+	void Push(int WorkerIdx, WalkItem* Item);
+	WalkItem* Pop(int WorkerIdx);
+	WalkItem* Steal(int WorkerIdx);
+	void ProcessDirectory(int WorkerIdx, WalkItem* Item);
+	void VisitEntry(WorkerBuffers& Worker, const DirectoryEntry& Entry, int Depth);
+	void Complete();
+
+	LinkAction& Action;
+	const WalkOptions& Options;
+	LinkStats& Stats;
+
+	int NumWorkers;
+	WorkQueue* Queues;
+	WorkerBuffers* Buffers;
+	/** The number of directories that have been queued but not yet fully processed. */
+	volatile LONG NumPending;
+	/** The number of workers that are waiting for work to become available. */
+	volatile LONG NumIdle;
+	volatile LONG bDone;
+	HANDLE hWakeSemaphore;
+	/** Limits the workers that process a directory at once when the walk is adaptive. */
+	ConcurrencyController Controller;
+};
+
+TreeWalker::TreeWalker(LinkAction& InAction, const WalkOptions& InOptions, LinkStats& InStats)
+	: Action(InAction)
+	, Options(InOptions)
+	, Stats(InStats)
+	, NumWorkers(InOptions.NumThreads < 1 ? 1 : (InOptions.NumThreads > MAX_WALK_THREADS ? MAX_WALK_THREADS : InOptions.NumThreads))
+	, NumPending(0)
+	, NumIdle(0)
+	, bDone(0)
+{
+	Queues = new WorkQueue[NumWorkers];
+	Buffers = new WorkerBuffers[NumWorkers];
+	for (int i = 0; i < NumWorkers; i++)
+	{
+		InitializeCriticalSection(&Queues[i].Lock);
+	}
+
+	hWakeSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	Controller.Start(NumWorkers);
+}
+
+TreeWalker::~TreeWalker()
+{
+	for (int i = 0; i < NumWorkers; i++)
+	{
+		DeleteCriticalSection(&Queues[i].Lock);
+	}
+	delete[] Queues;
+	delete[] Buffers;
+
+	CloseHandle(hWakeSemaphore);
+}
+
+void TreeWalker::Run(WalkItem* RootItem)
+{
+	Push(0, RootItem);
+
+	// The calling thread acts as the first worker
+	std::vector<HANDLE> Threads;
+	std::vector<WorkerParam> Params(NumWorkers);
+	for (int i = 1; i < NumWorkers; i++)
+	{
+		Params[i].Walker = this;
+		Params[i].WorkerIdx = i;
+
+		HANDLE hThread = CreateThread(NULL, 0, WorkerThreadProc, &Params[i], 0, NULL);
+		if (hThread != NULL)
+		{
+			Threads.push_back(hThread);
+		}
+	}
+
+	WorkerLoop(0);
+
+	for (size_t i = 0; i < Threads.size(); i++)
+	{
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+	}
+}
+
+DWORD WINAPI TreeWalker::WorkerThreadProc(LPVOID Param)
+{
+	WorkerParam* Worker = (WorkerParam*)Param;
+	Worker->Walker->WorkerLoop(Worker->WorkerIdx);
+	return 0;
+}
+
+void TreeWalker::WorkerLoop(int WorkerIdx)
+{
+	// The operations of every worker are measured by the controller of the walk, which makes it a controller per volume
+	ConcurrencyController* Control = Options.bAdaptive ? &Controller : NULL;
+	ThreadControllerScope Scope(Control);
+
+	while (bDone == 0)
+	{
+		WalkItem* Item = Pop(WorkerIdx);
+		if (Item == NULL)
+		{
+			Item = Steal(WorkerIdx);
+		}
+
+		if (Item == NULL)
+		{
+			// Announce that this worker is idle before checking the queues one last time. Anything pushed after this
+			// point will see the idle worker and wake it.
+			InterlockedIncrement(&NumIdle);
+			Item = Steal(WorkerIdx);
+			if (Item == NULL && bDone == 0)
+			{
+				WaitForSingleObject(hWakeSemaphore, INFINITE);
+			}
+			InterlockedDecrement(&NumIdle);
+		}
+
+		if (Item != NULL)
+		{
+			if (Control != NULL)
+			{
+				Control->Acquire();
+			}
+
+			ProcessDirectory(WorkerIdx, Item);
+
+			if (Control != NULL)
+			{
+				Control->Release();
+			}
+			ReleaseItem(Item);
+
+			// The children of the directory have already been queued so reaching zero means the walk is finished
+			if (InterlockedDecrement(&NumPending) == 0)
+			{
+				Complete();
+			}
+		}
+	}
+}
+
+void TreeWalker::Push(int WorkerIdx, WalkItem* Item)
+{
+	InterlockedIncrement(&NumPending);
+
+	WorkQueue& Queue = Queues[WorkerIdx];
+	EnterCriticalSection(&Queue.Lock);
+	Queue.Items.push_back(Item);
+	LeaveCriticalSection(&Queue.Lock);
+	AdjustQueueDepth(MetricWalkQueue, 1);
+
+	if (NumIdle > 0)
+	{
+		ReleaseSemaphore(hWakeSemaphore, 1, NULL);
+	}
+}
+
+WalkItem* TreeWalker::Pop(int WorkerIdx)
+{
+	WalkItem* Item = NULL;
+
+	WorkQueue& Queue = Queues[WorkerIdx];
+	EnterCriticalSection(&Queue.Lock);
+	if (Queue.Items.empty())
+	{
+		// Nothing to take
+	}
+	else if (Options.bBreadthFirst)
+	{
+		Item = Queue.Items.front();
+		Queue.Items.pop_front();
+	}
+	else
+	{
+		Item = Queue.Items.back();
+		Queue.Items.pop_back();
+	}
+	LeaveCriticalSection(&Queue.Lock);
+
+	if (Item != NULL)
+	{
+		AdjustQueueDepth(MetricWalkQueue, -1);
+	}
+
+	return Item;
+}
+
+WalkItem* TreeWalker::Steal(int WorkerIdx)
+{
+	// Visit every queue, starting with the neighbor of this worker so that thieves spread out over the victims
+	for (int i = 0; i < NumWorkers; i++)
+	{
+		WorkQueue& Queue = Queues[(WorkerIdx + 1 + i) % NumWorkers];
+
+		WalkItem* Item = NULL;
+		EnterCriticalSection(&Queue.Lock);
+		if (!Queue.Items.empty())
+		{
+			Item = Queue.Items.front();
+			Queue.Items.pop_front();
+		}
+		LeaveCriticalSection(&Queue.Lock);
+
+		if (Item != NULL)
+		{
+			AdjustQueueDepth(MetricWalkQueue, -1);
+			return Item;
+		}
+	}
+
+	return NULL;
+}
+
+void TreeWalker::Complete()
+{
+	InterlockedExchange(&bDone, 1);
+	ReleaseSemaphore(hWakeSemaphore, NumWorkers, NULL);
+}
+
+void TreeWalker::ProcessDirectory(int WorkerIdx, WalkItem* Item)
+{
+	WorkerBuffers& Worker = Buffers[WorkerIdx];
+	Worker.Arena.Reset();
+
+	// Rebuild the path of the directory from the names of its ancestors
+	Worker.Chain.clear();
+	WalkItem* RootItem = Item;
+	while (RootItem->Parent != NULL)
+	{
+		Worker.Chain.push_back(RootItem);
+		RootItem = RootItem->Parent;
+	}
+
+	Worker.Path.Assign(RootItem->Name, RootItem->NameLength);
+	Worker.RelativePath.Assign(TEXT(""), 0);
+	for (size_t i = Worker.Chain.size(); i > 0; i--)
+	{
+		Worker.Path.Push(Worker.Chain[i - 1]->Name);
+		Worker.RelativePath.Push(Worker.Chain[i - 1]->Name);
+	}
+
+	WalkEntry DirEntry;
+	DirEntry.Path = Worker.Path.c_str();
+	DirEntry.RelativePath = Worker.RelativePath.c_str();
+	DirEntry.Depth = Item->Depth;
+	DirEntry.Attributes = Item->Attributes;
+	DirEntry.ReparseTag = 0;
+	DirEntry.Arena = &Worker.Arena;
+
+	DWORD result = Action.OnDirectory(DirEntry);
+	DWORD incompleteResult = 0;
+
+	// If applicable, do not go further than the specified maximum depth
+	int ChildDepth = Item->Depth + 1;
+	if (result == 0 && (Options.MaxDepth < 0 || ChildDepth <= Options.MaxDepth))
+	{
+		DirectoryEnumerator& Enumerator = Worker.Enumerator;
+		DWORD enumResult = Enumerator.Open(Worker.Path.c_str());
+
+		// Iterate through the list of files in the directory. Reparse points, and files when asked for, are handed to the
+		// action right away while sub-directories are queued for the workers.
+		if (enumResult == 0)
+		{
+			std::vector<WalkItem*> SubDirs;
+
+			const WalkFilter* Filter = Options.Filter;
+
+			DirectoryEntry ffd;
+			LONG NumEntries = 0;
+			while ((enumResult = Enumerator.Next(ffd)) == 0)
+			{
+				NumEntries++;
+
+				// Excluded entries are dropped on what the listing reports, before anything is opened or queued
+				if (Filter != NULL && (ffd.Attributes & (FILE_ATTRIBUTE_REPARSE_POINT | FILE_ATTRIBUTE_DIRECTORY)) != 0)
+				{
+					size_t NameLength = _tcslen(ffd.Name);
+					if ((ffd.Attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ?
+						Filter->IsLinkExcluded(ffd.Name, NameLength, ffd.Attributes, ffd.ReparseTag) :
+						Filter->IsDirectoryExcluded(ffd.Name, NameLength))
+					{
+						continue;
+					}
+				}
+
+				// Reparse points must be processed first as they can also be considered a directory.
+				if ((ffd.Attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ||
+					((ffd.Attributes & FILE_ATTRIBUTE_DIRECTORY) == 0 && Options.bFiles))
+				{
+					VisitEntry(Worker, ffd, ChildDepth);
+				}
+				else if ((ffd.Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+				{
+					SubDirs.push_back(CreateItem(Item, ffd.Name, ChildDepth, ffd.Attributes));
+				}
+			}
+
+			Enumerator.Close();
+
+			// The entries are counted once per directory to keep the counters cheap
+			CountMetric(MetricDirectories, 1);
+			CountMetric(MetricEntries, NumEntries);
+
+			// A listing that broke off early is reported, but the entries read up to that point are still processed
+			if (enumResult != ERROR_NO_MORE_FILES)
+			{
+				result = enumResult;
+				incompleteResult = enumResult;
+			}
+
+			// Queue so that the owning worker visits the sub-directories in the order they were listed. A depth-first walk
+			// takes from the back of the queue so they are queued in reverse.
+			if (Options.bBreadthFirst)
+			{
+				for (size_t i = 0; i < SubDirs.size(); i++)
+				{
+					Push(WorkerIdx, SubDirs[i]);
+				}
+			}
+			else
+			{
+				for (size_t i = SubDirs.size(); i > 0; i--)
+				{
+					Push(WorkerIdx, SubDirs[i - 1]);
+				}
+			}
+		}
+		else
+		{
+			// If we failed to be able to read the directory listing due to a access violation count it as a skip
+			// instead of a complete failure.
+			if (enumResult == ERROR_ACCESS_DENIED)
+			{
+				PrintErrorMessage(enumResult, Worker.Path.c_str());
+				Stats.NumSkipped++;
+			}
+			else
+			{
+				result = enumResult;
+			}
+			incompleteResult = enumResult;
+		}
+	}
+
+	// Was the operation successful?
+	if (result != 0)
+	{
+		Stats.NumFailed++;
+		PrintErrorMessage(result, Worker.Path.c_str());
+		if (Options.bAdaptive)
+		{
+			Controller.RecordFailure(result);
+		}
+	}
+
+	if (incompleteResult != 0)
+	{
+		// Visiting the entries may have moved the path buffers and reset the arena
+		Worker.Arena.Reset();
+		DirEntry.Path = Worker.Path.c_str();
+		DirEntry.RelativePath = Worker.RelativePath.c_str();
+		Action.OnDirectoryIncomplete(DirEntry, incompleteResult);
+	}
+}
+
+void TreeWalker::VisitEntry(WorkerBuffers& Worker, const DirectoryEntry& Entry, int Depth)
+{
+	size_t dirLength = Worker.Path.size();
+	size_t relativeLength = Worker.RelativePath.size();
+	Worker.Path.Push(Entry.Name);
+	Worker.RelativePath.Push(Entry.Name);
+	Worker.Arena.Reset();
+
+	// The listing already carries the reparse tag so hand it to the action as is
+	WalkEntry FileEntry;
+	FileEntry.Path = Worker.Path.c_str();
+	FileEntry.RelativePath = Worker.RelativePath.c_str();
+	FileEntry.Depth = Depth;
+	FileEntry.Attributes = Entry.Attributes;
+	FileEntry.ReparseTag = Entry.ReparseTag;
+	FileEntry.Arena = &Worker.Arena;
+
+	DWORD result = (Entry.Attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ? Action.OnReparsePoint(FileEntry) :
+		Action.OnFile(FileEntry);
+	if (result != 0)
+	{
+		Stats.NumFailed++;
+		PrintErrorMessage(result, Worker.Path.c_str());
+		if (Options.bAdaptive)
+		{
+			Controller.RecordFailure(result);
+		}
+	}
+
+	Worker.Path.Pop(dirLength);
+	Worker.RelativePath.Pop(relativeLength);
+}
+
+} // namespace
+
+DWORD WalkTree(LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats)
+{
+	DWORD result = 0;
+
+	// Retrieve the file attributes of the root
+	WIN32_FILE_ATTRIBUTE_DATA rootAttributeData = {0};
+	if (GetFileAttributesEx(Root, GetFileExInfoStandard, &rootAttributeData))
+	{
+		// Reparse points must be processed first as they can also be considered a directory.
+		if ((rootAttributeData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+		{
+			// Only the find data carries the reparse tag. Searching for the path itself returns the entry of the link.
+			WIN32_FIND_DATA ffd;
+			HANDLE hFind = FindFirstFile(Root, &ffd);
+			if (hFind != INVALID_HANDLE_VALUE)
+			{
+				FindClose(hFind);
+
+				WalkEntry RootEntry;
+				RootEntry.Path = Root;
+				RootEntry.RelativePath = TEXT("");
+				RootEntry.Depth = 0;
+				RootEntry.Attributes = ffd.dwFileAttributes;
+				RootEntry.ReparseTag = ffd.dwReserved0;
+
+				StringArena Arena;
+				RootEntry.Arena = &Arena;
+				result = Action.OnReparsePoint(RootEntry);
+			}
+			else
+			{
+				result = GetLastError();
+			}
+		}
+		else if ((rootAttributeData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		{
+			// Links that aren't enumerated from their directory are filtered as they are handed to the action. The
+			// index is recorded unfiltered so that it serves every filter.
+			FilteredLinkAction DiscoveryAction(Action, Options.Filter);
+			WalkOptions DiscoveryOptions = Options;
+			DiscoveryOptions.Filter = NULL;
+
+			// The index falls back to walking the tree itself so that it can record a fresh one. Neither the index nor
+			// the volume metadata know of the ordinary files.
+			if (Options.IndexPath != NULL && !Options.bFiles)
+			{
+				return WalkIndex(Root, DiscoveryAction, DiscoveryOptions, Stats);
+			}
+
+			// Read the reparse points from the volume metadata if requested
+			if (Options.bFast && !Options.bFiles)
+			{
+				if (ScanReparsePoints(Root, DiscoveryAction, DiscoveryOptions, Stats) == 0)
+				{
+					return 0;
+				}
+
+				_tprintf(TEXT("Fast discovery is unavailable for %s, walking the directory tree instead.\n"),
+					GetDisplayPath(Root));
+			}
+
+			WalkItem* RootItem = CreateItem(NULL, Root, 0, rootAttributeData.dwFileAttributes);
+
+			TreeWalker Walker(Action, Options, Stats);
+			Walker.Run(RootItem);
+		}
+	}
+	else
+	{
+		result = GetLastError();
+	}
+
+	// Was the operation successful?
+	if (result != 0)
+	{
+		Stats.NumFailed++;
+		PrintErrorMessage(result, Root);
+	}
+
+	return result;
+}
+
+int ParseThreadCount(LPCTSTR Arg)
+{
+	// The count is optional, e.g. /MT or /MT:16
+	if (Arg[0] == 0 || Arg[1] == 0 || Arg[2] == 0 || Arg[3] != ':')
+	{
+		return DEFAULT_WALK_THREADS;
+	}
+
+	int NumThreads = _ttoi(&Arg[4]);
+	if (NumThreads < 1)
+	{
+		return 1;
+	}
+
+	return NumThreads > MAX_WALK_THREADS ? MAX_WALK_THREADS : NumThreads;
+}
@@ -0,0 +1,519 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <winioctl.h>
+
+#include "ErrorMessage.h"
+#include "PathBuffer.h"
+#include "VolumeScan.h"
+
+/** The size of the buffer that receives the records of the master file table. */
+#define MFT_ENUM_BUFFER_SIZE (1024 * 1024)
+
+/** The maximum number of parent directories followed when resolving the path of a record. */
+#define MAX_RESOLVE_DEPTH 4096
+
+namespace
+{
+
+/**
+ * A directory or reparse point read from the master file table. The name is stored in the shared name buffer of the
+ * volume index.
+ */
+struct FileRecord
+{
+	/** The file reference number of the parent directory. */
+	DWORDLONG ParentFrn;
+	/** The offset of the name within the name buffer, in characters. */
+	DWORD NameOffset;
+	/** The length of the name, in characters. */
+	USHORT NameLength;
+	/** The file attributes of the file object. */
+	DWORD Attributes;
+};
+
+/**
+ * A directory that has been resolved to a path beneath the root of the scan.
+ */
+struct ResolvedDirectory
+{
+	/** The path of the directory relative to the root of the scan. */
+	tstring RelativePath;
+	/** The level of the directory in the filesystem tree. */
+	int Depth;
+	/** Set to true if the directory is beneath the root of the scan. */
+	bool bUnderRoot;
+	/** The result returned by the action for this directory or any of its parents. */
+	DWORD Result;
+};
+
+/**
+ * A reparse point beneath the root of the scan that is waiting to be handed to the action.
+ */
+struct ScannedLink
+{
+	/** The path of the reparse point relative to the root of the scan. */
+	tstring RelativePath;
+	/** The level of the reparse point in the filesystem tree. */
+	int Depth;
+
+	bool operator<(const ScannedLink& Other) const
+	{
+		return RelativePath < Other.RelativePath;
+	}
+};
+
+class VolumeScanner
+{
+public:
+	VolumeScanner(LPCTSTR InRoot, LinkAction& InAction, const WalkOptions& InOptions, LinkStats& InStats);
+
+	/**
+	 * Reads every directory and reparse point record of the volume.
+	 */
+	DWORD ReadVolume(HANDLE hVolume);
+
+	/**
+	 * Invokes the action for the directories and reparse points beneath the root.
+	 */
+	void Run(DWORDLONG RootFrn);
+
+private:
+	VolumeScanner(const VolumeScanner&);
+	VolumeScanner& operator=(const VolumeScanner&);
+
+	static DWORD WINAPI WorkerThreadProc(LPVOID Param);
+
+	const ResolvedDirectory* ResolveDirectory(DWORDLONG Frn);
+	void WorkerLoop();
+
+	LPCTSTR Root;
+	LinkAction& Action;
+	const WalkOptions& Options;
+	LinkStats& Stats;
+
+	DWORDLONG RootFrn;
+	/** The directories of the volume, indexed by file reference number. */
+	std::unordered_map<DWORDLONG, FileRecord> Directories;
+	/** The reparse points of the volume. */
+	std::vector<FileRecord> Links;
+	/** The names of all records, stored back to back without terminators. */
+	std::vector<WCHAR> Names;
+	/** The directories that have already been resolved, indexed by file reference number. */
+	std::unordered_map<DWORDLONG, ResolvedDirectory> Resolved;
+
+	/** The reparse points beneath the root once all records have been resolved. */
+	std::vector<ScannedLink> Scanned;
+	/** The index of the next entry of Scanned to hand to a worker. */
+	volatile LONG NextLink;
+};
+
+VolumeScanner::VolumeScanner(LPCTSTR InRoot, LinkAction& InAction, const WalkOptions& InOptions, LinkStats& InStats)
+	: Root(InRoot)
+	, Action(InAction)
+	, Options(InOptions)
+	, Stats(InStats)
+	, RootFrn(0)
+	, NextLink(0)
+{
+}
+
+DWORD VolumeScanner::ReadVolume(HANDLE hVolume)
+{
+	std::vector<BYTE> Buffer(MFT_ENUM_BUFFER_SIZE);
+
+	MFT_ENUM_DATA_V0 EnumData;
+	EnumData.StartFileReferenceNumber = 0;
+	EnumData.LowUsn = 0;
+	EnumData.HighUsn = MAXLONGLONG;
+
+	for (;;)
+	{
+		DWORD bytesReturned = 0;
+		if (!DeviceIoControl(hVolume, FSCTL_ENUM_USN_DATA, &EnumData, sizeof(EnumData), &Buffer[0], (DWORD)Buffer.size(),
+			&bytesReturned, NULL))
+		{
+			DWORD result = GetLastError();
+			return result == ERROR_HANDLE_EOF ? 0 : result;
+		}
+
+		// The output starts with the file reference number to continue the enumeration from
+		if (bytesReturned <= sizeof(DWORDLONG))
+		{
+			return 0;
+		}
+
+		BYTE* Pos = &Buffer[0] + sizeof(DWORDLONG);
+		BYTE* End = &Buffer[0] + bytesReturned;
+		while (Pos < End)
+		{
+			const USN_RECORD* Record = (const USN_RECORD*)Pos;
+			if (Record->RecordLength == 0)
+			{
+				break;
+			}
+			Pos += Record->RecordLength;
+
+			// Only directories and reparse points are needed to find the links and build their paths
+			bool bLink = (Record->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+			bool bDirectory = (Record->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			if (Record->MajorVersion != 2 || (!bLink && !bDirectory))
+			{
+				continue;
+			}
+
+			FileRecord Entry;
+			Entry.ParentFrn = Record->ParentFileReferenceNumber;
+			Entry.NameOffset = (DWORD)Names.size();
+			Entry.NameLength = (USHORT)(Record->FileNameLength / sizeof(WCHAR));
+			Entry.Attributes = Record->FileAttributes;
+
+			const WCHAR* Name = (const WCHAR*)((const BYTE*)Record + Record->FileNameOffset);
+			Names.insert(Names.end(), Name, Name + Entry.NameLength);
+
+			// Reparse points are never traversed so a junction is only ever a link, not a parent directory
+			if (bLink)
+			{
+				Links.push_back(Entry);
+			}
+			else
+			{
+				Directories[Record->FileReferenceNumber] = Entry;
+			}
+		}
+
+		EnumData.StartFileReferenceNumber = *(DWORDLONG*)&Buffer[0];
+	}
+}
+
+const ResolvedDirectory* VolumeScanner::ResolveDirectory(DWORDLONG Frn)
+{
+	// Follow the parents up to the first directory that has already been resolved
+	std::vector<DWORDLONG> Chain;
+	const ResolvedDirectory* Parent = NULL;
+	for (;;)
+	{
+		std::unordered_map<DWORDLONG, ResolvedDirectory>::const_iterator it = Resolved.find(Frn);
+		if (it != Resolved.end())
+		{
+			Parent = &it->second;
+			break;
+		}
+
+		// Directories that aren't in the index (or are nested too deep to be real) are not beneath the root
+		std::unordered_map<DWORDLONG, FileRecord>::const_iterator dir = Directories.find(Frn);
+		if (dir == Directories.end() || Chain.size() >= MAX_RESOLVE_DEPTH || dir->second.ParentFrn == Frn)
+		{
+			ResolvedDirectory& Outside = Resolved[Frn];
+			Outside.Depth = 0;
+			Outside.bUnderRoot = false;
+			Outside.Result = 0;
+			Parent = &Outside;
+			break;
+		}
+
+		Chain.push_back(Frn);
+		Frn = dir->second.ParentFrn;
+	}
+
+	// Resolve the chain from the top down, invoking the action for each directory beneath the root
+	for (size_t i = Chain.size(); i > 0; i--)
+	{
+		const FileRecord& Record = Directories[Chain[i - 1]];
+
+		ResolvedDirectory Dir;
+		Dir.bUnderRoot = Parent->bUnderRoot;
+		Dir.Depth = Parent->Depth + 1;
+		Dir.Result = Parent->Result;
+		if (Dir.bUnderRoot)
+		{
+			Dir.RelativePath = Parent->RelativePath + TEXT("\\");
+			Dir.RelativePath.append(&Names[Record.NameOffset], Record.NameLength);
+
+			// Directories beyond the maximum depth can't contain any links of interest
+			if (Dir.Result == 0 && (Options.MaxDepth < 0 || Dir.Depth < Options.MaxDepth))
+			{
+				tstring Path = JoinPath(Root, Dir.RelativePath);
+				StringArena Arena;
+
+				WalkEntry DirEntry;
+				DirEntry.Path = Path.c_str();
+				DirEntry.RelativePath = Dir.RelativePath.c_str();
+				DirEntry.Depth = Dir.Depth;
+				DirEntry.Attributes = Record.Attributes;
+				DirEntry.ReparseTag = 0;
+				DirEntry.Arena = &Arena;
+
+				Dir.Result = Action.OnDirectory(DirEntry);
+				if (Dir.Result != 0)
+				{
+					Stats.NumFailed++;
+					PrintErrorMessage(Dir.Result, Path.c_str());
+				}
+			}
+		}
+
+		Parent = &(Resolved[Chain[i - 1]] = Dir);
+	}
+
+	return Parent;
+}
+
+void VolumeScanner::Run(DWORDLONG InRootFrn)
+{
+	RootFrn = InRootFrn;
+
+	// The root is resolved up front so that every chain of parent directories beneath it stops there
+	ResolvedDirectory& RootDir = Resolved[RootFrn];
+	RootDir.Depth = 0;
+	RootDir.bUnderRoot = true;
+
+	WalkEntry RootEntry;
+	RootEntry.Path = Root;
+	RootEntry.RelativePath = TEXT("");
+	RootEntry.Depth = 0;
+	RootEntry.Attributes = FILE_ATTRIBUTE_DIRECTORY;
+	RootEntry.ReparseTag = 0;
+
+	StringArena Arena;
+	RootEntry.Arena = &Arena;
+
+	RootDir.Result = Action.OnDirectory(RootEntry);
+	if (RootDir.Result != 0)
+	{
+		Stats.NumFailed++;
+		PrintErrorMessage(RootDir.Result, Root);
+		return;
+	}
+
+	// Keep only the links beneath the root and within the maximum depth
+	for (size_t i = 0; i < Links.size(); i++)
+	{
+		const FileRecord& Link = Links[i];
+		const ResolvedDirectory* Parent = ResolveDirectory(Link.ParentFrn);
+		if (!Parent->bUnderRoot || Parent->Result != 0 || (Options.MaxDepth >= 0 && Parent->Depth + 1 > Options.MaxDepth))
+		{
+			continue;
+		}
+
+		ScannedLink Entry;
+		Entry.RelativePath = Parent->RelativePath + TEXT("\\");
+		Entry.RelativePath.append(&Names[Link.NameOffset], Link.NameLength);
+		Entry.Depth = Parent->Depth + 1;
+		Scanned.push_back(Entry);
+	}
+
+	// The records are listed in file reference order, hand them out sorted by path instead
+	std::sort(Scanned.begin(), Scanned.end());
+
+	int NumWorkers = Options.NumThreads < 1 ? 1 : (Options.NumThreads > MAX_WALK_THREADS ? MAX_WALK_THREADS : Options.NumThreads);
+	std::vector<HANDLE> Threads;
+	for (int i = 1; i < NumWorkers; i++)
+	{
+		HANDLE hThread = CreateThread(NULL, 0, WorkerThreadProc, this, 0, NULL);
+		if (hThread != NULL)
+		{
+			Threads.push_back(hThread);
+		}
+	}
+
+	WorkerLoop();
+
+	for (size_t i = 0; i < Threads.size(); i++)
+	{
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+	}
+}
+
+DWORD WINAPI VolumeScanner::WorkerThreadProc(LPVOID Param)
+{
+	((VolumeScanner*)Param)->WorkerLoop();
+	return 0;
+}
+
+void VolumeScanner::WorkerLoop()
+{
+	StringArena Arena;
+	for (;;)
+	{
+		LONG Idx = InterlockedIncrement(&NextLink) - 1;
+		if (Idx >= (LONG)Scanned.size())
+		{
+			break;
+		}
+
+		const ScannedLink& Link = Scanned[Idx];
+		tstring Path = JoinPath(Root, Link.RelativePath);
+
+		// The master file table doesn't carry the reparse tag, the find data of the link does
+		WIN32_FIND_DATA ffd;
+		HANDLE hFind = FindFirstFile(Path.c_str(), &ffd);
+		if (hFind == INVALID_HANDLE_VALUE)
+		{
+			// The link may have been removed since the volume was scanned
+			DWORD result = GetLastError();
+			if (result != ERROR_FILE_NOT_FOUND && result != ERROR_PATH_NOT_FOUND)
+			{
+				Stats.NumFailed++;
+				PrintErrorMessage(result, Path.c_str());
+			}
+			continue;
+		}
+		FindClose(hFind);
+
+		WalkEntry LinkEntry;
+		LinkEntry.Path = Path.c_str();
+		LinkEntry.RelativePath = Link.RelativePath.c_str();
+		LinkEntry.Depth = Link.Depth;
+		LinkEntry.Attributes = ffd.dwFileAttributes;
+		LinkEntry.ReparseTag = ffd.dwReserved0;
+		LinkEntry.Arena = &Arena;
+		Arena.Reset();
+
+		DWORD result = Action.OnReparsePoint(LinkEntry);
+		if (result != 0)
+		{
+			Stats.NumFailed++;
+			PrintErrorMessage(result, Path.c_str());
+		}
+	}
+}
+
+} // namespace
+
+DWORD OpenVolume(LPCTSTR Path, HANDLE& hVolume)
+{
+	// The volume mount point functions expect a regular DOS path
+	Path = GetDisplayPath(Path);
+	DWORD length = GetFullPathName(Path, 0, NULL, NULL);
+	if (length == 0)
+	{
+		return GetLastError();
+	}
+
+	std::vector<TCHAR> FullPath(length);
+	if (GetFullPathName(Path, length, &FullPath[0], NULL) == 0)
+	{
+		return GetLastError();
+	}
+
+	std::vector<TCHAR> VolumePath(length + 1);
+	if (!GetVolumePathName(&FullPath[0], &VolumePath[0], length + 1))
+	{
+		return GetLastError();
+	}
+
+	// Only local NTFS volumes expose their master file table
+	TCHAR FileSystemName[MAX_PATH + 1] = {0};
+	if (GetDriveType(&VolumePath[0]) == DRIVE_REMOTE ||
+		!GetVolumeInformation(&VolumePath[0], NULL, 0, NULL, NULL, NULL, FileSystemName, MAX_PATH + 1) ||
+		lstrcmpi(FileSystemName, TEXT("NTFS")) != 0)
+	{
+		return ERROR_NOT_SUPPORTED;
+	}
+
+	// The volume device is opened by its GUID name without the trailing backslash
+	TCHAR VolumeName[MAX_PATH];
+	if (!GetVolumeNameForVolumeMountPoint(&VolumePath[0], VolumeName, MAX_PATH))
+	{
+		return GetLastError();
+	}
+
+	size_t nameLength = _tcslen(VolumeName);
+	if (nameLength > 0 && VolumeName[nameLength - 1] == '\\')
+	{
+		VolumeName[nameLength - 1] = 0;
+	}
+
+	hVolume = CreateFile(VolumeName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hVolume == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	return 0;
+}
+
+DWORD GetFileReference(LPCTSTR Path, DWORDLONG& FileReference)
+{
+	HANDLE hFile = CreateFile(Path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	DWORD result = 0;
+	BY_HANDLE_FILE_INFORMATION FileInfo;
+	if (GetFileInformationByHandle(hFile, &FileInfo))
+	{
+		FileReference = ((DWORDLONG)FileInfo.nFileIndexHigh << 32) | FileInfo.nFileIndexLow;
+	}
+	else
+	{
+		result = GetLastError();
+	}
+
+	CloseHandle(hFile);
+	return result;
+}
+
+DWORD ScanReparsePoints(LPCTSTR Root, LinkAction& Action, const WalkOptions& Options, LinkStats& Stats)
+{
+	DWORDLONG RootFrn = 0;
+	DWORD result = GetFileReference(Root, RootFrn);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	HANDLE hVolume = INVALID_HANDLE_VALUE;
+	result = OpenVolume(Root, hVolume);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	VolumeScanner Scanner(Root, Action, Options, Stats);
+	result = Scanner.ReadVolume(hVolume);
+	CloseHandle(hVolume);
+
+	if (result == 0)
+	{
+		Scanner.Run(RootFrn);
+	}
+
+	return result;
+}
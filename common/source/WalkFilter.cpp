@@ -0,0 +1,243 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include "StringMatch.h"
+#include "WalkFilter.h"
+
+namespace
+{
+
+/**
+ * Folds a string to upper case the way the file system compares names.
+ */
+tstring UpcaseString(LPCTSTR Str, size_t Length)
+{
+	tstring Result(Str, Length);
+	for (size_t i = 0; i < Length; i++)
+	{
+		Result[i] = UpcaseChar(Result[i]);
+	}
+
+	return Result;
+}
+
+/**
+ * Matches a name against a pattern already folded to upper case, where '*' matches any run of characters and '?' any
+ * single character. Only the last '*' is ever backtracked to, which keeps the match linear for the patterns used to
+ * name directories.
+ */
+bool MatchPattern(const tstring& Pattern, LPCTSTR Name, size_t NameLength)
+{
+	size_t p = 0;
+	size_t n = 0;
+	size_t StarPos = tstring::npos;
+	size_t StarMatch = 0;
+	while (n < NameLength)
+	{
+		if (p < Pattern.size() && Pattern[p] == '*')
+		{
+			StarPos = p++;
+			StarMatch = n;
+		}
+		else if (p < Pattern.size() && (Pattern[p] == '?' || Pattern[p] == UpcaseChar(Name[n])))
+		{
+			p++;
+			n++;
+		}
+		else if (StarPos != tstring::npos)
+		{
+			// Let the last '*' take one more character and try again from there
+			p = StarPos + 1;
+			n = ++StarMatch;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	while (p < Pattern.size() && Pattern[p] == '*')
+	{
+		p++;
+	}
+
+	return p == Pattern.size();
+}
+
+/**
+ * Returns the WALK_LINK_* flag of a reparse tag, or zero if it isn't a link.
+ */
+DWORD GetLinkType(DWORD ReparseTag)
+{
+	if (ReparseTag == IO_REPARSE_TAG_MOUNT_POINT)
+	{
+		return WALK_LINK_JUNCTION;
+	}
+
+	return ReparseTag == IO_REPARSE_TAG_SYMLINK ? WALK_LINK_SYMLINK : 0;
+}
+
+} // namespace
+
+WalkFilter::WalkFilter()
+	: LinkTypes(WALK_LINK_ALL)
+	, bOnlyLinks(false)
+{
+}
+
+void WalkFilter::ExcludeDirectory(LPCTSTR Pattern)
+{
+	size_t Length = _tcslen(Pattern);
+	if (Length == 0)
+	{
+		return;
+	}
+
+	tstring Upcased = UpcaseString(Pattern, Length);
+	if (Upcased.find_first_of(TEXT("*?")) == tstring::npos)
+	{
+		Literals.push_back(Upcased);
+	}
+	else
+	{
+		Patterns.push_back(Upcased);
+	}
+}
+
+void WalkFilter::ExcludeJunctions()
+{
+	LinkTypes &= ~WALK_LINK_JUNCTION;
+}
+
+bool WalkFilter::SetLinkTypes(LPCTSTR Types)
+{
+	DWORD NewTypes = 0;
+	LPCTSTR Type = Types;
+	while (*Type != 0)
+	{
+		size_t Length = _tcscspn(Type, TEXT("|,"));
+		if (Length == 8 && _tcsnicmp(Type, TEXT("junction"), 8) == 0)
+		{
+			NewTypes |= WALK_LINK_JUNCTION;
+		}
+		else if (Length == 7 && _tcsnicmp(Type, TEXT("symlink"), 7) == 0)
+		{
+			NewTypes |= WALK_LINK_SYMLINK;
+		}
+		else
+		{
+			return false;
+		}
+
+		Type += Length;
+		if (*Type != 0)
+		{
+			Type++;
+		}
+	}
+
+	if (NewTypes == 0)
+	{
+		return false;
+	}
+
+	// Combined with /XJ rather than replacing it, whichever comes first on the command line
+	LinkTypes &= NewTypes;
+	bOnlyLinks = true;
+	return true;
+}
+
+bool WalkFilter::IsDirectoryExcluded(LPCTSTR Name, size_t NameLength) const
+{
+	for (size_t i = 0; i < Literals.size(); i++)
+	{
+		const tstring& Literal = Literals[i];
+		if (Literal.size() != NameLength)
+		{
+			continue;
+		}
+
+		size_t c = 0;
+		while (c < NameLength && Literal[c] == UpcaseChar(Name[c]))
+		{
+			c++;
+		}
+
+		if (c == NameLength)
+		{
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < Patterns.size(); i++)
+	{
+		if (MatchPattern(Patterns[i], Name, NameLength))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool WalkFilter::IsLinkExcluded(LPCTSTR Name, size_t NameLength, DWORD Attributes, DWORD ReparseTag) const
+{
+	DWORD LinkType = GetLinkType(ReparseTag);
+	if (LinkType != 0 ? (LinkTypes & LinkType) == 0 : bOnlyLinks)
+	{
+		return true;
+	}
+
+	return (Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0 && IsDirectoryExcluded(Name, NameLength);
+}
+
+bool WalkFilter::IsPathExcluded(LPCTSTR RelativePath, DWORD Attributes, DWORD ReparseTag) const
+{
+	// Match each directory leading to the entry, then the entry itself
+	LPCTSTR Name = RelativePath[0] == '\\' ? RelativePath + 1 : RelativePath;
+	for (LPCTSTR Separator = _tcschr(Name, '\\'); Separator != NULL; Separator = _tcschr(Name, '\\'))
+	{
+		if (IsDirectoryExcluded(Name, Separator - Name))
+		{
+			return true;
+		}
+
+		Name = Separator + 1;
+	}
+
+	size_t NameLength = _tcslen(Name);
+	if ((Attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+	{
+		return IsLinkExcluded(Name, NameLength, Attributes, ReparseTag);
+	}
+
+	return NameLength > 0 && (Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0 && IsDirectoryExcluded(Name, NameLength);
+}
@@ -29,31 +29,21 @@
 
 #include "stdafx.h"
 
-#include <Junction.h>
-#include <memory.h>
-#include <Symlink.h>
 #include <strsafe.h>
 
-#include "DataTypes.h"
+#include "CopyLinks.h"
+#include "DestinationCache.h"
+#include "LinkCore.h"
+#include "LinkService.h"
+#include "PathBuffer.h"
+#include "RebaseMap.h"
+#include "RunMetrics.h"
+#include "StringMatch.h"
 #include "StringUtils.h"
+#include "TreeWalker.h"
 
-using namespace libntfslinks;
-
-cplinkOptions Options;
-cplinkStats Stats;
-
-/**
- * Prints a friendly message based on the given error code.
- */
-void PrintErrorMessage(DWORD ErrorCode, LPCTSTR Path)
-{
-	switch (ErrorCode)
-	{
-	case ERROR_FILE_NOT_FOUND: _tprintf(TEXT("File not found: %s.\n"), Path); break;
-	case ERROR_PATH_NOT_FOUND: _tprintf(TEXT("Path not found: %s.\n"), Path); break;
-	case ERROR_ACCESS_DENIED: _tprintf(TEXT("Access denied: %s.\n"), Path); break;
-	}
-}
+CopyLinkOptions Options;
+CopyLinkStats Stats;
 
 /**
  * Copies all reparse points in the specified source path to a given destination and rebases the target of each based on
@@ -61,256 +51,114 @@ void PrintErrorMessage(DWORD ErrorCode, LPCTSTR Path)
  *
  * @param Src The path of the source file to copy.
  * @param Dest The path of the destination to copy Src to.
- * @param CurDepth The current level that has been traversed in the filesystem tree.
+ * @param Rules The rules loaded with /RMAP.
  * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
  */
-DWORD cplink(LPCTSTR Src, LPCTSTR Dest, int CurDepth = 0)
+DWORD cplink(LPCTSTR Src, LPCTSTR Dest, const RebaseMap& Rules)
 {
-	DWORD result = 0;
-
-	// If applicable, do not go further than the specified maximum depth
-	if (Options.MaxDepth >= 0 && CurDepth > Options.MaxDepth)
+	DestinationCache DestDirs;
+	tstring SrcPath;
+	tstring DestPath;
+	DWORD result = GetCopyPaths(Src, Dest, Options, DestDirs, SrcPath, DestPath, Stats);
+	if (result != 0)
 	{
 		return result;
 	}
 
-	// Expand the source to a full path
-	TCHAR SrcPath[MAX_PATH] = {0};
-	if (GetFullPathName(Src, MAX_PATH, SrcPath, NULL) == 0)
-	{
-		Stats.NumFailed++;
-		_tprintf(TEXT("Invalid source path specified.\n"));
-		return 1;
-	}
-	
-	// Expand the destination to a full path
-	TCHAR DestPath[MAX_PATH] = {0};
-	if (GetFullPathName(Dest, MAX_PATH, DestPath, NULL) == 0)
-	{
-		Stats.NumFailed++;
-		_tprintf(TEXT("Invalid destination path specified.\n"));
-		return 1;
-	}
+	WalkOptions walkOptions = Options.GetWalkOptions();
+	walkOptions.bFiles = Options.bHardLinks;
 
-	// Retrieve the file attributes of SrcPath
-	WIN32_FILE_ATTRIBUTE_DATA srcAttributeData = {0};
-	if (GetFileAttributesEx(SrcPath, GetFileExInfoStandard, &srcAttributeData))
+	// Hand the links over to the stages of the pipeline if requested
+	if (Options.NumReaders > 0)
 	{
-		// Reparse points must be processed first as they can also be considered a directory.
-		if ((srcAttributeData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+		CopyLinkPipeline Pipeline(Options, Stats, DestDirs, Rules, DestPath.c_str());
+		result = Pipeline.Start(Options.NumReaders, Options.NumWriters);
+		if (result == 0)
 		{
-			// Check if the destination already exists
-			WIN32_FILE_ATTRIBUTE_DATA destAttributeData = {0};
-			if (GetFileAttributesEx(DestPath, GetFileExInfoStandard, &destAttributeData))
-			{
-				// Ask permission to delete the destination
-				// TODO
-
-				// Delete the existing reparse point destinations
-				if ((destAttributeData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-				{
-					if (IsJunction(DestPath))
-					{
-						result = DeleteJunction(DestPath);
-					}
-					else if (IsSymlink(DestPath))
-					{
-						result = DeleteSymlink(DestPath);
-					}
-				}
-			}
-
-			// Was there a failure deleting the existing destination?
-			if (result == 0)
-			{
-				// Is this a junction or a symlink?
-				if (IsJunction(SrcPath))
-				{
-					// Retrieve the existing target
-					TCHAR Target[MAX_PATH] = {0};
-					result = GetJunctionTarget(SrcPath, Target, sizeof(Target));
-					if (result == 0)
-					{
-						// If specified, rebase the target to the new root
-						if (Options.NewTargetBase[0] != 0 && Options.OldTargetBase[0] != 0)
-						{
-							TCHAR NewTarget[MAX_PATH] = {0};
-							StrReplace(Target, Options.OldTargetBase, Options.NewTargetBase, NewTarget, -1, -1);
-
-							// Create the junction at the destination
-							result = CreateJunction(DestPath, NewTarget);
-							if (result == 0 && Options.bVerbose)
-							{
-								_tprintf(TEXT("junction created for %s <<===>> %s\n"), DestPath, NewTarget);
-							}
-						}
-						// Otherwise create a junction to the existing target at the destination
-						else
-						{
-							result = CreateJunction(DestPath, Target);
-							if (result == 0 && Options.bVerbose)
-							{
-								_tprintf(TEXT("junction created for %s <<===>> %s\n"), DestPath, Target);
-							}
-						}
-
-						// Was the junction created successfully?
-						if (result == 0)
-						{
-							Stats.NumCopied++;
-						}
-					}
-				}
-				else if (IsSymlink(SrcPath))
-				{
-					// Retrieve the existing target
-					TCHAR Target[MAX_PATH] = {0};
-					result = GetSymlinkTarget(SrcPath, Target, sizeof(Target));
-					if (result == 0)
-					{
-						// If specified, rebase the target to the new root
-						if (Options.NewTargetBase[0] != 0 && Options.OldTargetBase[0] != 0)
-						{
-							TCHAR NewTarget[MAX_PATH] = {0};
-							StrReplace(Target, Options.OldTargetBase, Options.NewTargetBase, NewTarget, -1, -1);
-
-							// Create the symlink at the destination
-							result = CreateSymlink(DestPath, NewTarget);
-							if (result == 0 && Options.bVerbose)
-							{
-								_tprintf(TEXT("symbolic link created for %s <<===>> %s\n"), DestPath, NewTarget);
-							}
-						}
-						// Otherwise create a symlink to the existing target at the destination
-						else
-						{
-							result = CreateSymlink(DestPath, Target);
-							if (result == 0 && Options.bVerbose)
-							{
-								_tprintf(TEXT("symbolic link created for %s <<===>> %s\n"), DestPath, Target);
-							}
-						}
-
-						// Was the symlink created successfully?
-						if (result == 0)
-						{
-							Stats.NumCopied++;
-						}
-					}
-				}
-				else
-				{
-					result = GetLastError();
-					if (result == 0)
-					{
-						_tprintf(TEXT("Unrecognized reparse point: %s\n"), SrcPath);
-						Stats.NumSkipped++;
-					}
-				}
-			}
+			result = WalkTree(SrcPath.c_str(), Pipeline, walkOptions, Stats);
+			Pipeline.Finish();
+			return result;
 		}
-		else if ((srcAttributeData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
-		{
-			// Make sure the the destination directory exists. If not create it.
-			WIN32_FILE_ATTRIBUTE_DATA destAttributeData = {0};
-			if (GetFileAttributesEx(DestPath, GetFileExInfoStandard, &destAttributeData))
-			{
-				if ((destAttributeData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
-				{
-					// TODO Copy security descriptor?
-					if (!CreateDirectoryEx(SrcPath, DestPath, NULL))
-					{
-						// Failed to create the destination directory. Already exists?
-						// TODO
-					}
-				}
-			}
-
-			WIN32_FIND_DATA ffd;
-			TCHAR szDir[MAX_PATH] = {0};
-			HANDLE hFind;
 
-			// The search path must include '\*'
-			StringCchCopy(szDir, sizeof(szDir), SrcPath);
-			StringCchCat(szDir, sizeof(szDir), TEXT("\\*"));
-
-			// Iterate through the list of files in the directory and cplink each one. This will be done in two passes,
-			// the first pass will move all regular files and directories. The second pass will move all reparse points.
-			hFind = FindFirstFile(szDir, &ffd);
-			if (hFind != INVALID_HANDLE_VALUE)
-			{
-				do
-				{
-					// Ignore the '.' and '..' entries
-					size_t fileNameLength;
-					if (FAILED(StringCchLength(ffd.cFileName, MAX_PATH, &fileNameLength)) || fileNameLength == 0 ||
-						(fileNameLength == 1 && ffd.cFileName[0] == '.') ||
-						(fileNameLength == 2 && ffd.cFileName[0] == '.' && ffd.cFileName[1] == '.'))
-					{
-						continue;
-					}
-
-					// Ignore anything that isn't a directory or reparse point
-					if ((ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 ||
-						(ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-					{
-						TCHAR srcFile[MAX_PATH];
-						StringCchCopy(srcFile, sizeof(srcFile), SrcPath);
-						StringCchCat(srcFile, sizeof(srcFile), TEXT("\\"));
-						StringCchCat(srcFile, sizeof(srcFile), ffd.cFileName);
+		_tprintf(TEXT("Unable to start the copy pipeline, copying the links directly instead.\n"));
+	}
 
-						TCHAR destFile[MAX_PATH];
-						StringCchCopy(destFile, sizeof(destFile), DestPath);
-						StringCchCat(destFile, sizeof(destFile), TEXT("\\"));
-						StringCchCat(destFile, sizeof(destFile), ffd.cFileName);
+	CopyLinkAction Action(Options, Stats, DestDirs, Rules, DestPath.c_str());
+	return WalkTree(SrcPath.c_str(), Action, walkOptions, Stats);
+}
 
-						result = cplink(srcFile, destFile, CurDepth+1);
-					}
-				} while (FindNextFile(hFind, &ffd) != 0);
+/**
+ * Parses the worker counts of a /PIPE[:r[,w]] command line option. Both counts are optional and clamped to the range
+ * supported by WalkTree.
+ */
+void ParsePipeCounts(LPCTSTR Arg)
+{
+	Options.NumReaders = DEFAULT_WALK_THREADS;
+	Options.NumWriters = DEFAULT_WALK_THREADS;
 
-				// Close the handle for the first pass
-				FindClose(hFind);
-			}
-			else
-			{
-				// If we failed to be able to read the directory listing due to a access violation count it as a skip
-				// instead of a complete failure.
-				if (GetLastError() == ERROR_ACCESS_DENIED)
-				{
-					PrintErrorMessage(GetLastError(), SrcPath);
-					Stats.NumSkipped++;
-				}
-				else
-				{
-					result = GetLastError();
-				}
-			}
-		}
-	}
-	else
+	LPCTSTR Counts = _tcschr(Arg, ':');
+	if (Counts == NULL)
 	{
-		result = GetLastError();
+		return;
 	}
 
-	// Was the operation successful?
-	if (result != 0)
+	int NumReaders = _ttoi(Counts + 1);
+	Options.NumReaders = NumReaders < 1 ? 1 : (NumReaders > MAX_WALK_THREADS ? MAX_WALK_THREADS : NumReaders);
+
+	LPCTSTR Separator = _tcschr(Counts, ',');
+	if (Separator != NULL)
 	{
-		Stats.NumFailed++;
-		PrintErrorMessage(result, SrcPath);
+		int NumWriters = _ttoi(Separator + 1);
+		Options.NumWriters = NumWriters < 1 ? 1 : (NumWriters > MAX_WALK_THREADS ? MAX_WALK_THREADS : NumWriters);
 	}
-
-	return result;
 }
 
 void PrintUsage()
 {
-	_tprintf(TEXT("Copies all symbolic links and junctions from one path to another.\n\n"));
-	_tprintf(TEXT("Usage: cplink [/V] [/LEV:n] [/R <find> <replace>] <source> <destination>\n\n"));
+	_tprintf(TEXT("Copies all symbolic links, junctions and volume mount points from one path to another.\n\n"));
+	_tprintf(TEXT("Usage: cplink [/SERVE | /SERVICE] [/V] [/VERIFY] [/STATS[:n[,file]]] [/LEV:n] [/MT[:n]] [/ADAPT] [/MAXIOPS:n] [/BFS] [/EMPTYDEST] [/FAST] [/INDEX:file] [/XD:pattern]... [/XJ] [/TYPE:types] [/PIPE[:r[,w]]] [/HARDLINKS] [/R <find> <replace>] [/RMAP:file] <source> <destination>\n\n"));
 	_tprintf(TEXT("Options:\n"));
+	_tprintf(TEXT("\t\t/ADAPT\t\tAdapt the number of busy /MT threads to the volume: one more while\n"));
+	_tprintf(TEXT("\t\t\t\toperations stay fast, half as many once they slow down or the server\n"));
+	_tprintf(TEXT("\t\t\t\tturns requests away as busy.\n"));
+	_tprintf(TEXT("\t\t/BFS\t\tWalk the directory tree breadth-first instead of depth-first.\n"));
+	_tprintf(TEXT("\t\t/EMPTYDEST\tAssert that the destination is empty or missing, so that no existing\n"));
+	_tprintf(TEXT("\t\t\t\tlinks are looked for before creating the new ones.\n"));
+	_tprintf(TEXT("\t\t/FAST\t\tRead the links from the volume metadata instead of enumerating every\n"));
+	_tprintf(TEXT("\t\t\t\tdirectory. Requires elevation and a local NTFS volume.\n"));
+	_tprintf(TEXT("\t\t\t\tOnly the directories leading to links are created at the destination.\n"));
+	_tprintf(TEXT("\t\t/HARDLINKS\tLink the copies of the files that are hard links of each other in the\n"));
+	_tprintf(TEXT("\t\t\t\tsource to the same file, once they have been copied. Ignores /FAST and\n"));
+	_tprintf(TEXT("\t\t\t\t/INDEX since every file has to be looked at.\n"));
+	_tprintf(TEXT("\t\t/INDEX:file\tReplay the links recorded in a link index file while nothing beneath the\n"));
+	_tprintf(TEXT("\t\t\t\tpath changed, otherwise walk the tree and record a new index. Requires\n"));
+	_tprintf(TEXT("\t\t\t\televation.\n"));
 	_tprintf(TEXT("\t\t/LEV:n\t\tOnly copy the top n levels of the source directory tree.\n"));
-	_tprintf(TEXT("\t\t/R <old> <new>\tModifies the target path of all links, replacing the last occurrence of <old> with <new>.\n"));
+	_tprintf(TEXT("\t\t/PIPE[:r[,w]]\tCopy the links in stages, with r threads reading the source links and w\n"));
+	_tprintf(TEXT("\t\t\t\tthreads creating the copies (default 8 each), so that the latency of the\n"));
+	_tprintf(TEXT("\t\t\t\tsource and of the destination overlap. /MT sets the threads walking the tree.\n"));
+	_tprintf(TEXT("\t\t/R <old> <new>\tModifies the target path of all links, replacing the last occurrence of <old>, ignoring case, with <new>.\n"));
+	_tprintf(TEXT("\t\t/RMAP:file\tRebases the target path of all links with the rules in file, one <old>|<new>\n"));
+	_tprintf(TEXT("\t\t\t\tpair per line. The longest <old> prefix matching whole path components\n"));
+	_tprintf(TEXT("\t\t\t\twins. Targets no rule matches fall back to /R.\n"));
+	_tprintf(TEXT("\t\t/MAXIOPS:n\tStart at most n file system operations a second, across every thread.\n"));
+	_tprintf(TEXT("\t\t/MT[:n]\t\tWalk the directory tree using n worker threads (default 8).\n"));
+	_tprintf(TEXT("\t\t/SERVE\t\tRun as a service that carries out the invocations of the utility made by\n"));
+	_tprintf(TEXT("\t\t\t\tother processes over the named pipe \\\\.\\pipe\\ntfslinkd\\<utility>, one at a\n"));
+	_tprintf(TEXT("\t\t\t\ttime, as the user that made each of them.\n"));
+	_tprintf(TEXT("\t\t/SERVICE\tHand the invocation to the /SERVE service of the utility if this user runs\n"));
+	_tprintf(TEXT("\t\t\t\tone, otherwise run it in this process.\n"));
+	_tprintf(TEXT("\t\t/STATS[:n[,file]]\n\t\t\t\tReport progress, throughput, queue depths and latencies every n\n"));
+	_tprintf(TEXT("\t\t\t\tseconds (default 10), one JSON object per line, to stderr or file.\n"));
+	_tprintf(TEXT("\t\t/TYPE:types\tOnly visit the links of the given types, junction and/or symlink separated\n"));
+	_tprintf(TEXT("\t\t\t\tby commas. Other reparse points are skipped.\n"));
+	_tprintf(TEXT("\t\t/VERIFY\t\tOnly create the links whose target exists, and is a directory for directory\n"));
+	_tprintf(TEXT("\t\t\t\tlinks and a file for file links. The others are counted as broken.\n"));
 	_tprintf(TEXT("\t\t/V\t\tEnable verbose output and display more information.\n"));
 	_tprintf(TEXT("\t\t/VER\t\tDisplay the version and copyright information.\n"));
+	_tprintf(TEXT("\t\t/XD:pattern\tSkip the directories, and directory links, whose name matches pattern.\n"));
+	_tprintf(TEXT("\t\t\t\tThe wildcards * and ? may be used. May be given more than once.\n"));
+	_tprintf(TEXT("\t\t/XJ\t\tSkip junctions.\n"));
 	_tprintf(TEXT("\t\t/?\t\tView this list of options.\n"));
 }
 
@@ -340,16 +188,28 @@ void PrintVersion()
 	_tprintf(TEXT("OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.\n"));
 }
 
-int _tmain(int argc, TCHAR* argv[])
+/**
+ * Runs a single invocation of cplink with the given command line.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @return Returns the exit code of the invocation.
+ */
+int cplinkMain(int argc, TCHAR* argv[])
 {
 	DWORD result;
 	int requiredArgs = 3;
+	RebaseMap RebaseRules;
 
 	// Parse the command line arguments
-	TCHAR Value[1024];
 	for (int i = 1; i < argc; i++)
 	{
-		if (StrFind(argv[i], TEXT("/VER")) >= 0 || StrFind(argv[i], TEXT("/ver")) >= 0)
+		// /VERIFY is looked for first since it begins like /VER
+		if (StrFind(argv[i], TEXT("/VERIFY")) >= 0 || StrFind(argv[i], TEXT("/verify")) >= 0)
+		{
+			Options.bVerify = true;
+		}
+		else if (StrFind(argv[i], TEXT("/VER")) >= 0 || StrFind(argv[i], TEXT("/ver")) >= 0)
 		{
 			PrintVersion();
 			return 0;
@@ -359,11 +219,9 @@ int _tmain(int argc, TCHAR* argv[])
 			PrintUsage();
 			return 0;
 		}
-		else if (StrFind(argv[i], TEXT("/LEV")) >= 0 || StrFind(argv[i], TEXT("/lev")) >= 0)
+		else if (ParseLinkCopyOption(argv[i], Options))
 		{
-			memset(Value, 0, sizeof(Value));
-			StringCchCopy(Value, sizeof(Value), &argv[i][5]);
-			Options.MaxDepth = _ttoi(Value);
+			// One of the options shared with mvlink, looked for ahead of /R since /RMAP begins like it
 		}
 		else if (StrFind(argv[i], TEXT("/R")) >= 0 || StrFind(argv[i], TEXT("/r")) >= 0)
 		{
@@ -375,12 +233,16 @@ int _tmain(int argc, TCHAR* argv[])
 				return 1;
 			}
 
-			StringCchCopy(Options.OldTargetBase, sizeof(Options.OldTargetBase), argv[i+1]);
-			StringCchCopy(Options.NewTargetBase, sizeof(Options.NewTargetBase), argv[i+2]);
+			StringCchCopy(Options.OldTargetBase, ARRAYSIZE(Options.OldTargetBase), argv[i+1]);
+			StringCchCopy(Options.NewTargetBase, ARRAYSIZE(Options.NewTargetBase), argv[i+2]);
+		}
+		else if (StrFind(argv[i], TEXT("/PIPE")) >= 0 || StrFind(argv[i], TEXT("/pipe")) >= 0)
+		{
+			ParsePipeCounts(argv[i]);
 		}
-		else if (StrFind(argv[i], TEXT("/V")) >= 0 || StrFind(argv[i], TEXT("/v")) >= 0)
+		else if (StrFind(argv[i], TEXT("/HARDLINKS")) >= 0 || StrFind(argv[i], TEXT("/hardlinks")) >= 0)
 		{
-			Options.bVerbose = true;
+			Options.bHardLinks = true;
 		}
 	}
 
@@ -392,13 +254,36 @@ int _tmain(int argc, TCHAR* argv[])
 		return 1;
 	}
 
+	// Compile the rebase rules once up front
+	if (Options.RebaseMapPath[0] != 0)
+	{
+		result = LoadRebaseRules(Options.RebaseMapPath, Options.bVerbose, RebaseRules);
+		if (result != 0)
+		{
+			return result;
+		}
+	}
+
+	// Report on the run as it goes
+	result = StartToolMetrics(Options, Stats, Stats.NumCopied);
+	if (result != 0)
+	{
+		return result;
+	}
+
 	// Execute cplink
-	result = cplink(argv[argc-2], argv[argc-1]);
+	result = cplink(argv[argc-2], argv[argc-1], RebaseRules);
+
+	StopMetrics();
 
 	// Print the execution statistics
-	_tprintf(TEXT("Copied: %d\n"), Stats.NumCopied);
-	_tprintf(TEXT("Skipped: %d\n"), Stats.NumSkipped);
-	_tprintf(TEXT("Failed: %d\n"), Stats.NumFailed);
+	_tprintf(TEXT("Copied: %ld\n"), Stats.NumCopied.Get());
+	_tprintf(TEXT("Skipped: %ld\n"), Stats.NumSkipped.Get());
+	if (Options.bVerify)
+	{
+		_tprintf(TEXT("Broken: %ld\n"), Stats.NumBroken.Get());
+	}
+	_tprintf(TEXT("Failed: %ld\n"), Stats.NumFailed.Get());
 
 	// Make sure that if there were errors it is reflected in the result
 	if (result == 0 && Stats.NumFailed > 0)
@@ -408,3 +293,28 @@ int _tmain(int argc, TCHAR* argv[])
 
 	return result;
 }
+
+/**
+ * Runs each invocation of cplink. A service runs many of them in the same process so each starts from a clean state,
+ * and whatever an invocation that returned early left running is stopped.
+ */
+class cplinkJob : public LinkServiceJob
+{
+public:
+	virtual int Run(int argc, TCHAR* argv[])
+	{
+		Options = CopyLinkOptions();
+		Stats = CopyLinkStats();
+
+		int ExitCode = cplinkMain(argc, argv);
+
+		StopMetrics();
+		return ExitCode;
+	}
+};
+
+int _tmain(int argc, TCHAR* argv[])
+{
+	cplinkJob Job;
+	return RunLinkTool(TEXT("cplink"), argc, argv, Job);
+}
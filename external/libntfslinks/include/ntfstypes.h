@@ -83,5 +83,12 @@ typedef struct _REPARSE_DATA_BUFFER {
 #define FILE_OPEN_FOR_BACKUP_INTENT             0x00004000
 #define FILE_NO_COMPRESSION                     0x00008000
 
+#define FILE_OPEN_REPARSE_POINT                 0x00200000
+
+#define FILE_CREATE                             0x00000002
+
+// As defined in ntdef.h
+#define OBJ_CASE_INSENSITIVE                    0x00000040
+
 
 #endif //NTFSTYPES_H
\ No newline at end of file
@@ -29,182 +29,159 @@
 
 #include "stdafx.h"
 
-#include <Junction.h>
 #include <memory.h>
-#include <Symlink.h>
 #include <strsafe.h>
 
-#include "DataTypes.h"
+#include "AsyncReparse.h"
+#include "ChangeJournal.h"
+#include "ErrorMessage.h"
+#include "FixLinks.h"
+#include "LinkCore.h"
+#include "ApplyJournal.h"
+#include "LinkManifest.h"
+#include "LinkService.h"
+#include "PathBuffer.h"
+#include "RebaseMap.h"
+#include "RootScheduler.h"
+#include "RunMetrics.h"
 #include "StringUtils.h"
+#include "TreeWalker.h"
 
-using namespace libntfslinks;
+FixLinkOptions Options;
+FixLinkStats Stats;
 
-fixlinkOptions Options;
-fixlinkStats Stats;
+/** The checkpoints read from the checkpoint file and the ones to save after this run. */
+JournalCheckpointList SinceCheckpoints;
+JournalCheckpointList NextCheckpoints;
+
+/** The manifest written by /PLAN. */
+ManifestWriter Plan;
+
+/** The progress of /APPLY recorded with /JOURNAL. */
+ApplyJournal Journal;
 
 /**
- * Prints a friendly message based on the given error code.
+ * Modifies the target path of all reparse points in the given path.
+ *
+ * @param Path The path of the reparse point or directory tree to traverse and modify.
+ * @param Action The action that modifies each reparse point.
+ * @param Next The list to add the current checkpoint of the path to when /SINCE is specified. [IN/OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
  */
-void PrintErrorMessage(DWORD ErrorCode, LPCTSTR Path)
+DWORD fixlink(LPCTSTR Path, LinkAction& Action, JournalCheckpointList& Next)
 {
-	switch (ErrorCode)
+	LinkJob Job;
+	Job.Root = Path;
+	Job.Action = &Action;
+	if (Options.CheckpointPath[0] == 0)
+	{
+		return RunLinkJob(Job, Options.GetWalkOptions(), Stats);
+	}
+
+	// The extended-length syntax lifts the MAX_PATH limit for deep trees
+	tstring RootPath;
+	DWORD result = GetLongPath(Path, RootPath);
+	if (result != 0)
 	{
-	case ERROR_FILE_NOT_FOUND: _tprintf(TEXT("File not found: %s.\n"), Path); break;
-	case ERROR_PATH_NOT_FOUND: _tprintf(TEXT("Path not found: %s.\n"), Path); break;
-	case ERROR_ACCESS_DENIED: _tprintf(TEXT("Access denied: %s.\n"), Path); break;
+		Stats.NumFailed++;
+		PrintErrorMessage(result, Path);
+		return result;
 	}
+
+	return WalkChanges(RootPath.c_str(), Action, Options.GetWalkOptions(), Stats, SinceCheckpoints, Next);
 }
 
 /**
- * Modifies the target path of all reparse points in the given path.
- *
- * @param Path The path of the reparse point or directory tree to traverse and modify.
- * @param CurDepth The current level that has been traversed in the filesystem tree.
- * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ * Modifies the links of each root of the path list. Roots on different volumes are processed at the same time, so
+ * each one collects its checkpoints on its own before they are added to the ones saved after the run.
  */
-DWORD fixlink(LPCTSTR Path, int CurDepth = 0)
+class fixlinkRootAction : public RootAction
 {
-	DWORD result = 0;
+public:
+	/**
+	 * @param InAction The action that modifies each reparse point of every root.
+	 */
+	fixlinkRootAction(LinkAction& InAction)
+		: Action(InAction)
+	{
+		InitializeCriticalSection(&Lock);
+	}
 
-	// If applicable, do not go further than the specified maximum depth
-	if (Options.MaxDepth >= 0 && CurDepth > Options.MaxDepth)
+	~fixlinkRootAction()
 	{
-		return result;
+		DeleteCriticalSection(&Lock);
 	}
 
-	// Retrieve the file attributes of Path
-	WIN32_FILE_ATTRIBUTE_DATA srcAttributeData = {0};
-	if (GetFileAttributesEx(Path, GetFileExInfoStandard, &srcAttributeData))
+	virtual DWORD OnRoot(size_t Index, LPCTSTR Path)
 	{
-		// Reparse points must be processed first as they can also be considered a directory.
-		if ((srcAttributeData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+		UNREFERENCED_PARAMETER(Index);
+
+		JournalCheckpointList Next;
+		DWORD result = fixlink(Path, Action, Next);
+
+		EnterCriticalSection(&Lock);
+		for (size_t i = 0; i < Next.size(); i++)
 		{
-			// Is this a junction or a symlink?
-			if (IsJunction(Path))
-			{
-				// Retrieve the existing target
-				TCHAR Target[MAX_PATH] = {0};
-				result = GetJunctionTarget(Path, Target, sizeof(Target));
-				if (result == 0)
-				{
-					// Perform a string replace on the target path
-					TCHAR NewTarget[MAX_PATH] = {0};
-					StrReplace(Target, Options.OldTargetBase, Options.NewTargetBase, NewTarget, -1, -1);
-
-					// Delete the original junction
-					result = DeleteJunction(Path);
-					if (result == 0)
-					{
-						// Recreate the junction at the new target
-						result = CreateJunction(Path, NewTarget);
-						if (result == 0 && Options.bVerbose)
-						{
-							_tprintf(TEXT("junction %s target modified. old=%s, new=%s\n"), Path, Target, NewTarget);
-						}
-					}
-				}
-			}
-			else if (IsSymlink(Path))
-			{
-				// Retrieve the existing target
-				TCHAR Target[MAX_PATH] = {0};
-				result = GetSymlinkTarget(Path, Target, sizeof(Target));
-				if (result == 0)
-				{
-					// Perform a string replace on the target path
-					TCHAR NewTarget[MAX_PATH] = {0};
-					StrReplace(Target, Options.OldTargetBase, Options.NewTargetBase, NewTarget, -1, -1);
-
-					// Delete the original symlink
-					result = DeleteSymlink(Path);
-					if (result == 0)
-					{
-						// Recreate the symlink at the new target
-						result = CreateSymlink(Path, NewTarget);
-						if (result == 0 && Options.bVerbose)
-						{
-							_tprintf(TEXT("symlink %s target modified. old=%s, new=%s\n"), Path, Target, NewTarget);
-						}
-					}
-				}
-			}
-			else
+			// Keep the first checkpoint taken of each root so that nothing changed since is missed
+			if (FindCheckpoint(NextCheckpoints, Next[i].VolumeSerial, Next[i].Root) == NULL)
 			{
-				result = GetLastError();
-				if (result == 0)
-				{
-					_tprintf(TEXT("Unrecognized reparse point: %s\n"), Path);
-					Stats.NumSkipped++;
-				}
+				NextCheckpoints.push_back(Next[i]);
 			}
 		}
-		else if ((srcAttributeData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
-		{
-			WIN32_FIND_DATA ffd;
-			TCHAR szDir[MAX_PATH] = {0};
-			HANDLE hFind;
+		LeaveCriticalSection(&Lock);
+
+		return result;
+	}
 
-			// The search path must include '\*'
-			StringCchCopy(szDir, sizeof(szDir), Path);
-			StringCchCat(szDir, sizeof(szDir), TEXT("\\*"));
+private:
+	fixlinkRootAction(const fixlinkRootAction&);
+	fixlinkRootAction& operator=(const fixlinkRootAction&);
 
-			// Iterate through the list of files in the directory and fixlink each one.
-			hFind = FindFirstFile(szDir, &ffd);
-			if (hFind != INVALID_HANDLE_VALUE)
-			{
-				do
-				{
-					// Ignore the '.' and '..' entries
-					size_t fileNameLength;
-					if (FAILED(StringCchLength(ffd.cFileName, MAX_PATH, &fileNameLength)) || fileNameLength == 0 ||
-						(fileNameLength == 1 && ffd.cFileName[0] == '.') ||
-						(fileNameLength == 2 && ffd.cFileName[0] == '.' && ffd.cFileName[1] == '.'))
-					{
-						continue;
-					}
-
-					// Ignore anything that isn't a directory or reparse point
-					if ((ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 ||
-						(ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-					{
-						TCHAR filePath[MAX_PATH];
-						StringCchCopy(filePath, sizeof(filePath), Path);
-						StringCchCat(filePath, sizeof(filePath), TEXT("\\"));
-						StringCchCat(filePath, sizeof(filePath), ffd.cFileName);
-
-						result = fixlink(filePath, CurDepth+1);
-					}
-				} while (FindNextFile(hFind, &ffd) != 0);
-
-				// Close the handle for the first pass
-				FindClose(hFind);
-			}
-			else
-			{
-				// If we failed to be able to read the directory listing due to a access violation count it as a skip
-				// instead of a complete failure.
-				if (GetLastError() == ERROR_ACCESS_DENIED)
-				{
-					PrintErrorMessage(GetLastError(), Path);
-					Stats.NumSkipped++;
-				}
-				else
-				{
-					result = GetLastError();
-				}
-			}
-		}
+	LinkAction& Action;
+	CRITICAL_SECTION Lock;
+};
+
+/**
+ * Modifies the reparse points listed in a manifest written by /PLAN.
+ *
+ * @param ManifestPath The path of the manifest to apply.
+ * @param Fixer The fixer that checks and writes the new targets.
+ * @return Returns zero if the manifest could be applied, otherwise a non-zero value on failure.
+ */
+DWORD fixlinkApply(LPCTSTR ManifestPath, LinkFixer& Fixer)
+{
+	LinkManifest Manifest;
+	DWORD result = Manifest.Load(ManifestPath, TEXT("fixlink"));
+	if (result != 0)
+	{
+		_tprintf(TEXT("Error: Unable to read the manifest %s.\n"), ManifestPath);
+		return result;
 	}
-	else
+
+	// Record the progress of the run so that it can be resumed should it be interrupted
+	bool bJournal = Options.JournalPath[0] != 0;
+	if (bJournal)
 	{
-		result = GetLastError();
+		result = Journal.Open(Options.JournalPath, TEXT("fixlink"), Manifest.GetNumOps(), Manifest.GetContentHash(),
+			Options.bResume);
+		if (result != 0)
+		{
+			_tprintf(result == ERROR_INVALID_DATA ? TEXT("Error: The journal %s was written for another manifest.\n") :
+				TEXT("Error: Unable to write the journal %s.\n"), Options.JournalPath);
+			return result;
+		}
 	}
 
-	// Was the operation successful?
-	if (result != 0)
+	FixApplyAction Action(Fixer);
+	ApplyManifest(Manifest, Action, Options.NumThreads, Stats, bJournal ? &Journal : NULL);
+
+	if (bJournal)
 	{
-		Stats.NumFailed++;
-		PrintErrorMessage(result, Path);
+		result = Journal.Close();
+		if (result != 0)
+		{
+			_tprintf(TEXT("Error: Unable to write the journal %s.\n"), Options.JournalPath);
+		}
 	}
 
 	return result;
@@ -213,11 +190,55 @@ DWORD fixlink(LPCTSTR Path, int CurDepth = 0)
 void PrintUsage()
 {
 	_tprintf(TEXT("Modifies the target path of all symbolic links and junctions in a given set of paths.\n\n"));
-	_tprintf(TEXT("Usage: fixlink [/V] [/LEV:n] <find> <replace> <path>...\n\n"));
+	_tprintf(TEXT("Usage: fixlink [/SERVE | /SERVICE] [/V] [/VERIFY] [/STATS[:n[,file]]] [/LEV:n] [/MT[:n]] [/ADAPT] [/MAXIOPS:n] [/ASYNC[:n]] [/BFS] [/FAST] [/INDEX:file] [/XD:pattern]... [/XJ] [/TYPE:types] [/NOINPLACE] [/SINCE:file] [/PLAN:file] <find> <replace> <path>...\n"));
+	_tprintf(TEXT("       fixlink [/SERVE | /SERVICE] [/V] [/VERIFY] [/STATS[:n[,file]]] [/LEV:n] [/MT[:n]] [/ADAPT] [/MAXIOPS:n] [/ASYNC[:n]] [/BFS] [/FAST] [/INDEX:file] [/XD:pattern]... [/XJ] [/TYPE:types] [/NOINPLACE] [/SINCE:file] [/PLAN:file] /RMAP:file <path>...\n"));
+	_tprintf(TEXT("       fixlink [/SERVE | /SERVICE] [/V] [/VERIFY] [/STATS[:n[,file]]] [/MT[:n]] [/MAXIOPS:n] [/NOINPLACE] [/JOURNAL:file [/RESUME]] /APPLY:file\n\n"));
 	_tprintf(TEXT("Options:\n"));
+	_tprintf(TEXT("\t\t/ADAPT\t\tAdapt the number of busy /MT threads, and of /ASYNC requests in flight, to\n"));
+	_tprintf(TEXT("\t\t\t\tthe volume: one more while operations stay fast, half as many once they\n"));
+	_tprintf(TEXT("\t\t\t\tslow down or the server turns requests away as busy.\n"));
+	_tprintf(TEXT("\t\t/APPLY:file\tModify the links listed in a manifest written by /PLAN, using /MT threads.\n"));
+	_tprintf(TEXT("\t\t\t\tLinks that changed since the manifest was written are skipped.\n"));
+	_tprintf(TEXT("\t\t/ASYNC[:n]\tRead and write the links with overlapped requests, keeping n of them in\n"));
+	_tprintf(TEXT("\t\t\t\tflight at once (default 256). Speeds up file servers with high latency.\n"));
+	_tprintf(TEXT("\t\t/BFS\t\tWalk the directory tree breadth-first instead of depth-first.\n"));
+	_tprintf(TEXT("\t\t/FAST\t\tRead the links from the volume metadata instead of enumerating every\n"));
+	_tprintf(TEXT("\t\t\t\tdirectory. Requires elevation and a local NTFS volume.\n"));
+	_tprintf(TEXT("\t\t/INDEX:file\tReplay the links recorded in a link index file while nothing beneath the\n"));
+	_tprintf(TEXT("\t\t\t\tpath changed, otherwise walk the tree and record a new index. Requires\n"));
+	_tprintf(TEXT("\t\t\t\televation.\n"));
+	_tprintf(TEXT("\t\t/JOURNAL:file\tRecord the progress of /APPLY to a journal file, flushed to disk before each\n"));
+	_tprintf(TEXT("\t\t\t\tbatch of links is modified.\n"));
 	_tprintf(TEXT("\t\t/LEV:n\t\tOnly copy the top n levels of the source directory tree.\n"));
+	_tprintf(TEXT("\t\t/MAXIOPS:n\tStart at most n file system operations a second, across every thread.\n"));
+	_tprintf(TEXT("\t\t/MT[:n]\t\tWalk the directory tree using n worker threads (default 8).\n"));
+	_tprintf(TEXT("\t\t/NOINPLACE\tDelete and recreate the reparse data of each link instead of rewriting it\n"));
+	_tprintf(TEXT("\t\t\t\tin place.\n"));
+	_tprintf(TEXT("\t\t/PLAN:file\tWrite the links that would be modified, along with their new targets, to a\n"));
+	_tprintf(TEXT("\t\t\t\tmanifest file without changing anything.\n"));
+	_tprintf(TEXT("\t\t/RESUME\t\tCarry on from where the run that wrote the /JOURNAL stopped, skipping the\n"));
+	_tprintf(TEXT("\t\t\t\tlinks it modified and finishing the ones it was in the middle of.\n"));
+	_tprintf(TEXT("\t\t/RMAP:file\tRebase the target path of all links with the rules in file, one <old>|<new>\n"));
+	_tprintf(TEXT("\t\t\t\tpair per line, instead of <find> <replace>. The longest <old> prefix\n"));
+	_tprintf(TEXT("\t\t\t\tmatching whole path components wins. Links no rule matches are skipped.\n"));
+	_tprintf(TEXT("\t\t/SERVE\t\tRun as a service that carries out the invocations of the utility made by\n"));
+	_tprintf(TEXT("\t\t\t\tother processes over the named pipe \\\\.\\pipe\\ntfslinkd\\<utility>, one at a\n"));
+	_tprintf(TEXT("\t\t\t\ttime, as the user that made each of them.\n"));
+	_tprintf(TEXT("\t\t/SERVICE\tHand the invocation to the /SERVE service of the utility if this user runs\n"));
+	_tprintf(TEXT("\t\t\t\tone, otherwise run it in this process.\n"));
+	_tprintf(TEXT("\t\t/SINCE:file\tOnly modify links changed since the checkpoint saved in file by the\n"));
+	_tprintf(TEXT("\t\t\t\tprevious run, using the USN change journal. Requires elevation.\n"));
+	_tprintf(TEXT("\t\t/STATS[:n[,file]]\n\t\t\t\tReport progress, throughput, queue depths and latencies every n\n"));
+	_tprintf(TEXT("\t\t\t\tseconds (default 10), one JSON object per line, to stderr or file.\n"));
+	_tprintf(TEXT("\t\t/TYPE:types\tOnly visit the links of the given types, junction and/or symlink separated\n"));
+	_tprintf(TEXT("\t\t\t\tby commas. Other reparse points are skipped.\n"));
+	_tprintf(TEXT("\t\t/VERIFY\t\tLeave links untouched when their new target doesn't exist, or is a file\n"));
+	_tprintf(TEXT("\t\t\t\tfor a directory link or the other way around, and count them as broken.\n"));
 	_tprintf(TEXT("\t\t/V\t\tEnable verbose output and display more information.\n"));
 	_tprintf(TEXT("\t\t/VER\t\tDisplay the version and copyright information.\n"));
+	_tprintf(TEXT("\t\t/XD:pattern\tSkip the directories, and directory links, whose name matches pattern.\n"));
+	_tprintf(TEXT("\t\t\t\tThe wildcards * and ? may be used. May be given more than once.\n"));
+	_tprintf(TEXT("\t\t/XJ\t\tSkip junctions.\n"));
 	_tprintf(TEXT("\t\t/?\t\tView this list of options.\n"));
 }
 
@@ -247,17 +268,28 @@ void PrintVersion()
 	_tprintf(TEXT("OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.\n"));
 }
 
-int _tmain(int argc, TCHAR* argv[])
+/**
+ * Runs a single invocation of fixlink with the given command line.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @return Returns the exit code of the invocation.
+ */
+int fixlinkMain(int argc, TCHAR* argv[])
 {
-	DWORD result;
+	DWORD result = 0;
 	int requiredArgs = 4;
 	int StartArgIdx = 4;
 
 	// Parse the command line arguments
-	TCHAR Value[1024];
 	for (int i = 1; i < argc; i++)
 	{
-		if (StrFind(argv[i], TEXT("/VER")) >= 0 || StrFind(argv[i], TEXT("/ver")) >= 0)
+		// /VERIFY is looked for first since it begins like /VER
+		if (StrFind(argv[i], TEXT("/VERIFY")) >= 0 || StrFind(argv[i], TEXT("/verify")) >= 0)
+		{
+			Options.bVerify = true;
+		}
+		else if (StrFind(argv[i], TEXT("/VER")) >= 0 || StrFind(argv[i], TEXT("/ver")) >= 0)
 		{
 			PrintVersion();
 			return 0;
@@ -267,54 +299,214 @@ int _tmain(int argc, TCHAR* argv[])
 			PrintUsage();
 			return 0;
 		}
-		else if (StrFind(argv[i], TEXT("/LEV")) >= 0 || StrFind(argv[i], TEXT("/lev")) >= 0)
+		else if (ParseLinkToolOption(argv[i], Options))
+		{
+			// One of the options shared by every utility
+		}
+		else if (StrFind(argv[i], TEXT("/ASYNC")) >= 0 || StrFind(argv[i], TEXT("/async")) >= 0)
+		{
+			Options.NumAsyncRequests = ParseAsyncRequestCount(argv[i]);
+		}
+		else if (StrFind(argv[i], TEXT("/NOINPLACE")) >= 0 || StrFind(argv[i], TEXT("/noinplace")) >= 0)
+		{
+			Options.bInPlace = false;
+		}
+		else if (StrFind(argv[i], TEXT("/INPLACE")) >= 0 || StrFind(argv[i], TEXT("/inplace")) >= 0)
+		{
+			Options.bInPlace = true;
+		}
+		else if (StrFind(argv[i], TEXT("/APPLY:")) >= 0 || StrFind(argv[i], TEXT("/apply:")) >= 0)
+		{
+			StringCchCopy(Options.ApplyPath, ARRAYSIZE(Options.ApplyPath), &argv[i][7]);
+		}
+		else if (StrFind(argv[i], TEXT("/PLAN:")) >= 0 || StrFind(argv[i], TEXT("/plan:")) >= 0)
+		{
+			StringCchCopy(Options.PlanPath, ARRAYSIZE(Options.PlanPath), &argv[i][6]);
+		}
+		else if (StrFind(argv[i], TEXT("/JOURNAL:")) >= 0 || StrFind(argv[i], TEXT("/journal:")) >= 0)
+		{
+			StringCchCopy(Options.JournalPath, ARRAYSIZE(Options.JournalPath), &argv[i][9]);
+		}
+		else if (StrFind(argv[i], TEXT("/RESUME")) >= 0 || StrFind(argv[i], TEXT("/resume")) >= 0)
+		{
+			Options.bResume = true;
+		}
+		else if (StrFind(argv[i], TEXT("/RMAP:")) >= 0 || StrFind(argv[i], TEXT("/rmap:")) >= 0)
 		{
-			memset(Value, 0, sizeof(Value));
-			StringCchCopy(Value, sizeof(Value), &argv[i][5]);
-			Options.MaxDepth = _ttoi(Value);
+			StringCchCopy(Options.RebaseMapPath, ARRAYSIZE(Options.RebaseMapPath), &argv[i][6]);
+			requiredArgs = 3;
 		}
-		else if (StrFind(argv[i], TEXT("/V")) >= 0 || StrFind(argv[i], TEXT("/v")) >= 0)
+		else if (StrFind(argv[i], TEXT("/SINCE:")) >= 0 || StrFind(argv[i], TEXT("/since:")) >= 0)
 		{
-			Options.bVerbose = true;
+			StringCchCopy(Options.CheckpointPath, ARRAYSIZE(Options.CheckpointPath), &argv[i][7]);
+		}
+		else if (Options.RebaseMapPath[0] != 0)
+		{
+			// The rebase map takes the place of <find> <replace> so every remaining argument is a path
+			StartArgIdx = i;
+			break;
 		}
 		else if (i + 1 < argc)
 		{
-			StringCchCopy(Options.OldTargetBase, sizeof(Options.OldTargetBase), argv[i]);
-			StringCchCopy(Options.NewTargetBase, sizeof(Options.NewTargetBase), argv[i+1]);
+			StringCchCopy(Options.OldTargetBase, ARRAYSIZE(Options.OldTargetBase), argv[i]);
+			StringCchCopy(Options.NewTargetBase, ARRAYSIZE(Options.NewTargetBase), argv[i+1]);
 			StartArgIdx = i + 2;
 			break;
 		}
 	}
 
-	// Check the minimum required arguments
-	if (argc < requiredArgs)
+	// Check the minimum required arguments. Applying a manifest needs no paths.
+	if (Options.ApplyPath[0] == 0 && argc < requiredArgs)
 	{
 		_tprintf(TEXT("Error: Missing argument(s).\n"));
 		PrintUsage();
 		return 1;
 	}
 
-	// Iterate through each argument that isn't an option and execute fixlink on it
-	for (int i = 1; i < argc; i++)
+	// Only a manifest has a fixed list of links to journal
+	if ((Options.JournalPath[0] != 0 && Options.ApplyPath[0] == 0) || (Options.bResume && Options.JournalPath[0] == 0))
+	{
+		_tprintf(TEXT("Error: /JOURNAL requires /APPLY, and /RESUME requires /JOURNAL.\n"));
+		PrintUsage();
+		return 1;
+	}
+
+	// Compile the rebase rules once up front
+	RebaseMap RebaseRules;
+	if (Options.RebaseMapPath[0] != 0)
+	{
+		result = LoadRebaseRules(Options.RebaseMapPath, Options.bVerbose, RebaseRules);
+		if (result != 0)
+		{
+			return result;
+		}
+	}
+
+	// Report on the run as it goes
+	result = StartToolMetrics(Options, Stats, Stats.NumModified);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	// The links are planned, applied and modified through the same fixer, and through the completion port of /ASYNC
+	// when it is specified
+	bool bPlan = Options.PlanPath[0] != 0;
+	LinkFixer Fixer(Options, Stats, RebaseRules, bPlan ? &Plan : NULL);
+	FixLinkAsyncAction AsyncAction(Fixer);
+	AsyncLinkQueue AsyncLinks(AsyncAction, Stats);
+
+	// Carry out a manifest planned earlier instead of walking anything
+	if (Options.ApplyPath[0] != 0)
+	{
+		result = fixlinkApply(Options.ApplyPath, Fixer);
+
+		StopMetrics();
+
+		// Print the execution statistics
+		_tprintf(TEXT("Modified: %ld\n"), Stats.NumModified.Get());
+		if (Options.bResume)
+		{
+			_tprintf(TEXT("Modified before resuming: %ld\n"), Journal.GetNumDone());
+		}
+		_tprintf(TEXT("Skipped: %ld\n"), Stats.NumSkipped.Get());
+		if (Options.bVerify)
+		{
+			_tprintf(TEXT("Broken: %ld\n"), Stats.NumBroken.Get());
+		}
+		_tprintf(TEXT("Failed: %ld\n"), Stats.NumFailed.Get());
+
+		return result == 0 && Stats.NumFailed > 0 ? 1 : result;
+	}
+
+	// Load the checkpoints of the previous run
+	if (Options.CheckpointPath[0] != 0)
+	{
+		result = LoadCheckpoints(Options.CheckpointPath, SinceCheckpoints);
+		if (result != 0)
+		{
+			_tprintf(TEXT("Error: Unable to read the checkpoint file %s.\n"), Options.CheckpointPath);
+			return result;
+		}
+	}
+
+	if (bPlan)
+	{
+		result = Plan.Open(Options.PlanPath, TEXT("fixlink"));
+		if (result != 0)
+		{
+			_tprintf(TEXT("Error: Unable to write the manifest %s.\n"), Options.PlanPath);
+			return result;
+		}
+	}
+
+	if (Options.NumAsyncRequests > 0)
+	{
+		result = AsyncLinks.Start(Options.NumAsyncRequests, Options.bInPlace, Options.bAdaptive);
+		if (result != 0)
+		{
+			_tprintf(TEXT("Error: Unable to create the I/O completion port.\n"));
+			return result;
+		}
+	}
+
+	// Execute fixlink on each argument that isn't an option, the roots of a volume in turn and the volumes in parallel
+	// unless a link index, which describes a single root, has every root walked in turn
+	std::vector<LPCTSTR> Roots;
+	for (int i = StartArgIdx; i < argc; i++)
 	{
 		// Ignore options
-		if (argv[i][0] == '/')
+		if (argv[i][0] != '/')
+		{
+			Roots.push_back(argv[i]);
+		}
+	}
+
+	FixLinkAction FixAction(Fixer, Options.NumAsyncRequests > 0 ? &AsyncLinks : NULL);
+	fixlinkRootAction Action(FixAction);
+	result = ScheduleRoots(Roots, Action, Options.IndexPath[0] == 0);
+
+	// Wait for the links still in flight before anything is saved or counted
+	AsyncLinks.Finish();
+
+	if (bPlan)
+	{
+		DWORD planResult = Plan.Close();
+		if (planResult != 0)
 		{
-			continue;
+			_tprintf(TEXT("Error: Unable to write the manifest %s.\n"), Options.PlanPath);
+			result = result != 0 ? result : planResult;
 		}
+	}
 
-		result = fixlink(argv[i]);
+	// Only move the checkpoint forward when every link was processed so that failures are retried by the next run. A
+	// plan changes nothing so the next run must look at the same changes again.
+	if (Options.CheckpointPath[0] != 0 && !bPlan && result == 0 && Stats.NumFailed == 0)
+	{
+		result = SaveCheckpoints(Options.CheckpointPath, NextCheckpoints);
 		if (result != 0)
 		{
-			// Exit on failure
-			break;
+			_tprintf(TEXT("Error: Unable to write the checkpoint file %s.\n"), Options.CheckpointPath);
 		}
 	}
 
+	StopMetrics();
+
 	// Print the execution statistics
-	_tprintf(TEXT("Modified: %d\n"), Stats.NumModified);
-	_tprintf(TEXT("Skipped: %d\n"), Stats.NumSkipped);
-	_tprintf(TEXT("Failed: %d\n"), Stats.NumFailed);
+	if (bPlan)
+	{
+		_tprintf(TEXT("Planned: %ld\n"), Plan.GetNumOps());
+	}
+	else
+	{
+		_tprintf(TEXT("Modified: %ld\n"), Stats.NumModified.Get());
+	}
+	_tprintf(TEXT("Skipped: %ld\n"), Stats.NumSkipped.Get());
+	if (Options.bVerify)
+	{
+		_tprintf(TEXT("Broken: %ld\n"), Stats.NumBroken.Get());
+	}
+	_tprintf(TEXT("Failed: %ld\n"), Stats.NumFailed.Get());
 
 	// Make sure that if there were errors it is reflected in the result
 	if (result == 0 && Stats.NumFailed > 0)
@@ -324,3 +516,32 @@ int _tmain(int argc, TCHAR* argv[])
 
 	return result;
 }
+
+/**
+ * Runs each invocation of fixlink. A service runs many of them in the same process so each starts from a clean state,
+ * and whatever an invocation that returned early left running is stopped.
+ */
+class fixlinkJob : public LinkServiceJob
+{
+public:
+	virtual int Run(int argc, TCHAR* argv[])
+	{
+		Options = FixLinkOptions();
+		Stats = FixLinkStats();
+		SinceCheckpoints.clear();
+		NextCheckpoints.clear();
+
+		int ExitCode = fixlinkMain(argc, argv);
+
+		Plan.Close();
+		Journal.Close();
+		StopMetrics();
+		return ExitCode;
+	}
+};
+
+int _tmain(int argc, TCHAR* argv[])
+{
+	fixlinkJob Job;
+	return RunLinkTool(TEXT("fixlink"), argc, argv, Job);
+}
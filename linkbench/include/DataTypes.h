@@ -33,41 +33,37 @@
 
 #include <memory.h>
 
-struct fixlinkOptions
+#include "TreeGenerator.h"
+
+struct linkbenchOptions
 {
+	/** Set to true to keep the generated test data once the benchmark completes. */
+	bool bKeep;
 	/** Set to true to enable verbose logging. */
 	bool bVerbose;
-	/** The maximum file tree depth to traverse before stopping. */
-	int MaxDepth;
-	/** The path to rebase targets to. */
-	TCHAR NewTargetBase[MAX_PATH];
-	/** The path to rebase targets from. */
-	TCHAR OldTargetBase[MAX_PATH];
-
-	fixlinkOptions()
-		: bVerbose(false)
-		, MaxDepth(-1)
-	{
-		memset(NewTargetBase, 0, sizeof(NewTargetBase));
-		memset(OldTargetBase, 0, sizeof(OldTargetBase));
-	}
-};
-
-struct fixlinkStats
-{
-	/** The number of file objects that failed to be moved. */
-	size_t NumFailed;
-	/** The number of file objects successfully modified. */
-	size_t NumModified;
-	/** The number of file objects that were skipped. */
-	size_t NumSkipped;
+	/** The number of entries to generate when the benchmark directory doesn't exist yet. */
+	int NumEntries;
+	/** The number of timed runs of each benchmark. */
+	int NumRuns;
+	/** The number of worker threads the utilities are run with. */
+	int NumThreads;
+	/** The shape of the generated link trees. */
+	TreeShape Shape;
+	/** The directory holding the utilities to run. Defaults to the directory of linkbench itself. */
+	TCHAR ToolPath[MAX_PATH];
+	/** The file to append the results to as comma-separated values, if any. */
+	TCHAR OutputPath[MAX_PATH];
 
-	fixlinkStats()
-		: NumFailed(0)
-		, NumModified(0)
-		, NumSkipped(0)
+	linkbenchOptions()
+		: bKeep(false)
+		, bVerbose(false)
+		, NumEntries(100000)
+		, NumRuns(5)
+		, NumThreads(8)
 	{
+		memset(ToolPath, 0, sizeof(ToolPath));
+		memset(OutputPath, 0, sizeof(OutputPath));
 	}
 };
 
-#endif //DATATYPES_H
\ No newline at end of file
+#endif //DATATYPES_H
@@ -0,0 +1,137 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TREEGENERATOR_H
+#define TREEGENERATOR_H
+#pragma once
+
+#include <Windows.h>
+
+/**
+ * Describes the synthetic directory tree to generate.
+ */
+struct TreeShape
+{
+	/** The number of directory levels beneath the root. */
+	int Depth;
+	/** The number of sub-directories created in every directory above the last level. */
+	int FanOut;
+	/** The number of empty files created in every directory. */
+	int FilesPerDir;
+	/** The number of links created in every directory. */
+	int LinksPerDir;
+	/** The percentage of the links that are symbolic links rather than junctions. */
+	int SymlinkPercent;
+	/** Set to true to give directories long names so that deep paths exceed MAX_PATH. */
+	bool bLongNames;
+
+	TreeShape()
+		: Depth(4)
+		, FanOut(8)
+		, FilesPerDir(16)
+		, LinksPerDir(2)
+		, SymlinkPercent(0)
+		, bLongNames(false)
+	{
+	}
+};
+
+/**
+ * The number of file objects in a directory tree, by type.
+ */
+struct TreeCounts
+{
+	LONGLONG NumDirectories;
+	LONGLONG NumFiles;
+	LONGLONG NumJunctions;
+	LONGLONG NumSymlinks;
+
+	TreeCounts()
+		: NumDirectories(0)
+		, NumFiles(0)
+		, NumJunctions(0)
+		, NumSymlinks(0)
+	{
+	}
+
+	/**
+	 * Returns the total number of file objects in the tree.
+	 */
+	LONGLONG GetNumEntries() const
+	{
+		return NumDirectories + NumFiles + NumJunctions + NumSymlinks;
+	}
+
+	/**
+	 * Returns the number of links in the tree.
+	 */
+	LONGLONG GetNumLinks() const
+	{
+		return NumJunctions + NumSymlinks;
+	}
+};
+
+/**
+ * Creates a new directory holding the given number of empty files.
+ *
+ * @param Directory The path of the directory to create.
+ * @param NumEntries The number of files to create in the directory.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD GenerateFlatDirectory(LPCTSTR Directory, int NumEntries);
+
+/**
+ * Creates a new directory tree of the given shape. Every link points to the same target directory.
+ *
+ * @param Root The path of the root of the tree to create.
+ * @param TargetPath The absolute path of the directory the links point to.
+ * @param Shape The shape of the tree.
+ * @param Counts The number of file objects created. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD GenerateTree(LPCTSTR Root, LPCTSTR TargetPath, const TreeShape& Shape, TreeCounts& Counts);
+
+/**
+ * Counts the file objects of an existing directory tree without following links.
+ *
+ * @param Root The path of the root of the tree.
+ * @param Counts The number of file objects found. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD CountTree(LPCTSTR Root, TreeCounts& Counts);
+
+/**
+ * Deletes a directory tree along with the root itself. Links are deleted without touching their targets.
+ *
+ * @param Root The path of the root of the tree.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD DeleteTree(LPCTSTR Root);
+
+#endif //TREEGENERATOR_H
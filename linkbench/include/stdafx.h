@@ -27,47 +27,19 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ///////////////////////////////////////////////////////////////////////////////
 
-#ifndef DATATYPES_H
-#define DATATYPES_H
-#pragma once
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
 
-#include <memory.h>
+#pragma once
 
-struct mvlinkOptions
-{
-	/** Set to true to enable verbose logging. */
-	bool bVerbose;
-	/** The maximum file tree depth to traverse before stopping. */
-	int MaxDepth;
-	/** The path to rebase targets to. */
-	TCHAR NewTargetBase[MAX_PATH];
-	/** The path to rebase targets from. */
-	TCHAR OldTargetBase[MAX_PATH];
+#include "targetver.h"
 
-	mvlinkOptions()
-		: bVerbose(false)
-		, MaxDepth(-1)
-	{
-		memset(NewTargetBase, 0, sizeof(NewTargetBase));
-		memset(OldTargetBase, 0, sizeof(OldTargetBase));
-	}
-};
+#include <stdio.h>
+#include <tchar.h>
 
-struct mvlinkStats
-{
-	/** The number of file objects that failed to be moved. */
-	size_t NumFailed;
-	/** The number of file objects successfully moved. */
-	size_t NumMoved;
-	/** The number of file objects that were skipped. */
-	size_t NumSkipped;
+#include <Windows.h>
 
-	mvlinkStats()
-		: NumFailed(0)
-		, NumMoved(0)
-		, NumSkipped(0)
-	{
-	}
-};
 
-#endif //DATATYPES_H
\ No newline at end of file
+// TODO: reference additional headers your program requires here
@@ -0,0 +1,310 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <strsafe.h>
+#include <vector>
+
+#include "DirectoryEnumerator.h"
+#include "PathBuffer.h"
+#include "ReparsePoint.h"
+#include "TreeGenerator.h"
+
+namespace
+{
+
+/** The padding appended to directory names when long names are requested. */
+#define LONG_NAME_PADDING TEXT("_abcdefghijklmnopqrstuvwxyz_abcdefghijklmnopqrstuvwxyz_abcdefghij")
+
+/**
+ * Creates an empty file.
+ */
+DWORD CreateEmptyFile(LPCTSTR Path)
+{
+	HANDLE hFile = CreateFile(Path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	CloseHandle(hFile);
+	return 0;
+}
+
+/**
+ * Generates a tree depth-first, building every path in a single buffer.
+ */
+class TreeGenerator
+{
+public:
+	TreeGenerator(LPCTSTR InTargetPath, const TreeShape& InShape, TreeCounts& InCounts)
+		: TargetPath(InTargetPath)
+		, Shape(InShape)
+		, Counts(InCounts)
+		, SymlinkCredit(0)
+	{
+	}
+
+	/**
+	 * Fills the directory at the given path, which must already exist, and everything beneath it.
+	 */
+	DWORD Generate(int Depth)
+	{
+		DWORD result = 0;
+		TCHAR Name[128];
+
+		for (int i = 0; i < Shape.FilesPerDir && result == 0; i++)
+		{
+			StringCchPrintf(Name, ARRAYSIZE(Name), TEXT("file%04d.dat"), i);
+			size_t dirLength = Path.Push(Name);
+			result = CreateEmptyFile(Path.c_str());
+			Path.Pop(dirLength);
+
+			if (result == 0)
+			{
+				Counts.NumFiles++;
+			}
+		}
+
+		for (int i = 0; i < Shape.LinksPerDir && result == 0; i++)
+		{
+			// Spread the symbolic links evenly among the junctions
+			DWORD ReparseTag = IO_REPARSE_TAG_MOUNT_POINT;
+			SymlinkCredit += Shape.SymlinkPercent;
+			if (SymlinkCredit >= 100)
+			{
+				SymlinkCredit -= 100;
+				ReparseTag = IO_REPARSE_TAG_SYMLINK;
+			}
+
+			StringCchPrintf(Name, ARRAYSIZE(Name), TEXT("link%04d"), i);
+			size_t dirLength = Path.Push(Name);
+			result = CreateReparsePoint(Path.c_str(), ReparseTag, TargetPath, true);
+			Path.Pop(dirLength);
+
+			if (result != 0)
+			{
+				// Nothing to count
+			}
+			else if (ReparseTag == IO_REPARSE_TAG_SYMLINK)
+			{
+				Counts.NumSymlinks++;
+			}
+			else
+			{
+				Counts.NumJunctions++;
+			}
+		}
+
+		if (Depth >= Shape.Depth)
+		{
+			return result;
+		}
+
+		for (int i = 0; i < Shape.FanOut && result == 0; i++)
+		{
+			StringCchPrintf(Name, ARRAYSIZE(Name), TEXT("dir%03d%s"), i, Shape.bLongNames ? LONG_NAME_PADDING : TEXT(""));
+			size_t dirLength = Path.Push(Name);
+			if (!CreateDirectory(Path.c_str(), NULL))
+			{
+				result = GetLastError();
+			}
+			else
+			{
+				Counts.NumDirectories++;
+				result = Generate(Depth + 1);
+			}
+			Path.Pop(dirLength);
+		}
+
+		return result;
+	}
+
+	PathBuffer Path;
+
+private:
+	TreeGenerator(const TreeGenerator&);
+	TreeGenerator& operator=(const TreeGenerator&);
+
+	LPCTSTR TargetPath;
+	const TreeShape& Shape;
+	TreeCounts& Counts;
+	/** Accumulates SymlinkPercent for every link, a symbolic link is created each time it reaches 100. */
+	int SymlinkCredit;
+};
+
+/**
+ * Lists the sub-directories of a directory tree, parents first, optionally deleting everything else along the way.
+ */
+DWORD ListTree(LPCTSTR Root, TreeCounts* Counts, bool bDelete, std::vector<tstring>& Directories)
+{
+	DirectoryEnumerator Enumerator;
+	PathBuffer Path;
+
+	Directories.push_back(Root);
+	for (size_t i = 0; i < Directories.size(); i++)
+	{
+		// Copy the path as the list may grow while the directory is being read
+		Path.Assign(Directories[i]);
+		DWORD result = Enumerator.Open(Path.c_str());
+		if (result != 0)
+		{
+			return result;
+		}
+
+		DirectoryEntry Entry;
+		while ((result = Enumerator.Next(Entry)) == 0)
+		{
+			size_t dirLength = Path.Push(Entry.Name);
+			bool bDirectory = (Entry.Attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+			if ((Entry.Attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+			{
+				if (Counts != NULL && Entry.ReparseTag == IO_REPARSE_TAG_SYMLINK)
+				{
+					Counts->NumSymlinks++;
+				}
+				else if (Counts != NULL)
+				{
+					Counts->NumJunctions++;
+				}
+
+				// Removing the link itself never touches its target
+				if (bDelete && !(bDirectory ? RemoveDirectory(Path.c_str()) : DeleteFile(Path.c_str())))
+				{
+					result = GetLastError();
+				}
+			}
+			else if (bDirectory)
+			{
+				if (Counts != NULL)
+				{
+					Counts->NumDirectories++;
+				}
+				Directories.push_back(Path.c_str());
+			}
+			else
+			{
+				if (Counts != NULL)
+				{
+					Counts->NumFiles++;
+				}
+
+				if (bDelete && !DeleteFile(Path.c_str()))
+				{
+					result = GetLastError();
+				}
+			}
+
+			Path.Pop(dirLength);
+			if (result != 0)
+			{
+				return result;
+			}
+		}
+		Enumerator.Close();
+
+		if (result != ERROR_NO_MORE_FILES)
+		{
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+} // namespace
+
+DWORD GenerateFlatDirectory(LPCTSTR Directory, int NumEntries)
+{
+	if (!CreateDirectory(Directory, NULL))
+	{
+		return GetLastError();
+	}
+
+	PathBuffer Path;
+	Path.Assign(Directory, _tcslen(Directory));
+
+	for (int i = 0; i < NumEntries; i++)
+	{
+		TCHAR Name[32];
+		StringCchPrintf(Name, ARRAYSIZE(Name), TEXT("entry%07d.dat"), i);
+
+		size_t dirLength = Path.Push(Name);
+		DWORD result = CreateEmptyFile(Path.c_str());
+		Path.Pop(dirLength);
+
+		if (result != 0)
+		{
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+DWORD GenerateTree(LPCTSTR Root, LPCTSTR TargetPath, const TreeShape& Shape, TreeCounts& Counts)
+{
+	if (!CreateDirectory(Root, NULL))
+	{
+		return GetLastError();
+	}
+
+	TreeGenerator Generator(TargetPath, Shape, Counts);
+	Generator.Path.Assign(Root, _tcslen(Root));
+	return Generator.Generate(0);
+}
+
+DWORD CountTree(LPCTSTR Root, TreeCounts& Counts)
+{
+	std::vector<tstring> Directories;
+	return ListTree(Root, &Counts, false, Directories);
+}
+
+DWORD DeleteTree(LPCTSTR Root)
+{
+	std::vector<tstring> Directories;
+	DWORD result = ListTree(Root, NULL, true, Directories);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	// Children were listed after their parents so removing the directories in reverse leaves each one empty in turn
+	for (size_t i = Directories.size(); i > 0; i--)
+	{
+		if (!RemoveDirectory(Directories[i - 1].c_str()))
+		{
+			return GetLastError();
+		}
+	}
+
+	return 0;
+}
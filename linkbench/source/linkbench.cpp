@@ -0,0 +1,898 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// This file is part of ntfslinkutils.
+//
+// Copyright (c) 2014, Jean-Philippe Steinmetz
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// 
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+
+#include <memory.h>
+#include <Psapi.h>
+#include <strsafe.h>
+#include <vector>
+
+#include "DataTypes.h"
+#include "DirectoryEnumerator.h"
+#include "ErrorMessage.h"
+#include "PathBuffer.h"
+#include "StringUtils.h"
+#include "TreeGenerator.h"
+
+linkbenchOptions Options;
+
+/**
+ * The measurements of a single benchmark case.
+ */
+struct BenchmarkResult
+{
+	/** The name of the benchmark the case belongs to. */
+	LPCTSTR Benchmark;
+	/** The name of the case, e.g. the enumeration method or the utility that was run. */
+	LPCTSTR Case;
+	/** The number of file objects the case processed. */
+	LONGLONG NumEntries;
+	/** The number of links the case processed. */
+	LONGLONG NumLinks;
+	/** The duration of the fastest run, in milliseconds. */
+	double BestTime;
+	/** The mean duration of all runs, in milliseconds. */
+	double MeanTime;
+	/** The number of I/O requests issued during the fastest run, or zero if not measured. */
+	ULONGLONG NumOperations;
+	/** The peak working set of the fastest run, in bytes, or zero if not measured. */
+	SIZE_T PeakWorkingSet;
+	/** The result of the last run. */
+	DWORD Result;
+
+	BenchmarkResult(LPCTSTR InBenchmark, LPCTSTR InCase)
+		: Benchmark(InBenchmark)
+		, Case(InCase)
+		, NumEntries(0)
+		, NumLinks(0)
+		, BestTime(0)
+		, MeanTime(0)
+		, NumOperations(0)
+		, PeakWorkingSet(0)
+		, Result(0)
+	{
+	}
+
+	/**
+	 * Records the duration of a run, returning true if it is the fastest one so far.
+	 */
+	bool AddRun(int Run, double Time)
+	{
+		MeanTime += (Time - MeanTime) / Run;
+		if (Run == 1 || Time < BestTime)
+		{
+			BestTime = Time;
+			return true;
+		}
+
+		return false;
+	}
+};
+
+typedef std::vector<BenchmarkResult> BenchmarkResultList;
+
+/**
+ * Returns the current value of the performance counter in milliseconds.
+ */
+double GetTime()
+{
+	static LARGE_INTEGER Frequency = {0};
+	if (Frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&Frequency);
+	}
+
+	LARGE_INTEGER Counter;
+	QueryPerformanceCounter(&Counter);
+	return (double)Counter.QuadPart * 1000.0 / (double)Frequency.QuadPart;
+}
+
+/**
+ * Returns the number of items processed per second in the given time, in milliseconds.
+ */
+double GetRate(LONGLONG Count, double Time)
+{
+	return Time > 0 ? (double)Count * 1000.0 / Time : 0;
+}
+
+void PrintResultHeader()
+{
+	_tprintf(TEXT("%-40s %10s %10s %12s %12s %12s %12s %10s %12s\n"), TEXT("Case"), TEXT("Entries"), TEXT("Links"),
+		TEXT("Best (ms)"), TEXT("Mean (ms)"), TEXT("Entries/s"), TEXT("Links/s"), TEXT("I/O/link"), TEXT("Peak WS (KB)"));
+}
+
+void PrintResult(const BenchmarkResult& Result)
+{
+	double OperationsPerLink = Result.NumLinks > 0 ? (double)Result.NumOperations / (double)Result.NumLinks : 0;
+	_tprintf(TEXT("%-40s %10lld %10lld %12.2f %12.2f %12.0f %12.0f %10.2f %12llu\n"), Result.Case, Result.NumEntries,
+		Result.NumLinks, Result.BestTime, Result.MeanTime, GetRate(Result.NumEntries, Result.BestTime),
+		GetRate(Result.NumLinks, Result.BestTime), OperationsPerLink, (ULONGLONG)(Result.PeakWorkingSet / 1024));
+}
+
+/**
+ * Appends the given results to a comma-separated values file, writing the column names first if the file is new.
+ *
+ * @param Path The path of the file to append to.
+ * @param Results The results to write.
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD WriteResults(LPCTSTR Path, const BenchmarkResultList& Results)
+{
+	bool bNewFile = GetFileAttributes(Path) == INVALID_FILE_ATTRIBUTES;
+
+	FILE* File = NULL;
+	if (_tfopen_s(&File, Path, TEXT("a")) != 0 || File == NULL)
+	{
+		return ERROR_WRITE_FAULT;
+	}
+
+	if (bNewFile)
+	{
+		_ftprintf(File, TEXT("timestamp,benchmark,case,entries,links,best_ms,mean_ms,entries_per_sec,links_per_sec,")
+			TEXT("io_operations,io_operations_per_link,peak_working_set_bytes,result\n"));
+	}
+
+	// Every result of a session shares the timestamp so that runs can be told apart
+	SYSTEMTIME Now;
+	GetLocalTime(&Now);
+	TCHAR Timestamp[32];
+	StringCchPrintf(Timestamp, ARRAYSIZE(Timestamp), TEXT("%04u-%02u-%02uT%02u:%02u:%02u"), Now.wYear, Now.wMonth,
+		Now.wDay, Now.wHour, Now.wMinute, Now.wSecond);
+
+	for (size_t i = 0; i < Results.size(); i++)
+	{
+		const BenchmarkResult& Result = Results[i];
+		double OperationsPerLink = Result.NumLinks > 0 ? (double)Result.NumOperations / (double)Result.NumLinks : 0;
+		_ftprintf(File, TEXT("%s,%s,%s,%lld,%lld,%.3f,%.3f,%.1f,%.1f,%llu,%.3f,%llu,%lu\n"), Timestamp, Result.Benchmark,
+			Result.Case, Result.NumEntries, Result.NumLinks, Result.BestTime, Result.MeanTime,
+			GetRate(Result.NumEntries, Result.BestTime), GetRate(Result.NumLinks, Result.BestTime), Result.NumOperations,
+			OperationsPerLink, (ULONGLONG)Result.PeakWorkingSet, Result.Result);
+	}
+
+	DWORD result = ferror(File) != 0 ? ERROR_WRITE_FAULT : 0;
+	fclose(File);
+	return result;
+}
+
+/**
+ * Lists the given directory with one enumeration method, once to warm the caches and then for each timed run.
+ *
+ * @param Directory The path of the directory to list.
+ * @param Method The enumeration method to measure.
+ * @param Result The timings of the runs. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD BenchmarkEnumerate(LPCTSTR Directory, EnumerateMethod Method, BenchmarkResult& Result)
+{
+	DirectoryEnumerator Enumerator(Method);
+
+	for (int run = 0; run <= Options.NumRuns; run++)
+	{
+		LONGLONG NumEntries = 0;
+		double StartTime = GetTime();
+
+		DWORD result = Enumerator.Open(Directory);
+		if (result != 0)
+		{
+			return result;
+		}
+
+		DirectoryEntry Entry;
+		while ((result = Enumerator.Next(Entry)) == 0)
+		{
+			NumEntries++;
+		}
+		Enumerator.Close();
+
+		double Time = GetTime() - StartTime;
+		if (result != ERROR_NO_MORE_FILES)
+		{
+			return result;
+		}
+
+		// The first run only warms the caches so that every method competes on equal terms
+		if (run == 0)
+		{
+			continue;
+		}
+
+		if (Options.bVerbose)
+		{
+			_tprintf(TEXT("\tRun %d: %.2f ms\n"), run, Time);
+		}
+
+		Result.NumEntries = NumEntries;
+		Result.AddRun(run, Time);
+	}
+
+	return 0;
+}
+
+/**
+ * Compares the time it takes each enumeration method to list a single large directory. The directory is generated
+ * first, and deleted afterwards, unless it already exists.
+ *
+ * @param Directory The path of the directory to list.
+ * @param Results The list to add the results to. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD BenchmarkEnumeration(LPCTSTR Directory, BenchmarkResultList& Results)
+{
+	tstring Path;
+	DWORD result = GetLongPath(Directory, Path);
+	if (result != 0)
+	{
+		PrintErrorMessage(result, Directory);
+		return result;
+	}
+
+	bool bGenerated = false;
+	if (GetFileAttributes(Path.c_str()) == INVALID_FILE_ATTRIBUTES)
+	{
+		_tprintf(TEXT("Creating %d entries in %s...\n"), Options.NumEntries, GetDisplayPath(Path.c_str()));
+		result = GenerateFlatDirectory(Path.c_str(), Options.NumEntries);
+		if (result != 0)
+		{
+			PrintErrorMessage(result, Path.c_str());
+			return result;
+		}
+		bGenerated = true;
+	}
+
+	static const struct
+	{
+		EnumerateMethod Method;
+		LPCTSTR Name;
+	} Methods[] =
+	{
+		{ ENUMERATE_FIND_FILE, TEXT("FindFirstFile") },
+		{ ENUMERATE_FIND_FILE_EX, TEXT("FindFirstFileEx (basic, large fetch)") },
+		{ ENUMERATE_FILE_INFORMATION, TEXT("GetFileInformationByHandleEx") },
+	};
+
+	PrintResultHeader();
+	for (size_t i = 0; i < ARRAYSIZE(Methods) && result == 0; i++)
+	{
+		BenchmarkResult Result(TEXT("enum"), Methods[i].Name);
+		result = BenchmarkEnumerate(Path.c_str(), Methods[i].Method, Result);
+		if (result != 0)
+		{
+			PrintErrorMessage(result, Path.c_str());
+			break;
+		}
+
+		PrintResult(Result);
+		Results.push_back(Result);
+	}
+
+	if (bGenerated && !Options.bKeep)
+	{
+		DWORD deleteResult = DeleteTree(Path.c_str());
+		if (deleteResult != 0)
+		{
+			PrintErrorMessage(deleteResult, Path.c_str());
+			if (result == 0)
+			{
+				result = deleteResult;
+			}
+		}
+	}
+
+	return result;
+}
+
+/**
+ * The directories that make up the workspace of the link benchmarks.
+ */
+struct Workspace
+{
+	/** The generated tree of directories, files and links. */
+	tstring Tree;
+	/** The directory every generated link points to. */
+	tstring Target;
+	/** The directory fixlink points the links to instead. */
+	tstring Retarget;
+	/** The destination of cplink. */
+	tstring Copy;
+	/** The destination of mvlink. */
+	tstring Moved;
+
+	DWORD Init(LPCTSTR Directory)
+	{
+		tstring Root;
+		DWORD result = GetLongPath(Directory, Root);
+		if (result == 0)
+		{
+			Tree = JoinPath(Root.c_str(), TEXT("\\tree"));
+			Target = JoinPath(Root.c_str(), TEXT("\\target"));
+			Retarget = JoinPath(Root.c_str(), TEXT("\\retarget"));
+			Copy = JoinPath(Root.c_str(), TEXT("\\copy"));
+			Moved = JoinPath(Root.c_str(), TEXT("\\moved"));
+		}
+
+		return result;
+	}
+};
+
+/**
+ * Creates a directory unless it already exists.
+ */
+DWORD EnsureDirectory(LPCTSTR Path)
+{
+	if (!CreateDirectory(Path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+	{
+		return GetLastError();
+	}
+
+	return 0;
+}
+
+/**
+ * Deletes a directory tree if it exists.
+ */
+DWORD DeleteTreeIfExists(LPCTSTR Path)
+{
+	if (GetFileAttributes(Path) == INVALID_FILE_ATTRIBUTES)
+	{
+		return 0;
+	}
+
+	return DeleteTree(Path);
+}
+
+/**
+ * Generates the link tree of the workspace along with the directory the links point to.
+ *
+ * @param Work The workspace to generate the tree in.
+ * @param Results The list to add the result of the generation to. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD GenerateWorkspace(const Workspace& Work, BenchmarkResultList& Results)
+{
+	// The parent of the tree is created as needed so that a fresh path can be given
+	tstring Root = Work.Tree.substr(0, Work.Tree.rfind('\\'));
+	DWORD result = EnsureDirectory(Root.c_str());
+	if (result == 0)
+	{
+		result = EnsureDirectory(Work.Target.c_str());
+	}
+	if (result == 0)
+	{
+		result = EnsureDirectory(Work.Retarget.c_str());
+	}
+	if (result != 0)
+	{
+		PrintErrorMessage(result, Root.c_str());
+		return result;
+	}
+
+	_tprintf(TEXT("Generating the link tree in %s...\n"), GetDisplayPath(Work.Tree.c_str()));
+
+	// The links store the target by its display path, which is also what fixlink is told to search for
+
+	TreeCounts Counts;
+	double StartTime = GetTime();
+	result = GenerateTree(Work.Tree.c_str(), GetDisplayPath(Work.Target.c_str()), Options.Shape, Counts);
+	double Time = GetTime() - StartTime;
+
+	if (result == ERROR_PRIVILEGE_NOT_HELD)
+	{
+		_tprintf(TEXT("Error: Creating symbolic links requires the SeCreateSymbolicLinkPrivilege privilege.\n"));
+	}
+	else if (result != 0)
+	{
+		PrintErrorMessage(result, Work.Tree.c_str());
+	}
+
+	BenchmarkResult Result(TEXT("tree"), TEXT("generate"));
+	Result.NumEntries = Counts.GetNumEntries();
+	Result.NumLinks = Counts.GetNumLinks();
+	Result.AddRun(1, Time);
+	Result.Result = result;
+	Results.push_back(Result);
+
+	_tprintf(TEXT("Directories: %lld\n"), Counts.NumDirectories);
+	_tprintf(TEXT("Files: %lld\n"), Counts.NumFiles);
+	_tprintf(TEXT("Junctions: %lld\n"), Counts.NumJunctions);
+	_tprintf(TEXT("Symbolic links: %lld\n"), Counts.NumSymlinks);
+	_tprintf(TEXT("Time: %.2f ms\n"), Time);
+
+	return result;
+}
+
+/**
+ * Runs one of the utilities to completion and measures it.
+ *
+ * @param Tool The name of the utility's executable, without the extension.
+ * @param Arguments The arguments to pass to the utility.
+ * @param Time The wall-clock duration of the run, in milliseconds. [OUT]
+ * @param Result The I/O operations, peak working set and exit code of the run. [OUT]
+ * @return Returns zero if the utility was run, otherwise a non-zero value if it failed to start.
+ */
+DWORD RunTool(LPCTSTR Tool, const tstring& Arguments, double& Time, BenchmarkResult& Result)
+{
+	tstring CommandLine = TEXT("\"");
+	CommandLine += Options.ToolPath;
+	CommandLine += TEXT("\\");
+	CommandLine += Tool;
+	CommandLine += TEXT(".exe\" ");
+	CommandLine += Arguments;
+
+	if (Options.bVerbose)
+	{
+		_tprintf(TEXT("%s\n"), CommandLine.c_str());
+	}
+
+	// The output of the utility is discarded unless asked for, so that the console doesn't skew the timings
+	SECURITY_ATTRIBUTES Security = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	HANDLE hNull = INVALID_HANDLE_VALUE;
+	if (!Options.bVerbose)
+	{
+		hNull = CreateFile(TEXT("NUL"), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &Security, OPEN_EXISTING, 0, NULL);
+	}
+
+	STARTUPINFO Startup;
+	memset(&Startup, 0, sizeof(Startup));
+	Startup.cb = sizeof(Startup);
+	if (hNull != INVALID_HANDLE_VALUE)
+	{
+		Startup.dwFlags = STARTF_USESTDHANDLES;
+		Startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+		Startup.hStdOutput = hNull;
+		Startup.hStdError = hNull;
+	}
+
+	// CreateProcess may modify the command line in place
+	std::vector<TCHAR> CommandBuffer(CommandLine.begin(), CommandLine.end());
+	CommandBuffer.push_back(0);
+
+	PROCESS_INFORMATION Process;
+	double StartTime = GetTime();
+	BOOL bStarted = CreateProcess(NULL, &CommandBuffer[0], NULL, NULL, hNull != INVALID_HANDLE_VALUE, 0, NULL, NULL,
+		&Startup, &Process);
+	DWORD result = bStarted ? 0 : GetLastError();
+
+	if (hNull != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hNull);
+	}
+
+	if (result != 0)
+	{
+		return result;
+	}
+
+	WaitForSingleObject(Process.hProcess, INFINITE);
+	Time = GetTime() - StartTime;
+
+	// The counters of a process remain available until its last handle is closed
+	IO_COUNTERS IoCounters;
+	if (GetProcessIoCounters(Process.hProcess, &IoCounters))
+	{
+		Result.NumOperations = IoCounters.ReadOperationCount + IoCounters.WriteOperationCount +
+			IoCounters.OtherOperationCount;
+	}
+
+	PROCESS_MEMORY_COUNTERS MemoryCounters;
+	memset(&MemoryCounters, 0, sizeof(MemoryCounters));
+	MemoryCounters.cb = sizeof(MemoryCounters);
+	if (GetProcessMemoryInfo(Process.hProcess, &MemoryCounters, sizeof(MemoryCounters)))
+	{
+		Result.PeakWorkingSet = MemoryCounters.PeakWorkingSetSize;
+	}
+
+	DWORD ExitCode = 0;
+	GetExitCodeProcess(Process.hProcess, &ExitCode);
+	Result.Result = ExitCode;
+
+	CloseHandle(Process.hThread);
+	CloseHandle(Process.hProcess);
+	return 0;
+}
+
+/**
+ * Appends a path to a command line, quoted.
+ */
+void AppendArgument(tstring& Arguments, const tstring& Argument)
+{
+	Arguments += TEXT(" \"");
+	Arguments += Argument;
+	Arguments += TEXT("\"");
+}
+
+/**
+ * Runs every utility in turn against the link tree of the workspace: cplink copies the tree, fixlink retargets the
+ * copies, mvlink moves them and rmlink deletes them again.
+ *
+ * @param Directory The path of the workspace. The link tree is generated first if the workspace doesn't hold one.
+ * @param Results The list to add the results to. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD BenchmarkTools(LPCTSTR Directory, BenchmarkResultList& Results)
+{
+	Workspace Work;
+	DWORD result = Work.Init(Directory);
+	if (result != 0)
+	{
+		PrintErrorMessage(result, Directory);
+		return result;
+	}
+
+	bool bGenerated = false;
+	if (GetFileAttributes(Work.Tree.c_str()) == INVALID_FILE_ATTRIBUTES)
+	{
+		result = GenerateWorkspace(Work, Results);
+		if (result != 0)
+		{
+			return result;
+		}
+		bGenerated = true;
+	}
+
+	TCHAR ThreadOption[16];
+	StringCchPrintf(ThreadOption, ARRAYSIZE(ThreadOption), TEXT("/MT:%d"), Options.NumThreads);
+
+	tstring Find = GetDisplayPath(Work.Target.c_str());
+	tstring Replace = GetDisplayPath(Work.Retarget.c_str());
+
+	struct ToolStep
+	{
+		LPCTSTR Tool;
+		/** The tree the utility processes, whose contents are counted before each run. */
+		const tstring* Input;
+		tstring Arguments;
+	} Steps[4];
+
+	Steps[0].Tool = TEXT("cplink");
+	Steps[0].Input = &Work.Tree;
+	Steps[0].Arguments = ThreadOption;
+	AppendArgument(Steps[0].Arguments, GetDisplayPath(Work.Tree.c_str()));
+	AppendArgument(Steps[0].Arguments, GetDisplayPath(Work.Copy.c_str()));
+
+	Steps[1].Tool = TEXT("fixlink");
+	Steps[1].Input = &Work.Copy;
+	Steps[1].Arguments = ThreadOption;
+	AppendArgument(Steps[1].Arguments, Find);
+	AppendArgument(Steps[1].Arguments, Replace);
+	AppendArgument(Steps[1].Arguments, GetDisplayPath(Work.Copy.c_str()));
+
+	Steps[2].Tool = TEXT("mvlink");
+	Steps[2].Input = &Work.Copy;
+	Steps[2].Arguments = ThreadOption;
+	AppendArgument(Steps[2].Arguments, GetDisplayPath(Work.Copy.c_str()));
+	AppendArgument(Steps[2].Arguments, GetDisplayPath(Work.Moved.c_str()));
+
+	Steps[3].Tool = TEXT("rmlink");
+	Steps[3].Input = &Work.Moved;
+	Steps[3].Arguments = ThreadOption;
+	AppendArgument(Steps[3].Arguments, GetDisplayPath(Work.Moved.c_str()));
+
+	BenchmarkResultList StepResults;
+	for (size_t i = 0; i < ARRAYSIZE(Steps); i++)
+	{
+		StepResults.push_back(BenchmarkResult(TEXT("tools"), Steps[i].Tool));
+	}
+
+	for (int run = 1; run <= Options.NumRuns && result == 0; run++)
+	{
+		// Start every run from the generated tree alone
+		result = DeleteTreeIfExists(Work.Copy.c_str());
+		if (result == 0)
+		{
+			result = DeleteTreeIfExists(Work.Moved.c_str());
+		}
+		if (result != 0)
+		{
+			PrintErrorMessage(result, Work.Copy.c_str());
+			break;
+		}
+
+		for (size_t i = 0; i < ARRAYSIZE(Steps) && result == 0; i++)
+		{
+			BenchmarkResult& StepResult = StepResults[i];
+
+			TreeCounts Counts;
+			result = CountTree(Steps[i].Input->c_str(), Counts);
+			if (result != 0)
+			{
+				PrintErrorMessage(result, Steps[i].Input->c_str());
+				break;
+			}
+
+			BenchmarkResult RunResult(StepResult.Benchmark, StepResult.Case);
+			double Time = 0;
+			result = RunTool(Steps[i].Tool, Steps[i].Arguments, Time, RunResult);
+			if (result != 0)
+			{
+				_tprintf(TEXT("Error: Failed to start %s.\n"), Steps[i].Tool);
+				break;
+			}
+
+			if (Options.bVerbose)
+			{
+				_tprintf(TEXT("\tRun %d: %.2f ms\n"), run, Time);
+			}
+
+			// Keep the measurements of the fastest run
+			if (StepResult.AddRun(run, Time))
+			{
+				StepResult.NumEntries = Counts.GetNumEntries();
+				StepResult.NumLinks = Counts.GetNumLinks();
+				StepResult.NumOperations = RunResult.NumOperations;
+				StepResult.PeakWorkingSet = RunResult.PeakWorkingSet;
+			}
+			StepResult.Result = RunResult.Result;
+
+			// The later steps depend on the earlier ones so there is no point in going on after a failure
+			if (RunResult.Result != 0)
+			{
+				_tprintf(TEXT("Error: %s exited with code %lu.\n"), Steps[i].Tool, RunResult.Result);
+				result = ERROR_BAD_COMMAND;
+			}
+		}
+	}
+
+	PrintResultHeader();
+	for (size_t i = 0; i < StepResults.size(); i++)
+	{
+		PrintResult(StepResults[i]);
+		Results.push_back(StepResults[i]);
+	}
+
+	// Clean up everything but the generated tree, which is kept for the next session if asked for
+	DWORD cleanupResult = DeleteTreeIfExists(Work.Copy.c_str());
+	if (cleanupResult == 0)
+	{
+		cleanupResult = DeleteTreeIfExists(Work.Moved.c_str());
+	}
+	if (cleanupResult == 0 && bGenerated && !Options.bKeep)
+	{
+		cleanupResult = DeleteTree(Work.Tree.c_str());
+		if (cleanupResult == 0)
+		{
+			cleanupResult = DeleteTreeIfExists(Work.Target.c_str());
+		}
+		if (cleanupResult == 0)
+		{
+			cleanupResult = DeleteTreeIfExists(Work.Retarget.c_str());
+		}
+	}
+
+	if (cleanupResult != 0)
+	{
+		PrintErrorMessage(cleanupResult, Directory);
+		if (result == 0)
+		{
+			result = cleanupResult;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Generates the link tree of a workspace and keeps it, for later runs or for benchmarking the utilities by hand.
+ *
+ * @param Directory The path of the workspace.
+ * @param Results The list to add the result of the generation to. [OUT]
+ * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
+ */
+DWORD BenchmarkGeneration(LPCTSTR Directory, BenchmarkResultList& Results)
+{
+	Workspace Work;
+	DWORD result = Work.Init(Directory);
+	if (result != 0)
+	{
+		PrintErrorMessage(result, Directory);
+		return result;
+	}
+
+	return GenerateWorkspace(Work, Results);
+}
+
+void PrintUsage()
+{
+	_tprintf(TEXT("Measures the performance of the ntfslinkutils tools and their building blocks.\n\n"));
+	_tprintf(TEXT("Usage: linkbench enum [/N:n] [/RUNS:n] [/KEEP] [/OUT:file] [/V] <directory>\n"));
+	_tprintf(TEXT("       linkbench tree [<tree options>] [/OUT:file] [/V] <directory>\n"));
+	_tprintf(TEXT("       linkbench run [<tree options>] [/RUNS:n] [/MT:n] [/BIN:dir] [/KEEP] [/OUT:file] [/V] <directory>\n\n"));
+	_tprintf(TEXT("Commands:\n"));
+	_tprintf(TEXT("\t\tenum\t\tCompare the directory enumeration methods on a single directory. The\n"));
+	_tprintf(TEXT("\t\t\t\tdirectory is filled with empty files first if it doesn't exist.\n"));
+	_tprintf(TEXT("\t\ttree\t\tGenerate a link tree in the given workspace and keep it.\n"));
+	_tprintf(TEXT("\t\trun\t\tRun cplink, fixlink, mvlink and rmlink in turn against the link tree of\n"));
+	_tprintf(TEXT("\t\t\t\tthe given workspace, generating it first if needed.\n"));
+	_tprintf(TEXT("Tree options:\n"));
+	_tprintf(TEXT("\t\t/DEPTH:n\tThe number of directory levels beneath the root (default 4).\n"));
+	_tprintf(TEXT("\t\t/FANOUT:n\tThe number of sub-directories in each directory (default 8).\n"));
+	_tprintf(TEXT("\t\t/FILES:n\tThe number of empty files in each directory (default 16).\n"));
+	_tprintf(TEXT("\t\t/LINKS:n\tThe number of links in each directory (default 2).\n"));
+	_tprintf(TEXT("\t\t/LONG\t\tGive directories long names so that deep paths exceed MAX_PATH.\n"));
+	_tprintf(TEXT("\t\t/SYMLINKS:n\tThe percentage of links that are symbolic links instead of junctions\n"));
+	_tprintf(TEXT("\t\t\t\t(default 0). Creating symbolic links requires elevation.\n"));
+	_tprintf(TEXT("Options:\n"));
+	_tprintf(TEXT("\t\t/BIN:dir\tThe directory holding the utilities (default the directory of linkbench).\n"));
+	_tprintf(TEXT("\t\t/KEEP\t\tKeep the generated test data.\n"));
+	_tprintf(TEXT("\t\t/MT:n\t\tRun the utilities with n worker threads (default 8).\n"));
+	_tprintf(TEXT("\t\t/N:n\t\tThe number of entries to generate (default 100000).\n"));
+	_tprintf(TEXT("\t\t/OUT:file\tAppend the results to the given file as comma-separated values.\n"));
+	_tprintf(TEXT("\t\t/RUNS:n\t\tThe number of timed runs of each benchmark (default 5).\n"));
+	_tprintf(TEXT("\t\t/V\t\tEnable verbose output and display more information.\n"));
+	_tprintf(TEXT("\t\t/?\t\tView this list of options.\n"));
+}
+
+int _tmain(int argc, TCHAR* argv[])
+{
+	DWORD result = 0;
+	LPCTSTR Command = NULL;
+	LPCTSTR Directory = NULL;
+
+	// Parse the command line arguments
+	for (int i = 1; i < argc; i++)
+	{
+		if (StrFind(argv[i], TEXT("/?")) >= 0)
+		{
+			PrintUsage();
+			return 0;
+		}
+		else if (StrFind(argv[i], TEXT("/OUT:")) >= 0 || StrFind(argv[i], TEXT("/out:")) >= 0)
+		{
+			StringCchCopy(Options.OutputPath, ARRAYSIZE(Options.OutputPath), &argv[i][5]);
+		}
+		else if (StrFind(argv[i], TEXT("/BIN:")) >= 0 || StrFind(argv[i], TEXT("/bin:")) >= 0)
+		{
+			StringCchCopy(Options.ToolPath, ARRAYSIZE(Options.ToolPath), &argv[i][5]);
+		}
+		else if (StrFind(argv[i], TEXT("/KEEP")) >= 0 || StrFind(argv[i], TEXT("/keep")) >= 0)
+		{
+			Options.bKeep = true;
+		}
+		else if (StrFind(argv[i], TEXT("/N:")) >= 0 || StrFind(argv[i], TEXT("/n:")) >= 0)
+		{
+			Options.NumEntries = _ttoi(&argv[i][3]);
+		}
+		else if (StrFind(argv[i], TEXT("/RUNS:")) >= 0 || StrFind(argv[i], TEXT("/runs:")) >= 0)
+		{
+			Options.NumRuns = _ttoi(&argv[i][6]);
+		}
+		else if (StrFind(argv[i], TEXT("/MT")) >= 0 || StrFind(argv[i], TEXT("/mt")) >= 0)
+		{
+			Options.NumThreads = argv[i][3] == ':' ? _ttoi(&argv[i][4]) : Options.NumThreads;
+		}
+		else if (StrFind(argv[i], TEXT("/DEPTH:")) >= 0 || StrFind(argv[i], TEXT("/depth:")) >= 0)
+		{
+			Options.Shape.Depth = _ttoi(&argv[i][7]);
+		}
+		else if (StrFind(argv[i], TEXT("/FANOUT:")) >= 0 || StrFind(argv[i], TEXT("/fanout:")) >= 0)
+		{
+			Options.Shape.FanOut = _ttoi(&argv[i][8]);
+		}
+		else if (StrFind(argv[i], TEXT("/FILES:")) >= 0 || StrFind(argv[i], TEXT("/files:")) >= 0)
+		{
+			Options.Shape.FilesPerDir = _ttoi(&argv[i][7]);
+		}
+		else if (StrFind(argv[i], TEXT("/LINKS:")) >= 0 || StrFind(argv[i], TEXT("/links:")) >= 0)
+		{
+			Options.Shape.LinksPerDir = _ttoi(&argv[i][7]);
+		}
+		else if (StrFind(argv[i], TEXT("/SYMLINKS:")) >= 0 || StrFind(argv[i], TEXT("/symlinks:")) >= 0)
+		{
+			Options.Shape.SymlinkPercent = _ttoi(&argv[i][10]);
+		}
+		else if (StrFind(argv[i], TEXT("/LONG")) >= 0 || StrFind(argv[i], TEXT("/long")) >= 0)
+		{
+			Options.Shape.bLongNames = true;
+		}
+		else if (StrFind(argv[i], TEXT("/V")) >= 0 || StrFind(argv[i], TEXT("/v")) >= 0)
+		{
+			Options.bVerbose = true;
+		}
+		else if (argv[i][0] == '/')
+		{
+			continue;
+		}
+		else if (Command == NULL)
+		{
+			Command = argv[i];
+		}
+		else
+		{
+			Directory = argv[i];
+		}
+	}
+
+	if (Options.NumRuns < 1)
+	{
+		Options.NumRuns = 1;
+	}
+	if (Options.Shape.SymlinkPercent < 0)
+	{
+		Options.Shape.SymlinkPercent = 0;
+	}
+	else if (Options.Shape.SymlinkPercent > 100)
+	{
+		Options.Shape.SymlinkPercent = 100;
+	}
+
+	// The utilities are expected next to linkbench unless told otherwise
+	if (Options.ToolPath[0] == 0)
+	{
+		GetModuleFileName(NULL, Options.ToolPath, ARRAYSIZE(Options.ToolPath));
+		LPTSTR FileName = _tcsrchr(Options.ToolPath, '\\');
+		if (FileName != NULL)
+		{
+			*FileName = 0;
+		}
+	}
+
+	// Check the required arguments
+	if (Command == NULL || Directory == NULL)
+	{
+		_tprintf(TEXT("Error: Missing argument(s).\n"));
+		PrintUsage();
+		return 1;
+	}
+
+	BenchmarkResultList Results;
+	if (_tcscmp(Command, TEXT("enum")) == 0)
+	{
+		result = BenchmarkEnumeration(Directory, Results);
+	}
+	else if (_tcscmp(Command, TEXT("tree")) == 0)
+	{
+		result = BenchmarkGeneration(Directory, Results);
+	}
+	else if (_tcscmp(Command, TEXT("run")) == 0)
+	{
+		result = BenchmarkTools(Directory, Results);
+	}
+	else
+	{
+		_tprintf(TEXT("Error: Unknown command %s.\n"), Command);
+		PrintUsage();
+		return 1;
+	}
+
+	// Partial results are written too, as the cases that did complete are still comparable
+	if (Options.OutputPath[0] != 0 && !Results.empty())
+	{
+		DWORD writeResult = WriteResults(Options.OutputPath, Results);
+		if (writeResult != 0)
+		{
+			_tprintf(TEXT("Error: Failed to write the results to %s.\n"), Options.OutputPath);
+			if (result == 0)
+			{
+				result = writeResult;
+			}
+		}
+	}
+
+	return result != 0 ? 1 : 0;
+}
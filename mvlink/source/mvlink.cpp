@@ -29,31 +29,30 @@
 
 #include "stdafx.h"
 
-#include <Junction.h>
 #include <memory.h>
-#include <Symlink.h>
 #include <strsafe.h>
 
-#include "DataTypes.h"
+#include "ApplyJournal.h"
+#include "DestinationCache.h"
+#include "LinkCore.h"
+#include "LinkManifest.h"
+#include "LinkService.h"
+#include "MoveLinks.h"
+#include "PathBuffer.h"
+#include "RebaseMap.h"
+#include "RunMetrics.h"
+#include "StringMatch.h"
 #include "StringUtils.h"
+#include "TreeWalker.h"
 
-using namespace libntfslinks;
+MoveLinkOptions Options;
+MoveLinkStats Stats;
 
-mvlinkOptions Options;
-mvlinkStats Stats;
+/** The manifest written by /PLAN. */
+ManifestWriter Plan;
 
-/**
- * Prints a friendly message based on the given error code.
- */
-void PrintErrorMessage(DWORD ErrorCode, LPCTSTR Path)
-{
-	switch (ErrorCode)
-	{
-	case ERROR_FILE_NOT_FOUND: _tprintf(TEXT("File not found: %s.\n"), Path); break;
-	case ERROR_PATH_NOT_FOUND: _tprintf(TEXT("Path not found: %s.\n"), Path); break;
-	case ERROR_ACCESS_DENIED: _tprintf(TEXT("Access denied: %s.\n"), Path); break;
-	}
-}
+/** The progress of /APPLY recorded with /JOURNAL. */
+ApplyJournal Journal;
 
 /**
  * Moves all reparse points in the specified source path to a given destination and rebases the target of each based on
@@ -61,248 +60,69 @@ void PrintErrorMessage(DWORD ErrorCode, LPCTSTR Path)
  *
  * @param Src The path of the source file to move.
  * @param Dest The path of the destination to move Src to.
- * @param CurDepth The current level that has been traversed in the filesystem tree.
+ * @param Rules The rules loaded with /RMAP.
+ * @param PlanWriter The manifest to write the planned moves to, or NULL to move the links.
  * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
  */
-DWORD mvlink(LPCTSTR Src, LPCTSTR Dest, int CurDepth = 0)
+DWORD mvlink(LPCTSTR Src, LPCTSTR Dest, const RebaseMap& Rules, ManifestWriter* PlanWriter)
 {
-	DWORD result = 0;
-
-	// If applicable, do not go further than the specified maximum depth
-	if (Options.MaxDepth >= 0 && CurDepth > Options.MaxDepth)
+	DestinationCache DestDirs;
+	tstring SrcPath;
+	tstring DestPath;
+	DWORD result = GetCopyPaths(Src, Dest, Options, DestDirs, SrcPath, DestPath, Stats);
+	if (result != 0)
 	{
 		return result;
 	}
 
-	// Expand the source to a full path
-	TCHAR SrcPath[MAX_PATH] = {0};
-	if (GetFullPathName(Src, MAX_PATH, SrcPath, NULL) == 0)
-	{
-		Stats.NumFailed++;
-		_tprintf(TEXT("Invalid source path specified.\n"));
-		return 1;
-	}
-	
-	// Expand the destination to a full path
-	TCHAR DestPath[MAX_PATH] = {0};
-	if (GetFullPathName(Dest, MAX_PATH, DestPath, NULL) == 0)
+	// Links can simply be renamed when the source and the destination are on the same volume
+	bool bSameVolume = IsSameVolume(SrcPath.c_str(), DestPath.c_str());
+
+	MoveLinkAction Action(Options, Stats, DestDirs, Rules, DestPath.c_str(), bSameVolume, PlanWriter);
+	return WalkTree(SrcPath.c_str(), Action, Options.GetWalkOptions(), Stats);
+}
+
+/**
+ * Moves the reparse points listed in a manifest written by /PLAN.
+ *
+ * @param ManifestPath The path of the manifest to apply.
+ * @return Returns zero if the manifest could be applied, otherwise a non-zero value on failure.
+ */
+DWORD mvlinkApply(LPCTSTR ManifestPath)
+{
+	LinkManifest Manifest;
+	DWORD result = Manifest.Load(ManifestPath, TEXT("mvlink"));
+	if (result != 0)
 	{
-		Stats.NumFailed++;
-		_tprintf(TEXT("Invalid destination path specified.\n"));
-		return 1;
+		_tprintf(TEXT("Error: Unable to read the manifest %s.\n"), ManifestPath);
+		return result;
 	}
 
-	// Retrieve the file attributes of SrcPath
-	WIN32_FILE_ATTRIBUTE_DATA srcAttributeData = {0};
-	if (GetFileAttributesEx(SrcPath, GetFileExInfoStandard, &srcAttributeData))
+	// Record the progress of the run so that it can be resumed should it be interrupted
+	bool bJournal = Options.JournalPath[0] != 0;
+	if (bJournal)
 	{
-		// Reparse points must be processed first as they can also be considered a directory.
-		if ((srcAttributeData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+		result = Journal.Open(Options.JournalPath, TEXT("mvlink"), Manifest.GetNumOps(), Manifest.GetContentHash(),
+			Options.bResume);
+		if (result != 0)
 		{
-			// Check if the destination already exists
-			WIN32_FILE_ATTRIBUTE_DATA destAttributeData = {0};
-			if (GetFileAttributesEx(DestPath, GetFileExInfoStandard, &destAttributeData))
-			{
-				// Ask permission to delete the destination
-				// TODO
-
-				// Delete the existing reparse point destinations
-				if ((destAttributeData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-				{
-					if (IsJunction(DestPath))
-					{
-						result = DeleteJunction(DestPath);
-					}
-					else if (IsSymlink(DestPath))
-					{
-						result = DeleteSymlink(DestPath);
-					}
-				}
-			}
-
-			// Was there a failure deleting the existing destination?
-			if (result == 0)
-			{
-				// Is this a junction or a symlink?
-				if (IsJunction(SrcPath))
-				{
-					// Retrieve the existing target
-					TCHAR Target[MAX_PATH] = {0};
-					result = GetJunctionTarget(SrcPath, Target, sizeof(Target));
-					if (result == 0)
-					{
-						// If specified, rebase the target to the new root
-						if (Options.NewTargetBase[0] != 0 && Options.OldTargetBase[0] != 0)
-						{
-							TCHAR NewTarget[MAX_PATH] = {0};
-							StrReplace(Target, Options.OldTargetBase, Options.NewTargetBase, NewTarget, -1, -1);
-
-							// Create the junction at the destination
-							result = CreateJunction(DestPath, NewTarget);
-							if (result == 0 && Options.bVerbose)
-							{
-								_tprintf(TEXT("junction created for %s <<===>> %s\n"), DestPath, NewTarget);
-							}
-						}
-						// Otherwise create a junction to the existing target at the destination
-						else
-						{
-							result = CreateJunction(DestPath, Target);
-							if (result == 0 && Options.bVerbose)
-							{
-								_tprintf(TEXT("junction created for %s <<===>> %s\n"), DestPath, Target);
-							}
-						}
-
-						// Was the junction created successfully?
-						if (result == 0)
-						{
-							Stats.NumMoved++;
-
-							// Remove the original
-							result = DeleteJunction(SrcPath);
-						}
-					}
-				}
-				else if (IsSymlink(SrcPath))
-				{
-					// Retrieve the existing target
-					TCHAR Target[MAX_PATH] = {0};
-					result = GetSymlinkTarget(SrcPath, Target, sizeof(Target));
-					if (result == 0)
-					{
-						// If specified, rebase the target to the new root
-						if (Options.NewTargetBase[0] != 0 && Options.OldTargetBase[0] != 0)
-						{
-							TCHAR NewTarget[MAX_PATH] = {0};
-							StrReplace(Target, Options.OldTargetBase, Options.NewTargetBase, NewTarget, -1, -1);
-
-							// Create the symlink at the destination
-							result = CreateSymlink(DestPath, NewTarget);
-							if (result == 0 && Options.bVerbose)
-							{
-								_tprintf(TEXT("symbolic link created for %s <<===>> %s\n"), DestPath, NewTarget);
-							}
-						}
-						// Otherwise create a symlink to the existing target at the destination
-						else
-						{
-							result = CreateSymlink(DestPath, Target);
-							if (result == 0 && Options.bVerbose)
-							{
-								_tprintf(TEXT("symbolic link created for %s <<===>> %s\n"), DestPath, Target);
-							}
-						}
-
-						// Was the symlink created successfully?
-						if (result == 0)
-						{
-							Stats.NumMoved++;
-
-							// Remove the original
-							result = DeleteSymlink(SrcPath);
-						}
-					}
-				}
-				else
-				{
-					result = GetLastError();
-					if (result == 0)
-					{
-						_tprintf(TEXT("Unrecognized reparse point: %s\n"), SrcPath);
-						Stats.NumSkipped++;
-					}
-				}
-			}
+			_tprintf(result == ERROR_INVALID_DATA ? TEXT("Error: The journal %s was written for another manifest.\n") :
+				TEXT("Error: Unable to write the journal %s.\n"), Options.JournalPath);
+			return result;
 		}
-		else if ((srcAttributeData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
-		{
-			// Make sure the the destination directory exists. If not create it.
-			WIN32_FILE_ATTRIBUTE_DATA destAttributeData = {0};
-			if (GetFileAttributesEx(DestPath, GetFileExInfoStandard, &destAttributeData))
-			{
-				if ((destAttributeData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
-				{
-					// TODO Copy security descriptor?
-					if (!CreateDirectoryEx(SrcPath, DestPath, NULL))
-					{
-						// Failed to create the destination directory. Already exists?
-						// TODO
-					}
-				}
-			}
-
-			WIN32_FIND_DATA ffd;
-			TCHAR szDir[MAX_PATH] = {0};
-			HANDLE hFind;
-
-			// The search path must include '\*'
-			StringCchCopy(szDir, sizeof(szDir), SrcPath);
-			StringCchCat(szDir, sizeof(szDir), TEXT("\\*"));
-
-			// Iterate through the list of files in the directory and mvlink each one. This will be done in two passes,
-			// the first pass will move all regular files and directories. The second pass will move all reparse points.
-			hFind = FindFirstFile(szDir, &ffd);
-			if (hFind != INVALID_HANDLE_VALUE)
-			{
-				do
-				{
-					// Ignore the '.' and '..' entries
-					size_t fileNameLength;
-					if (FAILED(StringCchLength(ffd.cFileName, MAX_PATH, &fileNameLength)) || fileNameLength == 0 ||
-						(fileNameLength == 1 && ffd.cFileName[0] == '.') ||
-						(fileNameLength == 2 && ffd.cFileName[0] == '.' && ffd.cFileName[1] == '.'))
-					{
-						continue;
-					}
-
-					// Ignore anything that isn't a directory or reparse point
-					if ((ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 ||
-						(ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-					{
-						TCHAR srcFile[MAX_PATH];
-						StringCchCopy(srcFile, sizeof(srcFile), SrcPath);
-						StringCchCat(srcFile, sizeof(srcFile), TEXT("\\"));
-						StringCchCat(srcFile, sizeof(srcFile), ffd.cFileName);
-
-						TCHAR destFile[MAX_PATH];
-						StringCchCopy(destFile, sizeof(destFile), DestPath);
-						StringCchCat(destFile, sizeof(destFile), TEXT("\\"));
-						StringCchCat(destFile, sizeof(destFile), ffd.cFileName);
-
-						result = mvlink(srcFile, destFile, CurDepth+1);
-					}
-				} while (FindNextFile(hFind, &ffd) != 0);
-
-				// Close the handle for the first pass
-				FindClose(hFind);
-			}
-			else
-			{
-				// If we failed to be able to read the directory listing due to a access violation count it as a skip
-				// instead of a complete failure.
-				if (GetLastError() == ERROR_ACCESS_DENIED)
-				{
-					PrintErrorMessage(GetLastError(), SrcPath);
-					Stats.NumSkipped++;
-				}
-				else
-				{
-					result = GetLastError();
-				}
-			}
-		}
-	}
-	else
-	{
-		result = GetLastError();
 	}
 
-	// Was the operation successful?
-	if (result != 0)
+	DestinationCache DestDirs;
+	MoveApplyAction Action(Options, Stats, DestDirs);
+	ApplyManifest(Manifest, Action, Options.NumThreads, Stats, bJournal ? &Journal : NULL);
+
+	if (bJournal)
 	{
-		Stats.NumFailed++;
-		PrintErrorMessage(result, SrcPath);
+		result = Journal.Close();
+		if (result != 0)
+		{
+			_tprintf(TEXT("Error: Unable to write the journal %s.\n"), Options.JournalPath);
+		}
 	}
 
 	return result;
@@ -311,12 +131,50 @@ DWORD mvlink(LPCTSTR Src, LPCTSTR Dest, int CurDepth = 0)
 void PrintUsage()
 {
 	_tprintf(TEXT("Moves all symbolic links and junctions from one path to another.\n\n"));
-	_tprintf(TEXT("Usage: mvlink [/V] [/LEV:n] [/R <find> <replace>] <source> <destination>\n\n"));
+	_tprintf(TEXT("Usage: mvlink [/SERVE | /SERVICE] [/V] [/STATS[:n[,file]]] [/LEV:n] [/MT[:n]] [/ADAPT] [/MAXIOPS:n] [/BFS] [/EMPTYDEST] [/FAST] [/INDEX:file] [/XD:pattern]... [/XJ] [/TYPE:types] [/R <find> <replace>] [/RMAP:file] [/PLAN:file] <source> <destination>\n"));
+	_tprintf(TEXT("       mvlink [/SERVE | /SERVICE] [/V] [/STATS[:n[,file]]] [/MT[:n]] [/MAXIOPS:n] [/JOURNAL:file [/RESUME]] /APPLY:file\n\n"));
 	_tprintf(TEXT("Options:\n"));
+	_tprintf(TEXT("\t\t/ADAPT\t\tAdapt the number of busy /MT threads to the volume: one more while\n"));
+	_tprintf(TEXT("\t\t\t\toperations stay fast, half as many once they slow down or the server\n"));
+	_tprintf(TEXT("\t\t\t\tturns requests away as busy.\n"));
+	_tprintf(TEXT("\t\t/APPLY:file\tMove the links listed in a manifest written by /PLAN, using /MT threads.\n"));
+	_tprintf(TEXT("\t\t\t\tLinks that changed since the manifest was written are skipped.\n"));
+	_tprintf(TEXT("\t\t/BFS\t\tWalk the directory tree breadth-first instead of depth-first.\n"));
+	_tprintf(TEXT("\t\t/EMPTYDEST\tAssert that the destination is empty or missing, so that no existing\n"));
+	_tprintf(TEXT("\t\t\t\tlinks are looked for before creating the new ones.\n"));
+	_tprintf(TEXT("\t\t/FAST\t\tRead the links from the volume metadata instead of enumerating every\n"));
+	_tprintf(TEXT("\t\t\t\tdirectory. Requires elevation and a local NTFS volume.\n"));
+	_tprintf(TEXT("\t\t\t\tOnly the directories leading to links are created at the destination.\n"));
+	_tprintf(TEXT("\t\t/INDEX:file\tReplay the links recorded in a link index file while nothing beneath the\n"));
+	_tprintf(TEXT("\t\t\t\tpath changed, otherwise walk the tree and record a new index. Requires\n"));
+	_tprintf(TEXT("\t\t\t\televation.\n"));
+	_tprintf(TEXT("\t\t/JOURNAL:file\tRecord the progress of /APPLY to a journal file, flushed to disk before each\n"));
+	_tprintf(TEXT("\t\t\t\tbatch of links is moved.\n"));
 	_tprintf(TEXT("\t\t/LEV:n\t\tOnly move the top n levels of the source directory tree.\n"));
-	_tprintf(TEXT("\t\t/R <old> <new>\tModifies the target path of all links, replacing the last occurrence of <old> with <new>.\n"));
+	_tprintf(TEXT("\t\t/PLAN:file\tWrite the links that would be moved, along with their new targets, to a\n"));
+	_tprintf(TEXT("\t\t\t\tmanifest file without changing anything.\n"));
+	_tprintf(TEXT("\t\t/R <old> <new>\tModifies the target path of all links, replacing the last occurrence of <old>, ignoring case, with <new>.\n"));
+	_tprintf(TEXT("\t\t/RESUME\t\tCarry on from where the run that wrote the /JOURNAL stopped, skipping the\n"));
+	_tprintf(TEXT("\t\t\t\tlinks it moved and finishing the ones it was in the middle of.\n"));
+	_tprintf(TEXT("\t\t/RMAP:file\tRebases the target path of all links with the rules in file, one <old>|<new>\n"));
+	_tprintf(TEXT("\t\t\t\tpair per line. The longest <old> prefix matching whole path components\n"));
+	_tprintf(TEXT("\t\t\t\twins. Targets no rule matches fall back to /R.\n"));
+	_tprintf(TEXT("\t\t/MAXIOPS:n\tStart at most n file system operations a second, across every thread.\n"));
+	_tprintf(TEXT("\t\t/MT[:n]\t\tWalk the directory tree using n worker threads (default 8).\n"));
+	_tprintf(TEXT("\t\t/SERVE\t\tRun as a service that carries out the invocations of the utility made by\n"));
+	_tprintf(TEXT("\t\t\t\tother processes over the named pipe \\\\.\\pipe\\ntfslinkd\\<utility>, one at a\n"));
+	_tprintf(TEXT("\t\t\t\ttime, as the user that made each of them.\n"));
+	_tprintf(TEXT("\t\t/SERVICE\tHand the invocation to the /SERVE service of the utility if this user runs\n"));
+	_tprintf(TEXT("\t\t\t\tone, otherwise run it in this process.\n"));
+	_tprintf(TEXT("\t\t/STATS[:n[,file]]\n\t\t\t\tReport progress, throughput, queue depths and latencies every n\n"));
+	_tprintf(TEXT("\t\t\t\tseconds (default 10), one JSON object per line, to stderr or file.\n"));
+	_tprintf(TEXT("\t\t/TYPE:types\tOnly visit the links of the given types, junction and/or symlink separated\n"));
+	_tprintf(TEXT("\t\t\t\tby commas. Other reparse points are skipped.\n"));
 	_tprintf(TEXT("\t\t/V\t\tEnable verbose output and display more information.\n"));
 	_tprintf(TEXT("\t\t/VER\t\tDisplay the version and copyright information.\n"));
+	_tprintf(TEXT("\t\t/XD:pattern\tSkip the directories, and directory links, whose name matches pattern.\n"));
+	_tprintf(TEXT("\t\t\t\tThe wildcards * and ? may be used. May be given more than once.\n"));
+	_tprintf(TEXT("\t\t/XJ\t\tSkip junctions.\n"));
 	_tprintf(TEXT("\t\t/?\t\tView this list of options.\n"));
 }
 
@@ -346,13 +204,20 @@ void PrintVersion()
 	_tprintf(TEXT("OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.\n"));
 }
 
-int _tmain(int argc, TCHAR* argv[])
+/**
+ * Runs a single invocation of mvlink with the given command line.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @return Returns the exit code of the invocation.
+ */
+int mvlinkMain(int argc, TCHAR* argv[])
 {
 	DWORD result;
 	int requiredArgs = 3;
+	RebaseMap RebaseRules;
 
 	// Parse the command line arguments
-	TCHAR Value[1024];
 	for (int i = 1; i < argc; i++)
 	{
 		if (StrFind(argv[i], TEXT("/VER")) >= 0 || StrFind(argv[i], TEXT("/ver")) >= 0)
@@ -365,11 +230,26 @@ int _tmain(int argc, TCHAR* argv[])
 			PrintUsage();
 			return 0;
 		}
-		else if (StrFind(argv[i], TEXT("/LEV")) >= 0 || StrFind(argv[i], TEXT("/lev")) >= 0)
+		else if (StrFind(argv[i], TEXT("/APPLY:")) >= 0 || StrFind(argv[i], TEXT("/apply:")) >= 0)
+		{
+			StringCchCopy(Options.ApplyPath, ARRAYSIZE(Options.ApplyPath), &argv[i][7]);
+		}
+		else if (StrFind(argv[i], TEXT("/PLAN:")) >= 0 || StrFind(argv[i], TEXT("/plan:")) >= 0)
+		{
+			StringCchCopy(Options.PlanPath, ARRAYSIZE(Options.PlanPath), &argv[i][6]);
+		}
+		else if (StrFind(argv[i], TEXT("/JOURNAL:")) >= 0 || StrFind(argv[i], TEXT("/journal:")) >= 0)
+		{
+			StringCchCopy(Options.JournalPath, ARRAYSIZE(Options.JournalPath), &argv[i][9]);
+		}
+		else if (StrFind(argv[i], TEXT("/RESUME")) >= 0 || StrFind(argv[i], TEXT("/resume")) >= 0)
+		{
+			// Looked for ahead of /R since it begins like it
+			Options.bResume = true;
+		}
+		else if (ParseLinkCopyOption(argv[i], Options))
 		{
-			memset(Value, 0, sizeof(Value));
-			StringCchCopy(Value, sizeof(Value), &argv[i][5]);
-			Options.MaxDepth = _ttoi(Value);
+			// One of the options shared with cplink, looked for ahead of /R since /RMAP begins like it
 		}
 		else if (StrFind(argv[i], TEXT("/R")) >= 0 || StrFind(argv[i], TEXT("/r")) >= 0)
 		{
@@ -381,30 +261,89 @@ int _tmain(int argc, TCHAR* argv[])
 				return 1;
 			}
 
-			StringCchCopy(Options.OldTargetBase, sizeof(Options.OldTargetBase), argv[i+1]);
-			StringCchCopy(Options.NewTargetBase, sizeof(Options.NewTargetBase), argv[i+2]);
-		}
-		else if (StrFind(argv[i], TEXT("/V")) >= 0 || StrFind(argv[i], TEXT("/v")) >= 0)
-		{
-			Options.bVerbose = true;
+			StringCchCopy(Options.OldTargetBase, ARRAYSIZE(Options.OldTargetBase), argv[i+1]);
+			StringCchCopy(Options.NewTargetBase, ARRAYSIZE(Options.NewTargetBase), argv[i+2]);
 		}
 	}
 
-	// Check the minimum required arguments
-	if (argc < requiredArgs)
+	// Check the minimum required arguments. Applying a manifest needs no paths.
+	if (Options.ApplyPath[0] == 0 && argc < requiredArgs)
 	{
 		_tprintf(TEXT("Error: Missing argument(s).\n"));
 		PrintUsage();
 		return 1;
 	}
 
+	// Only a manifest has a fixed list of links to journal
+	if ((Options.JournalPath[0] != 0 && Options.ApplyPath[0] == 0) || (Options.bResume && Options.JournalPath[0] == 0))
+	{
+		_tprintf(TEXT("Error: /JOURNAL requires /APPLY, and /RESUME requires /JOURNAL.\n"));
+		PrintUsage();
+		return 1;
+	}
+
+	// Compile the rebase rules once up front
+	if (Options.RebaseMapPath[0] != 0)
+	{
+		result = LoadRebaseRules(Options.RebaseMapPath, Options.bVerbose, RebaseRules);
+		if (result != 0)
+		{
+			return result;
+		}
+	}
+
+	// Report on the run as it goes
+	result = StartToolMetrics(Options, Stats, Stats.NumMoved);
+	if (result != 0)
+	{
+		return result;
+	}
+
 	// Execute mvlink
-	result = mvlink(argv[argc-2], argv[argc-1]);
+	if (Options.ApplyPath[0] != 0)
+	{
+		result = mvlinkApply(Options.ApplyPath);
+	}
+	else if (Options.PlanPath[0] != 0)
+	{
+		result = Plan.Open(Options.PlanPath, TEXT("mvlink"));
+		if (result != 0)
+		{
+			_tprintf(TEXT("Error: Unable to write the manifest %s.\n"), Options.PlanPath);
+			return result;
+		}
+
+		result = mvlink(argv[argc-2], argv[argc-1], RebaseRules, &Plan);
+
+		DWORD planResult = Plan.Close();
+		if (planResult != 0)
+		{
+			_tprintf(TEXT("Error: Unable to write the manifest %s.\n"), Options.PlanPath);
+			result = result != 0 ? result : planResult;
+		}
+	}
+	else
+	{
+		result = mvlink(argv[argc-2], argv[argc-1], RebaseRules, NULL);
+	}
+
+	StopMetrics();
 
 	// Print the execution statistics
-	_tprintf(TEXT("Moved: %d\n"), Stats.NumMoved);
-	_tprintf(TEXT("Skipped: %d\n"), Stats.NumSkipped);
-	_tprintf(TEXT("Failed: %d\n"), Stats.NumFailed);
+	if (Options.PlanPath[0] != 0)
+	{
+		_tprintf(TEXT("Planned: %ld\n"), Plan.GetNumOps());
+	}
+	else
+	{
+		_tprintf(TEXT("Moved: %ld\n"), Stats.NumMoved.Get());
+	}
+	if (Options.bResume)
+	{
+		_tprintf(TEXT("Moved before resuming: %ld\n"), Journal.GetNumDone());
+	}
+	_tprintf(TEXT("Skipped: %ld\n"), Stats.NumSkipped.Get());
+	_tprintf(TEXT("Failed: %ld\n"), Stats.NumFailed.Get());
 
 	// Make sure that if there were errors it is reflected in the result
 	if (result == 0 && Stats.NumFailed > 0)
@@ -414,3 +353,30 @@ int _tmain(int argc, TCHAR* argv[])
 
 	return result;
 }
+
+/**
+ * Runs each invocation of mvlink. A service runs many of them in the same process so each starts from a clean state,
+ * and whatever an invocation that returned early left running is stopped.
+ */
+class mvlinkJob : public LinkServiceJob
+{
+public:
+	virtual int Run(int argc, TCHAR* argv[])
+	{
+		Options = MoveLinkOptions();
+		Stats = MoveLinkStats();
+
+		int ExitCode = mvlinkMain(argc, argv);
+
+		Plan.Close();
+		Journal.Close();
+		StopMetrics();
+		return ExitCode;
+	}
+};
+
+int _tmain(int argc, TCHAR* argv[])
+{
+	mvlinkJob Job;
+	return RunLinkTool(TEXT("mvlink"), argc, argv, Job);
+}
@@ -33,35 +33,16 @@
 
 #include <memory.h>
 
-struct rmlinkOptions
-{
-	/** Set to true to enable verbose logging. */
-	bool bVerbose;
-	/** The maximum file tree depth to traverse before stopping. */
-	int MaxDepth;
+#include "LinkCore.h"
 
-	rmlinkOptions()
-		: bVerbose(false)
-		, MaxDepth(-1)
-	{
-	}
+struct rmlinkOptions : public LinkToolOptions
+{
 };
 
-struct rmlinkStats
+struct rmlinkStats : public LinkStats
 {
-	/** The number of file objects that failed to be moved. */
-	size_t NumFailed;
 	/** The number of file objects successfully deleted. */
-	size_t NumDeleted;
-	/** The number of file objects that were skipped. */
-	size_t NumSkipped;
-
-	rmlinkStats()
-		: NumFailed(0)
-		, NumDeleted(0)
-		, NumSkipped(0)
-	{
-	}
+	AtomicCounter NumDeleted;
 };
 
 #endif //DATATYPES_H
\ No newline at end of file
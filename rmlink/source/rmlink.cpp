@@ -29,165 +29,46 @@
 
 #include "stdafx.h"
 
-#include <Junction.h>
-#include <memory.h>
-#include <Symlink.h>
-#include <strsafe.h>
-
 #include "DataTypes.h"
+#include "LinkCore.h"
+#include "LinkService.h"
+#include "RunMetrics.h"
 #include "StringUtils.h"
 
-using namespace libntfslinks;
-
 rmlinkOptions Options;
 rmlinkStats Stats;
 
-/**
- * Prints a friendly message based on the given error code.
- */
-void PrintErrorMessage(DWORD ErrorCode, LPCTSTR Path)
-{
-	switch (ErrorCode)
-	{
-	case ERROR_FILE_NOT_FOUND: _tprintf(TEXT("File not found: %s.\n"), Path); break;
-	case ERROR_PATH_NOT_FOUND: _tprintf(TEXT("Path not found: %s.\n"), Path); break;
-	case ERROR_ACCESS_DENIED: _tprintf(TEXT("Access denied: %s.\n"), Path); break;
-	}
-}
-
-/**
- * Deletes all reparse points in the specified source path to a given destination.
- *
- * @param Src The path of the source file to delete.
- * @param CurDepth The current level that has been traversed in the filesystem tree.
- * @return Returns zero if the operation was successful, otherwise a non-zero value on failure.
- */
-DWORD rmlink(LPCTSTR Path, int CurDepth = 0)
-{
-	DWORD result = 0;
-
-	// If applicable, do not go further than the specified maximum depth
-	if (Options.MaxDepth >= 0 && CurDepth > Options.MaxDepth)
-	{
-		return result;
-	}
-
-	// Retrieve the file attributes of Path
-	WIN32_FILE_ATTRIBUTE_DATA pathAttributeData = {0};
-	if (GetFileAttributesEx(Path, GetFileExInfoStandard, &pathAttributeData))
-	{
-		// Reparse points must be processed first as they can also be considered a directory.
-		if ((pathAttributeData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-		{
-			// Is this a junction or a symlink?
-			if (IsJunction(Path))
-			{
-				// Delete the junction
-				result = DeleteJunction(Path);
-				if (result == 0)
-				{
-					Stats.NumDeleted++;
-				}
-			}
-			else if (IsSymlink(Path))
-			{
-				// Delete the symlink
-				result = DeleteSymlink(Path);
-				if (result == 0)
-				{
-					Stats.NumDeleted++;
-				}
-			}
-			else
-			{
-				result = GetLastError();
-				if (result == 0)
-				{
-					_tprintf(TEXT("Unrecognized reparse point: %s\n"), Path);
-					Stats.NumSkipped++;
-				}
-			}
-		}
-		else if ((pathAttributeData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
-		{
-			WIN32_FIND_DATA ffd;
-			TCHAR szDir[MAX_PATH] = {0};
-			HANDLE hFind;
-
-			// The search path must include '\*'
-			StringCchCopy(szDir, sizeof(szDir), Path);
-			StringCchCat(szDir, sizeof(szDir), TEXT("\\*"));
-
-			// Iterate through the list of files in the directory and rmlink each one.
-			hFind = FindFirstFile(szDir, &ffd);
-			if (hFind != INVALID_HANDLE_VALUE)
-			{
-				do
-				{
-					// Ignore the '.' and '..' entries
-					size_t fileNameLength;
-					if (FAILED(StringCchLength(ffd.cFileName, MAX_PATH, &fileNameLength)) || fileNameLength == 0 ||
-						(fileNameLength == 1 && ffd.cFileName[0] == '.') ||
-						(fileNameLength == 2 && ffd.cFileName[0] == '.' && ffd.cFileName[1] == '.'))
-					{
-						continue;
-					}
-
-					// Ignore anything that isn't a directory or reparse point
-					if ((ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 ||
-						(ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-					{
-						TCHAR filePath[MAX_PATH];
-						StringCchCopy(filePath, sizeof(filePath), Path);
-						StringCchCat(filePath, sizeof(filePath), TEXT("\\"));
-						StringCchCat(filePath, sizeof(filePath), ffd.cFileName);
-
-						result = rmlink(filePath, CurDepth+1);
-					}
-				} while (FindNextFile(hFind, &ffd) != 0);
-
-				// Close the handle for the first pass
-				FindClose(hFind);
-			}
-			else
-			{
-				// If we failed to be able to read the directory listing due to a access violation count it as a skip
-				// instead of a complete failure.
-				if (GetLastError() == ERROR_ACCESS_DENIED)
-				{
-					PrintErrorMessage(GetLastError(), Path);
-					Stats.NumSkipped++;
-				}
-				else
-				{
-					result = GetLastError();
-				}
-			}
-		}
-	}
-	else
-	{
-		result = GetLastError();
-	}
-
-	// Was the operation successful?
-	if (result != 0)
-	{
-		Stats.NumFailed++;
-		PrintErrorMessage(result, Path);
-	}
-
-	return result;
-}
-
 void PrintUsage()
 {
 	_tprintf(TEXT("Deletes all symbolic links and junctions from the specified list of paths.\n\n"));
-	_tprintf(TEXT("Usage: rmlink [/V] [/LEV:n] <path>...\n\n"));
+	_tprintf(TEXT("Usage: rmlink [/SERVE | /SERVICE] [/V] [/STATS[:n[,file]]] [/LEV:n] [/MT[:n]] [/ADAPT] [/MAXIOPS:n] [/BFS] [/FAST] [/INDEX:file] [/XD:pattern]... [/XJ] [/TYPE:types] <path>...\n\n"));
 	_tprintf(TEXT("Options:\n"));
+	_tprintf(TEXT("\t\t/ADAPT\t\tAdapt the number of busy /MT threads to the volume: one more while\n"));
+	_tprintf(TEXT("\t\t\t\toperations stay fast, half as many once they slow down or the server\n"));
+	_tprintf(TEXT("\t\t\t\tturns requests away as busy.\n"));
+	_tprintf(TEXT("\t\t/BFS\t\tWalk the directory tree breadth-first instead of depth-first.\n"));
+	_tprintf(TEXT("\t\t/FAST\t\tRead the links from the volume metadata instead of enumerating every\n"));
+	_tprintf(TEXT("\t\t\t\tdirectory. Requires elevation and a local NTFS volume.\n"));
+	_tprintf(TEXT("\t\t/INDEX:file\tReplay the links recorded in a link index file while nothing beneath the\n"));
+	_tprintf(TEXT("\t\t\t\tpath changed, otherwise walk the tree and record a new index. Requires\n"));
+	_tprintf(TEXT("\t\t\t\televation.\n"));
 	_tprintf(TEXT("\t\t/LEV:n\t\tOnly remove links in the top n levels of the path.\n"));
+	_tprintf(TEXT("\t\t/MAXIOPS:n\tStart at most n file system operations a second, across every thread.\n"));
+	_tprintf(TEXT("\t\t/MT[:n]\t\tWalk the directory tree using n worker threads (default 8).\n"));
+	_tprintf(TEXT("\t\t/SERVE\t\tRun as a service that carries out the invocations of the utility made by\n"));
+	_tprintf(TEXT("\t\t\t\tother processes over the named pipe \\\\.\\pipe\\ntfslinkd\\<utility>, one at a\n"));
+	_tprintf(TEXT("\t\t\t\ttime, as the user that made each of them.\n"));
+	_tprintf(TEXT("\t\t/SERVICE\tHand the invocation to the /SERVE service of the utility if this user runs\n"));
+	_tprintf(TEXT("\t\t\t\tone, otherwise run it in this process.\n"));
+	_tprintf(TEXT("\t\t/STATS[:n[,file]]\n\t\t\t\tReport progress, throughput, queue depths and latencies every n\n"));
+	_tprintf(TEXT("\t\t\t\tseconds (default 10), one JSON object per line, to stderr or file.\n"));
+	_tprintf(TEXT("\t\t/TYPE:types\tOnly visit the links of the given types, junction and/or symlink separated\n"));
+	_tprintf(TEXT("\t\t\t\tby commas. Other reparse points are skipped.\n"));
 	_tprintf(TEXT("\t\t/V\t\tEnable verbose output and display more information.\n"));
 	_tprintf(TEXT("\t\t/VER\t\tDisplay the version and copyright information.\n"));
+	_tprintf(TEXT("\t\t/XD:pattern\tSkip the directories, and directory links, whose name matches pattern.\n"));
+	_tprintf(TEXT("\t\t\t\tThe wildcards * and ? may be used. May be given more than once.\n"));
+	_tprintf(TEXT("\t\t/XJ\t\tSkip junctions.\n"));
 	_tprintf(TEXT("\t\t/?\t\tView this list of options.\n"));
 }
 
@@ -217,13 +98,19 @@ void PrintVersion()
 	_tprintf(TEXT("OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.\n"));
 }
 
-int _tmain(int argc, TCHAR* argv[])
+/**
+ * Runs a single invocation of rmlink with the given command line.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @return Returns the exit code of the invocation.
+ */
+int rmlinkMain(int argc, TCHAR* argv[])
 {
-	DWORD result;
+	DWORD result = 0;
 	int requiredArgs = 2;
 
 	// Parse the command line arguments
-	TCHAR Value[1024];
 	for (int i = 1; i < argc; i++)
 	{
 		if (StrFind(argv[i], TEXT("/VER")) >= 0 || StrFind(argv[i], TEXT("/ver")) >= 0)
@@ -236,15 +123,9 @@ int _tmain(int argc, TCHAR* argv[])
 			PrintUsage();
 			return 0;
 		}
-		else if (StrFind(argv[i], TEXT("/LEV")) >= 0 || StrFind(argv[i], TEXT("/lev")) >= 0)
-		{
-			memset(Value, 0, sizeof(Value));
-			StringCchCopy(Value, sizeof(Value), &argv[i][5]);
-			Options.MaxDepth = _ttoi(Value);
-		}
-		else if (StrFind(argv[i], TEXT("/V")) >= 0 || StrFind(argv[i], TEXT("/v")) >= 0)
+		else
 		{
-			Options.bVerbose = true;
+			ParseLinkToolOption(argv[i], Options);
 		}
 	}
 
@@ -256,27 +137,38 @@ int _tmain(int argc, TCHAR* argv[])
 		return 1;
 	}
 
-	// Iterate through each argument that isn't an option and execute rmlink on it
+	// Report on the run as it goes
+	result = StartToolMetrics(Options, Stats, Stats.NumDeleted);
+	if (result != 0)
+	{
+		return result;
+	}
+
+	// Delete the links of each argument that isn't an option, the roots of a volume in turn and the volumes in parallel
+	RemoveLinkAction Action(Stats, Stats.NumDeleted);
+	std::vector<LinkJob> Jobs;
 	for (int i = 1; i < argc; i++)
 	{
 		// Ignore options
-		if (argv[i][0] == '/')
+		if (argv[i][0] != '/')
 		{
-			continue;
+			Jobs.push_back(LinkJob());
+			Jobs.back().Root = argv[i];
+			Jobs.back().Action = &Action;
 		}
+	}
 
-		result = rmlink(argv[i]);
-		if (result != 0)
-		{
-			// Exit on failure
-			break;
-		}
+	if (!Jobs.empty())
+	{
+		result = RunLinkJobs(&Jobs[0], Jobs.size(), Options.GetWalkOptions(), Stats);
 	}
 
+	StopMetrics();
+
 	// Print the execution statistics
-	_tprintf(TEXT("Deleted: %d\n"), Stats.NumDeleted);
-	_tprintf(TEXT("Skipped: %d\n"), Stats.NumSkipped);
-	_tprintf(TEXT("Failed: %d\n"), Stats.NumFailed);
+	_tprintf(TEXT("Deleted: %ld\n"), Stats.NumDeleted.Get());
+	_tprintf(TEXT("Skipped: %ld\n"), Stats.NumSkipped.Get());
+	_tprintf(TEXT("Failed: %ld\n"), Stats.NumFailed.Get());
 
 	// Make sure that if there were errors it is reflected in the result
 	if (result == 0 && Stats.NumFailed > 0)
@@ -286,3 +178,28 @@ int _tmain(int argc, TCHAR* argv[])
 
 	return result;
 }
+
+/**
+ * Runs each invocation of rmlink. A service runs many of them in the same process so each starts from a clean state,
+ * and whatever an invocation that returned early left running is stopped.
+ */
+class rmlinkJob : public LinkServiceJob
+{
+public:
+	virtual int Run(int argc, TCHAR* argv[])
+	{
+		Options = rmlinkOptions();
+		Stats = rmlinkStats();
+
+		int ExitCode = rmlinkMain(argc, argv);
+
+		StopMetrics();
+		return ExitCode;
+	}
+};
+
+int _tmain(int argc, TCHAR* argv[])
+{
+	rmlinkJob Job;
+	return RunLinkTool(TEXT("rmlink"), argc, argv, Job);
+}